@@ -5,14 +5,11 @@
 
 #include <rte_config.h>
 #include <rte_malloc.h>
-#include <rte_mempool.h>
 #include <rte_lcore.h>
 
 #include "omnios/nvme.h"
 #include "omnios/pci.h"
 
-struct rte_mempool *request_mempool;
-
 static int outstanding_commands;
 
 struct feature {
@@ -170,6 +167,27 @@ print_namespace(struct nvme_namespace *ns)
 	       (flags & NVME_NS_DEALLOCATE_SUPPORTED) ? "Supported" : "Not Supported");
 	printf("Flush:                       %s\n",
 	       (flags & NVME_NS_FLUSH_SUPPORTED) ? "Supported" : "Not Supported");
+	printf("Write Zeroes:                %s\n",
+	       (flags & NVME_NS_WRITE_ZEROES_SUPPORTED) ? "Supported" : "Not Supported");
+	printf("Compare:                     %s\n",
+	       (flags & NVME_NS_COMPARE_SUPPORTED) ? "Supported" : "Not Supported");
+	printf("Write Uncorrectable:         %s\n",
+	       (flags & NVME_NS_WRITE_UNCORRECTABLE_SUPPORTED) ? "Supported" : "Not Supported");
+	printf("Compare and Write:           %s\n",
+	       (flags & NVME_NS_COMPARE_AND_WRITE_SUPPORTED) ? "Supported" : "Not Supported");
+	printf("Extended LBA:                %s\n",
+	       (flags & NVME_NS_EXTENDED_LBA_SUPPORTED) ? "Supported" : "Not Supported");
+	if (flags & NVME_NS_DPS_PI_SUPPORTED) {
+		printf("Protection Information:      Type %d in %s eight bytes of metadata\n",
+		       nvme_ns_get_pi_type(ns), nsdata->dps.md_start ? "first" : "last");
+	} else {
+		printf("Protection Information:      Not Supported\n");
+	}
+	if (nvme_ns_get_optimal_io_boundary(ns) != 0) {
+		printf("Optimal I/O Boundary:        %u LBAs\n", nvme_ns_get_optimal_io_boundary(ns));
+	} else {
+		printf("Optimal I/O Boundary:        None\n");
+	}
 	printf("Size (in LBAs):              %lld (%lldM)\n",
 	       (long long)nsdata->nsze,
 	       (long long)nsdata->nsze / 1024 / 1024);
@@ -277,6 +295,10 @@ print_controller(struct nvme_controller *ctrlr, struct pci_device *pci_dev)
 	       cdata->oncs.write_unc ? "Supported" : "Not Supported");
 	printf("Dataset Management Command:  %s\n",
 	       cdata->oncs.dsm ? "Supported" : "Not Supported");
+	printf("Write Zeroes Command:        %s\n",
+	       cdata->oncs.write_zeroes ? "Supported" : "Not Supported");
+	printf("Fused Compare and Write:     %s\n",
+	       cdata->fuses.compare_and_write ? "Supported" : "Not Supported");
 	printf("Volatile Write Cache:        %s\n",
 	       cdata->vwc.present ? "Present" : "Not Present");
 	printf("\n");
@@ -410,16 +432,6 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	request_mempool = rte_mempool_create("nvme_request", 8192,
-					     nvme_request_size(), 128, 0,
-					     NULL, NULL, NULL, NULL,
-					     SOCKET_ID_ANY, 0);
-
-	if (request_mempool == NULL) {
-		fprintf(stderr, "could not initialize request mempool\n");
-		exit(1);
-	}
-
 	pci_system_init();
 
 	match.vendor_id =	PCI_MATCH_ANY;
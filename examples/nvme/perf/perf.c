@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -28,6 +29,12 @@ struct ctrlr_entry {
 	char			name[1024];
 };
 
+struct attach_entry {
+	struct nvme_controller	*ctrlr;
+	struct pci_device	*pci_dev;
+	struct attach_entry	*next;
+};
+
 enum entry_type {
 	ENTRY_TYPE_NVME_NS,
 	ENTRY_TYPE_AIO_FILE,
@@ -61,6 +68,8 @@ struct ns_worker_ctx {
 	uint64_t		offset_in_ios;
 	bool			is_draining;
 
+	struct nvme_qpair	*qpair;
+
 #if HAVE_LIBAIO
 	struct io_event		*events;
 	io_context_t		ctx;
@@ -74,6 +83,8 @@ struct perf_task {
 #if HAVE_LIBAIO
 	struct iocb		iocb;
 #endif
+	/* nvme_request_size() bytes of request storage for the NVMe driver */
+	uint8_t			nvme_req[] __attribute__((aligned(64)));
 };
 
 struct worker_thread {
@@ -82,7 +93,6 @@ struct worker_thread {
 	unsigned		lcore;
 };
 
-struct rte_mempool *request_mempool;
 static struct rte_mempool *task_pool;
 
 static struct ctrlr_entry *g_controllers = NULL;
@@ -113,14 +123,20 @@ register_ns(struct nvme_controller *ctrlr, struct pci_device *pci_dev, struct nv
 	struct ns_entry *entry;
 	const struct nvme_controller_data *cdata;
 
+	cdata = nvme_ctrlr_get_data(ctrlr);
+
+	if (nvme_ns_get_md_size(ns) != 0) {
+		printf("Skipping namespace %u of %-20.20s: formatted with metadata\n",
+		       nvme_ns_get_id(ns), cdata->mn);
+		return;
+	}
+
 	entry = malloc(sizeof(struct ns_entry));
 	if (entry == NULL) {
 		perror("ns_entry malloc");
 		exit(1);
 	}
 
-	cdata = nvme_ctrlr_get_data(ctrlr);
-
 	entry->type = ENTRY_TYPE_NVME_NS;
 	entry->u.nvme.ctrlr = ctrlr;
 	entry->u.nvme.ns = ns;
@@ -304,8 +320,9 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 		} else
 #endif
 		{
-			rc = nvme_ns_cmd_read(entry->u.nvme.ns, task->buf, offset_in_ios * entry->io_size_blocks,
-					      entry->io_size_blocks, io_complete, task);
+			rc = nvme_ns_cmd_read_req(entry->u.nvme.ns, ns_ctx->qpair, task->nvme_req,
+						  task->buf, offset_in_ios * entry->io_size_blocks,
+						  entry->io_size_blocks, io_complete, task, 0);
 		}
 	} else {
 #if HAVE_LIBAIO
@@ -315,8 +332,9 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 		} else
 #endif
 		{
-			rc = nvme_ns_cmd_write(entry->u.nvme.ns, task->buf, offset_in_ios * entry->io_size_blocks,
-					       entry->io_size_blocks, io_complete, task);
+			rc = nvme_ns_cmd_write_req(entry->u.nvme.ns, ns_ctx->qpair, task->nvme_req,
+						   task->buf, offset_in_ios * entry->io_size_blocks,
+						   entry->io_size_blocks, io_complete, task, 0);
 		}
 	}
 
@@ -364,16 +382,26 @@ check_io(struct ns_worker_ctx *ns_ctx)
 	} else
 #endif
 	{
-		nvme_ctrlr_process_io_completions(ns_ctx->entry->u.nvme.ctrlr, g_max_completions);
+		nvme_qpair_process_completions(ns_ctx->qpair, g_max_completions);
 	}
 }
 
 static void
 submit_io(struct ns_worker_ctx *ns_ctx, int queue_depth)
 {
+	struct ns_entry *entry = ns_ctx->entry;
+
+	if (entry->type == ENTRY_TYPE_NVME_NS) {
+		nvme_qpair_batch_begin(ns_ctx->qpair);
+	}
+
 	while (queue_depth-- > 0) {
 		submit_single_io(ns_ctx);
 	}
+
+	if (entry->type == ENTRY_TYPE_NVME_NS) {
+		nvme_qpair_batch_end(ns_ctx->qpair);
+	}
 }
 
 static void
@@ -394,9 +422,19 @@ work_fn(void *arg)
 
 	printf("Starting thread on core %u\n", worker->lcore);
 
-	if (nvme_register_io_thread() != 0) {
-		fprintf(stderr, "nvme_register_io_thread() failed on core %u\n", worker->lcore);
-		return -1;
+	/* Allocate a queue pair for each NVMe namespace this worker drives. */
+	ns_ctx = worker->ns_ctx;
+	while (ns_ctx != NULL) {
+		if (ns_ctx->entry->type == ENTRY_TYPE_NVME_NS) {
+			ns_ctx->qpair = nvme_ctrlr_alloc_io_qpair(ns_ctx->entry->u.nvme.ctrlr,
+					g_queue_depth);
+			if (ns_ctx->qpair == NULL) {
+				fprintf(stderr, "nvme_ctrlr_alloc_io_qpair() failed on core %u\n",
+					worker->lcore);
+				return -1;
+			}
+		}
+		ns_ctx = ns_ctx->next;
 	}
 
 	/* Submit initial I/O for each namespace. */
@@ -426,11 +464,13 @@ work_fn(void *arg)
 	ns_ctx = worker->ns_ctx;
 	while (ns_ctx != NULL) {
 		drain_io(ns_ctx);
+		if (ns_ctx->qpair != NULL) {
+			nvme_ctrlr_free_io_qpair(ns_ctx->qpair);
+			ns_ctx->qpair = NULL;
+		}
 		ns_ctx = ns_ctx->next;
 	}
 
-	nvme_unregister_io_thread();
-
 	return 0;
 }
 
@@ -644,7 +684,9 @@ register_controllers(void)
 	struct pci_device_iterator	*pci_dev_iter;
 	struct pci_device		*pci_dev;
 	struct pci_id_match		match;
-	int				rc;
+	struct nvme_ctrlr_opts		opts;
+	struct attach_entry		*attach, *pending;
+	int				rc, status;
 
 	printf("Initializing NVMe Controllers\n");
 
@@ -659,7 +701,21 @@ register_controllers(void)
 
 	pci_dev_iter = pci_id_match_iterator_create(&match);
 
+	/* Size the I/O queues so that the requested queue depth never spills into software. */
+	nvme_ctrlr_opts_set_defaults(&opts);
+	if ((uint32_t)g_queue_depth > opts.io_queue_requests) {
+		opts.io_queue_requests = g_queue_depth;
+	}
+	if (opts.io_queue_requests >= opts.io_queue_size) {
+		opts.io_queue_size = opts.io_queue_requests + 1;
+	}
+	/* Issue each I/O as one command where the controller allows it. */
+	if ((uint32_t)g_io_size_bytes > opts.max_xfer_size) {
+		opts.max_xfer_size = g_io_size_bytes;
+	}
+
 	rc = 0;
+	pending = NULL;
 	while ((pci_dev = pci_device_next(pci_dev_iter))) {
 		struct nvme_controller *ctrlr;
 
@@ -673,19 +729,52 @@ register_controllers(void)
 
 		pci_device_probe(pci_dev);
 
-		ctrlr = nvme_attach(pci_dev);
-		if (ctrlr == NULL) {
+		ctrlr = nvme_attach_async(pci_dev, &opts);
+		attach = ctrlr ? malloc(sizeof(struct attach_entry)) : NULL;
+		if (attach == NULL) {
 			fprintf(stderr, "nvme_attach failed for controller at pci bdf %d:%d:%d\n",
 				pci_dev->bus, pci_dev->dev, pci_dev->func);
+			if (ctrlr) {
+				nvme_detach(ctrlr);
+			}
 			rc = 1;
 			continue;
 		}
 
-		register_ctrlr(ctrlr, pci_dev);
+		attach->ctrlr = ctrlr;
+		attach->pci_dev = pci_dev;
+		attach->next = pending;
+		pending = attach;
 	}
 
 	pci_iterator_destroy(pci_dev_iter);
 
+	/* Bring all of the controllers up together instead of one after another. */
+	while (pending) {
+		struct attach_entry **prev = &pending;
+
+		while ((attach = *prev) != NULL) {
+			status = nvme_ctrlr_process_init(attach->ctrlr);
+			if (status == EAGAIN) {
+				prev = &attach->next;
+				continue;
+			}
+
+			if (status == 0) {
+				register_ctrlr(attach->ctrlr, attach->pci_dev);
+			} else {
+				fprintf(stderr, "nvme_attach failed for controller at pci bdf %d:%d:%d\n",
+					attach->pci_dev->bus, attach->pci_dev->dev,
+					attach->pci_dev->func);
+				nvme_detach(attach->ctrlr);
+				rc = 1;
+			}
+
+			*prev = attach->next;
+			free(attach);
+		}
+	}
+
 	return rc;
 }
 
@@ -798,18 +887,8 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	request_mempool = rte_mempool_create("nvme_request", 8192,
-					     nvme_request_size(), 128, 0,
-					     NULL, NULL, NULL, NULL,
-					     SOCKET_ID_ANY, 0);
-
-	if (request_mempool == NULL) {
-		fprintf(stderr, "could not initialize request mempool\n");
-		return 1;
-	}
-
 	task_pool = rte_mempool_create("task_pool", 8192,
-				       sizeof(struct perf_task),
+				       sizeof(struct perf_task) + nvme_request_size(),
 				       64, 0, NULL, NULL, task_ctor, NULL,
 				       SOCKET_ID_ANY, 0);
 
@@ -1,6 +1,7 @@
 #ifndef SPDK_BARRIER_H
 #define SPDK_BARRIER_H
 
+#define rmb()	__asm volatile("lfence" ::: "memory")
 #define wmb()	__asm volatile("sfence" ::: "memory")
 #define mb()	__asm volatile("mfence" ::: "memory")
 
@@ -2,6 +2,7 @@
 #define SPDK_NVME_H
 
 #include <stddef.h>
+#include <sys/uio.h>
 #include "nvme_spec.h"
 
 /** \file
@@ -32,6 +33,80 @@ struct nvme_controller;
  */
 struct nvme_controller *nvme_attach(void *devhandle);
 
+/**
+ * \brief Controller options, passed to nvme_attach_opts().
+ *
+ * Initialize with nvme_ctrlr_opts_set_defaults() before changing any fields.
+ */
+struct nvme_ctrlr_opts {
+	/**
+	 * Number of entries in each I/O submission and completion queue.
+	 *  Limited by the controller's maximum queue size (CAP.MQES).
+	 */
+	uint32_t	io_queue_size;
+
+	/**
+	 * Maximum number of commands outstanding on each I/O queue pair.
+	 *  Commands submitted beyond this are queued in software until an
+	 *  outstanding command completes.  Limited to io_queue_size - 1.
+	 */
+	uint32_t	io_queue_requests;
+
+	/**
+	 * Largest transfer, in bytes, sent to the controller as one command.
+	 *  Larger I/O is split.  Each I/O tracker reserves a PRP list of
+	 *  max_xfer_size / 512 bytes of pinned memory.  Rounded down to a
+	 *  multiple of the page size and limited by the controller's MDTS and
+	 *  by the driver to 4 MiB.
+	 */
+	uint32_t	max_xfer_size;
+};
+
+/**
+ * \brief Fill in the driver's default controller options.
+ *
+ * This function is thread safe and can be called at any time.
+ */
+void nvme_ctrlr_opts_set_defaults(struct nvme_ctrlr_opts *opts);
+
+/**
+ * \brief Attaches specified device to the NVMe driver with the given options.
+ *
+ * Same as nvme_attach(), but sizes the I/O queues according to \a opts.  Passing
+ * NULL for \a opts is the same as calling nvme_attach().
+ *
+ * Values in \a opts that the controller cannot support are clamped.  The values
+ * actually used can be read back with nvme_ctrlr_get_opts().
+ */
+struct nvme_controller *nvme_attach_opts(void *devhandle, const struct nvme_ctrlr_opts *opts);
+
+/**
+ * \brief Begin attaching the specified device to the NVMe driver without waiting.
+ *
+ * Maps the controller and returns immediately.  The controller is not usable until
+ * nvme_ctrlr_process_init() has returned 0 for it.  Any number of controllers can be
+ * started this way and then brought up together from one polling loop, so the
+ * controller resets and admin commands of all devices overlap.
+ *
+ * \a opts is handled as in nvme_attach_opts().  On failure, the return value will be NULL.
+ *
+ * To stop using the controller, whether or not initialization finished, call
+ * \ref nvme_detach with the nvme_controller instance returned by this function.
+ */
+struct nvme_controller *nvme_attach_async(void *devhandle, const struct nvme_ctrlr_opts *opts);
+
+/**
+ * \brief Advance initialization of a controller returned by nvme_attach_async().
+ *
+ * Does as much initialization work as it can without blocking, then returns.
+ *
+ * \return 0 once the controller is ready for use, EAGAIN if initialization is still
+ * in progress and this function must be called again, or another errno value (ENXIO,
+ * ENOMEM) if initialization failed.  A controller that failed to initialize must be
+ * released with nvme_detach().
+ */
+int nvme_ctrlr_process_init(struct nvme_controller *ctrlr);
+
 /**
  * \brief Detaches specified device returned by \ref nvme_attach() from the NVMe driver.
  *
@@ -46,8 +121,14 @@ int nvme_detach(struct nvme_controller *ctrlr);
 /**
  * \brief Perform a full hardware reset of the NVMe controller.
  *
- * This function should be called from a single thread while no other threads
- * are actively using the NVMe device.
+ * Equivalent to nvme_ctrlr_reset_async() followed by calling nvme_ctrlr_process_reset()
+ * until it stops returning EAGAIN.  Returns 0 without doing anything if the controller is
+ * already resetting or has failed.
+ *
+ * Other threads may keep submitting I/O and processing completions while this runs; see
+ * nvme_ctrlr_reset_async().  It must not be called from an I/O completion callback,
+ * since the reset would wait for the calling thread to finish with its qpair and then
+ * fail with ETIMEDOUT.
  *
  * Any pointers returned from nvme_ctrlr_get_ns() and nvme_ns_get_data() may be invalidated
  * by calling this function.  The number of namespaces as returned by nvme_ctrlr_get_num_ns() may
@@ -55,6 +136,34 @@ int nvme_detach(struct nvme_controller *ctrlr);
  */
 int nvme_ctrlr_reset(struct nvme_controller *ctrlr);
 
+/**
+ * \brief Start resetting the NVMe controller without blocking.
+ *
+ * The reset is driven by nvme_ctrlr_process_reset().  While it runs, each I/O qpair
+ * quiesces the next time its owning thread submits I/O or processes completions.  The
+ * reset does not disable the controller while any thread is inside a call that submits
+ * to or polls an I/O qpair, including its completion callbacks.  If a thread is still
+ * inside such a call after the controller's CAP.TO timeout, the reset fails with
+ * ETIMEDOUT and the controller is marked as failed.  Commands submitted during
+ * the reset are queued.  Once the reset finishes, each qpair, again on its owning
+ * thread, completes whatever the controller finished before the reset and resubmits the
+ * rest in their original submission order, followed by the queued commands.  If the
+ * reset fails, those commands are completed with an error instead.
+ *
+ * \return 0 if the reset was started, EBUSY if a reset is already in progress, or ENXIO
+ * if the controller has failed.
+ */
+int nvme_ctrlr_reset_async(struct nvme_controller *ctrlr);
+
+/**
+ * \brief Advance a reset started by nvme_ctrlr_reset_async().
+ *
+ * \return 0 once the reset has finished, EAGAIN if it is still in progress and this
+ * function must be called again, or another errno value if the reset failed, in which
+ * case the controller is marked as failed.
+ */
+int nvme_ctrlr_process_reset(struct nvme_controller *ctrlr);
+
 /**
  * \brief Get the identify controller data as defined by the NVMe specification.
  *
@@ -74,6 +183,57 @@ const struct nvme_controller_data *nvme_ctrlr_get_data(struct nvme_controller *c
  */
 uint32_t nvme_ctrlr_get_num_ns(struct nvme_controller *ctrlr);
 
+/**
+ * \brief Get the options in effect for the given NVMe controller.
+ *
+ * These are the options passed to nvme_attach_opts(), after clamping to what the
+ * controller supports.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+const struct nvme_ctrlr_opts *nvme_ctrlr_get_opts(struct nvme_controller *ctrlr);
+
+/**
+ * \brief Time, in microseconds, spent in each phase of the controller's most recent
+ * initialization or reset.
+ */
+struct nvme_ctrlr_init_times {
+	/** Reset only: waiting for I/O qpairs to quiesce. */
+	uint64_t	quiesce_us;
+
+	/** Bringing the controller into reset (CC.EN = 0, CSTS.RDY = 0). */
+	uint64_t	disable_us;
+
+	/** Setting CC.EN until CSTS.RDY = 1. */
+	uint64_t	enable_us;
+
+	/** Identify Controller. */
+	uint64_t	identify_us;
+
+	/** Set Features - Number of Queues. */
+	uint64_t	set_num_queues_us;
+
+	/** Recreating the I/O queues that were in use before a reset. */
+	uint64_t	create_io_queues_us;
+
+	/** Identify Namespace for every namespace. */
+	uint64_t	identify_ns_us;
+
+	/** Asynchronous event configuration. */
+	uint64_t	configure_aer_us;
+
+	/** The whole initialization or reset.  0 while one is still in progress. */
+	uint64_t	total_us;
+};
+
+/**
+ * \brief Get how long the controller's most recent initialization or reset took.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+void nvme_ctrlr_get_init_times(struct nvme_controller *ctrlr,
+			       struct nvme_ctrlr_init_times *times);
+
 /**
  * Signature for callback function invoked when a command is completed.
  *
@@ -116,6 +276,23 @@ int nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
 			  void *buf, uint32_t len,
 			  nvme_cb_fn_t cb_fn, void *cb_arg);
 
+/** \brief Opaque handle to an I/O queue pair. Obtained by calling nvme_ctrlr_alloc_io_qpair(). */
+struct nvme_qpair;
+
+/**
+ * \brief Send the given NVM I/O command to the NVMe controller on the given I/O qpair.
+ *
+ * Same as nvme_ctrlr_cmd_io_raw(), but submits the command on \a qpair
+ * instead of the calling thread's I/O queue.
+ *
+ * \sa nvme_ctrlr_alloc_io_qpair()
+ */
+int nvme_ctrlr_cmd_io_raw_qpair(struct nvme_controller *ctrlr,
+				struct nvme_qpair *qpair,
+				struct nvme_command *cmd,
+				void *buf, uint32_t len,
+				nvme_cb_fn_t cb_fn, void *cb_arg);
+
 /**
  * \brief Process any outstanding completions for I/O submitted on the current thread.
  *
@@ -132,6 +309,196 @@ int nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
  */
 void nvme_ctrlr_process_io_completions(struct nvme_controller *ctrlr, uint32_t max_completions);
 
+/**
+ * \brief Start a batch of I/O submissions on the current thread's I/O queue.
+ *
+ * I/O submitted on this thread until the matching nvme_ctrlr_io_batch_end() is
+ * written to the submission queue, but the controller is only notified once, when
+ * the batch ends.  This amortizes the write barrier and doorbell MMIO write
+ * over every command in the batch.
+ *
+ * Batches may be nested; the doorbell is written when the outermost batch ends.
+ * Submissions made from completion callbacks inside
+ * nvme_ctrlr_process_io_completions() are batched automatically.
+ *
+ * Commands submitted inside a batch are not started by the controller until the
+ * batch ends, so do not wait for their completion while the batch is open.
+ *
+ * This function is thread safe and can be called at any point after
+ * nvme_register_io_thread().
+ */
+void nvme_ctrlr_io_batch_begin(struct nvme_controller *ctrlr);
+
+/**
+ * \brief End a batch of I/O submissions started with nvme_ctrlr_io_batch_begin().
+ *
+ * This function is thread safe and can be called at any point after
+ * nvme_register_io_thread().
+ */
+void nvme_ctrlr_io_batch_end(struct nvme_controller *ctrlr);
+
+/**
+ * \brief Allocate an I/O queue pair on the given controller.
+ *
+ * The qpair is owned by the caller until it is passed to nvme_ctrlr_free_io_qpair().
+ * Commands are submitted to it with the nvme_ns_cmd_*_qpair() functions, and
+ * their completions are processed with nvme_qpair_process_completions().  No
+ * thread-local lookup is done on these paths, so one thread may drive any
+ * number of qpairs, on any number of controllers, without calling
+ * nvme_register_io_thread().
+ *
+ * A qpair is not itself thread safe.  Only one thread at a time may submit to or
+ * process completions on a given qpair.
+ *
+ * The queue pair is created on the controller by this call, and deleted again by
+ * nvme_ctrlr_free_io_qpair(), so this function blocks on admin commands.
+ *
+ * The calling thread's cache of request objects is sized for \a queue_depth, so
+ * allocate the qpair from the thread that will use it.
+ *
+ * \param queue_depth maximum number of commands outstanding on the qpair, or 0 for
+ *                    the controller's io_queue_requests option.  If this does not fit
+ *                    in the io_queue_size option, the qpair's queues are made larger,
+ *                    up to the controller's maximum queue size.
+ *
+ * \return the qpair, or NULL if the controller has no free I/O queues, is
+ *         resetting, or the qpair could not be sized to \a queue_depth
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+struct nvme_qpair *nvme_ctrlr_alloc_io_qpair(struct nvme_controller *ctrlr,
+		uint32_t queue_depth);
+
+/**
+ * \brief Free an I/O queue pair returned by nvme_ctrlr_alloc_io_qpair().
+ *
+ * The queue pair is deleted from the controller and its memory is released.
+ *
+ * \return 0 on success, EBUSY if I/O is still outstanding on the qpair or the
+ *         controller is resetting, or EINVAL if the qpair was not allocated with
+ *         nvme_ctrlr_alloc_io_qpair()
+ *
+ * This function is thread safe, but the qpair must not be in use by any other thread.
+ */
+int nvme_ctrlr_free_io_qpair(struct nvme_qpair *qpair);
+
+/**
+ * \brief Process any outstanding completions for I/O submitted on the given qpair.
+ *
+ * This call is non-blocking, i.e. it only processes completions that are ready at
+ * the time of this function call. It does not wait for outstanding commands to finish.
+ *
+ * \param max_completions Limit the number of completions to be processed in one call, or 0
+ * for unlimited.
+ *
+ * Only the thread currently using the qpair may call this function.
+ */
+void nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions);
+
+/**
+ * \brief Start a batch of I/O submissions on the given qpair.
+ *
+ * Same as nvme_ctrlr_io_batch_begin(), but for a qpair returned by
+ * nvme_ctrlr_alloc_io_qpair().
+ */
+void nvme_qpair_batch_begin(struct nvme_qpair *qpair);
+
+/**
+ * \brief End a batch of I/O submissions started with nvme_qpair_batch_begin().
+ */
+void nvme_qpair_batch_end(struct nvme_qpair *qpair);
+
+/** Pass as max_queued to nvme_qpair_set_queue_limit() to remove the limit. */
+#define NVME_QPAIR_QUEUE_UNLIMITED	UINT32_MAX
+
+/**
+ * Signature for the callback invoked when a qpair that refused a submission
+ * with EAGAIN can accept I/O again.
+ */
+typedef void (*nvme_qpair_slot_cb_fn_t)(void *cb_arg, struct nvme_qpair *qpair);
+
+/**
+ * \brief Bound the number of requests the driver queues in software for a qpair.
+ *
+ * By default, I/O submitted while all of a qpair's trackers are busy is queued
+ * by the driver without limit.  Once a limit is set, at most \a max_queued
+ * requests may wait for a tracker (0 disables software queueing), and
+ * nvme_ns_cmd_xxx functions submitting to \a qpair return EAGAIN instead of
+ * queueing further.  An I/O split into several commands is admitted only if
+ * its first window of commands fits.  A refused I/O is not submitted and its
+ * callback is not called.
+ *
+ * If \a cb_fn is not NULL, it is called once, from
+ * nvme_qpair_process_completions(), after a submission has been refused and
+ * a new one would be admitted again.  It may submit I/O.
+ *
+ * Pass NVME_QPAIR_QUEUE_UNLIMITED as \a max_queued to restore the default.
+ *
+ * Only the thread currently using the qpair may call this function.
+ */
+void nvme_qpair_set_queue_limit(struct nvme_qpair *qpair, uint32_t max_queued,
+				nvme_qpair_slot_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Get the number of commands that can be sent to the controller on the
+ * qpair right now, without being queued by the driver.
+ *
+ * Only the thread currently using the qpair may call this function.
+ */
+uint32_t nvme_qpair_get_num_free_trackers(struct nvme_qpair *qpair);
+
+/**
+ * \brief Get the number of requests queued by the driver waiting for a free tracker.
+ *
+ * Only the thread currently using the qpair may call this function.
+ */
+uint32_t nvme_qpair_get_num_queued_requests(struct nvme_qpair *qpair);
+
+/**
+ * \brief How controller resets have affected an I/O qpair.
+ */
+struct nvme_qpair_reset_stats {
+	/** Controller resets this qpair has come through. */
+	uint64_t	num_resets;
+
+	/** Commands that were outstanding at a reset and resubmitted after it. */
+	uint64_t	num_replayed;
+
+	/** Total time, in microseconds, that I/O on this qpair was held up by resets. */
+	uint64_t	stall_us;
+
+	/** Longest single hold-up, in microseconds. */
+	uint64_t	max_stall_us;
+};
+
+/**
+ * \brief Get reset statistics for an I/O qpair.
+ *
+ * Only the thread currently using the qpair may call this function.
+ */
+void nvme_qpair_get_reset_stats(struct nvme_qpair *qpair, struct nvme_qpair_reset_stats *stats);
+
+/**
+ * \brief How often I/O submitted on a qpair was split into several commands.
+ */
+struct nvme_qpair_split_stats {
+	/** Requests that were split. */
+	uint64_t	num_split_ios;
+
+	/** Commands issued for split requests. */
+	uint64_t	num_split_cmds;
+
+	/** Splits made at the namespace's optimal I/O boundary. */
+	uint64_t	num_boundary_splits;
+};
+
+/**
+ * \brief Get split statistics for an I/O qpair.
+ *
+ * Only the thread currently using the qpair may call this function.
+ */
+void nvme_qpair_get_split_stats(struct nvme_qpair *qpair, struct nvme_qpair_split_stats *stats);
+
 /**
  * \brief Send the given admin command to the NVMe controller.
  *
@@ -230,9 +597,75 @@ uint64_t nvme_ns_get_num_sectors(struct nvme_namespace *ns);
  */
 uint64_t nvme_ns_get_size(struct nvme_namespace *ns);
 
+/**
+ * \brief Get the metadata size, in bytes, of each sector of the given namespace.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ *
+ */
+uint32_t nvme_ns_get_md_size(struct nvme_namespace *ns);
+
+/**
+ * \brief Get the size, in bytes, that each sector of the given namespace takes
+ *  in a host data buffer.
+ *
+ * This is the sector size plus the metadata size if the namespace is formatted
+ * with extended LBAs (NVME_NS_EXTENDED_LBA_SUPPORTED), and the sector size
+ * otherwise.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ *
+ */
+uint32_t nvme_ns_get_extended_sector_size(struct nvme_namespace *ns);
+
+/**
+ * \brief Get the end-to-end protection information type the given namespace
+ *  is formatted with, or NVME_PI_TYPE_NONE.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ *
+ */
+enum nvme_pi_type nvme_ns_get_pi_type(struct nvme_namespace *ns);
+
+/**
+ * \brief Get the optimal I/O boundary of the given namespace, in sectors.
+ *
+ * Reads and writes that cross a multiple of this boundary are split at it.
+ *  0 means the namespace has no boundary.  Unless set with
+ *  nvme_ns_set_optimal_io_boundary(), this is the Namespace Optimal I/O
+ *  Boundary from identify data, or for controllers known to report an
+ *  internal stripe elsewhere, that stripe.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ *
+ */
+uint32_t nvme_ns_get_optimal_io_boundary(struct nvme_namespace *ns);
+
+/** Passed to nvme_ns_set_optimal_io_boundary() to go back to the device's boundary. */
+#define NVME_NS_IO_BOUNDARY_DEFAULT	UINT32_MAX
+
+/**
+ * \brief Set the boundary, in sectors, that I/O to the given namespace is split at.
+ *
+ * \param ns namespace to set the boundary of
+ * \param sectors boundary in sectors, which need not be a power of two; 0 to
+ *  not split at any boundary, or NVME_NS_IO_BOUNDARY_DEFAULT to use the
+ *  boundary the device reports
+ *
+ * The boundary is kept across controller resets.  It must not be changed
+ *  while I/O to the namespace is outstanding.
+ */
+void nvme_ns_set_optimal_io_boundary(struct nvme_namespace *ns, uint32_t sectors);
+
 enum nvme_namespace_flags {
-	NVME_NS_DEALLOCATE_SUPPORTED	= 0x1,
-	NVME_NS_FLUSH_SUPPORTED		= 0x2,
+	NVME_NS_DEALLOCATE_SUPPORTED		= 0x1,
+	NVME_NS_FLUSH_SUPPORTED			= 0x2,
+	NVME_NS_WRITE_ZEROES_SUPPORTED		= 0x4,
+	NVME_NS_COMPARE_SUPPORTED		= 0x8,
+	NVME_NS_WRITE_UNCORRECTABLE_SUPPORTED	= 0x10,
+	NVME_NS_COMPARE_AND_WRITE_SUPPORTED	= 0x20,
+	NVME_NS_DPS_PI_SUPPORTED		= 0x40,
+	NVME_NS_EXTENDED_LBA_SUPPORTED		= 0x80,
 };
 
 /**
@@ -245,45 +678,518 @@ enum nvme_namespace_flags {
  */
 uint32_t nvme_ns_get_flags(struct nvme_namespace *ns);
 
+/**
+ * \name I/O flags
+ *
+ * Flags for the io_flags argument of the read and write commands.  The
+ * driver applies them to every command of an I/O that it splits.
+ */
+/**@{*/
+/** Limit the controller's error recovery for the I/O. */
+#define NVME_IO_FLAGS_LIMITED_RETRY		(1U << 31)
+/** Complete a write only once the data is on non-volatile media; read from media. */
+#define NVME_IO_FLAGS_FORCE_UNIT_ACCESS		(1U << 30)
+/** Expected access frequency of the range, an enum nvme_dsm_access_frequency. */
+#define NVME_IO_FLAGS_ACCESS_FREQUENCY(f)	((uint32_t)(f) & 0xF)
+/** Desired access latency for the range, an enum nvme_dsm_access_latency. */
+#define NVME_IO_FLAGS_ACCESS_LATENCY(l)		(((uint32_t)(l) & 0x3) << 4)
+/** The I/O is part of a sequential request. */
+#define NVME_IO_FLAGS_SEQUENTIAL_REQUEST	(1U << 6)
+/** The data is not compressible. */
+#define NVME_IO_FLAGS_INCOMPRESSIBLE		(1U << 7)
+/**
+ * The controller generates protection information on writes and strips it on
+ *  reads.  If the protection information is all of the metadata, it is not
+ *  transferred to or from the host at all.
+ */
+#define NVME_IO_FLAGS_PRACT			(1U << 29)
+/** The controller checks the guard field of the protection information. */
+#define NVME_IO_FLAGS_PRCHK_GUARD		(1U << 28)
+/** The controller checks the application tag, under the given mask. */
+#define NVME_IO_FLAGS_PRCHK_APPTAG		(1U << 27)
+/** The controller checks the reference tag against the low 32 bits of the LBA. */
+#define NVME_IO_FLAGS_PRCHK_REFTAG		(1U << 26)
+/**@}*/
+
 /**
  * \brief Submits a write I/O to the specified NVMe namespace.
  *
  * \param ns NVMe namespace to submit the write I/O
- * \param payload virtual address pointer to the data payload
+ * \param payload virtual address pointer to the data payload, of
+ *                nvme_ns_get_extended_sector_size() bytes per sector
  * \param lba starting LBA to write the data
  * \param lba_count length (in sectors) for the write operation
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
+ * \param io_flags NVME_IO_FLAGS_* for the write, e.g.
+ *                 NVME_IO_FLAGS_FORCE_UNIT_ACCESS to make it durable
+ *                 without a separate flush
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, ENXIO if
+ *	     the calling thread has no I/O queue on this controller, EAGAIN
+ *	     if the queue limit set by nvme_qpair_set_queue_limit() is reached,
+ *	     EINVAL if \a io_flags holds an unknown flag, or protection
+ *	     information flags for a namespace formatted without it, or if
+ *	     the namespace has separate metadata, which needs
+ *	     nvme_ns_cmd_write_with_md() unless NVME_IO_FLAGS_PRACT is set and
+ *	     the metadata is only protection information
  *
  * This function is thread safe and can be called at any point after
  * nvme_register_io_thread().
  */
 int nvme_ns_cmd_write(struct nvme_namespace *ns, void *payload,
 		      uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
-		      void *cb_arg);
+		      void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a write I/O to the specified NVMe namespace on the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_write(), but submits on \a qpair instead of the calling
+ * thread's I/O queue.  \a qpair must have been allocated on the namespace's
+ * controller.
+ */
+int nvme_ns_cmd_write_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			    void *payload, uint64_t lba, uint32_t lba_count,
+			    nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags);
 
 /**
  * \brief Submits a read I/O to the specified NVMe namespace.
  *
  * \param ns NVMe namespace to submit the read I/O
- * \param payload virtual address pointer to the data payload
+ * \param payload virtual address pointer to the data payload, of
+ *                nvme_ns_get_extended_sector_size() bytes per sector
  * \param lba starting LBA to read the data
  * \param lba_count length (in sectors) for the read operation
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
+ * \param io_flags NVME_IO_FLAGS_* for the read
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, ENXIO if
+ *	     the calling thread has no I/O queue on this controller, EAGAIN
+ *	     if the queue limit set by nvme_qpair_set_queue_limit() is reached,
+ *	     EINVAL if \a io_flags holds an unknown flag, or protection
+ *	     information flags for a namespace formatted without it, or if
+ *	     the namespace has separate metadata, which needs
+ *	     nvme_ns_cmd_read_with_md() unless NVME_IO_FLAGS_PRACT is set and
+ *	     the metadata is only protection information
  *
  * This function is thread safe and can be called at any point after
  * nvme_register_io_thread().
  */
 int nvme_ns_cmd_read(struct nvme_namespace *ns, void *payload,
 		     uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
-		     void *cb_arg);
+		     void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a read I/O to the specified NVMe namespace on the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_read(), but submits on \a qpair instead of the calling
+ * thread's I/O queue.  \a qpair must have been allocated on the namespace's
+ * controller.
+ */
+int nvme_ns_cmd_read_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			   void *payload, uint64_t lba, uint32_t lba_count,
+			   nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a read I/O using caller-provided request storage.
+ *
+ * Same as nvme_ns_cmd_read_qpair(), but the request is built in \a req_buf
+ * instead of being taken from the driver's request pool, so the submission
+ * path makes no allocator calls unless the I/O must be split.
+ *
+ * \a req_buf must point to at least nvme_request_size() bytes, aligned to at
+ * least 8 bytes (64 is recommended so the request does not share cachelines
+ * with unrelated data).  It must remain valid and untouched until \a cb_fn has
+ * been called, and may be reused for a new submission from within \a cb_fn.
+ * Children of a split I/O are still allocated from the driver's pool.
+ *
+ * \return 0 if successfully submitted, ENOMEM if a split child could not be
+ *	     allocated, EAGAIN if the qpair's queue limit is reached (\a req_buf
+ *	     may be reused immediately in either case)
+ */
+int nvme_ns_cmd_read_req(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			 void *req_buf, void *payload, uint64_t lba,
+			 uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
+			 uint32_t io_flags);
+
+/**
+ * \brief Submits a write I/O using caller-provided request storage.
+ *
+ * Same as nvme_ns_cmd_read_req(), but for writes.
+ */
+int nvme_ns_cmd_write_req(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			  void *req_buf, void *payload, uint64_t lba,
+			  uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
+			  uint32_t io_flags);
+
+/**
+ * \brief Submits a vectored read I/O to the specified NVMe namespace on the
+ *  given I/O qpair.
+ *
+ * \param ns NVMe namespace to submit the read I/O
+ * \param qpair I/O qpair allocated on the namespace's controller
+ * \param lba starting LBA to read the data
+ * \param lba_count length (in sectors) for the read operation
+ * \param iov scatter list describing the data buffer
+ * \param iovcnt number of elements in \a iov
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ * \param io_flags NVME_IO_FLAGS_* for the read
+ *
+ * The elements of \a iov must add up to exactly \a lba_count sectors.  Each
+ * command carries as many elements as one PRP list can describe: only its
+ * first element may start within a page and only its last may end within one.
+ * At any other element boundary the I/O is split into separate commands, so
+ * such a boundary must also fall on a sector boundary.  If the controller
+ * supports SGLs, commands that a PRP list cannot describe use an SGL instead,
+ * and elements may then be of any length and alignment.  \a iov must remain
+ * valid until \a cb_fn has been called.
+ *
+ * \return 0 if successfully submitted, EINVAL if \a iov does not cover the
+ *	     transfer or cannot be split at sector boundaries, or for the
+ *	     same \a io_flags and metadata reasons as nvme_ns_cmd_read(),
+ *	     ENOMEM if an nvme_request structure cannot be allocated for the
+ *	     I/O request, EAGAIN if the queue limit set by
+ *	     nvme_qpair_set_queue_limit() is reached
+ */
+int nvme_ns_cmd_readv_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			    uint64_t lba, uint32_t lba_count,
+			    const struct iovec *iov, int iovcnt,
+			    nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a vectored read I/O to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_readv_qpair(), but submits on the calling thread's I/O
+ * queue.  Returns ENXIO if the calling thread has no I/O queue on this
+ * controller.
+ */
+int nvme_ns_cmd_readv(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+		      const struct iovec *iov, int iovcnt,
+		      nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a vectored write I/O to the specified NVMe namespace on the
+ *  given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_readv_qpair(), but for writes.
+ */
+int nvme_ns_cmd_writev_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			     uint64_t lba, uint32_t lba_count,
+			     const struct iovec *iov, int iovcnt,
+			     nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a vectored write I/O to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_readv(), but for writes.
+ */
+int nvme_ns_cmd_writev(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+		       const struct iovec *iov, int iovcnt,
+		       nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a read I/O with metadata to the specified NVMe namespace on
+ *  the given I/O qpair.
+ *
+ * \param ns NVMe namespace to submit the read I/O
+ * \param qpair I/O qpair allocated on the namespace's controller
+ * \param payload virtual address pointer to the data payload, of
+ *                nvme_ns_get_extended_sector_size() bytes per sector
+ * \param metadata separate metadata buffer of nvme_ns_get_md_size() bytes
+ *                 per sector, or NULL if the namespace is formatted with
+ *                 extended LBAs or without metadata, or if
+ *                 NVME_IO_FLAGS_PRACT is set and the metadata is only
+ *                 protection information
+ * \param lba starting LBA to read the data
+ * \param lba_count length (in sectors) for the read operation
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ * \param io_flags NVME_IO_FLAGS_* for the read, including the
+ *                 NVME_IO_FLAGS_PRACT and NVME_IO_FLAGS_PRCHK_* flags
+ * \param apptag_mask bits of the application tag to check
+ * \param apptag expected application tag
+ *
+ * The expected reference tag of each command is the low 32 bits of its
+ * starting LBA, as Type 1 protection requires; Type 2 namespaces must use the
+ * same convention.  \a metadata must be dword aligned and physically
+ * contiguous, and is split along with the I/O.
+ *
+ * \return 0 if successfully submitted, EINVAL if \a io_flags holds an
+ *	     unknown flag, or protection information flags for a namespace
+ *	     formatted without it, or if \a metadata is given for a namespace
+ *	     without separate metadata or is NULL for one with it, ENOMEM if an nvme_request structure
+ *	     cannot be allocated for the I/O request, EAGAIN if the queue
+ *	     limit set by nvme_qpair_set_queue_limit() is reached
+ */
+int nvme_ns_cmd_read_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				   void *payload, void *metadata,
+				   uint64_t lba, uint32_t lba_count,
+				   nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				   uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits a read I/O with metadata to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_read_with_md_qpair(), but submits on the calling
+ * thread's I/O queue.  Returns ENXIO if the calling thread has no I/O queue on
+ * this controller.
+ */
+int nvme_ns_cmd_read_with_md(struct nvme_namespace *ns, void *payload, void *metadata,
+			     uint64_t lba, uint32_t lba_count,
+			     nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+			     uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits a write I/O with metadata to the specified NVMe namespace on
+ *  the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_read_with_md_qpair(), but for writes.  \a apptag is
+ * also the application tag the controller generates with NVME_IO_FLAGS_PRACT.
+ */
+int nvme_ns_cmd_write_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				    void *payload, void *metadata,
+				    uint64_t lba, uint32_t lba_count,
+				    nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				    uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits a write I/O with metadata to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_read_with_md(), but for writes.
+ */
+int nvme_ns_cmd_write_with_md(struct nvme_namespace *ns, void *payload, void *metadata,
+			      uint64_t lba, uint32_t lba_count,
+			      nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+			      uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits a write zeroes I/O to the specified NVMe namespace on the
+ *  given I/O qpair.
+ *
+ * \param ns NVMe namespace to submit the write zeroes I/O
+ * \param qpair I/O qpair allocated on the namespace's controller
+ * \param lba starting LBA to write zeroes to
+ * \param lba_count length (in sectors) to write zeroes to
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ *
+ * No data is transferred.  Ranges longer than one command can cover, or
+ * that cross the namespace's optimal I/O boundary, are split like reads and writes.  Check
+ * for NVME_NS_WRITE_ZEROES_SUPPORTED in nvme_ns_get_flags() first.
+ *
+ * \return 0 if successfully submitted, EINVAL if \a lba_count is 0, ENOMEM
+ *	     if an nvme_request structure cannot be allocated for the I/O
+ *	     request, EAGAIN if the queue limit set by
+ *	     nvme_qpair_set_queue_limit() is reached
+ */
+int nvme_ns_cmd_write_zeroes_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				   uint64_t lba, uint32_t lba_count,
+				   nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits a write zeroes I/O to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_write_zeroes_qpair(), but submits on the calling
+ * thread's I/O queue.  Returns ENXIO if the calling thread has no I/O queue
+ * on this controller.
+ */
+int nvme_ns_cmd_write_zeroes(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+			     nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits a write uncorrectable I/O to the specified NVMe namespace on
+ *  the given I/O qpair.
+ *
+ * Marks the range invalid, so reads of it fail until it is written again.
+ * Otherwise the same as nvme_ns_cmd_write_zeroes_qpair().  Check for
+ * NVME_NS_WRITE_UNCORRECTABLE_SUPPORTED in nvme_ns_get_flags() first.
+ */
+int nvme_ns_cmd_write_uncorrectable_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+					  uint64_t lba, uint32_t lba_count,
+					  nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits a write uncorrectable I/O to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_write_uncorrectable_qpair(), but submits on the calling
+ * thread's I/O queue.  Returns ENXIO if the calling thread has no I/O queue
+ * on this controller.
+ */
+int nvme_ns_cmd_write_uncorrectable(struct nvme_namespace *ns, uint64_t lba,
+				    uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits a compare I/O to the specified NVMe namespace on the given
+ *  I/O qpair.
+ *
+ * The controller compares the range with \a payload and completes with
+ * NVME_SC_COMPARE_FAILURE if they differ.  Otherwise the same as
+ * nvme_ns_cmd_read_qpair(), including how large compares are split; a
+ * split compare stops at the first part that differs.  Check for
+ * NVME_NS_COMPARE_SUPPORTED in nvme_ns_get_flags() first.  Like a read, it
+ * returns EINVAL on a namespace with separate metadata; use
+ * nvme_ns_cmd_compare_with_md_qpair() there.
+ */
+int nvme_ns_cmd_compare_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			      void *payload, uint64_t lba, uint32_t lba_count,
+			      nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits a compare I/O to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_compare_qpair(), but submits on the calling thread's
+ * I/O queue.  Returns ENXIO if the calling thread has no I/O queue on this
+ * controller.
+ */
+int nvme_ns_cmd_compare(struct nvme_namespace *ns, void *payload, uint64_t lba,
+			uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits a compare I/O with metadata to the specified NVMe namespace
+ *  on the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_compare_qpair(), but with the metadata and protection
+ * information arguments of nvme_ns_cmd_read_with_md_qpair().  The controller
+ * compares \a metadata as well as \a payload.
+ */
+int nvme_ns_cmd_compare_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				      void *payload, void *metadata,
+				      uint64_t lba, uint32_t lba_count,
+				      nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				      uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits a compare I/O with metadata to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_compare_with_md_qpair(), but submits on the calling
+ * thread's I/O queue.  Returns ENXIO if the calling thread has no I/O queue
+ * on this controller.
+ */
+int nvme_ns_cmd_compare_with_md(struct nvme_namespace *ns, void *payload, void *metadata,
+				uint64_t lba, uint32_t lba_count,
+				nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits an atomic compare and write to the specified NVMe namespace
+ *  on the given I/O qpair.
+ *
+ * The range is compared with \a compare_payload and, only if it matches,
+ * overwritten with \a write_payload, with no other command to the range
+ * able to intervene.  The two halves are submitted as a fused pair in
+ * adjacent submission queue entries and complete through a single call to
+ * \a cb_fn.
+ *
+ * On error, the completion carries the status of the half that failed,
+ * and its cdw0 is NVME_CMD_FUSE_FIRST if that was the compare, in which
+ * case nothing was written, or NVME_CMD_FUSE_SECOND if it was the write.
+ * A mismatch is reported as NVME_SC_COMPARE_FAILURE from the compare.
+ * Fused commands are never retried by the driver.
+ *
+ * The range must fit in a single command (see
+ * nvme_ns_get_max_io_xfer_size()); it is never split.  Returns ENOTSUP
+ * unless NVME_NS_COMPARE_AND_WRITE_SUPPORTED is set in nvme_ns_get_flags(),
+ * and EINVAL if the range is empty or too large, or if the namespace
+ * carries separate metadata; use nvme_ns_cmd_compare_and_write_with_md_qpair()
+ * for such namespaces.
+ */
+int nvme_ns_cmd_compare_and_write_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+					void *compare_payload, void *write_payload,
+					uint64_t lba, uint32_t lba_count,
+					nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits an atomic compare and write to the specified NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_compare_and_write_qpair(), but submits on the calling
+ * thread's I/O queue.  Returns ENXIO if the calling thread has no I/O queue
+ * on this controller.
+ */
+int nvme_ns_cmd_compare_and_write(struct nvme_namespace *ns,
+				  void *compare_payload, void *write_payload,
+				  uint64_t lba, uint32_t lba_count,
+				  nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits an atomic compare and write with metadata to the specified
+ *  NVMe namespace on the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_compare_and_write_qpair(), but with the metadata and
+ * protection information arguments of nvme_ns_cmd_write_with_md_qpair().
+ * \a compare_md and \a write_md are the separate metadata of the compare
+ * and write halves; both \a io_flags and the application tag apply to each
+ * half, except that the dataset management hints apply to the write only.
+ */
+int nvme_ns_cmd_compare_and_write_with_md_qpair(struct nvme_namespace *ns,
+						struct nvme_qpair *qpair,
+						void *compare_payload, void *compare_md,
+						void *write_payload, void *write_md,
+						uint64_t lba, uint32_t lba_count,
+						nvme_cb_fn_t cb_fn, void *cb_arg,
+						uint32_t io_flags, uint16_t apptag_mask,
+						uint16_t apptag);
+
+/**
+ * \brief Submits an atomic compare and write with metadata to the specified
+ *  NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_compare_and_write_with_md_qpair(), but submits on the
+ * calling thread's I/O queue.  Returns ENXIO if the calling thread has no
+ * I/O queue on this controller.
+ */
+int nvme_ns_cmd_compare_and_write_with_md(struct nvme_namespace *ns,
+					  void *compare_payload, void *compare_md,
+					  void *write_payload, void *write_md,
+					  uint64_t lba, uint32_t lba_count,
+					  nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+					  uint16_t apptag_mask, uint16_t apptag);
+
+/**
+ * \brief Submits dataset management for a list of LBA ranges to the specified
+ *  NVMe namespace on the given I/O qpair.
+ *
+ * \param type enum nvme_dsm_attribute flags applied to every range, e.g.
+ *             NVME_DSM_ATTR_DEALLOCATE to deallocate them
+ * \param ranges the ranges, each with its own context attributes (see
+ *               NVME_DSM_CATTR_*).  They need not be sorted, and may
+ *               touch or overlap.
+ * \param num_ranges number of entries in \a ranges, with no upper limit
+ *
+ * \a ranges is not modified.  It is copied into commands of up to
+ * NVME_DSM_MAX_RANGES ranges each in driver memory, a few in flight at a
+ * time, so \a ranges must remain valid until \a cb_fn is called.  Empty
+ * ranges are dropped, and the ranges copied into each command are sorted by
+ * starting LBA, with those of the same attributes that touch or overlap
+ * merged.  Ranges in different commands are not merged, so a list already
+ * in LBA order coalesces best.  \a cb_fn is called once after all of the
+ * commands have completed, with the status of the first that failed.
+ *
+ * \return 0 if successfully submitted, EINVAL if there are no non-empty
+ *	     ranges, ENOMEM if an nvme_request structure or, on the qpair's
+ *	     first dataset management request, its range pages cannot be
+ *	     allocated, EAGAIN if the queue limit set by
+ *	     nvme_qpair_set_queue_limit() is reached or the qpair already has
+ *	     as many dataset management commands in flight as it can carry
+ */
+int nvme_ns_cmd_dataset_management_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+					 uint32_t type, const struct nvme_dsm_range *ranges,
+					 uint32_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Submits dataset management for a list of LBA ranges to the specified
+ *  NVMe namespace.
+ *
+ * Same as nvme_ns_cmd_dataset_management_qpair(), but submits on the calling
+ * thread's I/O queue.  Returns ENXIO if the calling thread has no I/O queue
+ * on this controller.
+ */
+int nvme_ns_cmd_dataset_management(struct nvme_namespace *ns, uint32_t type,
+				   const struct nvme_dsm_range *ranges, uint32_t num_ranges,
+				   nvme_cb_fn_t cb_fn, void *cb_arg);
 
 /**
  * \brief Submits a deallocation request to the specified NVMe namespace.
@@ -295,8 +1201,13 @@ int nvme_ns_cmd_read(struct nvme_namespace *ns, void *payload,
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
  *
+ * The list is sent to the controller as is, as a single command.  See
+ * nvme_ns_cmd_dataset_management() for longer or unsorted lists.
+ *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, ENXIO if
+ *	     the calling thread has no I/O queue on this controller, EAGAIN
+ *	     if the queue limit set by nvme_qpair_set_queue_limit() is reached
  *
  * This function is thread safe and can be called at any point after
  * nvme_register_io_thread().
@@ -305,6 +1216,16 @@ int nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
 			   uint8_t num_ranges, nvme_cb_fn_t cb_fn,
 			   void *cb_arg);
 
+/**
+ * \brief Submits a deallocation request to the specified NVMe namespace on the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_deallocate(), but submits on \a qpair instead of the
+ * calling thread's I/O queue.
+ */
+int nvme_ns_cmd_deallocate_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				 void *payload, uint8_t num_ranges,
+				 nvme_cb_fn_t cb_fn, void *cb_arg);
+
 /**
  * \brief Submits a flush request to the specified NVMe namespace.
  *
@@ -313,7 +1234,9 @@ int nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
  * \param cb_arg argument to pass to the callback function
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, ENXIO if
+ *	     the calling thread has no I/O queue on this controller, EAGAIN
+ *	     if the queue limit set by nvme_qpair_set_queue_limit() is reached
  *
  * This function is thread safe and can be called at any point after
  * nvme_register_io_thread().
@@ -321,11 +1244,105 @@ int nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
 int nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn,
 		      void *cb_arg);
 
+/**
+ * \brief Submits a flush request to the specified NVMe namespace on the given I/O qpair.
+ *
+ * Same as nvme_ns_cmd_flush(), but submits on \a qpair instead of the calling
+ * thread's I/O queue.
+ */
+int nvme_ns_cmd_flush_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			    nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Compute the CRC-16 T10 DIF of a buffer, as used for the guard field
+ *  of protection information.
+ *
+ * \param crc CRC of the data preceding \a buf, or 0 to start a new CRC
+ * \param buf data to add to the CRC
+ * \param len length of \a buf in bytes
+ *
+ * This function is thread safe and can be called at any time.
+ */
+uint16_t nvme_crc16_t10dif(uint16_t crc, const void *buf, size_t len);
+
+/**
+ * \brief Generate the protection information of sectors to be written.
+ *
+ * \param ns NVMe namespace the sectors will be written to
+ * \param payload data of \a lba_count sectors, with the metadata
+ *                interleaved if \a md is NULL
+ * \param md separate metadata buffer, or NULL if the namespace is formatted
+ *           with extended LBAs
+ * \param lba LBA of the first sector
+ * \param lba_count number of sectors
+ * \param apptag application tag to store in each sector
+ *
+ * Fills in the protection information of each sector the way the namespace's
+ * format places it, with the low 32 bits of the sector's LBA as its reference
+ * tag.  Any other metadata is left as it is, and if it precedes the protection
+ * information it is covered by the guard.
+ *
+ * \return 0 on success, EINVAL if the namespace is not formatted with
+ *	     protection information or \a md does not match its format
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+int nvme_ns_dif_generate(struct nvme_namespace *ns, void *payload, void *md,
+			 uint64_t lba, uint32_t lba_count, uint16_t apptag);
+
+/** \brief The first protection information check that failed in nvme_ns_dif_verify(). */
+struct nvme_dif_error {
+	/**
+	 * NVME_SC_GUARD_CHECK_ERROR, NVME_SC_APPLICATION_TAG_CHECK_ERROR or
+	 *  NVME_SC_REFERENCE_TAG_CHECK_ERROR, as the controller would report it
+	 */
+	uint8_t		sc;
+
+	/** LBA of the sector that failed */
+	uint64_t	lba;
+
+	uint32_t	expected;
+	uint32_t	actual;
+};
+
+/**
+ * \brief Verify the protection information of sectors that were read.
+ *
+ * \param ns NVMe namespace the sectors were read from
+ * \param payload data of \a lba_count sectors, with the metadata
+ *                interleaved if \a md is NULL
+ * \param md separate metadata buffer, or NULL if the namespace is formatted
+ *           with extended LBAs
+ * \param lba LBA of the first sector
+ * \param lba_count number of sectors
+ * \param check_flags NVME_IO_FLAGS_PRCHK_* flags selecting the fields to check
+ * \param apptag_mask bits of the application tag to check
+ * \param apptag expected application tag
+ * \param err if not NULL, filled in with the first failed check
+ *
+ * Checks each sector as the controller does for a read with the same flags:
+ * sectors whose application tag is 0xFFFF (and for Type 3, whose reference
+ * tag is also 0xFFFFFFFF) are not checked, and the reference tag is not
+ * checked for Type 3.
+ *
+ * \return 0 if every sector passes, EIO at the first check that fails,
+ *	     EINVAL if the namespace is not formatted with protection
+ *	     information or \a md does not match its format
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+int nvme_ns_dif_verify(struct nvme_namespace *ns, const void *payload, const void *md,
+		       uint64_t lba, uint32_t lba_count, uint32_t check_flags,
+		       uint16_t apptag_mask, uint16_t apptag, struct nvme_dif_error *err);
+
 /**
  * \brief Get the size, in bytes, of an nvme_request.
  *
- * This is the size of the request objects that need to be allocated by the
- * nvme_alloc_request macro in nvme_impl.h
+ * Request objects are allocated by the driver from a pool it creates itself,
+ * with a per-thread cache in front of it, so applications no longer need to
+ * provide a request mempool.  The pool grows with the depth of the I/O qpairs
+ * created, and a thread's cache is returned to it when the thread exits.  Applications using nvme_ns_cmd_read_req() or
+ * nvme_ns_cmd_write_req() reserve this many bytes in their own I/O context.
  *
  * This function is thread safe and can be called at any time.
  *
@@ -333,6 +1350,13 @@ int nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn,
 size_t nvme_request_size(void);
 
 int nvme_register_io_thread(void);
+
+/**
+ * \brief Release the calling thread's I/O queue index.
+ *
+ * Also returns any request objects cached by the calling thread to the driver's
+ * pool, which otherwise happens when the thread exits.
+ */
 void nvme_unregister_io_thread(void);
 
 #ifdef __cplusplus
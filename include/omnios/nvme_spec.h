@@ -216,6 +216,12 @@ enum nvme_psdt_value {
 	NVME_PSDT_RESERVED		= 0x3
 };
 
+enum nvme_cmd_fuse {
+	NVME_CMD_FUSE_NONE		= 0x0,
+	NVME_CMD_FUSE_FIRST		= 0x1,
+	NVME_CMD_FUSE_SECOND		= 0x2,
+};
+
 struct nvme_command {
 	/* dword 0 */
 	uint16_t opc	:  8;	/* opcode */
@@ -282,12 +288,39 @@ struct nvme_completion {
 _Static_assert(sizeof(struct nvme_completion) == 16, "Incorrect size");
 
 struct nvme_dsm_range {
-	uint32_t attributes;
+	uint32_t attributes;	/* context attributes, see NVME_DSM_CATTR_* */
 	uint32_t length;
 	uint64_t starting_lba;
 };
 _Static_assert(sizeof(struct nvme_dsm_range) == 16, "Incorrect size");
 
+/** maximum number of ranges in one dataset management command */
+#define NVME_DSM_MAX_RANGES		256
+
+/* dataset management range context attributes */
+enum nvme_dsm_access_frequency {
+	NVME_DSM_FREQ_NONE			= 0x0,
+	NVME_DSM_FREQ_TYPICAL			= 0x1,
+	NVME_DSM_FREQ_INFREQUENT		= 0x2,
+	NVME_DSM_FREQ_INFREQUENT_WRITE		= 0x3,	/* frequent reads */
+	NVME_DSM_FREQ_INFREQUENT_READ		= 0x4,	/* frequent writes */
+	NVME_DSM_FREQ_FREQUENT			= 0x5,
+};
+
+enum nvme_dsm_access_latency {
+	NVME_DSM_LATENCY_NONE			= 0x0,
+	NVME_DSM_LATENCY_IDLE			= 0x1,
+	NVME_DSM_LATENCY_NORMAL			= 0x2,
+	NVME_DSM_LATENCY_LOW			= 0x3,
+};
+
+#define NVME_DSM_CATTR_ACCESS_FREQUENCY(f)	((uint32_t)(f) & 0xF)
+#define NVME_DSM_CATTR_ACCESS_LATENCY(l)	(((uint32_t)(l) & 0x3) << 4)
+#define NVME_DSM_CATTR_SEQUENTIAL_READ		(1u << 8)
+#define NVME_DSM_CATTR_SEQUENTIAL_WRITE		(1u << 9)
+#define NVME_DSM_CATTR_WRITE_PREPARE		(1u << 10)
+#define NVME_DSM_CATTR_ACCESS_SIZE(blocks)	(((uint32_t)(blocks) & 0xFF) << 24)
+
 /* status code types */
 enum nvme_status_code_type {
 	NVME_SCT_GENERIC		= 0x0,
@@ -617,11 +650,17 @@ struct __attribute__((packed)) nvme_controller_data {
 		uint16_t	compare : 1;
 		uint16_t	write_unc : 1;
 		uint16_t	dsm: 1;
-		uint16_t	reserved: 13;
+		uint16_t	write_zeroes: 1;
+		uint16_t	set_features_save: 1;
+		uint16_t	reservations: 1;
+		uint16_t	reserved: 10;
 	} oncs;
 
 	/** fused operation support */
-	uint16_t		fuses;
+	struct {
+		uint16_t	compare_and_write : 1;
+		uint16_t	reserved : 15;
+	} fuses;
 
 	/** format nvm attributes */
 	uint8_t			fna;
@@ -794,7 +833,8 @@ struct nvme_namespace_data {
 	/** namespace atomic boundary size power fail */
 	uint16_t		nabspf;
 
-	uint16_t		reserved46;
+	/** namespace optimal I/O boundary in logical blocks, 0 if not reported */
+	uint16_t		noiob;
 
 	/** NVM capacity */
 	uint64_t		nvmcap[2];
@@ -827,6 +867,26 @@ struct nvme_namespace_data {
 };
 _Static_assert(sizeof(struct nvme_namespace_data) == 4096, "Incorrect size");
 
+/** protection information type, as in dps.pit */
+enum nvme_pi_type {
+	NVME_PI_TYPE_NONE		= 0x0,
+	NVME_PI_TYPE1			= 0x1,
+	NVME_PI_TYPE2			= 0x2,
+	NVME_PI_TYPE3			= 0x3,
+};
+
+/**
+ * End-to-end protection information of a block, in the first or last eight
+ *  bytes of its metadata.  All fields are big-endian.
+ */
+struct nvme_protection_info {
+	/** CRC-16 T10 DIF of the block's data */
+	uint16_t		guard;
+	uint16_t		app_tag;
+	uint32_t		ref_tag;
+};
+_Static_assert(sizeof(struct nvme_protection_info) == 8, "Incorrect size");
+
 enum nvme_log_page {
 	/* 0x00 - reserved */
 	NVME_LOG_ERROR			= 0x01,
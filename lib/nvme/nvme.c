@@ -45,6 +45,22 @@ struct nvme_driver g_nvme_driver = {
 int32_t		nvme_retry_count;
 __thread int	nvme_thread_ioq_index = -1;
 
+/*
+ * Requests freed by a thread are reused by that thread, most recently
+ *  freed first, before going back to the driver's pool.
+ */
+struct nvme_request_cache {
+	struct nvme_request	**reqs;
+	uint32_t		count;
+	uint32_t		size;
+};
+
+static __thread struct nvme_request_cache nvme_thread_request_cache;
+
+/* Returns a thread's cached requests to the pool when the thread exits. */
+static pthread_key_t g_nvme_request_cache_key;
+static pthread_once_t g_nvme_request_cache_key_once = PTHREAD_ONCE_INIT;
+
 
 /**
  * \page nvme_initialization NVMe Initialization
@@ -52,20 +68,36 @@ __thread int	nvme_thread_ioq_index = -1;
 \msc
 
 	app [label="Application"], nvme [label="NVMe Driver"];
-	app=>nvme [label="nvme_attach(devhandle)"];
+	app=>nvme [label="nvme_attach_async(devhandle, opts)"];
 	app<<nvme [label="nvme_controller ptr"];
-	app=>nvme [label="nvme_ctrlr_start(nvme_controller ptr)"];
+	app=>nvme [label="nvme_ctrlr_process_init(nvme_controller ptr)"];
+	nvme=>nvme [label="reset and enable controller"];
+	app<<nvme [label="EAGAIN"];
+	app=>nvme [label="nvme_ctrlr_process_init(nvme_controller ptr)"];
 	nvme=>nvme [label="identify controller"];
-	nvme=>nvme [label="create queue pairs"];
+	nvme=>nvme [label="set number of I/O queues"];
 	nvme=>nvme [label="identify namespace(s)"];
+	nvme=>nvme [label="configure asynchronous events"];
+	app<<nvme [label="0"];
 	app=>app [label="create block devices based on controller's namespaces"];
+	app=>nvme [label="nvme_ctrlr_alloc_io_qpair() or first I/O on a registered thread"];
+	nvme=>nvme [label="create I/O queue pair"];
 
 \endmsc
 
  */
 
+void
+nvme_ctrlr_opts_set_defaults(struct nvme_ctrlr_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->io_queue_size = NVME_IO_ENTRIES;
+	opts->io_queue_requests = NVME_IO_TRACKERS;
+	opts->max_xfer_size = NVME_DEFAULT_MAX_XFER_SIZE;
+}
+
 struct nvme_controller *
-nvme_attach(void *devhandle)
+nvme_attach_async(void *devhandle, const struct nvme_ctrlr_opts *opts)
 {
 	struct nvme_controller	*ctrlr;
 	int			status;
@@ -78,12 +110,25 @@ nvme_attach(void *devhandle)
 		return NULL;
 	}
 
-	status = nvme_ctrlr_construct(ctrlr, devhandle);
+	status = nvme_ctrlr_construct(ctrlr, opts, devhandle);
 	if (status != 0) {
 		nvme_free(ctrlr);
 		return NULL;
 	}
 
+	return ctrlr;
+}
+
+struct nvme_controller *
+nvme_attach_opts(void *devhandle, const struct nvme_ctrlr_opts *opts)
+{
+	struct nvme_controller	*ctrlr;
+
+	ctrlr = nvme_attach_async(devhandle, opts);
+	if (ctrlr == NULL) {
+		return NULL;
+	}
+
 	if (nvme_ctrlr_start(ctrlr) != 0) {
 		nvme_ctrlr_destruct(ctrlr);
 		nvme_free(ctrlr);
@@ -93,6 +138,12 @@ nvme_attach(void *devhandle)
 	return ctrlr;
 }
 
+struct nvme_controller *
+nvme_attach(void *devhandle)
+{
+	return nvme_attach_opts(devhandle, NULL);
+}
+
 int
 nvme_detach(struct nvme_controller *ctrlr)
 {
@@ -121,27 +172,254 @@ nvme_request_size(void)
 	return sizeof(struct nvme_request);
 }
 
-struct nvme_request *
-nvme_allocate_request(void *payload, uint32_t payload_size,
-		      nvme_cb_fn_t cb_fn, void *cb_arg)
+/*
+ * Add a pool segment of at least num_reqs requests.  Called with the
+ *  driver lock held.
+ */
+static int
+nvme_request_pool_grow(uint32_t num_reqs)
+{
+	struct nvme_driver	*driver = &g_nvme_driver;
+	nvme_request_pool_t	*pool;
+	char			name[32];
+
+	if (driver->num_request_pools == NVME_REQUEST_POOL_MAX_SEGMENTS) {
+		nvme_printf(NULL, "request pool cannot grow any further\n");
+		return ENOMEM;
+	}
+
+	/* Doubling the pool each time keeps the number of segments small. */
+	num_reqs = nvme_max(num_reqs, driver->request_pool_size);
+	num_reqs = nvme_max(num_reqs, NVME_REQUEST_POOL_MIN_SIZE);
+
+	snprintf(name, sizeof(name), "nvme_request_pool%u", driver->num_request_pools);
+	pool = nvme_request_pool_create(name, num_reqs, sizeof(struct nvme_request));
+	if (pool == NULL) {
+		nvme_printf(NULL, "could not create request pool\n");
+		return ENOMEM;
+	}
+
+	driver->request_pools[driver->num_request_pools] = pool;
+	driver->request_pool_size += num_reqs;
+	wmb();
+	driver->num_request_pools++;
+
+	return 0;
+}
+
+/*
+ * Make sure the pool holds enough requests for an I/O qpair with
+ *  num_trackers trackers on top of everything already reserved.
+ */
+int
+nvme_request_pool_reserve(uint32_t num_trackers)
+{
+	struct nvme_driver	*driver = &g_nvme_driver;
+	uint32_t		needed;
+	int			rc = 0;
+
+	nvme_mutex_lock(&driver->lock);
+	needed = NVME_REQUEST_POOL_MIN_SIZE + driver->num_reserved_requests +
+		 num_trackers * NVME_REQUESTS_PER_TRACKER;
+	if (needed > driver->request_pool_size) {
+		rc = nvme_request_pool_grow(needed - driver->request_pool_size);
+	}
+	if (rc == 0) {
+		driver->num_reserved_requests += num_trackers * NVME_REQUESTS_PER_TRACKER;
+	}
+	nvme_mutex_unlock(&driver->lock);
+
+	return rc;
+}
+
+/*
+ * Release the reservation of an I/O qpair that is being destroyed.  The
+ *  pool does not shrink, but later qpairs can use the room.
+ */
+void
+nvme_request_pool_unreserve(uint32_t num_trackers)
+{
+	struct nvme_driver *driver = &g_nvme_driver;
+
+	nvme_mutex_lock(&driver->lock);
+	driver->num_reserved_requests -= num_trackers * NVME_REQUESTS_PER_TRACKER;
+	nvme_mutex_unlock(&driver->lock);
+}
+
+static int
+nvme_request_pool_init(void)
+{
+	struct nvme_driver	*driver = &g_nvme_driver;
+	int			rc = 0;
+
+	nvme_mutex_lock(&driver->lock);
+	if (driver->num_request_pools == 0) {
+		rc = nvme_request_pool_grow(NVME_REQUEST_POOL_MIN_SIZE);
+	}
+	nvme_mutex_unlock(&driver->lock);
+
+	return rc;
+}
+
+/*
+ * Take num_reqs requests from a single segment, newest (largest) first.
+ */
+static int
+nvme_request_pool_get(struct nvme_request **reqs, uint32_t num_reqs)
+{
+	struct nvme_driver	*driver = &g_nvme_driver;
+	nvme_request_pool_t	*pool;
+	uint32_t		i, num_pools;
+
+	num_pools = driver->num_request_pools;
+	rmb();
+
+	while (num_pools > 0) {
+		pool = driver->request_pools[--num_pools];
+		if (nvme_request_pool_get_bulk(pool, reqs, num_reqs) == 0) {
+			for (i = 0; i < num_reqs; i++) {
+				reqs[i]->pool = pool;
+			}
+			return 0;
+		}
+	}
+
+	return ENOMEM;
+}
+
+/*
+ * Return requests to the segments they came from, one call for each run of
+ *  requests from the same segment.
+ */
+static void
+nvme_request_pool_put(struct nvme_request **reqs, uint32_t num_reqs)
+{
+	nvme_request_pool_t	*pool;
+	uint32_t		n;
+
+	while (num_reqs > 0) {
+		pool = reqs[0]->pool;
+		for (n = 1; n < num_reqs && reqs[n]->pool == pool; n++) {
+			;
+		}
+		nvme_request_pool_put_bulk(pool, reqs, n);
+		reqs += n;
+		num_reqs -= n;
+	}
+}
+
+static void
+nvme_request_cache_drain(struct nvme_request_cache *cache, uint32_t num_reqs)
+{
+	cache->count -= num_reqs;
+	nvme_request_pool_put(&cache->reqs[cache->count], num_reqs);
+}
+
+static void
+nvme_request_cache_release(void)
+{
+	struct nvme_request_cache *cache = &nvme_thread_request_cache;
+
+	if (cache->count > 0) {
+		nvme_request_cache_drain(cache, cache->count);
+	}
+	free(cache->reqs);
+	cache->reqs = NULL;
+	cache->size = 0;
+}
+
+static void
+nvme_request_cache_key_destroy(void *arg)
 {
-	struct nvme_request *req = NULL;
+	nvme_request_cache_release();
+}
 
-	nvme_alloc_request(&req);
+static void
+nvme_request_cache_key_create(void)
+{
+	pthread_key_create(&g_nvme_request_cache_key, nvme_request_cache_key_destroy);
+}
 
-	if (req == NULL) {
-		return req;
+static int
+nvme_request_cache_resize(struct nvme_request_cache *cache, uint32_t size)
+{
+	struct nvme_request **reqs;
+
+	reqs = realloc(cache->reqs, size * sizeof(*reqs));
+	if (reqs == NULL) {
+		return ENOMEM;
+	}
+
+	if (cache->reqs == NULL) {
+		/* The key's value only needs to be non-NULL for its destructor to run. */
+		pthread_once(&g_nvme_request_cache_key_once, nvme_request_cache_key_create);
+		pthread_setspecific(g_nvme_request_cache_key, cache);
 	}
 
+	cache->reqs = reqs;
+	cache->size = size;
+	return 0;
+}
+
+static int
+nvme_request_cache_refill(struct nvme_request_cache *cache)
+{
+	struct nvme_driver	*driver = &g_nvme_driver;
+	uint32_t		num_reqs;
+
+	if (driver->num_request_pools == 0 && nvme_request_pool_init() != 0) {
+		return ENOMEM;
+	}
+
+	if (cache->size == 0 &&
+	    nvme_request_cache_resize(cache, NVME_REQUEST_CACHE_MIN_SIZE) != 0) {
+		return ENOMEM;
+	}
+
+	/* Fall back to a single request when the pool is running low. */
+	num_reqs = cache->size / 2;
+	if (nvme_request_pool_get(cache->reqs, num_reqs) != 0) {
+		num_reqs = 1;
+		if (nvme_request_pool_get(cache->reqs, num_reqs) != 0) {
+			return ENOMEM;
+		}
+	}
+
+	cache->count = num_reqs;
+	return 0;
+}
+
+/*
+ * Size the calling thread's request cache for an I/O qpair with
+ *  num_requests trackers.  The cache only ever grows.
+ */
+void
+nvme_request_cache_reserve(uint32_t num_requests)
+{
+	struct nvme_request_cache *cache = &nvme_thread_request_cache;
+
+	num_requests = nvme_max(num_requests, NVME_REQUEST_CACHE_MIN_SIZE);
+	num_requests = nvme_min(num_requests, NVME_REQUEST_CACHE_MAX_SIZE);
+
+	if (num_requests > cache->size) {
+		nvme_request_cache_resize(cache, num_requests);
+	}
+}
+
+void
+nvme_init_request(struct nvme_request *req, void *payload, uint32_t payload_size,
+		  nvme_cb_fn_t cb_fn, void *cb_arg)
+{
 	/*
-	 * Only memset up to (but not including) the children
-	 *  TAILQ_ENTRY.  children, and following members, are
-	 *  only used as part of I/O splitting so we avoid
-	 *  memsetting them until it is actually needed.
-	 *  They will be initialized in nvme_request_add_child()
-	 *  if the request is split.
+	 * Only memset up to (but not including) the split cursor.
+	 *  It, and following members, are only used as part of I/O
+	 *  splitting so we avoid memsetting them until it is
+	 *  actually needed.  They will be initialized when the
+	 *  request is split.  cmd is only initialized by
+	 *  nvme_allocate_request(), since LBA-addressed I/O does not
+	 *  use it.
 	 */
-	memset(req, 0, offsetof(struct nvme_request, children));
+	memset(req, 0, offsetof(struct nvme_request, split_ns));
 	req->cb_fn = cb_fn;
 	req->cb_arg = cb_arg;
 	req->timeout = true;
@@ -155,6 +433,40 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 		req->u.payload = payload;
 		req->payload_size = payload_size;
 	}
+}
+
+/*
+ * Allocate a request for LBA-addressed I/O.  The caller describes the
+ *  command through the request's io_* fields, so cmd is left
+ *  uninitialized.
+ */
+struct nvme_request *
+nvme_allocate_io_request(void *payload, uint32_t payload_size,
+			 nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request_cache	*cache = &nvme_thread_request_cache;
+	struct nvme_request		*req;
+
+	if (cache->count == 0 && nvme_request_cache_refill(cache) != 0) {
+		return NULL;
+	}
+
+	req = cache->reqs[--cache->count];
+	nvme_init_request(req, payload, payload_size, cb_fn, cb_arg);
+
+	return req;
+}
+
+struct nvme_request *
+nvme_allocate_request(void *payload, uint32_t payload_size,
+		      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request *req;
+
+	req = nvme_allocate_io_request(payload, payload_size, cb_fn, cb_arg);
+	if (req != NULL) {
+		memset(&req->cmd, 0, sizeof(req->cmd));
+	}
 
 	return req;
 }
@@ -162,8 +474,23 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 void
 nvme_free_request(struct nvme_request *req)
 {
+	struct nvme_request_cache *cache = &nvme_thread_request_cache;
+
 	nvme_assert(req != NULL, ("nvme_free_request(NULL)\n"));
-	nvme_dealloc_request(req);
+
+	if (cache->count == cache->size) {
+		if (cache->size == 0) {
+			/* First request freed on this thread. */
+			if (nvme_request_cache_resize(cache, NVME_REQUEST_CACHE_MIN_SIZE) != 0) {
+				nvme_request_pool_put(&req, 1);
+				return;
+			}
+		} else {
+			nvme_request_cache_drain(cache, cache->size / 2);
+		}
+	}
+
+	cache->reqs[cache->count++] = req;
 }
 
 static int
@@ -234,6 +561,7 @@ nvme_register_io_thread(void)
 void
 nvme_unregister_io_thread(void)
 {
+	nvme_request_cache_release();
 	nvme_free_ioq_index();
 }
 
@@ -41,6 +41,27 @@
 static void nvme_ctrlr_construct_and_submit_aer(struct nvme_controller *ctrlr,
 		struct nvme_async_event_request *aer);
 
+static const struct nvme_quirk g_nvme_quirks[] = {
+	{ INTEL_DC_P3X00_DEVID,	NVME_QUIRK_STRIPE_VS3 },
+};
+
+static uint32_t
+nvme_ctrlr_get_quirks(void *devhandle)
+{
+	uint32_t	pci_id;
+	size_t		i;
+
+	nvme_pcicfg_read32(devhandle, &pci_id, 0);
+
+	for (i = 0; i < sizeof(g_nvme_quirks) / sizeof(g_nvme_quirks[0]); i++) {
+		if (g_nvme_quirks[i].pci_id == pci_id) {
+			return g_nvme_quirks[i].flags;
+		}
+	}
+
+	return 0;
+}
+
 static int
 nvme_ctrlr_construct_admin_qpair(struct nvme_controller *ctrlr)
 {
@@ -51,13 +72,33 @@ nvme_ctrlr_construct_admin_qpair(struct nvme_controller *ctrlr)
 				    ctrlr);
 }
 
+/*
+ * Largest I/O queue, in entries, that both this controller and the driver support.
+ */
+static uint32_t
+nvme_ctrlr_max_io_queue_size(struct nvme_controller *ctrlr)
+{
+	union nvme_cap_lo_register	cap_lo;
+
+	/*
+	 * NVMe spec sets a hard limit of 64K max entries, but
+	 *  devices may specify a smaller limit, so we need to check
+	 *  the MQES field in the capabilities register.
+	 */
+	cap_lo.raw = nvme_mmio_read_4(ctrlr, cap_lo.raw);
+	return nvme_min(cap_lo.bits.mqes + 1u, NVME_MAX_IO_ENTRIES);
+}
+
+/*
+ * Set up the I/O qpair slots.  No rings or trackers are allocated here;
+ *  that is deferred until a qpair is claimed by nvme_ctrlr_alloc_io_qpair()
+ *  or by a registered I/O thread.
+ */
 static int
 nvme_ctrlr_construct_io_qpairs(struct nvme_controller *ctrlr)
 {
 	struct nvme_qpair		*qpair;
-	union nvme_cap_lo_register	cap_lo;
 	uint32_t			i, num_entries, num_trackers;
-	int				rc;
 
 	if (ctrlr->ioq != NULL) {
 		/*
@@ -69,27 +110,35 @@ nvme_ctrlr_construct_io_qpairs(struct nvme_controller *ctrlr)
 		return 0;
 	}
 
-	/*
-	 * NVMe spec sets a hard limit of 64K max entries, but
-	 *  devices may specify a smaller limit, so we need to check
-	 *  the MQES field in the capabilities register.
-	 */
-	cap_lo.raw = nvme_mmio_read_4(ctrlr, cap_lo.raw);
-	num_entries = nvme_min(NVME_IO_ENTRIES, cap_lo.bits.mqes + 1);
+	num_entries = nvme_min(ctrlr->opts.io_queue_size, nvme_ctrlr_max_io_queue_size(ctrlr));
+	if (num_entries < NVME_MIN_IO_ENTRIES) {
+		num_entries = NVME_MIN_IO_ENTRIES;
+	}
 
 	/*
 	 * No need to have more trackers than entries in the submit queue.
 	 *  Note also that for a queue size of N, we can only have (N-1)
 	 *  commands outstanding, hence the "-1" here.
 	 */
-	num_trackers = nvme_min(NVME_IO_TRACKERS, (num_entries - 1));
+	num_trackers = nvme_min(ctrlr->opts.io_queue_requests, (num_entries - 1));
+	if (num_trackers < NVME_MIN_IO_TRACKERS) {
+		num_trackers = NVME_MIN_IO_TRACKERS;
+	}
 
-	ctrlr->max_xfer_size = NVME_MAX_XFER_SIZE;
+	if (num_entries != ctrlr->opts.io_queue_size ||
+	    num_trackers != ctrlr->opts.io_queue_requests) {
+		nvme_printf(ctrlr, "using I/O queue size %u with %u requests "
+			    "(asked for %u with %u)\n", num_entries, num_trackers,
+			    ctrlr->opts.io_queue_size, ctrlr->opts.io_queue_requests);
+		ctrlr->opts.io_queue_size = num_entries;
+		ctrlr->opts.io_queue_requests = num_trackers;
+	}
 
 	ctrlr->ioq = calloc(ctrlr->num_io_queues, sizeof(struct nvme_qpair));
 
 	if (ctrlr->ioq == NULL)
 		return -1;
+	ctrlr->ioq_size = ctrlr->num_io_queues;
 
 	for (i = 0; i < ctrlr->num_io_queues; i++) {
 		qpair = &ctrlr->ioq[i];
@@ -98,71 +147,89 @@ nvme_ctrlr_construct_io_qpairs(struct nvme_controller *ctrlr)
 		 * Admin queue has ID=0. IO queues start at ID=1 -
 		 *  hence the 'i+1' here.
 		 */
-		rc = nvme_qpair_construct(qpair,
-					  i + 1, /* qpair ID */
-					  num_entries,
-					  num_trackers,
-					  ctrlr);
-		if (rc)
-			return -1;
+		qpair->id = i + 1;
+		qpair->ctrlr = ctrlr;
+		STAILQ_INIT(&qpair->queued_req);
 	}
 
 	return 0;
 }
 
+static bool
+nvme_ctrlr_io_qpair_is_created(struct nvme_qpair *qpair)
+{
+	return qpair->cmd != NULL;
+}
+
+/*
+ * I/O qpairs are failed by their owning threads, which see is_failed the
+ *  next time they submit or process completions.
+ */
 static void
 nvme_ctrlr_fail(struct nvme_controller *ctrlr)
 {
-	uint32_t i;
-
 	ctrlr->is_failed = true;
 	nvme_qpair_fail(&ctrlr->adminq);
-	for (i = 0; i < ctrlr->num_io_queues; i++) {
-		nvme_qpair_fail(&ctrlr->ioq[i]);
-	}
 }
 
-static int
-_nvme_ctrlr_wait_for_ready(struct nvme_controller *ctrlr, int desired_ready_value)
+/*
+ * Check the deadline of a wait that gets CAP.TO, counted from the first
+ *  check.  ready_timeout_tsc must be 0 when a new wait starts.  Returns
+ *  true once the deadline has passed, with the timeout in *timeout_in_ms.
+ */
+static bool
+nvme_ctrlr_wait_timed_out(struct nvme_controller *ctrlr, uint32_t *timeout_in_ms)
 {
-	int ms_waited, ready_timeout_in_ms;
-	union nvme_csts_register csts;
-	union nvme_cap_lo_register cap_lo;
+	union nvme_cap_lo_register	cap_lo;
 
 	/* Get ready timeout value from controller, in units of 500ms. */
 	cap_lo.raw = nvme_mmio_read_4(ctrlr, cap_lo.raw);
-	ready_timeout_in_ms = cap_lo.bits.to * 500;
-
-	csts.raw = nvme_mmio_read_4(ctrlr, csts);
+	*timeout_in_ms = cap_lo.bits.to * 500;
 
-	ms_waited = 0;
-
-	while (csts.bits.rdy != desired_ready_value) {
-		nvme_delay(1000);
-		if (ms_waited++ > ready_timeout_in_ms) {
-			nvme_printf(ctrlr, "controller ready did not become %d "
-				    "within %d ms\n", desired_ready_value, ready_timeout_in_ms);
-			return ENXIO;
-		}
-		csts.raw = nvme_mmio_read_4(ctrlr, csts);
+	if (ctrlr->ready_timeout_tsc == 0) {
+		ctrlr->ready_timeout_tsc = nvme_get_tsc() +
+					   *timeout_in_ms * nvme_get_tsc_hz() / 1000;
+		return false;
 	}
 
-	return 0;
+	return nvme_get_tsc() > ctrlr->ready_timeout_tsc;
 }
 
+/*
+ * Check CSTS.RDY against desired_ready_value.  The controller gets CAP.TO,
+ *  counted from the first check that finds it not there yet, to get there.
+ */
 static int
-nvme_ctrlr_wait_for_ready(struct nvme_controller *ctrlr)
+nvme_ctrlr_poll_ready(struct nvme_controller *ctrlr, int desired_ready_value)
 {
-	union nvme_cc_register cc;
+	union nvme_csts_register	csts;
+	uint32_t			ready_timeout_in_ms;
 
-	cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
+	csts.raw = nvme_mmio_read_4(ctrlr, csts);
+	if (csts.bits.rdy == desired_ready_value) {
+		return 0;
+	}
 
-	if (!cc.bits.en) {
-		nvme_printf(ctrlr, "%s called with cc.en = 0\n", __func__);
+	if (nvme_ctrlr_wait_timed_out(ctrlr, &ready_timeout_in_ms)) {
+		nvme_printf(ctrlr, "controller ready did not become %d "
+			    "within %u ms\n", desired_ready_value, ready_timeout_in_ms);
 		return ENXIO;
 	}
 
-	return _nvme_ctrlr_wait_for_ready(ctrlr, 1);
+	return EAGAIN;
+}
+
+static int
+_nvme_ctrlr_wait_for_ready(struct nvme_controller *ctrlr, int desired_ready_value)
+{
+	int rc;
+
+	ctrlr->ready_timeout_tsc = 0;
+	do {
+		rc = nvme_ctrlr_poll_ready(ctrlr, desired_ready_value);
+	} while (rc == EAGAIN);
+
+	return rc;
 }
 
 static void
@@ -180,7 +247,6 @@ nvme_ctrlr_disable(struct nvme_controller *ctrlr)
 
 	cc.bits.en = 0;
 	nvme_mmio_write_4(ctrlr, cc.raw, cc.raw);
-	nvme_delay(5000);
 
 	_nvme_ctrlr_wait_for_ready(ctrlr, 0);
 }
@@ -190,59 +256,233 @@ nvme_ctrlr_shutdown(struct nvme_controller *ctrlr)
 {
 	union nvme_cc_register		cc;
 	union nvme_csts_register	csts;
-	int				ms_waited = 0;
+	uint64_t			timeout_tsc;
 
 	cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
 	cc.bits.shn = NVME_SHN_NORMAL;
 	nvme_mmio_write_4(ctrlr, cc.raw, cc.raw);
 
-	csts.raw = nvme_mmio_read_4(ctrlr, csts);
 	/*
 	 * The NVMe spec does not define a timeout period
 	 *  for shutdown notification, so we just pick
 	 *  5 seconds as a reasonable amount of time to
 	 *  wait before proceeding.
 	 */
-	while (csts.bits.shst != NVME_SHST_COMPLETE) {
-		nvme_delay(1000);
+	timeout_tsc = nvme_get_tsc() + 5 * nvme_get_tsc_hz();
+	do {
 		csts.raw = nvme_mmio_read_4(ctrlr, csts);
-		if (ms_waited++ >= 5000)
-			break;
-	}
+	} while (csts.bits.shst != NVME_SHST_COMPLETE && nvme_get_tsc() < timeout_tsc);
+
 	if (csts.bits.shst != NVME_SHST_COMPLETE)
 		nvme_printf(ctrlr, "did not shutdown within 5 seconds\n");
 }
 
+/*
+ * Move to the next initialization state, charging the time spent in the
+ *  current one to its phase.
+ */
+static void
+nvme_ctrlr_set_state(struct nvme_controller *ctrlr, enum nvme_ctrlr_state state)
+{
+	uint64_t now = nvme_get_tsc();
+
+	if (ctrlr->state < NVME_CTRLR_STATE_READY) {
+		ctrlr->init_state_ticks[ctrlr->state] += now - ctrlr->state_start_tsc;
+	}
+
+	if (state == NVME_CTRLR_STATE_READY || state == NVME_CTRLR_STATE_ERROR) {
+		ctrlr->init_ticks = now - ctrlr->init_start_tsc;
+	}
+
+	ctrlr->state = state;
+	ctrlr->state_start_tsc = now;
+	ctrlr->ready_timeout_tsc = 0;
+}
+
+/*
+ * Start a new initialization or reset at the given state, discarding the
+ *  timing of the previous one.
+ */
+static void
+nvme_ctrlr_begin_init(struct nvme_controller *ctrlr, enum nvme_ctrlr_state state)
+{
+	nvme_ctrlr_set_state(ctrlr, state);
+
+	memset(ctrlr->init_state_ticks, 0, sizeof(ctrlr->init_state_ticks));
+	ctrlr->init_start_tsc = ctrlr->state_start_tsc;
+	ctrlr->init_ticks = 0;
+}
+
+/*
+ * Check on the admin command issued by the current initialization state.
+ */
 static int
-nvme_ctrlr_enable(struct nvme_controller *ctrlr)
+nvme_ctrlr_poll_init_cmd(struct nvme_controller *ctrlr)
 {
-	union nvme_cc_register		cc;
-	union nvme_csts_register	csts;
-	union nvme_aqa_register		aqa;
+	nvme_qpair_process_completions(&ctrlr->adminq, 0);
 
-	cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
-	csts.raw = nvme_mmio_read_4(ctrlr, csts);
+	if (!ctrlr->init_status.done) {
+		return EAGAIN;
+	}
+	if (nvme_completion_is_error(&ctrlr->init_status.cpl)) {
+		return ENXIO;
+	}
 
-	if (cc.bits.en == 1) {
-		if (csts.bits.rdy == 1) {
-			return 0;
-		} else {
-			return nvme_ctrlr_wait_for_ready(ctrlr);
+	return 0;
+}
+
+static const char *
+nvme_ctrlr_io_qpair_cmd_name(enum nvme_ctrlr_state state)
+{
+	switch (state) {
+	case NVME_CTRLR_STATE_CREATE_IO_CQS:
+		return "nvme_create_io_cq";
+	case NVME_CTRLR_STATE_CREATE_IO_SQS:
+		return "nvme_create_io_sq";
+	case NVME_CTRLR_STATE_DELETE_IO_SQS:
+		return "nvme_delete_io_sq";
+	case NVME_CTRLR_STATE_DELETE_IO_CQS:
+	default:
+		return "nvme_delete_io_cq";
+	}
+}
+
+static void
+nvme_ctrlr_io_qpair_cmd_done(void *arg, const struct nvme_completion *cpl)
+{
+	struct nvme_qpair	*qpair = arg;
+	struct nvme_controller	*ctrlr = qpair->ctrlr;
+	bool			success = !nvme_completion_is_error(cpl);
+
+	ctrlr->init_outstanding--;
+
+	switch (ctrlr->state) {
+	case NVME_CTRLR_STATE_CREATE_IO_CQS:
+		qpair->is_cq_created = success;
+		break;
+	case NVME_CTRLR_STATE_CREATE_IO_SQS:
+		qpair->is_sq_created = success;
+		break;
+	case NVME_CTRLR_STATE_DELETE_IO_SQS:
+		qpair->is_sq_created = !success;
+		break;
+	case NVME_CTRLR_STATE_DELETE_IO_CQS:
+		qpair->is_cq_created = !success;
+		break;
+	default:
+		break;
+	}
+
+	if (!success) {
+		nvme_printf(ctrlr, "%s failed for queue %u!\n",
+			    nvme_ctrlr_io_qpair_cmd_name(ctrlr->state), qpair->id);
+		ctrlr->init_failed = true;
+	}
+}
+
+/*
+ * Start issuing the given state's queue command for every I/O qpair that
+ *  needs it.
+ */
+static void
+nvme_ctrlr_start_io_qpair_cmds(struct nvme_controller *ctrlr, enum nvme_ctrlr_state state)
+{
+	nvme_ctrlr_set_state(ctrlr, state);
+	ctrlr->init_index = 0;
+	ctrlr->init_outstanding = 0;
+	if (state == NVME_CTRLR_STATE_CREATE_IO_CQS) {
+		ctrlr->init_failed = false;
+	}
+}
+
+/*
+ * Keep as many of the current state's queue commands in flight as the
+ *  admin queue has trackers for, rather than waiting for each one in turn.
+ *  Once a create has failed no more creates are issued, but every delete
+ *  is.  Returns EAGAIN until every command issued has completed.
+ */
+static int
+nvme_ctrlr_process_io_qpair_cmds(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair	*qpair;
+	bool			needed;
+	bool			create;
+
+	create = ctrlr->state == NVME_CTRLR_STATE_CREATE_IO_CQS ||
+		 ctrlr->state == NVME_CTRLR_STATE_CREATE_IO_SQS;
+
+	while (ctrlr->init_index < ctrlr->num_io_queues && !(create && ctrlr->init_failed)) {
+		qpair = &ctrlr->ioq[ctrlr->init_index];
+
+		switch (ctrlr->state) {
+		case NVME_CTRLR_STATE_CREATE_IO_CQS:
+			needed = nvme_ctrlr_io_qpair_is_created(qpair);
+			break;
+		case NVME_CTRLR_STATE_CREATE_IO_SQS:
+		case NVME_CTRLR_STATE_DELETE_IO_CQS:
+			needed = qpair->is_cq_created;
+			break;
+		case NVME_CTRLR_STATE_DELETE_IO_SQS:
+		default:
+			needed = qpair->is_sq_created;
+			break;
+		}
+		if (!needed) {
+			ctrlr->init_index++;
+			continue;
+		}
+
+		if (ctrlr->init_outstanding >= ctrlr->adminq.num_trackers) {
+			break;
+		}
+
+		ctrlr->init_index++;
+		ctrlr->init_outstanding++;
+		switch (ctrlr->state) {
+		case NVME_CTRLR_STATE_CREATE_IO_CQS:
+			nvme_ctrlr_cmd_create_io_cq(ctrlr, qpair, nvme_ctrlr_io_qpair_cmd_done, qpair);
+			break;
+		case NVME_CTRLR_STATE_CREATE_IO_SQS:
+			nvme_ctrlr_cmd_create_io_sq(ctrlr, qpair, nvme_ctrlr_io_qpair_cmd_done, qpair);
+			break;
+		case NVME_CTRLR_STATE_DELETE_IO_SQS:
+			nvme_ctrlr_cmd_delete_io_sq(ctrlr, qpair, nvme_ctrlr_io_qpair_cmd_done, qpair);
+			break;
+		case NVME_CTRLR_STATE_DELETE_IO_CQS:
+		default:
+			nvme_ctrlr_cmd_delete_io_cq(ctrlr, qpair, nvme_ctrlr_io_qpair_cmd_done, qpair);
+			break;
 		}
 	}
 
+	if (ctrlr->init_outstanding != 0) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+
+	if (ctrlr->init_outstanding != 0 ||
+	    (ctrlr->init_index < ctrlr->num_io_queues && !(create && ctrlr->init_failed))) {
+		return EAGAIN;
+	}
+
+	return 0;
+}
+
+static void
+nvme_ctrlr_enable(struct nvme_controller *ctrlr)
+{
+	union nvme_cc_register		cc;
+	union nvme_aqa_register		aqa;
+
 	nvme_mmio_write_8(ctrlr, asq, ctrlr->adminq.cmd_bus_addr);
-	nvme_delay(5000);
 	nvme_mmio_write_8(ctrlr, acq, ctrlr->adminq.cpl_bus_addr);
-	nvme_delay(5000);
 
 	aqa.raw = 0;
 	/* acqs and asqs are 0-based. */
 	aqa.bits.acqs = ctrlr->adminq.num_entries - 1;
 	aqa.bits.asqs = ctrlr->adminq.num_entries - 1;
 	nvme_mmio_write_4(ctrlr, aqa.raw, aqa.raw);
-	nvme_delay(5000);
 
+	cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
 	cc.bits.en = 1;
 	cc.bits.css = 0;
 	cc.bits.ams = 0;
@@ -254,39 +494,53 @@ nvme_ctrlr_enable(struct nvme_controller *ctrlr)
 	cc.bits.mps = nvme_u32log2(PAGE_SIZE) - 12;
 
 	nvme_mmio_write_4(ctrlr, cc.raw, cc.raw);
-	nvme_delay(5000);
+}
+
+int
+nvme_ctrlr_reset_async(struct nvme_controller *ctrlr)
+{
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (ctrlr->is_resetting || ctrlr->is_failed) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return ctrlr->is_failed ? ENXIO : EBUSY;
+	}
+
+	ctrlr->is_resetting = true;
+
+	nvme_printf(ctrlr, "resetting controller\n");
+	nvme_ctrlr_begin_init(ctrlr, NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS);
+
+	/* Tell the I/O qpairs to quiesce. */
+	wmb();
+	ctrlr->reset_seq++;
 
-	return nvme_ctrlr_wait_for_ready(ctrlr);
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+
+	return 0;
 }
 
 int
-nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr)
+nvme_ctrlr_process_reset(struct nvme_controller *ctrlr)
 {
-	uint32_t i;
 	int rc;
-	union nvme_cc_register cc;
 
-	cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
-	if (cc.bits.en) {
-		nvme_qpair_disable(&ctrlr->adminq);
-		for (i = 0; i < ctrlr->num_io_queues; i++) {
-			nvme_qpair_disable(&ctrlr->ioq[i]);
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	rc = nvme_ctrlr_process_init(ctrlr);
+	if (rc != EAGAIN && ctrlr->is_resetting) {
+		if (rc != 0) {
+			nvme_ctrlr_fail(ctrlr);
 		}
 
-		nvme_delay(100 * 1000);
-	} else {
-		/*
-		 * Ensure we do a transition from cc.en==1 to cc.en==0.
-		 *  If we started disabled (cc.en==0), then we have to enable
-		 *  first to get a reset.
-		 */
-		nvme_ctrlr_enable(ctrlr);
-	}
+		ctrlr->is_resetting = false;
 
-	nvme_ctrlr_disable(ctrlr);
-	rc = nvme_ctrlr_enable(ctrlr);
+		/* Tell the I/O qpairs to resume, or to fail if the reset did. */
+		wmb();
+		ctrlr->reset_seq++;
+	}
 
-	nvme_delay(100 * 1000);
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 
 	return rc;
 }
@@ -296,50 +550,25 @@ nvme_ctrlr_reset(struct nvme_controller *ctrlr)
 {
 	int rc;
 
-	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-
-	if (ctrlr->is_resetting || ctrlr->is_failed) {
+	if (nvme_ctrlr_reset_async(ctrlr) != 0) {
 		/*
 		 * Controller is already resetting or has failed.  Return
 		 *  immediately since there is no need to kick off another
 		 *  reset in these cases.
 		 */
-		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return 0;
 	}
 
-	ctrlr->is_resetting = true;
-
-	nvme_printf(ctrlr, "resetting controller\n");
-	/* nvme_ctrlr_start() issues a reset as its first step */
-	rc = nvme_ctrlr_start(ctrlr);
-	if (rc) {
-		nvme_ctrlr_fail(ctrlr);
-	}
-
-	ctrlr->is_resetting = false;
-
-	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	do {
+		rc = nvme_ctrlr_process_reset(ctrlr);
+	} while (rc == EAGAIN);
 
 	return rc;
 }
 
-static int
-nvme_ctrlr_identify(struct nvme_controller *ctrlr)
+static void
+nvme_ctrlr_identify_done(struct nvme_controller *ctrlr)
 {
-	struct nvme_completion_poll_status	status;
-
-	status.done = false;
-	nvme_ctrlr_cmd_identify_controller(ctrlr, &ctrlr->cdata,
-					   nvme_completion_poll_cb, &status);
-	while (status.done == false) {
-		nvme_qpair_process_completions(&ctrlr->adminq, 0);
-	}
-	if (nvme_completion_is_error(&status.cpl)) {
-		nvme_printf(ctrlr, "nvme_identify_controller failed!\n");
-		return ENXIO;
-	}
-
 	/*
 	 * Use MDTS to ensure our default max_xfer_size doesn't exceed what the
 	 *  controller supports.
@@ -348,94 +577,209 @@ nvme_ctrlr_identify(struct nvme_controller *ctrlr)
 		ctrlr->max_xfer_size = nvme_min(ctrlr->max_xfer_size,
 						ctrlr->min_page_size * (1 << (ctrlr->cdata.mdts)));
 	}
+	ctrlr->opts.max_xfer_size = ctrlr->max_xfer_size;
 
-	return 0;
+	ctrlr->sgl_supported = ctrlr->cdata.sgls.supported;
 }
 
-static int
+static void
 nvme_ctrlr_set_num_qpairs(struct nvme_controller *ctrlr)
 {
 	struct nvme_driver			*driver = &g_nvme_driver;
-	struct nvme_completion_poll_status	status;
-	int					cq_allocated, sq_allocated;
 	uint32_t				max_io_queues;
 
-	status.done = false;
-
 	nvme_mutex_lock(&driver->lock);
 	max_io_queues = driver->max_io_queues;
 	nvme_mutex_unlock(&driver->lock);
 
-	nvme_ctrlr_cmd_set_num_queues(ctrlr, max_io_queues,
-				      nvme_completion_poll_cb, &status);
-	while (status.done == false) {
-		nvme_qpair_process_completions(&ctrlr->adminq, 0);
-	}
-	if (nvme_completion_is_error(&status.cpl)) {
-		nvme_printf(ctrlr, "nvme_set_num_queues failed!\n");
-		return ENXIO;
+	/* After a reset, ask for no more queues than ioq has room for. */
+	if (ctrlr->ioq != NULL) {
+		max_io_queues = ctrlr->ioq_size;
 	}
 
+	ctrlr->init_status.done = false;
+	nvme_ctrlr_cmd_set_num_queues(ctrlr, max_io_queues,
+				      nvme_completion_poll_cb, &ctrlr->init_status);
+}
+
+static int
+nvme_ctrlr_set_num_qpairs_done(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair			*qpair;
+	uint32_t				cq_allocated, sq_allocated;
+	uint32_t				granted, i;
+
 	/*
 	 * Data in cdw0 is 0-based.
 	 * Lower 16-bits indicate number of submission queues allocated.
 	 * Upper 16-bits indicate number of completion queues allocated.
 	 */
-	sq_allocated = (status.cpl.cdw0 & 0xFFFF) + 1;
-	cq_allocated = (status.cpl.cdw0 >> 16) + 1;
+	sq_allocated = (ctrlr->init_status.cpl.cdw0 & 0xFFFF) + 1;
+	cq_allocated = (ctrlr->init_status.cpl.cdw0 >> 16) + 1;
 
-	ctrlr->num_io_queues = nvme_min(sq_allocated, cq_allocated);
-
-	nvme_mutex_lock(&driver->lock);
-	driver->max_io_queues = nvme_min(driver->max_io_queues, ctrlr->num_io_queues);
-	nvme_mutex_unlock(&driver->lock);
+	/*
+	 * Each controller keeps however many queues it granted.  Threads whose
+	 *  nvme_register_io_thread() index is beyond this controller's range
+	 *  must use an explicitly allocated qpair on it instead.
+	 */
+	granted = nvme_min(sq_allocated, cq_allocated);
+	if (ctrlr->ioq == NULL) {
+		ctrlr->num_io_queues = granted;
+		return 0;
+	}
 
+	/*
+	 * After a reset, ioq keeps the size it was first given, so more
+	 *  queues than that cannot be used.  Fewer are fine only if none of
+	 *  the qpairs that lose their queues are in use.
+	 */
+	granted = nvme_min(granted, ctrlr->ioq_size);
+	for (i = granted; i < ctrlr->num_io_queues; i++) {
+		qpair = &ctrlr->ioq[i];
+		if (qpair->is_allocated || qpair->is_thread_queue ||
+		    nvme_ctrlr_io_qpair_is_created(qpair)) {
+			nvme_printf(ctrlr, "controller granted %u I/O queues, "
+				    "but queue %u is in use\n", granted, qpair->id);
+			return ENXIO;
+		}
+	}
+	ctrlr->num_io_queues = granted;
 	return 0;
 }
 
+/*
+ * Issue CREATE IO CQ and CREATE IO SQ for a qpair whose rings are already
+ *  allocated.
+ */
 static int
-nvme_ctrlr_create_qpairs(struct nvme_controller *ctrlr)
+nvme_ctrlr_submit_create_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
 {
 	struct nvme_completion_poll_status	status;
-	struct nvme_qpair			*qpair;
-	uint32_t				i;
 
-	if (nvme_ctrlr_construct_io_qpairs(ctrlr)) {
-		nvme_printf(ctrlr, "nvme_ctrlr_construct_io_qpairs failed!\n");
+	status.done = false;
+	nvme_ctrlr_cmd_create_io_cq(ctrlr, qpair,
+				    nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "nvme_create_io_cq failed!\n");
+		return ENXIO;
+	}
+	qpair->is_cq_created = true;
+
+	status.done = false;
+	nvme_ctrlr_cmd_create_io_sq(qpair->ctrlr, qpair,
+				    nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "nvme_create_io_sq failed!\n");
 		return ENXIO;
 	}
+	qpair->is_sq_created = true;
 
-	for (i = 0; i < ctrlr->num_io_queues; i++) {
-		qpair = &ctrlr->ioq[i];
+	nvme_qpair_reset(qpair);
 
+	return 0;
+}
+
+/*
+ * Issue DELETE IO SQ and DELETE IO CQ for whichever of a qpair's queues
+ *  were created.  Errors are only logged, since the caller releases the
+ *  qpair's rings either way.
+ */
+static void
+nvme_ctrlr_submit_delete_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	struct nvme_completion_poll_status	status;
+
+	if (qpair->is_sq_created) {
 		status.done = false;
-		nvme_ctrlr_cmd_create_io_cq(ctrlr, qpair,
+		nvme_ctrlr_cmd_delete_io_sq(ctrlr, qpair,
 					    nvme_completion_poll_cb, &status);
 		while (status.done == false) {
 			nvme_qpair_process_completions(&ctrlr->adminq, 0);
 		}
 		if (nvme_completion_is_error(&status.cpl)) {
-			nvme_printf(ctrlr, "nvme_create_io_cq failed!\n");
-			return ENXIO;
+			nvme_printf(ctrlr, "nvme_delete_io_sq failed!\n");
 		}
+		qpair->is_sq_created = false;
+	}
 
+	if (qpair->is_cq_created) {
 		status.done = false;
-		nvme_ctrlr_cmd_create_io_sq(qpair->ctrlr, qpair,
+		nvme_ctrlr_cmd_delete_io_cq(ctrlr, qpair,
 					    nvme_completion_poll_cb, &status);
 		while (status.done == false) {
 			nvme_qpair_process_completions(&ctrlr->adminq, 0);
 		}
 		if (nvme_completion_is_error(&status.cpl)) {
-			nvme_printf(ctrlr, "nvme_create_io_sq failed!\n");
-			return ENXIO;
+			nvme_printf(ctrlr, "nvme_delete_io_cq failed!\n");
 		}
+		qpair->is_cq_created = false;
+	}
+}
+
+/*
+ * Allocate rings and trackers for an I/O qpair slot and create the queues
+ *  on the controller.  Called with ctrlr_lock held.
+ */
+static int
+nvme_ctrlr_create_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair,
+			   uint16_t num_entries, uint16_t num_trackers)
+{
+	int rc;
+
+	if (ctrlr->is_failed) {
+		return ENXIO;
+	}
 
-		nvme_qpair_reset(qpair);
+	/* The admin queue belongs to the reset state machine until it finishes. */
+	if (ctrlr->is_resetting) {
+		return EBUSY;
+	}
+
+	rc = nvme_qpair_construct(qpair, qpair->id, num_entries, num_trackers, ctrlr);
+	if (rc != 0) {
+		return ENOMEM;
+	}
+
+	if (nvme_request_pool_reserve(qpair->num_trackers) != 0) {
+		nvme_qpair_destroy(qpair);
+		return ENOMEM;
+	}
+
+	rc = nvme_ctrlr_submit_create_io_qpair(ctrlr, qpair);
+	if (rc != 0) {
+		/* Delete the CQ if only the SQ create failed. */
+		nvme_ctrlr_submit_delete_io_qpair(ctrlr, qpair);
+		nvme_request_pool_unreserve(qpair->num_trackers);
+		nvme_qpair_destroy(qpair);
+		return rc;
 	}
 
 	return 0;
 }
 
+/*
+ * Delete an I/O qpair from the controller and release its rings and
+ *  trackers.  The slot can be created again later.  Called with ctrlr_lock
+ *  held.
+ */
+static void
+nvme_ctrlr_delete_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	if (!ctrlr->is_failed) {
+		nvme_ctrlr_submit_delete_io_qpair(ctrlr, qpair);
+	}
+	qpair->is_sq_created = false;
+	qpair->is_cq_created = false;
+	nvme_request_pool_unreserve(qpair->num_trackers);
+	nvme_qpair_destroy(qpair);
+}
+
 static void
 nvme_ctrlr_destruct_namespaces(struct nvme_controller *ctrlr)
 {
@@ -460,12 +804,12 @@ nvme_ctrlr_destruct_namespaces(struct nvme_controller *ctrlr)
 static int
 nvme_ctrlr_construct_namespaces(struct nvme_controller *ctrlr)
 {
-	uint32_t i, nn = ctrlr->cdata.nn;
+	uint32_t nn = ctrlr->cdata.nn;
 	uint64_t phys_addr = 0;
 
 	if (nn == 0) {
 		nvme_printf(ctrlr, "controller has 0 namespaces\n");
-		return -1;
+		return ENXIO;
 	}
 
 	/* ctrlr->num_ns may be 0 (startup) or a different number of namespaces (reset),
@@ -489,20 +833,11 @@ nvme_ctrlr_construct_namespaces(struct nvme_controller *ctrlr)
 		ctrlr->num_ns = nn;
 	}
 
-	for (i = 0; i < nn; i++) {
-		struct nvme_namespace	*ns = &ctrlr->ns[i];
-		uint32_t 		nsid = i + 1;
-
-		if (nvme_ns_construct(ns, nsid, ctrlr) != 0) {
-			goto fail;
-		}
-	}
-
 	return 0;
 
 fail:
 	nvme_ctrlr_destruct_namespaces(ctrlr);
-	return -1;
+	return ENOMEM;
 }
 
 static void
@@ -551,27 +886,24 @@ nvme_ctrlr_construct_and_submit_aer(struct nvme_controller *ctrlr,
 	nvme_ctrlr_submit_admin_request(ctrlr, req);
 }
 
-static int
+static void
 nvme_ctrlr_configure_aer(struct nvme_controller *ctrlr)
 {
 	union nvme_critical_warning_state	state;
-	struct nvme_async_event_request		*aer;
-	uint32_t				i;
-	struct nvme_completion_poll_status	status;
-
-	status.done = false;
 
 	state.raw = 0xFF;
 	state.bits.reserved = 0;
-	nvme_ctrlr_cmd_set_async_event_config(ctrlr, state, nvme_completion_poll_cb, &status);
 
-	while (status.done == false) {
-		nvme_qpair_process_completions(&ctrlr->adminq, 0);
-	}
-	if (nvme_completion_is_error(&status.cpl)) {
-		nvme_printf(ctrlr, "nvme_ctrlr_cmd_set_async_event_config failed!\n");
-		return ENXIO;
-	}
+	ctrlr->init_status.done = false;
+	nvme_ctrlr_cmd_set_async_event_config(ctrlr, state, nvme_completion_poll_cb,
+					      &ctrlr->init_status);
+}
+
+static void
+nvme_ctrlr_configure_aer_done(struct nvme_controller *ctrlr)
+{
+	struct nvme_async_event_request		*aer;
+	uint32_t				i;
 
 	/* aerl is a zero-based value, so we need to add 1 here. */
 	ctrlr->num_aers = nvme_min(NVME_MAX_ASYNC_EVENTS, (ctrlr->cdata.aerl + 1));
@@ -580,42 +912,276 @@ nvme_ctrlr_configure_aer(struct nvme_controller *ctrlr)
 		aer = &ctrlr->aer[i];
 		nvme_ctrlr_construct_and_submit_aer(ctrlr, aer);
 	}
-
-	return 0;
 }
 
-int
-nvme_ctrlr_start(struct nvme_controller *ctrlr)
+/*
+ * Run the current initialization state.  Returns 0 if the controller moved
+ *  to a new state, EAGAIN if it is still waiting on the hardware or an admin
+ *  command, or an errno if initialization failed.
+ */
+static int
+nvme_ctrlr_process_init_state(struct nvme_controller *ctrlr)
 {
-	if (nvme_ctrlr_hw_reset(ctrlr) != 0) {
-		return -1;
-	}
+	union nvme_cc_register		cc;
+	union nvme_csts_register	csts;
+	struct nvme_qpair		*qpair;
+	uint32_t			i, timeout_in_ms;
+	int				rc;
 
-	nvme_qpair_reset(&ctrlr->adminq);
+	switch (ctrlr->state) {
+	case NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS:
+		/*
+		 * Wait for every thread that is in the middle of submitting to
+		 *  or polling its qpair to finish, for up to CAP.TO.  A qpair
+		 *  not in use is idle: this barrier pairs with the one in
+		 *  nvme_qpair_enter(), so its thread sees the new reset_seq and
+		 *  quiesces before touching the queues again.  A thread that
+		 *  stays in longer fails the reset, and so the controller,
+		 *  rather than hanging it.
+		 */
+		mb();
+		for (i = 0; i < ctrlr->num_io_queues; i++) {
+			qpair = &ctrlr->ioq[i];
+			if (nvme_ctrlr_io_qpair_is_created(qpair) && qpair->in_use != 0) {
+				if (nvme_ctrlr_wait_timed_out(ctrlr, &timeout_in_ms)) {
+					nvme_printf(ctrlr, "I/O qpair %u still in use after %u ms\n",
+						    qpair->id, timeout_in_ms);
+					return ETIMEDOUT;
+				}
+				return EAGAIN;
+			}
+		}
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_INIT);
+		return 0;
 
-	nvme_qpair_enable(&ctrlr->adminq);
+	case NVME_CTRLR_STATE_INIT:
+		cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
+		csts.raw = nvme_mmio_read_4(ctrlr, csts);
 
-	if (nvme_ctrlr_identify(ctrlr) != 0) {
-		return -1;
-	}
+		if (cc.bits.en) {
+			nvme_qpair_disable(&ctrlr->adminq);
 
-	if (nvme_ctrlr_set_num_qpairs(ctrlr) != 0) {
-		return -1;
-	}
+			nvme_ctrlr_set_state(ctrlr, csts.bits.rdy ?
+					     NVME_CTRLR_STATE_DISABLE :
+					     NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_1);
+		} else if (csts.bits.rdy) {
+			/* CC.EN was cleared, but the controller has not finished resetting. */
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+		} else {
+			/* CC.EN = 0 and CSTS.RDY = 0 means the controller is already held in reset. */
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_ENABLE);
+		}
+		return 0;
 
-	if (nvme_ctrlr_create_qpairs(ctrlr) != 0) {
-		return -1;
+	case NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_1:
+		rc = nvme_ctrlr_poll_ready(ctrlr, 1);
+		if (rc == 0) {
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_DISABLE);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_DISABLE:
+		cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
+		cc.bits.en = 0;
+		nvme_mmio_write_4(ctrlr, cc.raw, cc.raw);
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+		return 0;
+
+	case NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0:
+		rc = nvme_ctrlr_poll_ready(ctrlr, 0);
+		if (rc == 0) {
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_ENABLE);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_ENABLE:
+		nvme_ctrlr_enable(ctrlr);
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1);
+		return 0;
+
+	case NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1:
+		rc = nvme_ctrlr_poll_ready(ctrlr, 1);
+		if (rc == 0) {
+			nvme_qpair_reset(&ctrlr->adminq);
+			nvme_qpair_enable(&ctrlr->adminq);
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_IDENTIFY);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_IDENTIFY:
+		ctrlr->init_status.done = false;
+		nvme_ctrlr_cmd_identify_controller(ctrlr, &ctrlr->cdata,
+						   nvme_completion_poll_cb, &ctrlr->init_status);
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY);
+		return 0;
+
+	case NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY:
+		rc = nvme_ctrlr_poll_init_cmd(ctrlr);
+		if (rc == ENXIO) {
+			nvme_printf(ctrlr, "nvme_identify_controller failed!\n");
+		} else if (rc == 0) {
+			nvme_ctrlr_identify_done(ctrlr);
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_SET_NUM_QPAIRS);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_SET_NUM_QPAIRS:
+		nvme_ctrlr_set_num_qpairs(ctrlr);
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QPAIRS);
+		return 0;
+
+	case NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QPAIRS:
+		rc = nvme_ctrlr_poll_init_cmd(ctrlr);
+		if (rc == ENXIO) {
+			nvme_printf(ctrlr, "nvme_set_num_queues failed!\n");
+		} else if (rc == 0) {
+			rc = nvme_ctrlr_set_num_qpairs_done(ctrlr);
+			if (rc != 0) {
+				return rc;
+			}
+			if (nvme_ctrlr_construct_io_qpairs(ctrlr)) {
+				nvme_printf(ctrlr, "nvme_ctrlr_construct_io_qpairs failed!\n");
+				return ENOMEM;
+			}
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_CREATE_IO_QPAIRS);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_CREATE_IO_QPAIRS:
+		/* The controller reset deleted every I/O queue. */
+		for (i = 0; i < ctrlr->num_io_queues; i++) {
+			ctrlr->ioq[i].is_cq_created = false;
+			ctrlr->ioq[i].is_sq_created = false;
+		}
+		nvme_ctrlr_start_io_qpair_cmds(ctrlr, NVME_CTRLR_STATE_CREATE_IO_CQS);
+		return 0;
+
+	case NVME_CTRLR_STATE_CREATE_IO_CQS:
+		rc = nvme_ctrlr_process_io_qpair_cmds(ctrlr);
+		if (rc == 0) {
+			nvme_ctrlr_start_io_qpair_cmds(ctrlr, ctrlr->init_failed ?
+						       NVME_CTRLR_STATE_DELETE_IO_CQS :
+						       NVME_CTRLR_STATE_CREATE_IO_SQS);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_CREATE_IO_SQS:
+		rc = nvme_ctrlr_process_io_qpair_cmds(ctrlr);
+		if (rc == 0 && ctrlr->init_failed) {
+			nvme_ctrlr_start_io_qpair_cmds(ctrlr, NVME_CTRLR_STATE_DELETE_IO_SQS);
+		} else if (rc == 0) {
+			/* Each qpair resets its own rings when it resumes. */
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_CONSTRUCT_NS);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_DELETE_IO_SQS:
+		rc = nvme_ctrlr_process_io_qpair_cmds(ctrlr);
+		if (rc == 0) {
+			nvme_ctrlr_start_io_qpair_cmds(ctrlr, NVME_CTRLR_STATE_DELETE_IO_CQS);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_DELETE_IO_CQS:
+		rc = nvme_ctrlr_process_io_qpair_cmds(ctrlr);
+		return rc == 0 ? ENXIO : rc;
+
+	case NVME_CTRLR_STATE_CONSTRUCT_NS:
+		rc = nvme_ctrlr_construct_namespaces(ctrlr);
+		if (rc == 0) {
+			ctrlr->init_index = 0;
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_IDENTIFY_NS);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_IDENTIFY_NS:
+		if (ctrlr->init_index == ctrlr->num_ns) {
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_CONFIGURE_AER);
+			return 0;
+		}
+
+		ctrlr->init_status.done = false;
+		nvme_ctrlr_cmd_identify_namespace(ctrlr, ctrlr->init_index + 1,
+						  &ctrlr->nsdata[ctrlr->init_index],
+						  nvme_completion_poll_cb, &ctrlr->init_status);
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS);
+		return 0;
+
+	case NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS:
+		rc = nvme_ctrlr_poll_init_cmd(ctrlr);
+		if (rc == 0) {
+			rc = nvme_ns_construct(&ctrlr->ns[ctrlr->init_index],
+					       ctrlr->init_index + 1, ctrlr);
+		} else if (rc == ENXIO) {
+			nvme_printf(ctrlr, "nvme_identify_namespace failed\n");
+		}
+		if (rc == 0) {
+			ctrlr->init_index++;
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_IDENTIFY_NS);
+		} else if (rc != EAGAIN) {
+			nvme_ctrlr_destruct_namespaces(ctrlr);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_CONFIGURE_AER:
+		nvme_ctrlr_configure_aer(ctrlr);
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER);
+		return 0;
+
+	case NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER:
+		rc = nvme_ctrlr_poll_init_cmd(ctrlr);
+		if (rc == ENXIO) {
+			nvme_printf(ctrlr, "nvme_ctrlr_cmd_set_async_event_config failed!\n");
+		} else if (rc == 0) {
+			nvme_ctrlr_configure_aer_done(ctrlr);
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_READY);
+		}
+		return rc;
+
+	case NVME_CTRLR_STATE_READY:
+		return 0;
+
+	case NVME_CTRLR_STATE_ERROR:
+	default:
+		return ENXIO;
 	}
+}
 
-	if (nvme_ctrlr_construct_namespaces(ctrlr) != 0) {
-		return -1;
+int
+nvme_ctrlr_process_init(struct nvme_controller *ctrlr)
+{
+	int rc = 0;
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	while (ctrlr->state != NVME_CTRLR_STATE_READY) {
+		rc = nvme_ctrlr_process_init_state(ctrlr);
+		if (rc != 0) {
+			break;
+		}
 	}
 
-	if (nvme_ctrlr_configure_aer(ctrlr) != 0) {
-		return -1;
+	if (rc != 0 && rc != EAGAIN && ctrlr->state != NVME_CTRLR_STATE_ERROR) {
+		nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_ERROR);
 	}
 
-	return 0;
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+
+	return rc;
+}
+
+int
+nvme_ctrlr_start(struct nvme_controller *ctrlr)
+{
+	int rc;
+
+	nvme_ctrlr_begin_init(ctrlr, NVME_CTRLR_STATE_INIT);
+
+	do {
+		rc = nvme_ctrlr_process_init(ctrlr);
+	} while (rc == EAGAIN);
+
+	return rc;
 }
 
 static int
@@ -647,7 +1213,8 @@ nvme_ctrlr_free_bars(struct nvme_controller *ctrlr)
 }
 
 int
-nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
+nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+		     const struct nvme_ctrlr_opts *opts, void *devhandle)
 {
 	union nvme_cap_hi_register	cap_hi;
 	uint32_t			cmd_reg;
@@ -655,6 +1222,13 @@ nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
 	int				rc;
 
 	ctrlr->devhandle = devhandle;
+	ctrlr->quirks = nvme_ctrlr_get_quirks(devhandle);
+
+	if (opts != NULL) {
+		ctrlr->opts = *opts;
+	} else {
+		nvme_ctrlr_opts_set_defaults(&ctrlr->opts);
+	}
 
 	status = nvme_ctrlr_allocate_bars(ctrlr);
 	if (status != 0) {
@@ -674,12 +1248,21 @@ nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
 
 	ctrlr->min_page_size = 1 << (12 + cap_hi.bits.mpsmin);
 
+	ctrlr->max_xfer_size = nvme_min(ctrlr->opts.max_xfer_size, NVME_MAX_XFER_SIZE);
+	ctrlr->max_xfer_size &= ~(PAGE_SIZE - 1);
+	if (ctrlr->max_xfer_size == 0) {
+		ctrlr->max_xfer_size = PAGE_SIZE;
+	}
+
 	rc = nvme_ctrlr_construct_admin_qpair(ctrlr);
 	if (rc)
 		return rc;
 
 	ctrlr->is_resetting = false;
 	ctrlr->is_failed = false;
+	ctrlr->reset_seq = 0;
+
+	nvme_ctrlr_begin_init(ctrlr, NVME_CTRLR_STATE_INIT);
 
 	nvme_mutex_init_recursive(&ctrlr->ctrlr_lock);
 
@@ -697,6 +1280,7 @@ nvme_ctrlr_destruct(struct nvme_controller *ctrlr)
 	nvme_ctrlr_destruct_namespaces(ctrlr);
 
 	for (i = 0; i < ctrlr->num_io_queues; i++) {
+		nvme_request_pool_unreserve(ctrlr->ioq[i].num_trackers);
 		nvme_qpair_destroy(&ctrlr->ioq[i]);
 	}
 
@@ -717,21 +1301,192 @@ nvme_ctrlr_submit_admin_request(struct nvme_controller *ctrlr,
 
 void
 nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
+			     struct nvme_qpair *qpair,
 			     struct nvme_request *req)
 {
-	struct nvme_qpair       *qpair;
+	nvme_assert(qpair->ctrlr == ctrlr, ("qpair belongs to another controller\n"));
+	nvme_qpair_submit_request(qpair, req);
+}
+
+/*
+ * Thread queues are indexed by the calling thread's nvme_register_io_thread()
+ *  index, and so are claimed from the bottom of the I/O queue range.
+ *  nvme_ctrlr_alloc_io_qpair() hands out qpairs from the top of the range,
+ *  so the two only collide once the controller runs out of queues.
+ */
+static struct nvme_qpair *
+nvme_ctrlr_claim_thread_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	int rc;
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (qpair->is_thread_queue) {
+		/* Another thread with this index claimed it first. */
+		goto out;
+	}
+
+	if (qpair->is_allocated) {
+		nvme_printf(ctrlr, "I/O queue %u already allocated\n", qpair->id);
+		qpair = NULL;
+		goto out;
+	}
+
+	rc = nvme_ctrlr_create_io_qpair(ctrlr, qpair, ctrlr->opts.io_queue_size,
+					ctrlr->opts.io_queue_requests);
+	if (rc != 0) {
+		/* Polling threads retry quietly until a reset finishes. */
+		if (rc != EBUSY) {
+			nvme_printf(ctrlr, "could not create I/O queue %u (%d)\n", qpair->id, rc);
+		}
+		qpair = NULL;
+		goto out;
+	}
+
+	qpair->is_thread_queue = true;
+	nvme_request_cache_reserve(qpair->num_trackers);
+
+out:
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	return qpair;
+}
+
+struct nvme_qpair *
+nvme_ctrlr_get_thread_io_qpair(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair	*qpair;
 
 	nvme_assert(nvme_thread_ioq_index >= 0, ("no ioq_index assigned for thread\n"));
+	if ((uint32_t)nvme_thread_ioq_index >= ctrlr->num_io_queues) {
+		return NULL;
+	}
+
 	qpair = &ctrlr->ioq[nvme_thread_ioq_index];
+	if (!qpair->is_thread_queue) {
+		qpair = nvme_ctrlr_claim_thread_io_qpair(ctrlr, qpair);
+	}
 
-	nvme_qpair_submit_request(qpair, req);
+	return qpair;
 }
 
 void
 nvme_ctrlr_process_io_completions(struct nvme_controller *ctrlr, uint32_t max_completions)
 {
-	nvme_assert(nvme_thread_ioq_index >= 0, ("no ioq_index assigned for thread\n"));
-	nvme_qpair_process_completions(&ctrlr->ioq[nvme_thread_ioq_index], max_completions);
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ctrlr);
+
+	if (qpair != NULL) {
+		nvme_qpair_process_completions(qpair, max_completions);
+	}
+}
+
+void
+nvme_ctrlr_io_batch_begin(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ctrlr);
+
+	if (qpair != NULL) {
+		nvme_qpair_batch_begin(qpair);
+	}
+}
+
+void
+nvme_ctrlr_io_batch_end(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ctrlr);
+
+	if (qpair != NULL) {
+		nvme_qpair_batch_end(qpair);
+	}
+}
+
+struct nvme_qpair *
+nvme_ctrlr_alloc_io_qpair(struct nvme_controller *ctrlr, uint32_t queue_depth)
+{
+	struct nvme_qpair	*qpair = NULL;
+	uint32_t		i, num_entries;
+	int			rc;
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (ctrlr->is_failed) {
+		goto out;
+	}
+
+	for (i = ctrlr->num_io_queues; i > 0; i--) {
+		if (!ctrlr->ioq[i - 1].is_allocated &&
+		    !ctrlr->ioq[i - 1].is_thread_queue) {
+			qpair = &ctrlr->ioq[i - 1];
+			break;
+		}
+	}
+
+	if (qpair == NULL) {
+		nvme_printf(ctrlr, "no free I/O queues\n");
+		goto out;
+	}
+
+	/*
+	 * The ring is grown past the controller's io_queue_size if needed to
+	 *  hold the requested depth, up to what the controller supports.
+	 */
+	if (queue_depth == 0) {
+		queue_depth = ctrlr->opts.io_queue_requests;
+	}
+	num_entries = nvme_max(ctrlr->opts.io_queue_size, queue_depth + 1);
+	num_entries = nvme_min(num_entries, nvme_ctrlr_max_io_queue_size(ctrlr));
+	queue_depth = nvme_min(queue_depth, num_entries - 1);
+
+	rc = nvme_ctrlr_create_io_qpair(ctrlr, qpair, num_entries, queue_depth);
+	if (rc != 0) {
+		nvme_printf(ctrlr, "could not create I/O queue %u with depth %u (%d)\n",
+			    qpair->id, queue_depth, rc);
+		qpair = NULL;
+		goto out;
+	}
+
+	qpair->is_allocated = true;
+	nvme_request_cache_reserve(qpair->num_trackers);
+
+out:
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	return qpair;
+}
+
+int
+nvme_ctrlr_free_io_qpair(struct nvme_qpair *qpair)
+{
+	struct nvme_controller	*ctrlr;
+
+	if (qpair == NULL) {
+		return 0;
+	}
+
+	ctrlr = qpair->ctrlr;
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (!qpair->is_allocated) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return EINVAL;
+	}
+
+	if (ctrlr->is_resetting) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return EBUSY;
+	}
+
+	if (qpair->num_free_tr != qpair->num_trackers ||
+	    !STAILQ_EMPTY(&qpair->queued_req)) {
+		nvme_printf(ctrlr, "I/O queue %u still has outstanding I/O\n", qpair->id);
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return EBUSY;
+	}
+
+	nvme_ctrlr_delete_io_qpair(ctrlr, qpair);
+	qpair->is_allocated = false;
+
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	return 0;
 }
 
 void
@@ -755,6 +1510,52 @@ nvme_ctrlr_get_num_ns(struct nvme_controller *ctrlr)
 	return ctrlr->num_ns;
 }
 
+const struct nvme_ctrlr_opts *
+nvme_ctrlr_get_opts(struct nvme_controller *ctrlr)
+{
+	return &ctrlr->opts;
+}
+
+static uint64_t
+nvme_ctrlr_init_phase_us(struct nvme_controller *ctrlr, enum nvme_ctrlr_state first,
+			 enum nvme_ctrlr_state last)
+{
+	uint64_t	ticks = 0;
+	uint32_t	state;
+
+	for (state = first; state <= last; state++) {
+		ticks += ctrlr->init_state_ticks[state];
+	}
+
+	return ticks * 1000000 / nvme_get_tsc_hz();
+}
+
+void
+nvme_ctrlr_get_init_times(struct nvme_controller *ctrlr, struct nvme_ctrlr_init_times *times)
+{
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	times->quiesce_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS,
+			    NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS);
+	times->disable_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_INIT,
+			    NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+	times->enable_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_ENABLE,
+			   NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1);
+	times->identify_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_IDENTIFY,
+			     NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY);
+	times->set_num_queues_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_SET_NUM_QPAIRS,
+				   NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QPAIRS);
+	times->create_io_queues_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_CREATE_IO_QPAIRS,
+				     NVME_CTRLR_STATE_DELETE_IO_CQS);
+	times->identify_ns_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_CONSTRUCT_NS,
+				NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS);
+	times->configure_aer_us = nvme_ctrlr_init_phase_us(ctrlr, NVME_CTRLR_STATE_CONFIGURE_AER,
+				  NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER);
+	times->total_us = ctrlr->init_ticks * 1000000 / nvme_get_tsc_hz();
+
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+}
+
 struct nvme_namespace *
 nvme_ctrlr_get_ns(struct nvme_controller *ctrlr, uint32_t ns_id)
 {
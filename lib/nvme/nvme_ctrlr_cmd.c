@@ -34,10 +34,11 @@
 #include "nvme_internal.h"
 
 int
-nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
-		      struct nvme_command *cmd,
-		      void *buf, uint32_t len,
-		      nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ctrlr_cmd_io_raw_qpair(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *qpair,
+			    struct nvme_command *cmd,
+			    void *buf, uint32_t len,
+			    nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 	struct nvme_request	*req;
 
@@ -49,10 +50,25 @@ nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
 
 	memcpy(&req->cmd, cmd, sizeof(req->cmd));
 
-	nvme_ctrlr_submit_io_request(ctrlr, req);
+	nvme_ctrlr_submit_io_request(ctrlr, qpair, req);
 	return 0;
 }
 
+int
+nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
+		      struct nvme_command *cmd,
+		      void *buf, uint32_t len,
+		      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair	*qpair = nvme_ctrlr_get_thread_io_qpair(ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ctrlr_cmd_io_raw_qpair(ctrlr, qpair, cmd, buf, len, cb_fn, cb_arg);
+}
+
 int
 nvme_ctrlr_cmd_admin_raw(struct nvme_controller *ctrlr,
 			 struct nvme_command *cmd,
@@ -173,6 +189,40 @@ nvme_ctrlr_cmd_create_io_sq(struct nvme_controller *ctrlr,
 	nvme_ctrlr_submit_admin_request(ctrlr, req);
 }
 
+void
+nvme_ctrlr_cmd_delete_io_cq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
+			    void *cb_arg)
+{
+	struct nvme_request *req;
+	struct nvme_command *cmd;
+
+	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+
+	cmd = &req->cmd;
+	cmd->opc = NVME_OPC_DELETE_IO_CQ;
+	cmd->cdw10 = io_que->id;
+
+	nvme_ctrlr_submit_admin_request(ctrlr, req);
+}
+
+void
+nvme_ctrlr_cmd_delete_io_sq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
+			    void *cb_arg)
+{
+	struct nvme_request *req;
+	struct nvme_command *cmd;
+
+	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+
+	cmd = &req->cmd;
+	cmd->opc = NVME_OPC_DELETE_IO_SQ;
+	cmd->cdw10 = io_que->id;
+
+	nvme_ctrlr_submit_admin_request(ctrlr, req);
+}
+
 void
 nvme_ctrlr_cmd_set_feature(struct nvme_controller *ctrlr, uint8_t feature,
 			   uint32_t cdw11, void *payload, uint32_t payload_size,
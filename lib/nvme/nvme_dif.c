@@ -0,0 +1,414 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <endian.h>
+
+#include "nvme_internal.h"
+
+/**
+ * \file
+ *
+ * End-to-end protection information on the host: the CRC-16 T10 DIF used
+ *  for the guard field, and generation and checking of the protection
+ *  information of sectors in host memory.
+ */
+
+/*
+ * CRC-16 T10 DIF: polynomial x^16 + x^15 + x^11 + x^9 + x^8 + x^7 + x^5 +
+ *  x^4 + x^2 + x + 1 (0x8BB7), MSB first, initial value 0 and no final xor.
+ *  g_crc16_t10dif_table[i] is the CRC of the single byte i.
+ */
+static const uint16_t g_crc16_t10dif_table[256] = {
+	0x0000, 0x8bb7, 0x9cd9, 0x176e, 0xb205, 0x39b2, 0x2edc, 0xa56b,
+	0xefbd, 0x640a, 0x7364, 0xf8d3, 0x5db8, 0xd60f, 0xc161, 0x4ad6,
+	0x54cd, 0xdf7a, 0xc814, 0x43a3, 0xe6c8, 0x6d7f, 0x7a11, 0xf1a6,
+	0xbb70, 0x30c7, 0x27a9, 0xac1e, 0x0975, 0x82c2, 0x95ac, 0x1e1b,
+	0xa99a, 0x222d, 0x3543, 0xbef4, 0x1b9f, 0x9028, 0x8746, 0x0cf1,
+	0x4627, 0xcd90, 0xdafe, 0x5149, 0xf422, 0x7f95, 0x68fb, 0xe34c,
+	0xfd57, 0x76e0, 0x618e, 0xea39, 0x4f52, 0xc4e5, 0xd38b, 0x583c,
+	0x12ea, 0x995d, 0x8e33, 0x0584, 0xa0ef, 0x2b58, 0x3c36, 0xb781,
+	0xd883, 0x5334, 0x445a, 0xcfed, 0x6a86, 0xe131, 0xf65f, 0x7de8,
+	0x373e, 0xbc89, 0xabe7, 0x2050, 0x853b, 0x0e8c, 0x19e2, 0x9255,
+	0x8c4e, 0x07f9, 0x1097, 0x9b20, 0x3e4b, 0xb5fc, 0xa292, 0x2925,
+	0x63f3, 0xe844, 0xff2a, 0x749d, 0xd1f6, 0x5a41, 0x4d2f, 0xc698,
+	0x7119, 0xfaae, 0xedc0, 0x6677, 0xc31c, 0x48ab, 0x5fc5, 0xd472,
+	0x9ea4, 0x1513, 0x027d, 0x89ca, 0x2ca1, 0xa716, 0xb078, 0x3bcf,
+	0x25d4, 0xae63, 0xb90d, 0x32ba, 0x97d1, 0x1c66, 0x0b08, 0x80bf,
+	0xca69, 0x41de, 0x56b0, 0xdd07, 0x786c, 0xf3db, 0xe4b5, 0x6f02,
+	0x3ab1, 0xb106, 0xa668, 0x2ddf, 0x88b4, 0x0303, 0x146d, 0x9fda,
+	0xd50c, 0x5ebb, 0x49d5, 0xc262, 0x6709, 0xecbe, 0xfbd0, 0x7067,
+	0x6e7c, 0xe5cb, 0xf2a5, 0x7912, 0xdc79, 0x57ce, 0x40a0, 0xcb17,
+	0x81c1, 0x0a76, 0x1d18, 0x96af, 0x33c4, 0xb873, 0xaf1d, 0x24aa,
+	0x932b, 0x189c, 0x0ff2, 0x8445, 0x212e, 0xaa99, 0xbdf7, 0x3640,
+	0x7c96, 0xf721, 0xe04f, 0x6bf8, 0xce93, 0x4524, 0x524a, 0xd9fd,
+	0xc7e6, 0x4c51, 0x5b3f, 0xd088, 0x75e3, 0xfe54, 0xe93a, 0x628d,
+	0x285b, 0xa3ec, 0xb482, 0x3f35, 0x9a5e, 0x11e9, 0x0687, 0x8d30,
+	0xe232, 0x6985, 0x7eeb, 0xf55c, 0x5037, 0xdb80, 0xccee, 0x4759,
+	0x0d8f, 0x8638, 0x9156, 0x1ae1, 0xbf8a, 0x343d, 0x2353, 0xa8e4,
+	0xb6ff, 0x3d48, 0x2a26, 0xa191, 0x04fa, 0x8f4d, 0x9823, 0x1394,
+	0x5942, 0xd2f5, 0xc59b, 0x4e2c, 0xeb47, 0x60f0, 0x779e, 0xfc29,
+	0x4ba8, 0xc01f, 0xd771, 0x5cc6, 0xf9ad, 0x721a, 0x6574, 0xeec3,
+	0xa415, 0x2fa2, 0x38cc, 0xb37b, 0x1610, 0x9da7, 0x8ac9, 0x017e,
+	0x1f65, 0x94d2, 0x83bc, 0x080b, 0xad60, 0x26d7, 0x31b9, 0xba0e,
+	0xf0d8, 0x7b6f, 0x6c01, 0xe7b6, 0x42dd, 0xc96a, 0xde04, 0x55b3,
+};
+
+static uint16_t
+nvme_crc16_t10dif_scalar(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	while (len-- > 0) {
+		crc = (crc << 8) ^ g_crc16_t10dif_table[(crc >> 8) ^ *buf++];
+	}
+
+	return crc;
+}
+
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+/*
+ * The carry-less multiply kernels take the buffer 16 bytes at a time as
+ *  128-bit polynomials, with the MSB of the first byte as the coefficient
+ *  of x^127.  Shifting such a value A by D bits is replaced by the
+ *  congruent A_hi * (x^(D + 64) mod P) + A_lo * (x^D mod P), which again
+ *  fits in 128 bits, so the whole buffer is folded into one block and only
+ *  that is reduced to the CRC.  Entry n - 1 holds x^D mod P and
+ *  x^(D + 64) mod P for D = 128 * n.
+ */
+static const uint64_t g_crc16_fold_k[8][2] __attribute__((aligned(16))) = {
+	{ 0xa010, 0x1faa },
+	{ 0x857d, 0x7acc },
+	{ 0x84da, 0x4a84 },
+	{ 0x1069, 0xdd31 },
+	{ 0xe2c0, 0xf65c },
+	{ 0xdfcb, 0x4132 },
+	{ 0xd9dd, 0xbd4a },
+	{ 0x6123, 0x2295 },
+};
+
+static inline __m128i
+nvme_crc16_bswap128(__m128i a)
+{
+	return _mm_shuffle_epi8(a, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+						8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+static inline __m128i
+nvme_crc16_load128(const uint8_t *p)
+{
+	return nvme_crc16_bswap128(_mm_loadu_si128((const __m128i *)p));
+}
+
+/* Shift a by nblocks 16-byte blocks, modulo P. */
+static inline __m128i
+nvme_crc16_fold128(__m128i a, uint32_t nblocks)
+{
+	__m128i k = _mm_load_si128((const __m128i *)g_crc16_fold_k[nblocks - 1]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00),
+			     _mm_clmulepi64_si128(a, k, 0x11));
+}
+
+/*
+ * Fold the remaining len bytes, a multiple of 16, into acc and reduce it
+ *  to the CRC.  The table CRC of acc's 16 bytes is acc * x^16 mod P.
+ */
+static uint16_t
+nvme_crc16_t10dif_reduce(__m128i acc, const uint8_t *buf, size_t len)
+{
+	uint8_t out[16];
+
+	for (; len >= 16; buf += 16, len -= 16) {
+		acc = _mm_xor_si128(nvme_crc16_fold128(acc, 1), nvme_crc16_load128(buf));
+	}
+
+	_mm_storeu_si128((__m128i *)out, nvme_crc16_bswap128(acc));
+	return nvme_crc16_t10dif_scalar(0, out, sizeof(out));
+}
+
+/*
+ * CRC of len bytes, a multiple of 16 and at least 16.  Adding the CRC so
+ *  far to the first 16 bits of the buffer continues it exactly.
+ */
+static uint16_t
+nvme_crc16_t10dif_pclmul(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	__m128i a0, a1, a2, a3;
+
+	a0 = _mm_xor_si128(nvme_crc16_load128(buf), _mm_set_epi64x((uint64_t)crc << 48, 0));
+	if (len < 64) {
+		return nvme_crc16_t10dif_reduce(a0, buf + 16, len - 16);
+	}
+
+	a1 = nvme_crc16_load128(buf + 16);
+	a2 = nvme_crc16_load128(buf + 32);
+	a3 = nvme_crc16_load128(buf + 48);
+	for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64) {
+		a0 = _mm_xor_si128(nvme_crc16_fold128(a0, 4), nvme_crc16_load128(buf));
+		a1 = _mm_xor_si128(nvme_crc16_fold128(a1, 4), nvme_crc16_load128(buf + 16));
+		a2 = _mm_xor_si128(nvme_crc16_fold128(a2, 4), nvme_crc16_load128(buf + 32));
+		a3 = _mm_xor_si128(nvme_crc16_fold128(a3, 4), nvme_crc16_load128(buf + 48));
+	}
+
+	a0 = _mm_xor_si128(_mm_xor_si128(nvme_crc16_fold128(a0, 3), nvme_crc16_fold128(a1, 2)),
+			   _mm_xor_si128(nvme_crc16_fold128(a2, 1), a3));
+	return nvme_crc16_t10dif_reduce(a0, buf, len);
+}
+
+#if defined(__VPCLMULQDQ__) && defined(__AVX2__)
+static inline __m256i
+nvme_crc16_load256(const uint8_t *p)
+{
+	const __m256i bswap = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					      8, 9, 10, 11, 12, 13, 14, 15,
+					      0, 1, 2, 3, 4, 5, 6, 7,
+					      8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)p), bswap);
+}
+
+static inline __m256i
+nvme_crc16_fold256(__m256i a, __m256i k)
+{
+	return _mm256_xor_si256(_mm256_clmulepi64_epi128(a, k, 0x00),
+				_mm256_clmulepi64_epi128(a, k, 0x11));
+}
+
+/*
+ * Same as nvme_crc16_t10dif_pclmul(), for len of at least 128, folding
+ *  eight blocks at a time in four 256-bit accumulators.
+ */
+static uint16_t
+nvme_crc16_t10dif_vpclmul(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	__m256i	k = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)
+							       g_crc16_fold_k[7]));
+	__m256i	a[4];
+	__m128i	acc, lane;
+	int	i;
+
+	for (i = 0; i < 4; i++) {
+		a[i] = nvme_crc16_load256(buf + 32 * i);
+	}
+	a[0] = _mm256_xor_si256(a[0], _mm256_set_epi64x(0, 0, (uint64_t)crc << 48, 0));
+
+	for (buf += 128, len -= 128; len >= 128; buf += 128, len -= 128) {
+		for (i = 0; i < 4; i++) {
+			a[i] = _mm256_xor_si256(nvme_crc16_fold256(a[i], k),
+						nvme_crc16_load256(buf + 32 * i));
+		}
+	}
+
+	/* Block i of the last eight is in the low (even i) or high lane of a[i / 2]. */
+	acc = _mm256_extracti128_si256(a[3], 1);
+	for (i = 0; i < 7; i++) {
+		lane = (i & 1) ? _mm256_extracti128_si256(a[i / 2], 1) :
+		       _mm256_castsi256_si128(a[i / 2]);
+		acc = _mm_xor_si128(acc, nvme_crc16_fold128(lane, 7 - i));
+	}
+
+	return nvme_crc16_t10dif_reduce(acc, buf, len);
+}
+#endif
+#endif
+
+uint16_t
+nvme_crc16_t10dif(uint16_t crc, const void *buf, size_t len)
+{
+	const uint8_t	*p = buf;
+
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+	size_t		n = len & ~(size_t)15;
+
+#if defined(__VPCLMULQDQ__) && defined(__AVX2__)
+	if (n >= 128) {
+		crc = nvme_crc16_t10dif_vpclmul(crc, p, n);
+		return nvme_crc16_t10dif_scalar(crc, p + n, len - n);
+	}
+#endif
+	if (n >= 16) {
+		crc = nvme_crc16_t10dif_pclmul(crc, p, n);
+		return nvme_crc16_t10dif_scalar(crc, p + n, len - n);
+	}
+#endif
+	return nvme_crc16_t10dif_scalar(crc, p, len);
+}
+
+/*
+ * Where the sectors of a buffer are: the data of sector i at data +
+ *  i * data_stride, its metadata at md + i * md_stride, and its protection
+ *  information pi_offset bytes into the metadata.
+ */
+struct nvme_dif_layout {
+	uint8_t		*data;
+	uint8_t		*md;
+	uint32_t	data_stride;
+	uint32_t	md_stride;
+	uint32_t	pi_offset;
+};
+
+static int
+nvme_dif_get_layout(struct nvme_namespace *ns, const void *payload, const void *md,
+		    struct nvme_dif_layout *layout)
+{
+	bool extended = ns->extended_lba_size != ns->sector_size;
+
+	if (ns->pi_type == NVME_PI_TYPE_NONE || extended != (md == NULL)) {
+		return EINVAL;
+	}
+
+	layout->data = (uint8_t *)payload;
+	if (extended) {
+		layout->md = layout->data + ns->sector_size;
+		layout->data_stride = ns->extended_lba_size;
+		layout->md_stride = ns->extended_lba_size;
+	} else {
+		layout->md = (uint8_t *)md;
+		layout->data_stride = ns->sector_size;
+		layout->md_stride = ns->md_size;
+	}
+
+	layout->pi_offset = ns->pi_md_start ? 0 :
+			    ns->md_size - sizeof(struct nvme_protection_info);
+	return 0;
+}
+
+/*
+ * The guard of a sector covers its data and any metadata that precedes
+ *  the protection information.
+ */
+static inline uint16_t
+nvme_dif_guard(struct nvme_namespace *ns, const uint8_t *data, const uint8_t *md,
+	       uint32_t pi_offset)
+{
+	uint16_t guard = nvme_crc16_t10dif(0, data, ns->sector_size);
+
+	return nvme_crc16_t10dif(guard, md, pi_offset);
+}
+
+int
+nvme_ns_dif_generate(struct nvme_namespace *ns, void *payload, void *md,
+		     uint64_t lba, uint32_t lba_count, uint16_t apptag)
+{
+	struct nvme_dif_layout		layout;
+	struct nvme_protection_info	pi;
+	uint8_t				*data, *meta;
+	uint32_t			i;
+	int				rc;
+
+	rc = nvme_dif_get_layout(ns, payload, md, &layout);
+	if (rc != 0) {
+		return rc;
+	}
+
+	for (i = 0; i < lba_count; i++) {
+		data = layout.data + (size_t)i * layout.data_stride;
+		meta = layout.md + (size_t)i * layout.md_stride;
+
+		pi.guard = htobe16(nvme_dif_guard(ns, data, meta, layout.pi_offset));
+		pi.app_tag = htobe16(apptag);
+		pi.ref_tag = htobe32((uint32_t)(lba + i));
+		memcpy(meta + layout.pi_offset, &pi, sizeof(pi));
+	}
+
+	return 0;
+}
+
+static int
+nvme_dif_set_error(struct nvme_dif_error *err, uint8_t sc, uint64_t lba,
+		   uint32_t expected, uint32_t actual)
+{
+	if (err != NULL) {
+		err->sc = sc;
+		err->lba = lba;
+		err->expected = expected;
+		err->actual = actual;
+	}
+
+	return EIO;
+}
+
+int
+nvme_ns_dif_verify(struct nvme_namespace *ns, const void *payload, const void *md,
+		   uint64_t lba, uint32_t lba_count, uint32_t check_flags,
+		   uint16_t apptag_mask, uint16_t apptag, struct nvme_dif_error *err)
+{
+	struct nvme_dif_layout		layout;
+	struct nvme_protection_info	pi;
+	const uint8_t			*data, *meta;
+	uint16_t			guard, app_tag;
+	uint32_t			ref_tag, i;
+	int				rc;
+
+	rc = nvme_dif_get_layout(ns, payload, md, &layout);
+	if (rc != 0) {
+		return rc;
+	}
+
+	for (i = 0; i < lba_count; i++) {
+		data = layout.data + (size_t)i * layout.data_stride;
+		meta = layout.md + (size_t)i * layout.md_stride;
+
+		memcpy(&pi, meta + layout.pi_offset, sizeof(pi));
+		app_tag = be16toh(pi.app_tag);
+		ref_tag = be32toh(pi.ref_tag);
+
+		/* These escape values disable checking of the sector. */
+		if (app_tag == 0xFFFF &&
+		    (ns->pi_type != NVME_PI_TYPE3 || ref_tag == 0xFFFFFFFF)) {
+			continue;
+		}
+
+		if (check_flags & NVME_IO_FLAGS_PRCHK_GUARD) {
+			guard = nvme_dif_guard(ns, data, meta, layout.pi_offset);
+			if (guard != be16toh(pi.guard)) {
+				return nvme_dif_set_error(err, NVME_SC_GUARD_CHECK_ERROR, lba + i,
+							  guard, be16toh(pi.guard));
+			}
+		}
+
+		if ((check_flags & NVME_IO_FLAGS_PRCHK_APPTAG) &&
+		    ((app_tag ^ apptag) & apptag_mask) != 0) {
+			return nvme_dif_set_error(err, NVME_SC_APPLICATION_TAG_CHECK_ERROR, lba + i,
+						  apptag & apptag_mask, app_tag & apptag_mask);
+		}
+
+		/* Type 3 reference tags are opaque to the controller. */
+		if ((check_flags & NVME_IO_FLAGS_PRCHK_REFTAG) && ns->pi_type != NVME_PI_TYPE3 &&
+		    ref_tag != (uint32_t)(lba + i)) {
+			return nvme_dif_set_error(err, NVME_SC_REFERENCE_TAG_CHECK_ERROR, lba + i,
+						  (uint32_t)(lba + i), ref_tag);
+		}
+	}
+
+	return 0;
+}
@@ -6,8 +6,10 @@
 #include <pciaccess.h>
 #include <rte_malloc.h>
 #include <rte_config.h>
+#include <rte_cycles.h>
 #include <rte_mempool.h>
 #include <rte_memcpy.h>
+#include <x86intrin.h>
 
 /**
  * \file
@@ -35,8 +37,8 @@
  * Allocate a pinned, physically contiguous memory buffer with the
  *   given size and alignment.
  * Note: these calls are only made during driver initialization.  Per
- *   I/O allocations during driver operation use the nvme_alloc_request
- *   callback.
+ *   I/O allocations during driver operation come from the request pool
+ *   below.
  */
 static inline void *
 nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
@@ -68,18 +70,36 @@ nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
 #define nvme_vtophys(buf)		vtophys(buf)
 #define NVME_VTOPHYS_ERROR		VTOPHYS_ERROR
 
-extern struct rte_mempool *request_mempool;
+/**
+ * nvme_vtophys() translations are linear within each naturally aligned
+ *  region of this size, the hugepage size backing DMA memory.
+ */
+#define NVME_VTOPHYS_REGION_SIZE	(2 * 1024 * 1024)
+
+typedef struct rte_mempool nvme_request_pool_t;
+
+/**
+ * Create the pool that nvme_request objects are allocated from.  These
+ *  objects are allocated for each I/O.  They do not need to be pinned nor
+ *  physically contiguous.  The driver keeps its own per-thread cache in
+ *  front of the pool, so the pool itself is created without one.
+ *  Returns NULL on failure.
+ */
+#define nvme_request_pool_create(name, count, size) \
+	rte_mempool_create(name, count, size, 0, 0, NULL, NULL, NULL, NULL, SOCKET_ID_ANY, 0)
 
 /**
- * Return a buffer for an nvme_request object.  These objects are allocated
- *  for each I/O.  They do not need to be pinned nor physically contiguous.
+ * Take \a n objects from the pool into the array \a reqs.  Returns 0 on
+ *  success, or nonzero without taking any objects.
  */
-#define nvme_alloc_request(bufp)	rte_mempool_get(request_mempool, (void **)(bufp));
+#define nvme_request_pool_get_bulk(pool, reqs, n) \
+	rte_mempool_get_bulk(pool, (void **)(reqs), n)
 
 /**
- * Free a buffer previously allocated with nvme_alloc_request().
+ * Return \a n objects from the array \a reqs to the pool.
  */
-#define nvme_dealloc_request(buf)	rte_mempool_put(request_mempool, buf)
+#define nvme_request_pool_put_bulk(pool, reqs, n) \
+	rte_mempool_put_bulk(pool, (void * const *)(reqs), n)
 
 /**
  *
@@ -131,8 +151,43 @@ nvme_mutex_init_recursive(nvme_mutex_t *mtx)
 }
 
 /**
- * Copy a struct nvme_command from one memory location to another.
+ * Return the current value of a free-running, monotonic timestamp counter.
  */
-#define nvme_copy_command(dst, src)	rte_memcpy((dst), (src), sizeof(struct nvme_command))
+#define nvme_get_tsc()			rte_get_timer_cycles()
+
+/**
+ * Return the number of nvme_get_tsc() ticks per second.
+ */
+#define nvme_get_tsc_hz()		rte_get_timer_hz()
+
+/**
+ * Copy a struct nvme_command into a submission queue slot.
+ *
+ * The slot is written with full-cacheline non-temporal stores, so the
+ *  controller's fetch of the entry does not have to snoop it out of the
+ *  CPU cache.  Callers order these stores with wmb() before ringing the
+ *  doorbell.  dst must be 64-byte aligned, as submission queue entries are.
+ */
+static inline void
+nvme_copy_command(void *dst, const void *src)
+{
+#if defined(__AVX__)
+	__m256i *d = dst;
+	const __m256i *s = src;
+
+	_mm256_stream_si256(&d[0], _mm256_loadu_si256(&s[0]));
+	_mm256_stream_si256(&d[1], _mm256_loadu_si256(&s[1]));
+#elif defined(__SSE2__)
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	_mm_stream_si128(&d[0], _mm_loadu_si128(&s[0]));
+	_mm_stream_si128(&d[1], _mm_loadu_si128(&s[1]));
+	_mm_stream_si128(&d[2], _mm_loadu_si128(&s[2]));
+	_mm_stream_si128(&d[3], _mm_loadu_si128(&s[3]));
+#else
+	rte_memcpy(dst, src, 64);
+#endif
+}
 
 #endif /* __NVME_IMPL_H__ */
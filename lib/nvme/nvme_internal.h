@@ -3,6 +3,7 @@
 #define __NVME_INTERNAL_H__
 
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,6 +12,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <x86intrin.h>
 
 #include <sys/user.h>
@@ -20,16 +22,32 @@
 #include "omnios/queue.h"
 #include "omnios/barrier.h"
 
-#define NVME_MAX_PRP_LIST_ENTRIES	(32)
-
 /*
  * For commands requiring more than 2 PRP entries, one PRP will be
  *  embedded in the command (prp1), and the rest of the PRP entries
- *  will be in a list pointed to by the command (prp2).  This means
- *  that real max number of PRP entries we support is 32+1, which
- *  results in a max xfer size of 32*PAGE_SIZE.
+ *  will be in a list pointed to by the command (prp2).  Each tracker's
+ *  list holds max_xfer_size / PAGE_SIZE entries, so with prp1 a command
+ *  can cover max_xfer_size bytes starting anywhere in a page.  Lists
+ *  longer than a page are chained through their last entry.
+ *
+ * NVME_DEFAULT_MAX_XFER_SIZE is the default for the max_xfer_size
+ *  controller option and NVME_MAX_XFER_SIZE is its upper limit.  The
+ *  controller's MDTS may lower both.
  */
-#define NVME_MAX_XFER_SIZE	NVME_MAX_PRP_LIST_ENTRIES * PAGE_SIZE
+#define NVME_DEFAULT_MAX_XFER_SIZE	(128 * 1024)
+#define NVME_MAX_XFER_SIZE		(4 * 1024 * 1024)
+
+/* Lists are never shorter than this, so they can also hold an SGL segment. */
+#define NVME_MIN_PRP_LIST_ENTRIES	(32)
+
+#define NVME_PRP_ENTRIES_PER_PAGE	(PAGE_SIZE / sizeof(uint64_t))
+
+/*
+ * Most logical blocks one LBA-addressed command can cover, as the count
+ *  is a 0's based 16-bit field.  This bounds commands that transfer no
+ *  data, such as Write Zeroes.
+ */
+#define NVME_MAX_IO_BLOCKS		(1u << 16)
 
 #define NVME_ADMIN_TRACKERS	(16)
 #define NVME_ADMIN_ENTRIES	(128)
@@ -47,13 +65,76 @@
  */
 #define NVME_IO_ENTRIES		(256)
 #define NVME_IO_TRACKERS	(128)
-#define NVME_MIN_IO_TRACKERS	(4)
-#define NVME_MAX_IO_TRACKERS	(1024)
 
 /*
- * NVME_MAX_IO_ENTRIES is not defined, since it is specified in CC.MQES
- *  for each controller.
+ * These are the defaults for the io_queue_size and io_queue_requests
+ *  controller options.  The limits below apply to the options.
+ *
+ * The spec allows 64K entries per I/O queue, and each controller may
+ *  specify a smaller limit in CAP.MQES.  qpair indices are 16 bits wide,
+ *  so the driver itself stops one short of the spec limit.
+ */
+#define NVME_MIN_IO_ENTRIES	(2)
+#define NVME_MAX_IO_ENTRIES	(UINT16_MAX)
+#define NVME_MIN_IO_TRACKERS	(1)
+#define NVME_MAX_IO_TRACKERS	(NVME_MAX_IO_ENTRIES - 1)
+
+/*
+ * Maximum number of completions reaped before the completion queue head
+ *  doorbell is written.  The head doorbell is always written at the end of
+ *  each nvme_qpair_process_completions() pass, so this only bounds how long
+ *  the controller goes without seeing consumed entries released during a
+ *  long pass.  It is further capped to the qpair size at construct time.
+ */
+#define NVME_CQ_HDBL_BATCH	(64)
+
+/*
+ * Every nvme_request comes from a pool owned by the driver, with a
+ *  per-thread LIFO cache in front of it.  A thread's cache is sized to the
+ *  depth of the I/O qpairs it creates, within these bounds, and is refilled
+ *  from and drained to the pool half a cache at a time.
+ */
+#define NVME_REQUEST_CACHE_MIN_SIZE	(32)
+#define NVME_REQUEST_CACHE_MAX_SIZE	(1024)
+
+/*
+ * The pool holds NVME_REQUEST_POOL_MIN_SIZE requests for admin commands and
+ *  threads without a qpair of their own, plus NVME_REQUESTS_PER_TRACKER for
+ *  every tracker of every I/O qpair: one for the command on the tracker,
+ *  and two more for split parents, queued requests and thread caches.
+ *  Pools cannot grow in place, so it grows by adding segments, each at
+ *  least as large as all the ones before it.
+ */
+#define NVME_REQUEST_POOL_MIN_SIZE	(1024)
+#define NVME_REQUESTS_PER_TRACKER	(3)
+#define NVME_REQUEST_POOL_MAX_SEGMENTS	(16)
+
+/*
+ * Most children of one split I/O in flight at a time.  Large I/O is issued
+ *  through this window as children complete, so it cannot crowd out the
+ *  rest of the qpair.
+ */
+#define NVME_SPLIT_WINDOW		(8)
+
+/*
+ * Pages an I/O qpair keeps for dataset management range lists once it
+ *  issues one, each holding the NVME_DSM_MAX_RANGES ranges of one command
+ *  in flight.
  */
+#define NVME_QPAIR_DSM_PAGES		NVME_SPLIT_WINDOW
+
+/*
+ * io_flags bits that are placed in the upper half of CDW12, and in the
+ *  dataset management byte of CDW13.  The PRINFO bits are those of the
+ *  protection information field of CDW12.
+ */
+#define NVME_IO_FLAGS_PRINFO_MASK	(NVME_IO_FLAGS_PRACT | NVME_IO_FLAGS_PRCHK_GUARD | \
+					 NVME_IO_FLAGS_PRCHK_APPTAG | NVME_IO_FLAGS_PRCHK_REFTAG)
+#define NVME_IO_FLAGS_CDW12_MASK	(NVME_IO_FLAGS_LIMITED_RETRY | \
+					 NVME_IO_FLAGS_FORCE_UNIT_ACCESS | \
+					 NVME_IO_FLAGS_PRINFO_MASK)
+#define NVME_IO_FLAGS_DSM_MASK		(0xFFu)
+#define NVME_IO_FLAGS_VALID_MASK	(NVME_IO_FLAGS_CDW12_MASK | NVME_IO_FLAGS_DSM_MASK)
 
 #define NVME_MAX_ASYNC_EVENTS	(8)
 
@@ -70,31 +151,80 @@
  */
 #define DEFAULT_MAX_IO_QUEUES		(1024)
 
-struct nvme_request {
-	struct nvme_command		cmd;
+enum nvme_payload_type {
+	/** u.payload is a single virtually contiguous buffer. */
+	NVME_PAYLOAD_TYPE_CONTIG = 0,
 
-	/**
-	 * Points to a parent request if part of a split request,
-	 *   NULL otherwise.
-	 */
-	struct nvme_request		*parent;
+	/** u.iov is a scatter list; the payload starts iov_offset bytes into it. */
+	NVME_PAYLOAD_TYPE_IOV,
+
+	/** The command transfers no data, e.g. Write Zeroes. */
+	NVME_PAYLOAD_TYPE_NONE,
+};
+
+/*
+ * Position in a request's payload, used as the cursor of a split request.
+ */
+struct nvme_payload_cursor {
+	union {
+		void			*payload;
+		const struct iovec	*iov;
+	} u;
+	uint32_t			iov_offset;
+};
+
+struct nvme_request {
 	union {
 		void			*payload;
+		const struct iovec	*iov;
 	} u;
+	uint32_t			payload_size;
 
 	uint8_t				timeout;
 	uint8_t				retries;
 
+	/** This request is split into children; see split_ns below. */
+	uint8_t				is_split;
+
 	/**
-	 * Number of children requests still outstanding for this
-	 *  request which was split into multiple child requests.
+	 * Storage is owned by the submitter (the application, or the
+	 *  splitter for children), so completion does not return it to
+	 *  the request pool.
 	 */
-	uint8_t				num_children;
-	uint32_t			payload_size;
+	uint8_t				is_caller_owned;
 	nvme_cb_fn_t			cb_fn;
 	void				*cb_arg;
 	STAILQ_ENTRY(nvme_request)	stailq;
 
+	/**
+	 * LBA-addressed I/O (read, write) is described by the following
+	 *  fields instead of by cmd, and the submission queue entry is
+	 *  assembled from them directly in the queue slot.  This keeps the
+	 *  per-I/O request state within this first cacheline.  Only valid
+	 *  if is_io_cmd is set.
+	 */
+	uint64_t			io_lba;
+	uint32_t			io_nsid;
+	uint32_t			io_cdw12;
+	uint8_t				io_opc;
+
+	/** Dataset management hints for the range, the low byte of CDW13. */
+	uint8_t				io_dsm;
+
+	/** enum nvme_payload_type */
+	uint8_t				payload_type;
+
+	uint8_t				is_io_cmd : 1;
+
+	/** Describe the payload with an SGL rather than a PRP list. */
+	uint8_t				use_sgl : 1;
+
+	/** The I/O carries metadata or protection information; see md below. */
+	uint8_t				has_md : 1;
+
+	/** Offset of the payload into u.iov[0] for NVME_PAYLOAD_TYPE_IOV. */
+	uint32_t			iov_offset;
+
 	/**
 	 * The following members should not be reordered with members
 	 *  above.  These members are only needed when splitting
@@ -104,16 +234,48 @@ struct nvme_request {
 	 */
 
 	/**
-	 * Points to the outstanding child requests for a parent request.
-	 *  Only valid if a request was split into multiple children
-	 *  requests, and is not initialized for non-split requests.
+	 * Cursor of a split request.  Children are built from it a window
+	 *  at a time and rebuilt as they complete, so it always describes
+	 *  the part of the transfer not yet handed to a child.  Only valid
+	 *  if is_split is set, and not initialized otherwise.
 	 */
-	TAILQ_HEAD(, nvme_request)	children;
+	struct nvme_namespace		*split_ns;
+	struct nvme_qpair		*split_qpair;
+	struct nvme_payload_cursor	split_payload;
+	uint64_t			split_lba;
+	uint32_t			split_lba_remaining;
+	uint8_t				split_opc;
+
+	/** io_flags given for a split request, applied to every child. */
+	uint32_t			split_io_flags;
 
 	/**
-	 * Linked-list pointers for a child request in its parent's list.
+	 * Number of children of a split request currently in flight.
 	 */
-	TAILQ_ENTRY(nvme_request)	child_tailq;
+	uint32_t			num_children;
+
+	/**
+	 * Points to the parent request of a child request.  Only valid
+	 *  for children of a split request.
+	 */
+	struct nvme_request		*parent;
+
+	/**
+	 * Second command of a fused pair.  Only valid on the first command,
+	 *  which carries the pair through the qpair so that both are placed
+	 *  in the submission queue together.
+	 */
+	struct nvme_request		*fused_next;
+
+	/**
+	 * Separate metadata buffer of an I/O, or NULL if its metadata is
+	 *  interleaved with the data or not transferred, and the tags that
+	 *  are placed in CDW14 and CDW15.  Only valid if has_md is set.  A
+	 *  split request advances md past each child it builds.
+	 */
+	void				*md;
+	uint32_t			io_reftag;
+	uint32_t			io_apptag;
 
 	/**
 	 * Completion status for a parent request.  Initialized to all 0's
@@ -123,7 +285,20 @@ struct nvme_request {
 	 *  status once all child requests are completed.
 	 */
 	struct nvme_completion		parent_status;
+
+	/**
+	 * Command staged by the builder of any request that is not
+	 *  LBA-addressed I/O (admin commands, dataset management, flush).
+	 *  The cid and, when there is a payload, the data pointer are
+	 *  filled in when the command is placed in the submission queue.
+	 */
+	struct nvme_command		cmd;
+
+	/** Request pool segment this request is returned to, unless is_caller_owned. */
+	nvme_request_pool_t		*pool;
 };
+_Static_assert(offsetof(struct nvme_request, split_ns) <= 64,
+	       "per-I/O request state must fit in one cacheline");
 
 struct nvme_completion_poll_status {
 	struct nvme_completion	cpl;
@@ -136,15 +311,51 @@ struct nvme_async_event_request {
 	struct nvme_completion		cpl;
 };
 
+/*
+ * Trackers are allocated as one array per qpair and indexed by cid.  Each
+ *  is padded to a cacheline, so that completing one never touches a
+ *  neighbour's line.  The PRP lists are kept in a separate, page-aligned
+ *  array so that no PRP list ever spans a 4KB boundary.
+ */
 struct nvme_tracker {
-	LIST_ENTRY(nvme_tracker)	list;
-
+	/** Request currently using this tracker, or NULL if the tracker is free. */
 	struct nvme_request		*req;
-	uint16_t			cid;
 
+	/** This tracker's PRP list and its bus address. */
+	uint64_t			*prp;
 	uint64_t			prp_bus_addr;
-	uint64_t			prp[NVME_MAX_PRP_LIST_ENTRIES];
-};
+
+	uint16_t			cid;
+
+	/** cid of the second command, if this tracker holds the first of a fused pair */
+	uint16_t			fused_cid;
+
+	/** qpair->submit_seq when the command was last submitted, for in-order replay after a reset */
+	uint32_t			submit_seq;
+
+	/** Bus address of the request's separate metadata buffer, kept like dptr. */
+	uint64_t			mptr;
+
+	/**
+	 * Data pointer for the request's payload, kept so retries and
+	 *  replays need no vtophys.  Copied as-is into the command.
+	 */
+	union {
+		struct {
+			uint64_t		prp1;
+			uint64_t		prp2;
+		} prp;
+		struct nvme_sgl_descriptor	sgl1;
+	} dptr;
+} __attribute__((aligned(64)));
+_Static_assert(sizeof(struct nvme_tracker) == 64, "tracker must fill exactly one cacheline");
+
+/*
+ * A tracker's PRP list doubles as its SGL segment when the request is
+ *  described by an SGL.
+ */
+#define NVME_MAX_SGL_DESCRIPTORS	\
+	(NVME_MIN_PRP_LIST_ENTRIES * sizeof(uint64_t) / sizeof(struct nvme_sgl_descriptor))
 
 struct nvme_qpair {
 	volatile uint32_t		*sq_tdbl;
@@ -160,12 +371,21 @@ struct nvme_qpair {
 	 */
 	struct nvme_completion		*cpl;
 
-	LIST_HEAD(, nvme_tracker)	free_tr;
-	LIST_HEAD(, nvme_tracker)	outstanding_tr;
+	/**
+	 * Array of num_trackers trackers, indexed by cid.
+	 */
+	struct nvme_tracker		*tr;
+
+	/**
+	 * Stack of free tracker indices.  The most recently freed tracker
+	 *  is at free_tr[num_free_tr - 1] and is the next one handed out.
+	 */
+	uint16_t			*free_tr;
 
 	STAILQ_HEAD(, nvme_request)	queued_req;
 
-	struct nvme_tracker		**act_tr;
+	uint16_t			num_free_tr;
+	uint16_t			num_trackers;
 
 	uint16_t			id;
 
@@ -173,10 +393,51 @@ struct nvme_qpair {
 	uint16_t			sq_tail;
 	uint16_t			cq_head;
 
+	/** max completions reaped between completion queue head doorbell writes */
+	uint16_t			cq_hdbl_batch;
+
 	uint8_t				phase;
 
 	bool				is_enabled;
 
+	/**
+	 * Nesting depth of submission batches.  While non-zero, new
+	 *  commands are written to the submission queue but the tail
+	 *  doorbell is not rung until the outermost batch ends.
+	 */
+	uint8_t				batch_depth;
+
+	/** sq_tail has advanced since the tail doorbell was last written */
+	bool				sq_tdbl_pending;
+
+	/**
+	 * Nesting depth of calls in which the owning thread may touch the
+	 *  queues or doorbells.  A reset does not disable the controller
+	 *  while this is non-zero.
+	 */
+	volatile uint16_t		in_use;
+
+	/** admission is bounded by max_queued_req, see nvme_qpair_set_queue_limit() */
+	bool				is_queue_limited;
+
+	/** a submission was refused and slot_cb_fn is owed a call */
+	bool				is_slot_cb_pending;
+
+	/** number of requests on queued_req */
+	uint32_t			num_queued_req;
+
+	/** most requests that may wait on queued_req when is_queue_limited */
+	uint32_t			max_queued_req;
+
+	/** sequence number given to the next command submitted */
+	uint32_t			submit_seq;
+
+	/** ctrlr->reset_seq when this qpair last quiesced for or resumed from a reset */
+	uint32_t			reset_seq;
+
+	/** PRP entries each tracker's list holds, not counting chain entries */
+	uint32_t			prp_list_entries;
+
 	/*
 	 * Fields below this point should not be touched on the normal I/O happy path.
 	 */
@@ -184,16 +445,143 @@ struct nvme_qpair {
 
 	uint64_t			cmd_bus_addr;
 	uint64_t			cpl_bus_addr;
+
+	/** PRP lists for all trackers, prp_list_size bytes each */
+	uint64_t			*prp;
+	uint32_t			prp_list_size;
+
+	/**
+	 * NVME_QPAIR_DSM_PAGES pages of NVME_DSM_MAX_RANGES ranges each, in
+	 *  which dataset management commands carry their ranges, and a bit
+	 *  per page that is set while it is free.  Allocated by the qpair's
+	 *  first dataset management command.
+	 */
+	struct nvme_dsm_range		*dsm_pages;
+	uint32_t			dsm_free_pages;
+
+	/** handed out by nvme_ctrlr_alloc_io_qpair() */
+	bool				is_allocated;
+
+	/** in use by threads registered with nvme_register_io_thread() */
+	bool				is_thread_queue;
+
+	/** CREATE IO CQ has completed since the controller was last reset */
+	bool				is_cq_created;
+
+	/** CREATE IO SQ has completed since the controller was last reset */
+	bool				is_sq_created;
+
+	/** called once a refused submission would be admitted again */
+	nvme_qpair_slot_cb_fn_t		slot_cb_fn;
+	void				*slot_cb_arg;
+
+	/** nvme_get_tsc() value when this qpair quiesced for the current reset, or 0 */
+	uint64_t			stall_start_tsc;
+
+	struct {
+		uint64_t		num_resets;
+		uint64_t		num_replayed;
+		uint64_t		stall_ticks;
+		uint64_t		max_stall_ticks;
+	} reset_stats;
+
+	struct {
+		uint64_t		num_split_ios;
+		uint64_t		num_split_cmds;
+		uint64_t		num_boundary_splits;
+	} split_stats;
 };
 
 struct nvme_namespace {
 	struct nvme_controller		*ctrlr;
-	uint32_t			stripe_size;
 	uint32_t			sector_size;
+
+	/** Bytes per sector in a host buffer, including interleaved metadata. */
+	uint32_t			extended_lba_size;
 	uint32_t			sectors_per_max_io;
-	uint32_t			sectors_per_stripe;
+
+	/** Commands are split so none crosses a multiple of this many sectors, 0 = none. */
+	uint32_t			sectors_per_boundary;
+	uint16_t			md_size;
 	uint16_t			id;
 	uint16_t			flags;
+
+	/** enum nvme_pi_type */
+	uint8_t				pi_type;
+
+	/** Protection information is the first eight bytes of metadata, not the last. */
+	uint8_t				pi_md_start;
+
+	/** app_sectors_per_boundary overrides the device's boundary. */
+	bool				has_app_boundary;
+
+	/** Boundary reported by identify data or found through a quirk, 0 = none. */
+	uint32_t			dev_sectors_per_boundary;
+
+	/** Boundary set with nvme_ns_set_optimal_io_boundary(), kept across resets. */
+	uint32_t			app_sectors_per_boundary;
+};
+
+/*
+ * Controller initialization steps, in the order nvme_ctrlr_process_init()
+ *  advances through them.  WAIT_FOR_* states have an admin command
+ *  outstanding and move on once it completes.
+ */
+enum nvme_ctrlr_state {
+	/** Reset only: wait for the I/O threads to quiesce their qpairs. */
+	NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS,
+
+	/** Read CC and CSTS to decide how to bring the controller into reset. */
+	NVME_CTRLR_STATE_INIT,
+
+	/** CC.EN = 1 but CSTS.RDY = 0; wait for RDY = 1 before clearing EN. */
+	NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_1,
+
+	/** Clear CC.EN. */
+	NVME_CTRLR_STATE_DISABLE,
+
+	/** CC.EN = 0; wait for CSTS.RDY = 0. */
+	NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0,
+
+	/** Program the admin queue registers and set CC.EN. */
+	NVME_CTRLR_STATE_ENABLE,
+
+	/** CC.EN = 1; wait for CSTS.RDY = 1. */
+	NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1,
+
+	NVME_CTRLR_STATE_IDENTIFY,
+	NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY,
+	NVME_CTRLR_STATE_SET_NUM_QPAIRS,
+	NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QPAIRS,
+
+	/** Set up the I/O qpair slots. */
+	NVME_CTRLR_STATE_CREATE_IO_QPAIRS,
+
+	/** CREATE IO CQ for every I/O qpair that was in use before a reset. */
+	NVME_CTRLR_STATE_CREATE_IO_CQS,
+
+	/** CREATE IO SQ for every I/O qpair whose CQ was created. */
+	NVME_CTRLR_STATE_CREATE_IO_SQS,
+
+	/** A create failed; DELETE IO SQ for every SQ that was created. */
+	NVME_CTRLR_STATE_DELETE_IO_SQS,
+
+	/** A create failed; DELETE IO CQ for every CQ that was created. */
+	NVME_CTRLR_STATE_DELETE_IO_CQS,
+
+	/** Allocate the namespace arrays. */
+	NVME_CTRLR_STATE_CONSTRUCT_NS,
+	NVME_CTRLR_STATE_IDENTIFY_NS,
+	NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS,
+
+	NVME_CTRLR_STATE_CONFIGURE_AER,
+	NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER,
+
+	/** Initialization finished; the controller is ready for I/O. */
+	NVME_CTRLR_STATE_READY,
+
+	/** Initialization failed. */
+	NVME_CTRLR_STATE_ERROR,
 };
 
 /*
@@ -217,13 +605,30 @@ struct nvme_controller {
 
 	bool				is_failed;
 
+	/** The controller accepts SGLs as I/O command data pointers. */
+	bool				sgl_supported;
+
+	/**
+	 * Incremented when a reset starts and again when it finishes, so it is
+	 *  odd while a reset is in progress.  Each I/O qpair compares this with
+	 *  its own reset_seq to quiesce and resume on its owning thread.
+	 */
+	uint32_t			reset_seq;
+
 	/* Cold data (not accessed in normal I/O path) is after this point. */
 
 	/* Opaque handle to associated PCI device. */
 	void				*devhandle;
 
+	/** enum nvme_quirks flags for this device, from g_nvme_quirks */
+	uint32_t			quirks;
+
+	/** I/O queues the controller granted at the last (re)initialization */
 	uint32_t			num_io_queues;
 
+	/** entries in ioq, fixed when it is first allocated; num_io_queues never exceeds it */
+	uint32_t			ioq_size;
+
 	/** maximum i/o size in bytes */
 	uint32_t			max_xfer_size;
 
@@ -233,11 +638,44 @@ struct nvme_controller {
 	/** stride in uint32_t units between doorbell registers (1 = 4 bytes, 2 = 8 bytes, ...) */
 	uint32_t			doorbell_stride_u32;
 
+	/** options from nvme_attach_opts(), clamped to what the controller supports */
+	struct nvme_ctrlr_opts		opts;
+
 	uint32_t			num_aers;
 	struct nvme_async_event_request	aer[NVME_MAX_ASYNC_EVENTS];
 	nvme_aer_cb_fn_t		aer_cb_fn;
 	void				*aer_cb_arg;
 
+	/** current initialization step */
+	enum nvme_ctrlr_state		state;
+
+	/** nvme_get_tsc() value when the current state was entered */
+	uint64_t			state_start_tsc;
+
+	/** nvme_get_tsc() value at which a CSTS.RDY wait gives up */
+	uint64_t			ready_timeout_tsc;
+
+	/** qpair or namespace index the current state is working on */
+	uint32_t			init_index;
+
+	/** admin commands outstanding for the current state */
+	uint32_t			init_outstanding;
+
+	/** an I/O queue create issued by the current state failed */
+	bool				init_failed;
+
+	/** completion of the admin command issued by the current state */
+	struct nvme_completion_poll_status	init_status;
+
+	/** nvme_get_tsc() value when the last initialization or reset started */
+	uint64_t			init_start_tsc;
+
+	/** ticks the last initialization or reset took, once it finished */
+	uint64_t			init_ticks;
+
+	/** ticks spent in each state during the last initialization or reset */
+	uint64_t			init_state_ticks[NVME_CTRLR_STATE_READY];
+
 	/** guards access to the controller itself, including admin queues */
 	nvme_mutex_t			ctrlr_lock;
 
@@ -264,14 +702,48 @@ struct nvme_driver {
 	uint16_t	*ioq_index_pool;
 	uint32_t	max_io_queues;
 	uint16_t	ioq_index_pool_next;
+
+	/**
+	 * Backing store for every thread's request cache, oldest segment
+	 *  first.  Created on first use and only ever added to.  Segments
+	 *  are filled in before num_request_pools is raised to include them.
+	 */
+	nvme_request_pool_t	*request_pools[NVME_REQUEST_POOL_MAX_SEGMENTS];
+	volatile uint32_t	num_request_pools;
+
+	/** requests held by all segments */
+	uint32_t		request_pool_size;
+
+	/** requests set aside for the trackers of I/O qpairs that exist */
+	uint32_t		num_reserved_requests;
 };
 
 extern struct nvme_driver g_nvme_driver;
 
 #define nvme_min(a,b) (((a)<(b))?(a):(b))
+#define nvme_max(a,b) (((a)>(b))?(a):(b))
 
 #define INTEL_DC_P3X00_DEVID	0x09538086
 
+/*
+ * Device-specific behavior, looked up by PCI vendor and device ID when the
+ *  controller is constructed.
+ */
+enum nvme_quirks {
+	/*
+	 * Commands should not cross the controller's internal stripe, which is
+	 *  (1 << cdata.vs[3]) * min_page_size bytes wide.  Only used when the
+	 *  namespace does not report NOIOB.
+	 */
+	NVME_QUIRK_STRIPE_VS3		= 0x1,
+};
+
+struct nvme_quirk {
+	/** PCI device ID in the upper 16 bits, vendor ID in the lower */
+	uint32_t	pci_id;
+	uint32_t	flags;
+};
+
 static inline uint32_t
 _nvme_mmio_read_4(const volatile uint32_t *addr)
 {
@@ -317,6 +789,37 @@ nvme_align32pow2(uint32_t x)
 	return 1u << (1 + nvme_u32log2(x - 1));
 }
 
+/*
+ * Fill count PRP entries for consecutive pages starting at phys_addr.
+ */
+static inline void
+nvme_prp_fill(uint64_t *prp, uint64_t phys_addr, uint32_t count)
+{
+	uint32_t i = 0;
+
+#if defined(__AVX2__)
+	__m256i v = _mm256_set_epi64x(phys_addr + 3 * PAGE_SIZE, phys_addr + 2 * PAGE_SIZE,
+				      phys_addr + PAGE_SIZE, phys_addr);
+	__m256i step = _mm256_set1_epi64x(4 * PAGE_SIZE);
+
+	for (; i + 4 <= count; i += 4) {
+		_mm256_storeu_si256((__m256i *)&prp[i], v);
+		v = _mm256_add_epi64(v, step);
+	}
+#elif defined(__SSE2__)
+	__m128i v = _mm_set_epi64x(phys_addr + PAGE_SIZE, phys_addr);
+	__m128i step = _mm_set1_epi64x(2 * PAGE_SIZE);
+
+	for (; i + 2 <= count; i += 2) {
+		_mm_storeu_si128((__m128i *)&prp[i], v);
+		v = _mm_add_epi64(v, step);
+	}
+#endif
+	for (; i < count; i++) {
+		prp[i] = phys_addr + (uint64_t)i * PAGE_SIZE;
+	}
+}
+
 /* Admin functions */
 void	nvme_ctrlr_cmd_set_feature(struct nvme_controller *ctrlr,
 				   uint8_t feature, uint32_t cdw11,
@@ -357,6 +860,12 @@ void	nvme_ctrlr_cmd_create_io_cq(struct nvme_controller *ctrlr,
 void	nvme_ctrlr_cmd_create_io_sq(struct nvme_controller *ctrlr,
 				    struct nvme_qpair *io_que,
 				    nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_ctrlr_cmd_delete_io_cq(struct nvme_controller *ctrlr,
+				    struct nvme_qpair *io_que,
+				    nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_ctrlr_cmd_delete_io_sq(struct nvme_controller *ctrlr,
+				    struct nvme_qpair *io_que,
+				    nvme_cb_fn_t cb_fn, void *cb_arg);
 void	nvme_ctrlr_cmd_set_num_queues(struct nvme_controller *ctrlr,
 				      uint32_t num_queues, nvme_cb_fn_t cb_fn,
 				      void *cb_arg);
@@ -368,15 +877,18 @@ void	nvme_ctrlr_cmd_abort(struct nvme_controller *ctrlr, uint16_t cid,
 
 void	nvme_completion_poll_cb(void *arg, const struct nvme_completion *cpl);
 
-int	nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle);
+int	nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+			     const struct nvme_ctrlr_opts *opts, void *devhandle);
 void	nvme_ctrlr_destruct(struct nvme_controller *ctrlr);
 int	nvme_ctrlr_start(struct nvme_controller *ctrlr);
-int	nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr);
 
 void	nvme_ctrlr_submit_admin_request(struct nvme_controller *ctrlr,
 					struct nvme_request *req);
 void	nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
+				     struct nvme_qpair *qpair,
 				     struct nvme_request *req);
+struct nvme_qpair *
+nvme_ctrlr_get_thread_io_qpair(struct nvme_controller *ctrlr);
 void	nvme_ctrlr_post_failed_request(struct nvme_controller *ctrlr,
 				       struct nvme_request *req);
 
@@ -389,7 +901,6 @@ void	nvme_qpair_enable(struct nvme_qpair *qpair);
 void	nvme_qpair_disable(struct nvme_qpair *qpair);
 void	nvme_qpair_submit_tracker(struct nvme_qpair *qpair,
 				  struct nvme_tracker *tr);
-void	nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions);
 void	nvme_qpair_submit_request(struct nvme_qpair *qpair,
 				  struct nvme_request *req);
 void	nvme_qpair_reset(struct nvme_qpair *qpair);
@@ -398,6 +909,9 @@ void	nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 		struct nvme_request *req,
 		uint32_t sct, uint32_t sc,
 		bool print_on_error);
+int	nvme_tracker_build_prps(struct nvme_tracker *tr,
+				struct nvme_request *req,
+				uint32_t max_entries);
 
 int	nvme_ns_construct(struct nvme_namespace *ns, uint16_t id,
 			  struct nvme_controller *ctrlr);
@@ -406,6 +920,71 @@ void	nvme_ns_destruct(struct nvme_namespace *ns);
 struct nvme_request *
 nvme_allocate_request(void *payload, uint32_t payload_size,
 		      nvme_cb_fn_t cb_fn, void *cb_arg);
+struct nvme_request *nvme_allocate_io_request(void *payload, uint32_t payload_size,
+		nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_init_request(struct nvme_request *req, void *payload, uint32_t payload_size,
+			  nvme_cb_fn_t cb_fn, void *cb_arg);
 void	nvme_free_request(struct nvme_request *req);
+void	nvme_request_cache_reserve(uint32_t num_requests);
+int	nvme_request_pool_reserve(uint32_t num_trackers);
+void	nvme_request_pool_unreserve(uint32_t num_trackers);
+
+/*
+ * Invoke the request's callback and release the request.  Caller-owned
+ *  storage may be reused by the callback itself, so it is not touched
+ *  once the callback has been called.
+ */
+static inline void
+nvme_complete_request(struct nvme_request *req, const struct nvme_completion *cpl)
+{
+	bool is_caller_owned = req->is_caller_owned;
+
+	if (req->cb_fn) {
+		req->cb_fn(req->cb_arg, cpl);
+	}
+
+	if (!is_caller_owned) {
+		nvme_free_request(req);
+	}
+}
+
+/*
+ * Role of a request in a fused operation, as an enum nvme_cmd_fuse.  Only
+ *  staged commands are ever fused, so this does not touch cmd for
+ *  LBA-addressed I/O.
+ */
+static inline uint8_t
+nvme_request_fuse(const struct nvme_request *req)
+{
+	return req->is_io_cmd ? NVME_CMD_FUSE_NONE : req->cmd.fuse;
+}
+
+/*
+ * Decide whether a submission needing num_cmds commands may enter the
+ *  qpair.  Without a queue limit everything is admitted, and requests
+ *  that find no free tracker wait on queued_req.  With a limit, at most
+ *  max_queued_req requests may wait, and a refused submission arms the
+ *  slot-available callback.
+ */
+static inline bool
+nvme_qpair_admit(struct nvme_qpair *qpair, uint32_t num_cmds)
+{
+	uint32_t num_free_tr;
+
+	if (!qpair->is_queue_limited) {
+		return true;
+	}
+
+	num_free_tr = qpair->is_enabled ? qpair->num_free_tr : 0;
+	if (qpair->num_queued_req <= qpair->max_queued_req &&
+	    num_cmds <= num_free_tr + (qpair->max_queued_req - qpair->num_queued_req)) {
+		return true;
+	}
+
+	if (qpair->slot_cb_fn != NULL) {
+		qpair->is_slot_cb_pending = true;
+	}
+	return false;
+}
 
 #endif /* __NVME_INTERNAL_H__ */
@@ -69,6 +69,43 @@ nvme_ns_get_size(struct nvme_namespace *ns)
 	return nvme_ns_get_num_sectors(ns) * nvme_ns_get_sector_size(ns);
 }
 
+uint32_t
+nvme_ns_get_md_size(struct nvme_namespace *ns)
+{
+	return ns->md_size;
+}
+
+uint32_t
+nvme_ns_get_extended_sector_size(struct nvme_namespace *ns)
+{
+	return ns->extended_lba_size;
+}
+
+enum nvme_pi_type
+nvme_ns_get_pi_type(struct nvme_namespace *ns)
+{
+	return ns->pi_type;
+}
+
+uint32_t
+nvme_ns_get_optimal_io_boundary(struct nvme_namespace *ns)
+{
+	return ns->sectors_per_boundary;
+}
+
+void
+nvme_ns_set_optimal_io_boundary(struct nvme_namespace *ns, uint32_t sectors)
+{
+	if (sectors == NVME_NS_IO_BOUNDARY_DEFAULT) {
+		ns->has_app_boundary = false;
+		ns->sectors_per_boundary = ns->dev_sectors_per_boundary;
+	} else {
+		ns->app_sectors_per_boundary = sectors;
+		ns->has_app_boundary = true;
+		ns->sectors_per_boundary = sectors;
+	}
+}
+
 uint32_t
 nvme_ns_get_flags(struct nvme_namespace *ns)
 {
@@ -85,38 +122,58 @@ int
 nvme_ns_construct(struct nvme_namespace *ns, uint16_t id,
 		  struct nvme_controller *ctrlr)
 {
-	struct nvme_completion_poll_status	status;
 	struct nvme_namespace_data		*nsdata;
-	uint32_t				pci_devid;
 
 	nvme_assert(id > 0, ("invalid namespace id %d", id));
 
 	ns->ctrlr = ctrlr;
 	ns->id = id;
-	ns->stripe_size = 0;
-
-	nvme_pcicfg_read32(ctrlr->devhandle, &pci_devid, 0);
-	if (pci_devid == INTEL_DC_P3X00_DEVID && ctrlr->cdata.vs[3] != 0) {
-		ns->stripe_size = (1 << ctrlr->cdata.vs[3]) * ctrlr->min_page_size;
-	}
+	ns->flags = 0;
 
+	/* The controller has already read Identify Namespace data into nsdata. */
 	nsdata = _nvme_ns_get_data(ns);
 
-	status.done = false;
-	nvme_ctrlr_cmd_identify_namespace(ctrlr, id, nsdata,
-					  nvme_completion_poll_cb, &status);
-	while (status.done == false) {
-		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	ns->sector_size = 1 << nsdata->lbaf[nsdata->flbas.format].lbads;
+	ns->md_size = nsdata->lbaf[nsdata->flbas.format].ms;
+
+	/*
+	 * With extended LBAs each sector's metadata follows its data in the
+	 *  host buffer, so it counts against the maximum transfer size.
+	 */
+	ns->extended_lba_size = ns->sector_size;
+	if (nsdata->flbas.extended && ns->md_size > 0) {
+		ns->extended_lba_size += ns->md_size;
+		ns->flags |= NVME_NS_EXTENDED_LBA_SUPPORTED;
 	}
-	if (nvme_completion_is_error(&status.cpl)) {
-		nvme_printf(ctrlr, "nvme_identify_namespace failed\n");
-		return ENXIO;
+
+	ns->pi_type = NVME_PI_TYPE_NONE;
+	ns->pi_md_start = false;
+	if (nsdata->dps.pit != NVME_PI_TYPE_NONE &&
+	    ns->md_size >= sizeof(struct nvme_protection_info)) {
+		ns->pi_type = nsdata->dps.pit;
+		ns->pi_md_start = nsdata->dps.md_start;
+		ns->flags |= NVME_NS_DPS_PI_SUPPORTED;
 	}
 
-	ns->sector_size = 1 << nsdata->lbaf[nsdata->flbas.format].lbads;
+	ns->sectors_per_max_io = nvme_ns_get_max_io_xfer_size(ns) / ns->extended_lba_size;
+
+	/*
+	 * Prefer the boundary the namespace reports.  Some controllers that
+	 *  predate NOIOB report an internal stripe in vendor-specific data instead.
+	 */
+	ns->dev_sectors_per_boundary = nsdata->noiob;
+	if (ns->dev_sectors_per_boundary == 0 &&
+	    (ctrlr->quirks & NVME_QUIRK_STRIPE_VS3) && ctrlr->cdata.vs[3] != 0) {
+		ns->dev_sectors_per_boundary = ((1 << ctrlr->cdata.vs[3]) * ctrlr->min_page_size) /
+					       ns->sector_size;
+	}
 
-	ns->sectors_per_max_io = nvme_ns_get_max_io_xfer_size(ns) / ns->sector_size;
-	ns->sectors_per_stripe = ns->stripe_size / ns->sector_size;
+	/* An application-set boundary is kept across controller resets. */
+	if (ns->has_app_boundary) {
+		ns->sectors_per_boundary = ns->app_sectors_per_boundary;
+	} else {
+		ns->sectors_per_boundary = ns->dev_sectors_per_boundary;
+	}
 
 	if (ctrlr->cdata.oncs.dsm) {
 		ns->flags |= NVME_NS_DEALLOCATE_SUPPORTED;
@@ -126,6 +183,22 @@ nvme_ns_construct(struct nvme_namespace *ns, uint16_t id,
 		ns->flags |= NVME_NS_FLUSH_SUPPORTED;
 	}
 
+	if (ctrlr->cdata.oncs.write_zeroes) {
+		ns->flags |= NVME_NS_WRITE_ZEROES_SUPPORTED;
+	}
+
+	if (ctrlr->cdata.oncs.compare) {
+		ns->flags |= NVME_NS_COMPARE_SUPPORTED;
+	}
+
+	if (ctrlr->cdata.oncs.write_unc) {
+		ns->flags |= NVME_NS_WRITE_UNCORRECTABLE_SUPPORTED;
+	}
+
+	if (ctrlr->cdata.fuses.compare_and_write) {
+		ns->flags |= NVME_NS_COMPARE_AND_WRITE_SUPPORTED;
+	}
+
 	return 0;
 }
 
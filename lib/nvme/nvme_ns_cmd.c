@@ -38,10 +38,249 @@
  *
  */
 
-static struct nvme_request *
-_nvme_ns_cmd_rw(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
-		uint32_t opc);
+static void nvme_cb_complete_child(void *child_arg, const struct nvme_completion *cpl);
+
+static void
+nvme_request_set_payload(struct nvme_request *req, uint8_t payload_type,
+			 const struct nvme_payload_cursor *pos, uint32_t payload_size)
+{
+	req->payload_type = payload_type;
+	req->payload_size = payload_size;
+	if (payload_type == NVME_PAYLOAD_TYPE_NONE) {
+		req->payload_size = 0;
+	} else if (payload_type == NVME_PAYLOAD_TYPE_IOV) {
+		req->u.iov = pos->u.iov;
+		req->iov_offset = pos->iov_offset;
+	} else {
+		req->u.payload = pos->u.payload;
+	}
+}
+
+static void
+nvme_payload_cursor_advance(struct nvme_payload_cursor *pos, uint8_t payload_type,
+			    uint32_t bytes)
+{
+	uint32_t left;
+
+	if (payload_type == NVME_PAYLOAD_TYPE_NONE) {
+		return;
+	}
+
+	if (payload_type != NVME_PAYLOAD_TYPE_IOV) {
+		pos->u.payload = (void *)((uintptr_t)pos->u.payload + bytes);
+		return;
+	}
+
+	while (bytes > 0) {
+		left = pos->u.iov->iov_len - pos->iov_offset;
+		if (bytes < left) {
+			pos->iov_offset += bytes;
+			return;
+		}
+		bytes -= left;
+		pos->u.iov++;
+		pos->iov_offset = 0;
+	}
+}
+
+/*
+ * Bytes of a scatter list, starting at pos and at most max_bytes, that one
+ *  PRP list can describe: only the first element may start within a page,
+ *  and only the last may end within one.  The scatter list must hold at
+ *  least max_bytes past pos.
+ */
+static uint32_t
+nvme_iov_prp_run(const struct nvme_payload_cursor *pos, uint32_t max_bytes)
+{
+	const struct iovec	*iov = pos->u.iov;
+	uintptr_t		addr = (uintptr_t)iov->iov_base + pos->iov_offset;
+	uint32_t		len = iov->iov_len - pos->iov_offset;
+	uint32_t		run = 0;
+
+	for (;;) {
+		if (len >= max_bytes - run) {
+			return max_bytes;
+		}
+		run += len;
+
+		if ((addr + len) & (PAGE_SIZE - 1)) {
+			return run;
+		}
+
+		iov++;
+		addr = (uintptr_t)iov->iov_base;
+		len = iov->iov_len;
+		if (addr & (PAGE_SIZE - 1)) {
+			return run;
+		}
+	}
+}
+
+/*
+ * Bytes of a scatter list, starting at pos and at most max_bytes, that one
+ *  SGL segment can describe.  Each page an element touches is counted as a
+ *  separate data block descriptor; runs found to be physically contiguous
+ *  when the SGL is built only need fewer.  The scatter list must hold at
+ *  least max_bytes past pos.
+ */
+static uint32_t
+nvme_iov_sgl_run(const struct nvme_payload_cursor *pos, uint32_t max_bytes)
+{
+	const struct iovec	*iov = pos->u.iov;
+	uintptr_t		addr = (uintptr_t)iov->iov_base + pos->iov_offset;
+	uint32_t		len = iov->iov_len - pos->iov_offset;
+	uint32_t		run = 0;
+	uint32_t		ndesc = 0;
+	uint32_t		npages, take;
+
+	for (;;) {
+		take = nvme_min(len, max_bytes - run);
+		if (take > 0) {
+			npages = ((addr + take - 1) >> nvme_u32log2(PAGE_SIZE)) -
+				 (addr >> nvme_u32log2(PAGE_SIZE)) + 1;
+			if (ndesc + npages > NVME_MAX_SGL_DESCRIPTORS) {
+				npages = NVME_MAX_SGL_DESCRIPTORS - ndesc;
+				if (npages == 0) {
+					return run;
+				}
+				return run + ((addr & ~((uintptr_t)PAGE_SIZE - 1)) +
+					      npages * PAGE_SIZE - addr);
+			}
+			ndesc += npages;
+			run += take;
+		}
+
+		if (run == max_bytes) {
+			return run;
+		}
+
+		iov++;
+		addr = (uintptr_t)iov->iov_base;
+		len = iov->iov_len;
+	}
+}
+
+/*
+ * Bytes per sector that an I/O with io_flags transfers to or from the host
+ *  data buffer.  Metadata interleaved with the data counts, unless it is
+ *  only protection information that PRACT has the controller insert and
+ *  strip.
+ */
+static inline uint32_t
+nvme_ns_host_sector_size(const struct nvme_namespace *ns, uint32_t io_flags)
+{
+	if ((io_flags & NVME_IO_FLAGS_PRACT) &&
+	    ns->md_size == sizeof(struct nvme_protection_info)) {
+		return ns->sector_size;
+	}
+
+	return ns->extended_lba_size;
+}
+
+/*
+ * Number of sectors, starting at lba and at pos in the payload, that one
+ *  command can carry.  This is bounded by the remaining length, the
+ *  maximum transfer size (or for commands without data, the largest
+ *  block count a command can hold), the namespace's optimal I/O boundary
+ *  if it has one, and for a scatter list of sector_size bytes per sector by what one PRP
+ *  list, or one SGL segment if the controller supports SGLs and that
+ *  carries more, can describe.  0 means the scatter list cannot be split
+ *  at a sector boundary here.
+ */
+static uint32_t
+nvme_ns_cmd_chunk_sectors(struct nvme_namespace *ns, uint8_t payload_type,
+			  const struct nvme_payload_cursor *pos, uint64_t lba,
+			  uint32_t lba_remaining, uint32_t sector_size, uint8_t *use_sgl)
+{
+	uint32_t sectors_per_boundary = ns->sectors_per_boundary;
+	uint32_t lba_count, prp_count, sgl_count;
+	uint32_t offset;
+
+	if (payload_type == NVME_PAYLOAD_TYPE_NONE) {
+		lba_count = nvme_min(lba_remaining, NVME_MAX_IO_BLOCKS);
+	} else {
+		lba_count = nvme_min(lba_remaining, ns->sectors_per_max_io);
+	}
+
+	/*
+	 * Commands that cross an internal boundary, such as a stripe, can take
+	 *  much longer on some controllers, so don't let a command span one.
+	 *  NOIOB need not be a power of two.
+	 */
+	if (sectors_per_boundary > 0) {
+		if ((sectors_per_boundary & (sectors_per_boundary - 1)) == 0) {
+			offset = lba & (sectors_per_boundary - 1);
+		} else {
+			offset = lba % sectors_per_boundary;
+		}
+		lba_count = nvme_min(lba_count, sectors_per_boundary - offset);
+	}
+
+	*use_sgl = false;
+	if (payload_type == NVME_PAYLOAD_TYPE_IOV) {
+		prp_count = nvme_iov_prp_run(pos, lba_count * sector_size) / sector_size;
+		if (prp_count < lba_count && ns->ctrlr->sgl_supported) {
+			sgl_count = nvme_iov_sgl_run(pos, lba_count * sector_size) / sector_size;
+			if (sgl_count > prp_count) {
+				*use_sgl = true;
+				return sgl_count;
+			}
+		}
+		lba_count = prp_count;
+	}
+
+	return lba_count;
+}
+
+/*
+ * Build the next child of a split request from the parent's cursor into
+ *  child, which is either newly allocated or a just-completed child being
+ *  reused.  Children are owned by the splitter rather than returned to the
+ *  pool on completion, so the completion path can reuse them.
+ */
+static void
+nvme_ns_cmd_split_next_child(struct nvme_request *parent, struct nvme_request *child)
+{
+	struct nvme_namespace	*ns = parent->split_ns;
+	uint64_t		lba = parent->split_lba;
+	uint32_t		sector_size = nvme_ns_host_sector_size(ns, parent->split_io_flags);
+	uint32_t		lba_count;
+
+	uint8_t			use_sgl;
+
+	lba_count = nvme_ns_cmd_chunk_sectors(ns, parent->payload_type, &parent->split_payload,
+					      lba, parent->split_lba_remaining, sector_size,
+					      &use_sgl);
+	parent->split_qpair->split_stats.num_split_cmds++;
+
+	nvme_init_request(child, NULL, 0, nvme_cb_complete_child, child);
+	nvme_request_set_payload(child, parent->payload_type, &parent->split_payload,
+				 lba_count * sector_size);
+	child->use_sgl = use_sgl;
+	child->is_caller_owned = true;
+	child->parent = parent;
+	child->is_io_cmd = true;
+	child->io_opc = parent->split_opc;
+	child->io_nsid = ns->id;
+	child->io_lba = lba;
+	child->io_cdw12 = (parent->split_io_flags & NVME_IO_FLAGS_CDW12_MASK) | (lba_count - 1);
+	child->io_dsm = parent->split_io_flags & NVME_IO_FLAGS_DSM_MASK;
+
+	if (parent->has_md) {
+		child->has_md = true;
+		child->md = parent->md;
+		child->io_reftag = (uint32_t)lba;
+		child->io_apptag = parent->io_apptag;
+		if (parent->md != NULL) {
+			parent->md = (void *)((uintptr_t)parent->md + lba_count * ns->md_size);
+		}
+	}
+
+	parent->split_lba += lba_count;
+	parent->split_lba_remaining -= lba_count;
+	nvme_payload_cursor_advance(&parent->split_payload, parent->payload_type,
+				    lba_count * sector_size);
+}
 
 static void
 nvme_cb_complete_child(void *child_arg, const struct nvme_completion *cpl)
@@ -49,153 +288,1057 @@ nvme_cb_complete_child(void *child_arg, const struct nvme_completion *cpl)
 	struct nvme_request *child = child_arg;
 	struct nvme_request *parent = child->parent;
 
-	parent->num_children--;
-	TAILQ_REMOVE(&parent->children, child, child_tailq);
-
 	if (nvme_completion_is_error(cpl)) {
 		memcpy(&parent->parent_status, cpl, sizeof(*cpl));
+		/* The parent will fail anyway, so don't issue the rest of it. */
+		parent->split_lba_remaining = 0;
+	}
+
+	if (parent->split_lba_remaining > 0) {
+		nvme_ns_cmd_split_next_child(parent, child);
+		nvme_ctrlr_submit_io_request(parent->split_ns->ctrlr, parent->split_qpair, child);
+		return;
 	}
 
-	if (parent->num_children == 0) {
-		if (parent->cb_fn) {
-			parent->cb_fn(parent->cb_arg, &parent->parent_status);
+	nvme_free_request(child);
+	if (--parent->num_children == 0) {
+		nvme_complete_request(parent, &parent->parent_status);
+	}
+}
+
+/*
+ * Walk a transfer of sector_size bytes per sector the way the splitter
+ *  will, up to max_children commands.  Returns the number of commands, or
+ *  0 if a scatter list cannot be split into commands at sector boundaries.
+ */
+static uint32_t
+nvme_ns_cmd_count_chunks(struct nvme_namespace *ns, uint8_t payload_type,
+			 struct nvme_payload_cursor pos, uint64_t lba,
+			 uint32_t lba_count, uint32_t sector_size, uint32_t max_children)
+{
+	uint32_t num_chunks = 0;
+	uint32_t chunk;
+	uint8_t use_sgl;
+
+	while (lba_count > 0 && num_chunks < max_children) {
+		chunk = nvme_ns_cmd_chunk_sectors(ns, payload_type, &pos, lba, lba_count,
+						  sector_size, &use_sgl);
+		if (chunk == 0) {
+			return 0;
 		}
-		nvme_free_request(parent);
+		nvme_payload_cursor_advance(&pos, payload_type, chunk * sector_size);
+		lba += chunk;
+		lba_count -= chunk;
+		num_chunks++;
 	}
+
+	return num_chunks;
 }
 
+/*
+ * Release a request that was built but never submitted.
+ */
 static void
-nvme_request_add_child(struct nvme_request *parent, struct nvme_request *child)
+nvme_ns_cmd_free_request(struct nvme_request *req)
 {
-	if (parent->num_children == 0) {
-		/*
-		 * Defer initialization of the children TAILQ since it falls
-		 *  on a separate cacheline.  This ensures we do not touch this
-		 *  cacheline except on request splitting cases, which are
-		 *  relatively rare.
-		 */
-		TAILQ_INIT(&parent->children);
-		memset(&parent->parent_status, 0, sizeof(struct nvme_completion));
+	if (!req->is_caller_owned) {
+		nvme_free_request(req);
 	}
+}
 
-	parent->num_children++;
-	TAILQ_INSERT_TAIL(&parent->children, child, child_tailq);
-	child->parent = parent;
-	child->cb_fn = nvme_cb_complete_child;
-	child->cb_arg = child;
+/*
+ * Start a split request: build its first window of children and submit
+ *  them.  Each child that completes is rebuilt for the next part of the
+ *  transfer and resubmitted, so a split request never has more than
+ *  NVME_SPLIT_WINDOW commands in flight and never allocates more than that
+ *  many children, however large it is.
+ */
+static int
+nvme_ns_cmd_submit_split(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			 struct nvme_request *parent)
+{
+	struct nvme_request	*children[NVME_SPLIT_WINDOW];
+	uint32_t		sectors_per_boundary = ns->sectors_per_boundary;
+	uint64_t		lba = parent->split_lba;
+	uint64_t		last_lba = lba + parent->split_lba_remaining - 1;
+	uint32_t		i, num_children;
+
+	num_children = nvme_ns_cmd_count_chunks(ns, parent->payload_type, parent->split_payload,
+						parent->split_lba, parent->split_lba_remaining,
+						nvme_ns_host_sector_size(ns, parent->split_io_flags),
+						NVME_SPLIT_WINDOW);
+	if (!nvme_qpair_admit(qpair, num_children)) {
+		nvme_ns_cmd_free_request(parent);
+		return EAGAIN;
+	}
+
+	parent->split_qpair = qpair;
+	for (i = 0; i < num_children; i++) {
+		children[i] = nvme_allocate_io_request(NULL, 0, NULL, NULL);
+		if (children[i] == NULL) {
+			break;
+		}
+		nvme_ns_cmd_split_next_child(parent, children[i]);
+	}
+
+	/*
+	 * Fewer children just narrow the window; the remainder of the
+	 *  transfer is issued as they complete.
+	 */
+	num_children = i;
+	if (num_children == 0) {
+		nvme_ns_cmd_free_request(parent);
+		return ENOMEM;
+	}
+
+	qpair->split_stats.num_split_ios++;
+	if (sectors_per_boundary > 0) {
+		qpair->split_stats.num_boundary_splits += last_lba / sectors_per_boundary -
+				lba / sectors_per_boundary;
+	}
+
+	parent->num_children = num_children;
+	memset(&parent->parent_status, 0, sizeof(parent->parent_status));
+
+	/*
+	 * A child may be completed with an error during submission, so
+	 *  num_children must be final before the first one is submitted, and
+	 *  the parent must not be touched after the last one is.
+	 */
+	for (i = 0; i < num_children; i++) {
+		nvme_ctrlr_submit_io_request(ns->ctrlr, qpair, children[i]);
+	}
+
+	return 0;
 }
 
-static struct nvme_request *
-_nvme_ns_cmd_split_request(struct nvme_namespace *ns, void *payload,
-			   uint64_t lba, uint32_t lba_count,
-			   nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc,
-			   struct nvme_request *req,
-			   uint32_t sectors_per_max_io, uint32_t sector_mask)
+static int
+nvme_ns_cmd_submit_request(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			   struct nvme_request *req)
 {
-	uint32_t		sector_size = ns->sector_size;
-	uint32_t		remaining_lba_count = lba_count;
-	struct nvme_request	*child;
+	if (req->is_split) {
+		return nvme_ns_cmd_submit_split(ns, qpair, req);
+	}
 
-	while (remaining_lba_count > 0) {
-		lba_count = sectors_per_max_io - (lba & sector_mask);
-		lba_count = nvme_min(remaining_lba_count, lba_count);
+	if (!nvme_qpair_admit(qpair, 1)) {
+		nvme_ns_cmd_free_request(req);
+		return EAGAIN;
+	}
+
+	nvme_ctrlr_submit_io_request(ns->ctrlr, qpair, req);
+	return 0;
+}
 
-		child = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn,
-					cb_arg, opc);
-		if (child == NULL) {
-			nvme_free_request(req);
-			return NULL;
+/*
+ * Check io_flags and the separate metadata buffer md of an LBA-addressed
+ *  command against the namespace's format.
+ */
+static int
+nvme_ns_cmd_check_md(struct nvme_namespace *ns, uint8_t payload_type, uint32_t io_flags,
+		     void *md)
+{
+	if (io_flags & ~NVME_IO_FLAGS_VALID_MASK) {
+		return EINVAL;
+	}
+
+	if ((io_flags & NVME_IO_FLAGS_PRINFO_MASK) && ns->pi_type == NVME_PI_TYPE_NONE) {
+		return EINVAL;
+	}
+
+	/* The metadata pointer must be dword aligned. */
+	if (md != NULL && (ns->md_size == 0 || ns->extended_lba_size != ns->sector_size ||
+			   ((uintptr_t)md & 3))) {
+		return EINVAL;
+	}
+
+	/*
+	 * A namespace with separate metadata transfers it with every data
+	 *  transfer, unless PRACT has the controller insert and strip
+	 *  protection information that is all of the metadata.
+	 */
+	if (md == NULL && payload_type != NVME_PAYLOAD_TYPE_NONE && ns->md_size > 0 &&
+	    ns->extended_lba_size == ns->sector_size &&
+	    !((io_flags & NVME_IO_FLAGS_PRACT) &&
+	      ns->md_size == sizeof(struct nvme_protection_info))) {
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Build and submit an LBA-addressed request such as a read or write,
+ *  split as needed by nvme_ns_cmd_chunk_sectors(), with io_flags applied
+ *  to every command.  If req_buf is NULL, the request
+ *  is allocated from the driver's request pool; otherwise req_buf is
+ *  caller-provided storage of nvme_request_size() bytes.  Split children
+ *  always come from the pool.  md is the separate metadata buffer, if
+ *  any, and apptag the application tag and mask of CDW15.
+ */
+static int
+_nvme_ns_cmd_rw(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *req_buf,
+		uint8_t payload_type, struct nvme_payload_cursor pos,
+		uint64_t lba, uint32_t lba_count,
+		nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc, uint32_t io_flags,
+		void *md, uint32_t apptag)
+{
+	struct nvme_request	*req;
+	uint32_t		sector_size;
+	uint32_t		first_chunk;
+	uint8_t			use_sgl;
+	int			rc;
+
+	rc = nvme_ns_cmd_check_md(ns, payload_type, io_flags, md);
+	if (rc != 0) {
+		return rc;
+	}
+
+	sector_size = nvme_ns_host_sector_size(ns, io_flags);
+	first_chunk = nvme_ns_cmd_chunk_sectors(ns, payload_type, &pos, lba, lba_count,
+						sector_size, &use_sgl);
+
+	if (req_buf != NULL) {
+		req = req_buf;
+		nvme_init_request(req, NULL, 0, cb_fn, cb_arg);
+		req->is_caller_owned = true;
+	} else {
+		req = nvme_allocate_io_request(NULL, 0, cb_fn, cb_arg);
+		if (req == NULL) {
+			return ENOMEM;
 		}
-		nvme_request_add_child(req, child);
-		remaining_lba_count -= lba_count;
-		lba += lba_count;
-		payload = (void *)((uintptr_t)payload + (lba_count * sector_size));
 	}
+	nvme_request_set_payload(req, payload_type, &pos, lba_count * sector_size);
 
-	return req;
+	if (md != NULL || (io_flags & NVME_IO_FLAGS_PRINFO_MASK)) {
+		req->has_md = true;
+		req->md = md;
+		req->io_reftag = (uint32_t)lba;
+		req->io_apptag = apptag;
+	}
+
+	if (first_chunk == lba_count) {
+		req->use_sgl = use_sgl;
+		req->is_io_cmd = true;
+		req->io_opc = opc;
+		req->io_nsid = ns->id;
+		req->io_lba = lba;
+		req->io_cdw12 = (io_flags & NVME_IO_FLAGS_CDW12_MASK) | (lba_count - 1);
+		req->io_dsm = io_flags & NVME_IO_FLAGS_DSM_MASK;
+	} else {
+		req->is_split = true;
+		req->split_ns = ns;
+		req->split_payload = pos;
+		req->split_lba = lba;
+		req->split_lba_remaining = lba_count;
+		req->split_opc = opc;
+		req->split_io_flags = io_flags;
+	}
+
+	return nvme_ns_cmd_submit_request(ns, qpair, req);
+}
+
+static int
+nvme_ns_cmd_rw_contig(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *req_buf,
+		      void *payload, uint64_t lba, uint32_t lba_count,
+		      nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc, uint32_t io_flags)
+{
+	struct nvme_payload_cursor pos = { .u.payload = payload };
+
+	return _nvme_ns_cmd_rw(ns, qpair, req_buf, NVME_PAYLOAD_TYPE_CONTIG, pos, lba, lba_count,
+			       cb_fn, cb_arg, opc, io_flags, NULL, 0);
+}
+
+static int
+nvme_ns_cmd_no_data(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		    uint64_t lba, uint32_t lba_count,
+		    nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc)
+{
+	struct nvme_payload_cursor pos = { .u.payload = NULL };
+
+	if (lba_count == 0) {
+		return EINVAL;
+	}
+
+	return _nvme_ns_cmd_rw(ns, qpair, NULL, NVME_PAYLOAD_TYPE_NONE, pos, lba, lba_count,
+			       cb_fn, cb_arg, opc, 0, NULL, 0);
+}
+
+static int
+nvme_ns_cmd_rwv(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		uint64_t lba, uint32_t lba_count, const struct iovec *iov, int iovcnt,
+		nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc, uint32_t io_flags)
+{
+	struct nvme_payload_cursor	pos = { .u.iov = iov };
+	uint64_t			len = 0;
+	uint32_t			sector_size;
+	int				i;
+
+	if (lba_count == 0 || iov == NULL || iovcnt <= 0) {
+		return EINVAL;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	/*
+	 * Check up front that the scatter list covers the transfer exactly and
+	 *  can be cut into commands at sector boundaries, since later children
+	 *  are built from completion context where there is no caller to fail.
+	 */
+	sector_size = nvme_ns_host_sector_size(ns, io_flags);
+	if (len != (uint64_t)lba_count * sector_size ||
+	    nvme_ns_cmd_count_chunks(ns, NVME_PAYLOAD_TYPE_IOV, pos, lba, lba_count,
+				     sector_size, UINT32_MAX) == 0) {
+		return EINVAL;
+	}
+
+	return _nvme_ns_cmd_rw(ns, qpair, NULL, NVME_PAYLOAD_TYPE_IOV, pos, lba, lba_count,
+			       cb_fn, cb_arg, opc, io_flags, NULL, 0);
+}
+
+int
+nvme_ns_cmd_read_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		       void *payload, uint64_t lba, uint32_t lba_count,
+		       nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_ns_cmd_rw_contig(ns, qpair, NULL, payload, lba, lba_count, cb_fn, cb_arg,
+				     NVME_OPC_READ, io_flags);
+}
+
+int
+nvme_ns_cmd_read(struct nvme_namespace *ns, void *payload, uint64_t lba,
+		 uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_read_qpair(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg, io_flags);
+}
+
+int
+nvme_ns_cmd_read_req(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		     void *req_buf, void *payload, uint64_t lba, uint32_t lba_count,
+		     nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_ns_cmd_rw_contig(ns, qpair, req_buf, payload, lba, lba_count, cb_fn, cb_arg,
+				     NVME_OPC_READ, io_flags);
+}
+
+int
+nvme_ns_cmd_readv_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			uint64_t lba, uint32_t lba_count,
+			const struct iovec *iov, int iovcnt,
+			nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_ns_cmd_rwv(ns, qpair, lba, lba_count, iov, iovcnt, cb_fn, cb_arg,
+			       NVME_OPC_READ, io_flags);
+}
+
+int
+nvme_ns_cmd_readv(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+		  const struct iovec *iov, int iovcnt,
+		  nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_readv_qpair(ns, qpair, lba, lba_count, iov, iovcnt, cb_fn, cb_arg,
+				       io_flags);
+}
+
+int
+nvme_ns_cmd_write_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			void *payload, uint64_t lba, uint32_t lba_count,
+			nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_ns_cmd_rw_contig(ns, qpair, NULL, payload, lba, lba_count, cb_fn, cb_arg,
+				     NVME_OPC_WRITE, io_flags);
+}
+
+int
+nvme_ns_cmd_write(struct nvme_namespace *ns, void *payload, uint64_t lba,
+		  uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_write_qpair(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg, io_flags);
+}
+
+int
+nvme_ns_cmd_write_req(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		      void *req_buf, void *payload, uint64_t lba, uint32_t lba_count,
+		      nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_ns_cmd_rw_contig(ns, qpair, req_buf, payload, lba, lba_count, cb_fn, cb_arg,
+				     NVME_OPC_WRITE, io_flags);
+}
+
+int
+nvme_ns_cmd_writev_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			 uint64_t lba, uint32_t lba_count,
+			 const struct iovec *iov, int iovcnt,
+			 nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_ns_cmd_rwv(ns, qpair, lba, lba_count, iov, iovcnt, cb_fn, cb_arg,
+			       NVME_OPC_WRITE, io_flags);
+}
+
+int
+nvme_ns_cmd_writev(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+		   const struct iovec *iov, int iovcnt,
+		   nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_writev_qpair(ns, qpair, lba, lba_count, iov, iovcnt, cb_fn, cb_arg,
+					io_flags);
+}
+
+static int
+nvme_ns_cmd_rw_with_md(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		       void *payload, void *metadata, uint64_t lba, uint32_t lba_count,
+		       nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc, uint32_t io_flags,
+		       uint16_t apptag_mask, uint16_t apptag)
+{
+	struct nvme_payload_cursor pos = { .u.payload = payload };
+
+	return _nvme_ns_cmd_rw(ns, qpair, NULL, NVME_PAYLOAD_TYPE_CONTIG, pos, lba, lba_count,
+			       cb_fn, cb_arg, opc, io_flags, metadata,
+			       ((uint32_t)apptag_mask << 16) | apptag);
+}
+
+int
+nvme_ns_cmd_read_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			       void *payload, void *metadata,
+			       uint64_t lba, uint32_t lba_count,
+			       nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+			       uint16_t apptag_mask, uint16_t apptag)
+{
+	return nvme_ns_cmd_rw_with_md(ns, qpair, payload, metadata, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_READ, io_flags, apptag_mask, apptag);
+}
+
+int
+nvme_ns_cmd_read_with_md(struct nvme_namespace *ns, void *payload, void *metadata,
+			 uint64_t lba, uint32_t lba_count,
+			 nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+			 uint16_t apptag_mask, uint16_t apptag)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_read_with_md_qpair(ns, qpair, payload, metadata, lba, lba_count,
+					      cb_fn, cb_arg, io_flags, apptag_mask, apptag);
 }
 
+int
+nvme_ns_cmd_write_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				void *payload, void *metadata,
+				uint64_t lba, uint32_t lba_count,
+				nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				uint16_t apptag_mask, uint16_t apptag)
+{
+	return nvme_ns_cmd_rw_with_md(ns, qpair, payload, metadata, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_WRITE, io_flags, apptag_mask, apptag);
+}
+
+int
+nvme_ns_cmd_write_with_md(struct nvme_namespace *ns, void *payload, void *metadata,
+			  uint64_t lba, uint32_t lba_count,
+			  nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+			  uint16_t apptag_mask, uint16_t apptag)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_write_with_md_qpair(ns, qpair, payload, metadata, lba, lba_count,
+					       cb_fn, cb_arg, io_flags, apptag_mask, apptag);
+}
+
+int
+nvme_ns_cmd_write_zeroes_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			       uint64_t lba, uint32_t lba_count,
+			       nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	return nvme_ns_cmd_no_data(ns, qpair, lba, lba_count, cb_fn, cb_arg,
+				   NVME_OPC_WRITE_ZEROES);
+}
+
+int
+nvme_ns_cmd_write_zeroes(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+			 nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_write_zeroes_qpair(ns, qpair, lba, lba_count, cb_fn, cb_arg);
+}
+
+int
+nvme_ns_cmd_write_uncorrectable_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				      uint64_t lba, uint32_t lba_count,
+				      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	return nvme_ns_cmd_no_data(ns, qpair, lba, lba_count, cb_fn, cb_arg,
+				   NVME_OPC_WRITE_UNCORRECTABLE);
+}
+
+int
+nvme_ns_cmd_write_uncorrectable(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count,
+				nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_write_uncorrectable_qpair(ns, qpair, lba, lba_count, cb_fn, cb_arg);
+}
+
+int
+nvme_ns_cmd_compare_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			  void *payload, uint64_t lba, uint32_t lba_count,
+			  nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	return nvme_ns_cmd_rw_contig(ns, qpair, NULL, payload, lba, lba_count, cb_fn, cb_arg,
+				     NVME_OPC_COMPARE, 0);
+}
+
+int
+nvme_ns_cmd_compare(struct nvme_namespace *ns, void *payload, uint64_t lba,
+		    uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_compare_qpair(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg);
+}
+
+int
+nvme_ns_cmd_compare_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				  void *payload, void *metadata,
+				  uint64_t lba, uint32_t lba_count,
+				  nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				  uint16_t apptag_mask, uint16_t apptag)
+{
+	return nvme_ns_cmd_rw_with_md(ns, qpair, payload, metadata, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_COMPARE, io_flags, apptag_mask, apptag);
+}
+
+int
+nvme_ns_cmd_compare_with_md(struct nvme_namespace *ns, void *payload, void *metadata,
+			    uint64_t lba, uint32_t lba_count,
+			    nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+			    uint16_t apptag_mask, uint16_t apptag)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_compare_with_md_qpair(ns, qpair, payload, metadata, lba, lba_count,
+						 cb_fn, cb_arg, io_flags, apptag_mask, apptag);
+}
+
+/*
+ * Completion of one half of a fused compare and write.  A failed compare
+ *  also fails the write, with NVME_SC_ABORTED_FAILED_FUSED, so the
+ *  compare's status takes precedence whichever completes first.
+ */
+static void
+nvme_cb_complete_fused(void *child_arg, const struct nvme_completion *cpl)
+{
+	struct nvme_request	*child = child_arg;
+	struct nvme_request	*parent = child->parent;
+
+	if (nvme_completion_is_error(cpl) &&
+	    (!nvme_completion_is_error(&parent->parent_status) ||
+	     child->cmd.fuse == NVME_CMD_FUSE_FIRST)) {
+		memcpy(&parent->parent_status, cpl, sizeof(*cpl));
+		parent->parent_status.cdw0 = child->cmd.fuse;
+	}
+
+	if (--parent->num_children == 0) {
+		nvme_complete_request(parent, &parent->parent_status);
+	}
+}
+
+/*
+ * Allocate one half of a fused pair.  The command is built in full here,
+ *  protection information fields included, since fused requests do not
+ *  use the is_io_cmd fields.  The compare takes only the CDW12 io_flags;
+ *  it has no dataset management hints.
+ */
 static struct nvme_request *
-_nvme_ns_cmd_rw(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
-		uint32_t opc)
+nvme_ns_cmd_alloc_fused(struct nvme_namespace *ns, struct nvme_request *parent,
+			void *payload, void *md, uint64_t lba, uint32_t lba_count,
+			uint8_t opc, uint8_t fuse, uint32_t io_flags, uint32_t apptag)
 {
 	struct nvme_request	*req;
 	struct nvme_command	*cmd;
-	uint64_t		*tmp_lba;
-	uint32_t		sector_size;
-	uint32_t		sectors_per_max_io;
-	uint32_t		sectors_per_stripe;
 
-	sector_size = ns->sector_size;
-	sectors_per_max_io = ns->sectors_per_max_io;
-	sectors_per_stripe = ns->sectors_per_stripe;
-
-	req = nvme_allocate_request(payload, lba_count * sector_size, cb_fn, cb_arg);
+	req = nvme_allocate_request(payload, lba_count * nvme_ns_host_sector_size(ns, io_flags),
+				    nvme_cb_complete_fused, NULL);
 	if (req == NULL) {
 		return NULL;
 	}
 
-	/*
-	 * Intel DC P3*00 NVMe controllers benefit from driver-assisted striping.
-	 * If this controller defines a stripe boundary and this I/O spans a stripe
-	 *  boundary, split the request into multiple requests and submit each
-	 *  separately to hardware.
-	 */
-	if (sectors_per_stripe > 0 &&
-	    (((lba & (sectors_per_stripe - 1)) + lba_count) > sectors_per_stripe)) {
-
-		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, cb_fn, cb_arg, opc,
-						  req, sectors_per_stripe, sectors_per_stripe - 1);
-	} else if (lba_count > sectors_per_max_io) {
-		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, cb_fn, cb_arg, opc,
-						  req, sectors_per_max_io, 0);
-	} else {
-		cmd = &req->cmd;
-		cmd->opc = opc;
-		cmd->nsid = ns->id;
+	req->cb_arg = req;
+	req->parent = parent;
+	req->fused_next = NULL;
 
-		tmp_lba = (uint64_t *)&cmd->cdw10;
-		*tmp_lba = lba;
-		cmd->cdw12 = lba_count - 1;
+	cmd = &req->cmd;
+	cmd->opc = opc;
+	cmd->fuse = fuse;
+	cmd->nsid = ns->id;
+	*(uint64_t *)&cmd->cdw10 = lba;
+	cmd->cdw12 = (io_flags & NVME_IO_FLAGS_CDW12_MASK) | (lba_count - 1);
+	if (opc == NVME_OPC_WRITE) {
+		cmd->cdw13 = io_flags & NVME_IO_FLAGS_DSM_MASK;
+	}
+
+	if (md != NULL || (io_flags & NVME_IO_FLAGS_PRINFO_MASK)) {
+		req->has_md = true;
+		req->md = md;
+		cmd->cdw14 = (uint32_t)lba;
+		cmd->cdw15 = apptag;
 	}
 
 	return req;
 }
 
 int
-nvme_ns_cmd_read(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		 uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ns_cmd_compare_and_write_with_md_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+					    void *compare_payload, void *compare_md,
+					    void *write_payload, void *write_md,
+					    uint64_t lba, uint32_t lba_count,
+					    nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+					    uint16_t apptag_mask, uint16_t apptag)
 {
-	struct nvme_request *req;
+	struct nvme_request	*parent, *compare, *write;
+	uint32_t		cdw15 = ((uint32_t)apptag_mask << 16) | apptag;
+	int			rc;
 
-	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, NVME_OPC_READ);
-	if (req != NULL) {
-		nvme_ctrlr_submit_io_request(ns->ctrlr, req);
-		return 0;
-	} else {
+	if (!(ns->flags & NVME_NS_COMPARE_AND_WRITE_SUPPORTED)) {
+		return ENOTSUP;
+	}
+
+	/* Both halves must cover the same range, so the pair cannot be split. */
+	if (compare_payload == NULL || write_payload == NULL ||
+	    lba_count == 0 || lba_count > ns->sectors_per_max_io) {
+		return EINVAL;
+	}
+
+	rc = nvme_ns_cmd_check_md(ns, NVME_PAYLOAD_TYPE_CONTIG, io_flags, compare_md);
+	if (rc == 0) {
+		rc = nvme_ns_cmd_check_md(ns, NVME_PAYLOAD_TYPE_CONTIG, io_flags, write_md);
+	}
+	if (rc != 0) {
+		return rc;
+	}
+
+	parent = nvme_allocate_io_request(NULL, 0, cb_fn, cb_arg);
+	if (parent == NULL) {
+		return ENOMEM;
+	}
+
+	compare = nvme_ns_cmd_alloc_fused(ns, parent, compare_payload, compare_md, lba, lba_count,
+					  NVME_OPC_COMPARE, NVME_CMD_FUSE_FIRST, io_flags, cdw15);
+	if (compare == NULL) {
+		nvme_free_request(parent);
+		return ENOMEM;
+	}
+
+	write = nvme_ns_cmd_alloc_fused(ns, parent, write_payload, write_md, lba, lba_count,
+					NVME_OPC_WRITE, NVME_CMD_FUSE_SECOND, io_flags, cdw15);
+	if (write == NULL) {
+		nvme_free_request(compare);
+		nvme_free_request(parent);
 		return ENOMEM;
 	}
+
+	if (!nvme_qpair_admit(qpair, 2)) {
+		nvme_free_request(write);
+		nvme_free_request(compare);
+		nvme_free_request(parent);
+		return EAGAIN;
+	}
+
+	compare->fused_next = write;
+	parent->num_children = 2;
+	memset(&parent->parent_status, 0, sizeof(parent->parent_status));
+
+	/* The qpair submits the write along with the compare. */
+	nvme_ctrlr_submit_io_request(ns->ctrlr, qpair, compare);
+	return 0;
 }
 
 int
-nvme_ns_cmd_write(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		  uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ns_cmd_compare_and_write_with_md(struct nvme_namespace *ns,
+				      void *compare_payload, void *compare_md,
+				      void *write_payload, void *write_md,
+				      uint64_t lba, uint32_t lba_count,
+				      nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t io_flags,
+				      uint16_t apptag_mask, uint16_t apptag)
 {
-	struct nvme_request *req;
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
 
-	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, NVME_OPC_WRITE);
-	if (req != NULL) {
-		nvme_ctrlr_submit_io_request(ns->ctrlr, req);
-		return 0;
-	} else {
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_compare_and_write_with_md_qpair(ns, qpair, compare_payload, compare_md,
+							   write_payload, write_md, lba, lba_count,
+							   cb_fn, cb_arg, io_flags, apptag_mask,
+							   apptag);
+}
+
+int
+nvme_ns_cmd_compare_and_write_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				    void *compare_payload, void *write_payload,
+				    uint64_t lba, uint32_t lba_count,
+				    nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	return nvme_ns_cmd_compare_and_write_with_md_qpair(ns, qpair, compare_payload, NULL,
+							   write_payload, NULL, lba, lba_count,
+							   cb_fn, cb_arg, 0, 0, 0);
+}
+
+int
+nvme_ns_cmd_compare_and_write(struct nvme_namespace *ns,
+			      void *compare_payload, void *write_payload,
+			      uint64_t lba, uint32_t lba_count,
+			      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_compare_and_write_qpair(ns, qpair, compare_payload, write_payload,
+						   lba, lba_count, cb_fn, cb_arg);
+}
+
+static int
+nvme_dsm_range_cmp(const void *a, const void *b)
+{
+	const struct nvme_dsm_range *range_a = a;
+	const struct nvme_dsm_range *range_b = b;
+
+	if (range_a->starting_lba != range_b->starting_lba) {
+		return range_a->starting_lba < range_b->starting_lba ? -1 : 1;
+	}
+	if (range_a->attributes != range_b->attributes) {
+		return range_a->attributes < range_b->attributes ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Sort ranges by starting LBA and merge those with the same attributes
+ *  that touch or overlap, as long as the result still fits in a range.
+ *  Returns the number of ranges left.
+ */
+static uint32_t
+nvme_dsm_coalesce(struct nvme_dsm_range *ranges, uint32_t num_ranges)
+{
+	struct nvme_dsm_range	*last = NULL;
+	uint64_t		end, next_end;
+	uint32_t		i, n = 0;
+
+	qsort(ranges, num_ranges, sizeof(*ranges), nvme_dsm_range_cmp);
+
+	for (i = 0; i < num_ranges; i++) {
+		if (last != NULL && ranges[i].attributes == last->attributes) {
+			end = last->starting_lba + last->length;
+			next_end = ranges[i].starting_lba + ranges[i].length;
+			if (ranges[i].starting_lba <= end && next_end <= end) {
+				continue;
+			}
+			if (ranges[i].starting_lba <= end &&
+			    next_end - last->starting_lba <= UINT32_MAX) {
+				last->length = next_end - last->starting_lba;
+				continue;
+			}
+		}
+
+		last = &ranges[n++];
+		*last = ranges[i];
+	}
+
+	return n;
+}
+
+static void nvme_cb_complete_dsm_child(void *child_arg, const struct nvme_completion *cpl);
+
+/*
+ * Allocate the qpair's dataset management range pages.  This is done on
+ *  its first dataset management command rather than at construction, so
+ *  that qpairs which never issue one do not pin the memory.
+ */
+static int
+nvme_qpair_alloc_dsm_pages(struct nvme_qpair *qpair)
+{
+	uint64_t phys_addr;
+
+	qpair->dsm_pages = nvme_malloc("qpair_dsm",
+				       NVME_QPAIR_DSM_PAGES * NVME_DSM_MAX_RANGES *
+				       sizeof(struct nvme_dsm_range),
+				       0x1000, &phys_addr);
+	if (qpair->dsm_pages == NULL) {
 		return ENOMEM;
 	}
+
+	qpair->dsm_free_pages = (1u << NVME_QPAIR_DSM_PAGES) - 1;
+	return 0;
+}
+
+/*
+ * Take one of the qpair's dataset management range pages, or return NULL
+ *  if all of them are carrying commands.
+ */
+static struct nvme_dsm_range *
+nvme_qpair_get_dsm_page(struct nvme_qpair *qpair)
+{
+	uint32_t i;
+
+	if (qpair->dsm_free_pages == 0) {
+		return NULL;
+	}
+
+	i = __builtin_ctz(qpair->dsm_free_pages);
+	qpair->dsm_free_pages &= ~(1u << i);
+	return qpair->dsm_pages + i * NVME_DSM_MAX_RANGES;
+}
+
+static void
+nvme_qpair_put_dsm_page(struct nvme_qpair *qpair, struct nvme_dsm_range *page)
+{
+	qpair->dsm_free_pages |= 1u << ((page - qpair->dsm_pages) / NVME_DSM_MAX_RANGES);
+}
+
+/*
+ * Copy the next ranges from the parent's cursor into page, dropping empty
+ *  ranges.  Once the page is full it is sorted and merged, and if that
+ *  leaves at least a quarter of it free, copying resumes.  Ranges are only
+ *  merged with others that land in the same page, so the caller's list is
+ *  never modified.  Returns the number of ranges in the page.
+ */
+static uint32_t
+nvme_ns_cmd_dsm_fill_page(struct nvme_request *parent, struct nvme_dsm_range *page)
+{
+	const struct nvme_dsm_range	*ranges = parent->split_payload.u.payload;
+	uint32_t			n = 0;
+
+	for (;;) {
+		while (n < NVME_DSM_MAX_RANGES && parent->split_lba_remaining > 0) {
+			if (ranges->length != 0) {
+				page[n++] = *ranges;
+			}
+			ranges++;
+			parent->split_lba_remaining--;
+		}
+
+		n = nvme_dsm_coalesce(page, n);
+		if (parent->split_lba_remaining == 0 || n > NVME_DSM_MAX_RANGES * 3 / 4) {
+			break;
+		}
+	}
+
+	parent->split_payload.u.payload = (void *)ranges;
+	return n;
+}
+
+/*
+ * Build the next command of a dataset management request from the
+ *  parent's cursor into child, as for split reads and writes, with its
+ *  ranges in page.  For these requests split_payload walks the caller's
+ *  range list, split_lba_remaining counts the entries not yet copied, and
+ *  the parent's cmd is the template for every command.  Returns false if
+ *  only empty ranges were left.
+ */
+static bool
+nvme_ns_cmd_dsm_next_child(struct nvme_request *parent, struct nvme_request *child,
+			   struct nvme_dsm_range *page)
+{
+	uint32_t num_ranges;
+
+	num_ranges = nvme_ns_cmd_dsm_fill_page(parent, page);
+	if (num_ranges == 0) {
+		return false;
+	}
+
+	nvme_init_request(child, page, num_ranges * sizeof(*page),
+			  nvme_cb_complete_dsm_child, child);
+	child->is_caller_owned = true;
+	child->parent = parent;
+	child->cmd = parent->cmd;
+	child->cmd.cdw10 = num_ranges - 1;
+	return true;
+}
+
+static void
+nvme_cb_complete_dsm_child(void *child_arg, const struct nvme_completion *cpl)
+{
+	struct nvme_request	*child = child_arg;
+	struct nvme_request	*parent = child->parent;
+	struct nvme_dsm_range	*page;
+
+	if (nvme_completion_is_error(cpl)) {
+		memcpy(&parent->parent_status, cpl, sizeof(*cpl));
+		parent->split_lba_remaining = 0;
+	}
+
+	/* The child keeps its range page for the next command, if any. */
+	page = child->u.payload;
+	if (parent->split_lba_remaining > 0 &&
+	    nvme_ns_cmd_dsm_next_child(parent, child, page)) {
+		nvme_ctrlr_submit_io_request(parent->split_ns->ctrlr, parent->split_qpair, child);
+		return;
+	}
+
+	nvme_qpair_put_dsm_page(parent->split_qpair, page);
+	nvme_free_request(child);
+	if (--parent->num_children == 0) {
+		nvme_complete_request(parent, &parent->parent_status);
+	}
 }
 
 int
-nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
-		       uint8_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ns_cmd_dataset_management_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				     uint32_t type, const struct nvme_dsm_range *ranges,
+				     uint32_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request	*children[NVME_SPLIT_WINDOW];
+	struct nvme_request	*parent;
+	struct nvme_dsm_range	*page = NULL;
+	uint32_t		i, num_children, num_left;
+
+	if (ranges == NULL || num_ranges == 0) {
+		return EINVAL;
+	}
+
+	if (qpair->dsm_pages == NULL && nvme_qpair_alloc_dsm_pages(qpair) != 0) {
+		return ENOMEM;
+	}
+
+	/* Every command but the last carries at least NVME_DSM_MAX_RANGES entries. */
+	num_children = nvme_min((num_ranges + NVME_DSM_MAX_RANGES - 1) / NVME_DSM_MAX_RANGES,
+				NVME_SPLIT_WINDOW);
+	if (!nvme_qpair_admit(qpair, num_children)) {
+		return EAGAIN;
+	}
+
+	parent = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+	if (parent == NULL) {
+		return ENOMEM;
+	}
+	parent->cmd.opc = NVME_OPC_DATASET_MANAGEMENT;
+	parent->cmd.nsid = ns->id;
+	parent->cmd.cdw11 = type;
+	parent->split_ns = ns;
+	parent->split_qpair = qpair;
+	parent->split_payload.u.payload = (void *)ranges;
+	parent->split_lba_remaining = num_ranges;
+
+	/*
+	 * Each child carries its ranges in one of the qpair's range pages,
+	 *  so no more children are started than there are pages free.
+	 */
+	for (i = 0; i < num_children && parent->split_lba_remaining > 0; i++) {
+		page = nvme_qpair_get_dsm_page(qpair);
+		if (page == NULL) {
+			break;
+		}
+		children[i] = nvme_allocate_io_request(NULL, 0, NULL, NULL);
+		if (children[i] == NULL) {
+			nvme_qpair_put_dsm_page(qpair, page);
+			break;
+		}
+		if (!nvme_ns_cmd_dsm_next_child(parent, children[i], page)) {
+			nvme_qpair_put_dsm_page(qpair, page);
+			nvme_free_request(children[i]);
+			break;
+		}
+	}
+
+	num_children = i;
+	if (num_children == 0) {
+		num_left = parent->split_lba_remaining;
+		nvme_free_request(parent);
+		if (num_left == 0) {
+			/* Every range was empty. */
+			return EINVAL;
+		}
+		if (page != NULL) {
+			return ENOMEM;
+		}
+		/* A page comes free when a command completes, as a slot does. */
+		if (qpair->slot_cb_fn != NULL) {
+			qpair->is_slot_cb_pending = true;
+		}
+		return EAGAIN;
+	}
+
+	parent->num_children = num_children;
+	memset(&parent->parent_status, 0, sizeof(parent->parent_status));
+
+	for (i = 0; i < num_children; i++) {
+		nvme_ctrlr_submit_io_request(ns->ctrlr, qpair, children[i]);
+	}
+
+	return 0;
+}
+
+int
+nvme_ns_cmd_dataset_management(struct nvme_namespace *ns, uint32_t type,
+			       const struct nvme_dsm_range *ranges, uint32_t num_ranges,
+			       nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_dataset_management_qpair(ns, qpair, type, ranges, num_ranges,
+						    cb_fn, cb_arg);
+}
+
+int
+nvme_ns_cmd_deallocate_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			     void *payload, uint8_t num_ranges,
+			     nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 	struct nvme_request	*req;
 	struct nvme_command	*cmd;
@@ -219,13 +1362,25 @@ nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
 	cmd->cdw10 = num_ranges - 1;
 	cmd->cdw11 = NVME_DSM_ATTR_DEALLOCATE;
 
-	nvme_ctrlr_submit_io_request(ns->ctrlr, req);
+	return nvme_ns_cmd_submit_request(ns, qpair, req);
+}
 
-	return 0;
+int
+nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
+		       uint8_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_deallocate_qpair(ns, qpair, payload, num_ranges, cb_fn, cb_arg);
 }
 
 int
-nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ns_cmd_flush_qpair(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 	struct nvme_request	*req;
 	struct nvme_command	*cmd;
@@ -239,7 +1394,17 @@ nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn, void *cb_arg)
 	cmd->opc = NVME_OPC_FLUSH;
 	cmd->nsid = ns->id;
 
-	nvme_ctrlr_submit_io_request(ns->ctrlr, req);
+	return nvme_ns_cmd_submit_request(ns, qpair, req);
+}
 
-	return 0;
+int
+nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_qpair *qpair = nvme_ctrlr_get_thread_io_qpair(ns->ctrlr);
+
+	if (qpair == NULL) {
+		return ENXIO;
+	}
+
+	return nvme_ns_cmd_flush_qpair(ns, qpair, cb_fn, cb_arg);
 }
@@ -287,60 +287,148 @@ nvme_completion_is_retry(const struct nvme_completion *cpl)
 }
 
 static void
-nvme_qpair_construct_tracker(struct nvme_tracker *tr, uint16_t cid, uint64_t phys_addr)
+nvme_qpair_construct_tracker(struct nvme_tracker *tr, uint16_t cid, uint64_t *prp,
+			     uint64_t prp_bus_addr)
 {
-	tr->prp_bus_addr = phys_addr + offsetof(struct nvme_tracker, prp);
+	tr->req = NULL;
+	tr->prp = prp;
+	tr->prp_bus_addr = prp_bus_addr;
 	tr->cid = cid;
 }
 
+static inline struct nvme_tracker *
+nvme_qpair_get_active_tracker(struct nvme_qpair *qpair, uint16_t cid)
+{
+	struct nvme_tracker *tr;
+
+	if (cid >= qpair->num_trackers) {
+		return NULL;
+	}
+
+	tr = &qpair->tr[cid];
+	return tr->req != NULL ? tr : NULL;
+}
+
+/*
+ * Assemble the command for a request, less the cid and data pointer.
+ *  LBA-addressed I/O is built from the request's io_* fields; anything
+ *  else was staged in req->cmd by its builder.
+ */
+static inline void
+nvme_request_build_command(const struct nvme_request *req, struct nvme_command *cmd)
+{
+	if (!req->is_io_cmd) {
+		*cmd = req->cmd;
+		return;
+	}
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = req->io_opc;
+	cmd->nsid = req->io_nsid;
+	*(uint64_t *)&cmd->cdw10 = req->io_lba;
+	cmd->cdw12 = req->io_cdw12;
+	cmd->cdw13 = req->io_dsm;
+	if (req->has_md) {
+		cmd->cdw14 = req->io_reftag;
+		cmd->cdw15 = req->io_apptag;
+	}
+}
+
+/*
+ * Assemble the full submission queue entry for the tracker's request.
+ *  Everything comes from the request and the tracker, so a retry or a
+ *  replay after reset rebuilds exactly the command that was first
+ *  submitted.
+ */
+static inline void
+nvme_qpair_build_command(struct nvme_tracker *tr, struct nvme_command *cmd)
+{
+	struct nvme_request *req = tr->req;
+
+	nvme_request_build_command(req, cmd);
+	cmd->cid = tr->cid;
+
+	if (req->payload_size) {
+		cmd->psdt = req->use_sgl ? NVME_PSDT_SGL_MPTR_CONTIG : NVME_PSDT_PRP;
+		memcpy(&cmd->dptr, &tr->dptr, sizeof(cmd->dptr));
+	}
+
+	if (req->has_md) {
+		cmd->mptr = tr->mptr;
+	}
+}
+
+static void
+nvme_qpair_notify_slot_available(struct nvme_qpair *qpair)
+{
+	/*
+	 * Clear the pending flag before probing, so a probe that is refused
+	 *  re-arms it, and before calling back, so the callback may itself
+	 *  be refused and re-arm it.
+	 */
+	qpair->is_slot_cb_pending = false;
+	if (nvme_qpair_admit(qpair, 1)) {
+		qpair->slot_cb_fn(qpair->slot_cb_arg, qpair);
+	}
+}
+
 static void
 nvme_qpair_complete_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr,
 			    struct nvme_completion *cpl, bool print_on_error)
 {
 	struct nvme_request	*req;
+	struct nvme_command	cmd;
 	bool			retry, error;
 
 	req = tr->req;
 
 	nvme_assert(req != NULL, ("tr has NULL req\n"));
 
+	/*
+	 * Half of a fused pair cannot be resubmitted on its own, so fused
+	 *  commands are never retried.
+	 */
 	error = nvme_completion_is_error(cpl);
 	retry = error && nvme_completion_is_retry(cpl) &&
-		req->retries < nvme_retry_count;
+		req->retries < nvme_retry_count &&
+		nvme_request_fuse(req) == NVME_CMD_FUSE_NONE;
 
 	if (error && print_on_error) {
-		nvme_qpair_print_command(qpair, &req->cmd);
+		nvme_qpair_build_command(tr, &cmd);
+		nvme_qpair_print_command(qpair, &cmd);
 		nvme_qpair_print_completion(qpair, cpl);
 	}
 
-	qpair->act_tr[cpl->cid] = NULL;
-
-	nvme_assert(cpl->cid == req->cmd.cid, ("cpl cid does not match cmd cid\n"));
+	nvme_assert(cpl->cid == tr->cid, ("cpl cid does not match cmd cid\n"));
 
 	if (retry) {
 		req->retries++;
 		nvme_qpair_submit_tracker(qpair, tr);
 	} else {
-		if (req->cb_fn) {
-			req->cb_fn(req->cb_arg, cpl);
-		}
-
-		nvme_free_request(req);
+		nvme_complete_request(req, cpl);
 		tr->req = NULL;
 
-		LIST_REMOVE(tr, list);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
+		qpair->free_tr[qpair->num_free_tr++] = tr->cid;
 
 		/*
-		 * If the controller is in the middle of resetting, don't
-		 *  try to submit queued requests here - let the reset logic
-		 *  handle that instead.
+		 * If the qpair is quiesced or the controller is in the middle
+		 *  of resetting, don't try to submit queued requests here -
+		 *  let the reset logic handle that instead.  A fused pair
+		 *  at the head stays there until two trackers are free.
 		 */
-		if (!STAILQ_EMPTY(&qpair->queued_req) &&
+		if (!STAILQ_EMPTY(&qpair->queued_req) && qpair->is_enabled &&
 		    !qpair->ctrlr->is_resetting) {
 			req = STAILQ_FIRST(&qpair->queued_req);
-			STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
-			nvme_qpair_submit_request(qpair, req);
+			if (nvme_request_fuse(req) != NVME_CMD_FUSE_FIRST ||
+			    qpair->num_free_tr >= 2) {
+				STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+				qpair->num_queued_req--;
+				nvme_qpair_submit_request(qpair, req);
+			}
+		}
+
+		if (qpair->is_slot_cb_pending) {
+			nvme_qpair_notify_slot_available(qpair);
 		}
 	}
 }
@@ -367,6 +455,8 @@ nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 				   bool print_on_error)
 {
 	struct nvme_completion	cpl;
+	struct nvme_command	cmd;
+	struct nvme_request	*fused_next = NULL;
 	bool			error;
 
 	memset(&cpl, 0, sizeof(cpl));
@@ -377,22 +467,65 @@ nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 	error = nvme_completion_is_error(&cpl);
 
 	if (error && print_on_error) {
-		nvme_qpair_print_command(qpair, &req->cmd);
+		nvme_request_build_command(req, &cmd);
+		nvme_qpair_print_command(qpair, &cmd);
 		nvme_qpair_print_completion(qpair, &cpl);
 	}
 
-	if (req->cb_fn) {
-		req->cb_fn(req->cb_arg, &cpl);
+	/* A fused pair waits as its first command, so complete both. */
+	if (nvme_request_fuse(req) == NVME_CMD_FUSE_FIRST) {
+		fused_next = req->fused_next;
 	}
 
-	nvme_free_request(req);
+	nvme_complete_request(req, &cpl);
+
+	if (fused_next != NULL) {
+		nvme_qpair_manual_complete_request(qpair, fused_next, sct, sc, print_on_error);
+	}
 }
 
+static void nvme_io_qpair_follow_reset(struct nvme_qpair *qpair);
+
+/*
+ * The owning thread brackets every call that may touch the qpair's queues
+ *  or doorbells with nvme_qpair_enter() and nvme_qpair_exit(), and checks
+ *  reset_seq only after entering.  The barrier pairs with the one the reset
+ *  issues after bumping ctrlr->reset_seq: either the reset sees in_use and
+ *  waits, or this thread sees the new reset_seq and quiesces.
+ */
+static inline void
+nvme_qpair_enter(struct nvme_qpair *qpair)
+{
+	if (qpair->in_use++ == 0) {
+		mb();
+	}
+}
+
+static inline void
+nvme_qpair_exit(struct nvme_qpair *qpair)
+{
+	if (qpair->in_use == 1) {
+		/* Doorbell writes must land before the reset may disable the controller. */
+		wmb();
+	}
+	qpair->in_use--;
+}
+
+/*
+ * I/O qpairs follow controller resets on their owning thread: the reset
+ *  bumps ctrlr->reset_seq, and the next submission or completion pass on
+ *  each qpair notices and quiesces or resumes it.  The admin qpair is
+ *  driven directly by the reset state machine.
+ */
 static inline bool
 nvme_qpair_check_enabled(struct nvme_qpair *qpair)
 {
-	if (!qpair->is_enabled &&
-	    !qpair->ctrlr->is_resetting) {
+	if (nvme_qpair_is_io_queue(qpair)) {
+		if (qpair->reset_seq != qpair->ctrlr->reset_seq) {
+			nvme_io_qpair_follow_reset(qpair);
+		}
+	} else if (!qpair->is_enabled &&
+		   !qpair->ctrlr->is_resetting) {
 		nvme_qpair_enable(qpair);
 	}
 	return qpair->is_enabled;
@@ -442,21 +575,18 @@ nvme_qpair_check_enabled(struct nvme_qpair *qpair)
  *
  * \sa nvme_cb_fn_t
  */
-void
-nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions)
+/*
+ * Reap completions.  update_cq_hdbl is false only when draining the
+ *  completion queue of a controller that has since been reset, whose head
+ *  doorbell now belongs to the recreated queue.
+ */
+static inline void
+_nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions,
+				bool update_cq_hdbl)
 {
 	struct nvme_tracker	*tr;
 	struct nvme_completion	*cpl;
-
-	if (!nvme_qpair_check_enabled(qpair)) {
-		/*
-		 * qpair is not enabled, likely because a controller reset is
-		 *  is in progress.  Ignore the interrupt - any I/O that was
-		 *  associated with this interrupt will get retried when the
-		 *  reset is complete.
-		 */
-		return;
-	}
+	uint16_t		num_reaped = 0;
 
 	while (1) {
 		cpl = &qpair->cpl[qpair->cq_head];
@@ -464,7 +594,7 @@ nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completion
 		if (cpl->status.p != qpair->phase)
 			break;
 
-		tr = qpair->act_tr[cpl->cid];
+		tr = nvme_qpair_get_active_tracker(qpair, cpl->cid);
 
 		if (tr != NULL) {
 			nvme_qpair_complete_tracker(qpair, tr, cpl, true);
@@ -480,12 +610,155 @@ nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completion
 			qpair->phase = !qpair->phase;
 		}
 
-		_nvme_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
+		if (++num_reaped == qpair->cq_hdbl_batch && update_cq_hdbl) {
+			_nvme_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
+			num_reaped = 0;
+		}
 
 		if (max_completions > 0 && --max_completions == 0) {
 			break;
 		}
 	}
+
+	/*
+	 * Release the reaped entries to the controller before ringing the
+	 *  submission doorbell for anything the callbacks submitted.  Until
+	 *  that doorbell is rung the controller can only complete commands
+	 *  that were outstanding when this pass started, and there are
+	 *  never more of those than there are free completion queue
+	 *  entries, so deferring the head doorbell cannot fill the queue.
+	 */
+	if (num_reaped > 0 && update_cq_hdbl) {
+		_nvme_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
+	}
+}
+
+void
+nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions)
+{
+	nvme_qpair_enter(qpair);
+
+	if (!nvme_qpair_check_enabled(qpair)) {
+		/*
+		 * qpair is not enabled, likely because a controller reset is
+		 *  is in progress.  Ignore the interrupt - any I/O that was
+		 *  associated with this interrupt will get retried when the
+		 *  reset is complete.
+		 */
+		nvme_qpair_exit(qpair);
+		return;
+	}
+
+	/*
+	 * Completion callbacks commonly submit new I/O.  Batch those
+	 *  submissions so that they are all made visible to the controller
+	 *  with a single tail doorbell write once this pass is finished.
+	 */
+	nvme_qpair_batch_begin(qpair);
+	_nvme_qpair_process_completions(qpair, max_completions, true);
+	nvme_qpair_batch_end(qpair);
+
+	nvme_qpair_exit(qpair);
+}
+
+static void
+nvme_qpair_destroy_trackers(struct nvme_qpair *qpair)
+{
+	if (qpair->tr)
+		nvme_free(qpair->tr);
+	if (qpair->prp)
+		nvme_free(qpair->prp);
+	if (qpair->free_tr)
+		free(qpair->free_tr);
+
+	qpair->tr = NULL;
+	qpair->prp = NULL;
+	qpair->free_tr = NULL;
+	qpair->num_trackers = 0;
+	qpair->num_free_tr = 0;
+}
+
+/*
+ * Slot in a tracker's PRP list memory that holds list entry i.  A list
+ *  longer than a page uses the last slot of each full page to point to
+ *  the next page, so from the second page on entries shift by one slot
+ *  per page.
+ */
+static inline uint32_t
+nvme_prp_list_slot(uint32_t i)
+{
+	return i == 0 ? 0 : i + (i - 1) / (NVME_PRP_ENTRIES_PER_PAGE - 1);
+}
+
+/*
+ * Size the per-tracker PRP lists for the controller's max_xfer_size.  A
+ *  list that fits in a page takes a power-of-two size so that no list
+ *  spans a page; a longer one takes whole pages.
+ */
+static void
+nvme_qpair_size_prp_lists(struct nvme_qpair *qpair)
+{
+	uint32_t	entries, size;
+
+	entries = nvme_max(qpair->ctrlr->max_xfer_size / PAGE_SIZE, NVME_MIN_PRP_LIST_ENTRIES);
+	size = (nvme_prp_list_slot(entries - 1) + 1) * sizeof(uint64_t);
+
+	if (size <= PAGE_SIZE) {
+		size = nvme_align32pow2(size);
+	} else {
+		size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	}
+
+	qpair->prp_list_entries = entries;
+	qpair->prp_list_size = size;
+}
+
+static int
+nvme_qpair_construct_trackers(struct nvme_qpair *qpair, uint16_t num_trackers)
+{
+	uint16_t		i;
+	uint64_t		prp_bus_addr = 0;
+	uint64_t		phys_addr = 0;
+
+	nvme_qpair_size_prp_lists(qpair);
+
+	/*
+	 * All trackers live in one array indexed by cid, with their PRP
+	 *  lists in a second, page-aligned array.  Both come from pinned
+	 *  memory so that the hot path stays on hugepage-backed TLB entries.
+	 */
+	qpair->tr = nvme_malloc("qpair_tr", num_trackers * sizeof(struct nvme_tracker),
+				64, &phys_addr);
+	if (qpair->tr == NULL) {
+		nvme_printf(qpair->ctrlr, "alloc qpair_tr failed\n");
+		goto fail;
+	}
+	qpair->prp = nvme_malloc("qpair_prp", num_trackers * qpair->prp_list_size,
+				 0x1000, &prp_bus_addr);
+	if (qpair->prp == NULL) {
+		nvme_printf(qpair->ctrlr, "alloc qpair_prp failed\n");
+		goto fail;
+	}
+	qpair->free_tr = calloc(num_trackers, sizeof(*qpair->free_tr));
+	if (qpair->free_tr == NULL) {
+		nvme_printf(qpair->ctrlr, "alloc qpair free_tr failed\n");
+		goto fail;
+	}
+
+	for (i = 0; i < num_trackers; i++) {
+		nvme_qpair_construct_tracker(&qpair->tr[i], i,
+					     qpair->prp + i * (qpair->prp_list_size / sizeof(uint64_t)),
+					     prp_bus_addr + i * qpair->prp_list_size);
+		/* Hand out trackers in cid order initially. */
+		qpair->free_tr[i] = num_trackers - 1 - i;
+	}
+	qpair->num_trackers = num_trackers;
+	qpair->num_free_tr = num_trackers;
+
+	return 0;
+fail:
+	nvme_qpair_destroy_trackers(qpair);
+	return -1;
 }
 
 int
@@ -493,18 +766,26 @@ nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
 		     uint16_t num_entries, uint16_t num_trackers,
 		     struct nvme_controller *ctrlr)
 {
-	struct nvme_tracker	*tr;
-	uint16_t		i;
 	volatile uint32_t	*doorbell_base;
-	uint64_t		phys_addr = 0;
 
 	nvme_assert(num_entries != 0, ("invalid num_entries\n"));
 	nvme_assert(num_trackers != 0, ("invalid num_trackers\n"));
 
 	qpair->id = id;
 	qpair->num_entries = num_entries;
+	qpair->cq_hdbl_batch = nvme_min(NVME_CQ_HDBL_BATCH, num_entries - 1);
+	if (qpair->cq_hdbl_batch == 0) {
+		qpair->cq_hdbl_batch = 1;
+	}
 
 	qpair->ctrlr = ctrlr;
+	qpair->tr = NULL;
+	qpair->prp = NULL;
+	qpair->free_tr = NULL;
+	qpair->num_trackers = 0;
+	qpair->num_free_tr = 0;
+	qpair->dsm_pages = NULL;
+	qpair->dsm_free_pages = 0;
 
 	/* cmd and cpl rings must be aligned on 4KB boundaries. */
 	qpair->cmd = nvme_malloc("qpair_cmd",
@@ -528,31 +809,26 @@ nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
 	qpair->sq_tdbl = doorbell_base + (2 * id + 0) * ctrlr->doorbell_stride_u32;
 	qpair->cq_hdbl = doorbell_base + (2 * id + 1) * ctrlr->doorbell_stride_u32;
 
-	LIST_INIT(&qpair->free_tr);
-	LIST_INIT(&qpair->outstanding_tr);
 	STAILQ_INIT(&qpair->queued_req);
+	qpair->num_queued_req = 0;
+	qpair->is_queue_limited = false;
+	qpair->is_slot_cb_pending = false;
+	qpair->slot_cb_fn = NULL;
+	qpair->slot_cb_arg = NULL;
 
-	for (i = 0; i < num_trackers; i++) {
-		/*
-		 * Round alignment up to next power of 2.  This ensures the PRP
-		 *  list embedded in the nvme_tracker object will not span a
-		 *  4KB boundary.
-		 */
-		tr = nvme_malloc("nvme_tr", sizeof(*tr), nvme_align32pow2(sizeof(*tr)), &phys_addr);
-		if (tr == NULL) {
-			nvme_printf(ctrlr, "nvme_tr failed\n");
-			goto fail;
-		}
-		nvme_qpair_construct_tracker(tr, i, phys_addr);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
-	}
-
-	qpair->act_tr = calloc(num_trackers, sizeof(struct nvme_tracker *));
-	if (qpair->act_tr == NULL) {
-		nvme_printf(ctrlr, "alloc nvme_act_tr failed\n");
+	if (nvme_qpair_construct_trackers(qpair, num_trackers) != 0) {
 		goto fail;
 	}
+
 	nvme_qpair_reset(qpair);
+
+	/*
+	 * I/O qpairs are only handed out once their queues exist on the
+	 *  controller, so they start out enabled.  The admin qpair is
+	 *  enabled by controller initialization.
+	 */
+	qpair->reset_seq = ctrlr->reset_seq;
+	qpair->is_enabled = nvme_qpair_is_io_queue(qpair);
 	return 0;
 fail:
 	nvme_qpair_destroy(qpair);
@@ -563,16 +839,14 @@ static void
 nvme_admin_qpair_abort_aers(struct nvme_qpair *qpair)
 {
 	struct nvme_tracker	*tr;
+	uint16_t		i;
 
-	tr = LIST_FIRST(&qpair->outstanding_tr);
-	while (tr != NULL) {
-		if (tr->req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST) {
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = nvme_qpair_get_active_tracker(qpair, i);
+		if (tr != NULL && tr->req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST) {
 			nvme_qpair_manual_complete_tracker(qpair, tr,
 							   NVME_SCT_GENERIC, NVME_SC_ABORTED_SQ_DELETION, 0,
 							   false);
-			tr = LIST_FIRST(&qpair->outstanding_tr);
-		} else {
-			tr = LIST_NEXT(tr, list);
 		}
 	}
 }
@@ -587,8 +861,6 @@ _nvme_admin_qpair_destroy(struct nvme_qpair *qpair)
 void
 nvme_qpair_destroy(struct nvme_qpair *qpair)
 {
-	struct nvme_tracker	*tr;
-
 	if (nvme_qpair_is_admin_queue(qpair)) {
 		_nvme_admin_qpair_destroy(qpair);
 	}
@@ -596,14 +868,15 @@ nvme_qpair_destroy(struct nvme_qpair *qpair)
 		nvme_free(qpair->cmd);
 	if (qpair->cpl)
 		nvme_free(qpair->cpl);
-	if (qpair->act_tr)
-		free(qpair->act_tr);
-
-	while (!LIST_EMPTY(&qpair->free_tr)) {
-		tr = LIST_FIRST(&qpair->free_tr);
-		LIST_REMOVE(tr, list);
-		nvme_free(tr);
-	}
+	nvme_qpair_destroy_trackers(qpair);
+	if (qpair->dsm_pages)
+		nvme_free(qpair->dsm_pages);
+
+	qpair->cmd = NULL;
+	qpair->cpl = NULL;
+	qpair->dsm_pages = NULL;
+	qpair->dsm_free_pages = 0;
+	qpair->is_enabled = false;
 }
 
 /**
@@ -619,23 +892,97 @@ nvme_qpair_destroy(struct nvme_qpair *qpair)
  */
 
 
-void
-nvme_qpair_submit_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+static inline void
+nvme_qpair_ring_sq_doorbell(struct nvme_qpair *qpair)
 {
-	struct nvme_request	*req;
+	qpair->sq_tdbl_pending = false;
+	wmb();
+	_nvme_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+}
 
-	req = tr->req;
-	qpair->act_tr[tr->cid] = tr;
+/*
+ * Place the tracker's command in the next submission queue slot without
+ *  notifying the controller.  Returns the command's fuse field.
+ */
+static inline uint8_t
+nvme_qpair_place_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	struct nvme_command	cmd;
 
-	/* Copy the command from the tracker to the submission queue. */
-	nvme_copy_command(&qpair->cmd[qpair->sq_tail], &req->cmd);
+	/*
+	 * Assemble the entry in registers and write it to the submission
+	 *  queue slot as whole cachelines.
+	 */
+	nvme_qpair_build_command(tr, &cmd);
+	nvme_copy_command(&qpair->cmd[qpair->sq_tail], &cmd);
+	tr->submit_seq = qpair->submit_seq++;
 
 	if (++qpair->sq_tail == qpair->num_entries) {
 		qpair->sq_tail = 0;
 	}
 
-	wmb();
-	_nvme_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+	return cmd.fuse;
+}
+
+/*
+ * Submit the tracker's command.  The first command of a fused pair brings
+ *  the second with it, since the controller requires the two in adjacent
+ *  slots and both must be visible by the time the doorbell is rung.
+ */
+void
+nvme_qpair_submit_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	if (nvme_qpair_place_tracker(qpair, tr) == NVME_CMD_FUSE_FIRST) {
+		nvme_qpair_place_tracker(qpair, &qpair->tr[tr->fused_cid]);
+	}
+
+	if (qpair->batch_depth == 0) {
+		nvme_qpair_ring_sq_doorbell(qpair);
+	} else {
+		qpair->sq_tdbl_pending = true;
+	}
+}
+
+/**
+ * \brief Start deferring submission queue tail doorbell writes on the qpair.
+ *
+ * Commands submitted until the matching nvme_qpair_batch_end() are placed
+ *  in the submission queue, but the controller is not notified until the
+ *  outermost batch ends, so N commands cost a single write barrier and
+ *  doorbell write.  Batches may nest.
+ *
+ * Since a qpair never has more commands outstanding than it has trackers,
+ *  and there are always fewer trackers than submission queue entries,
+ *  deferring the doorbell can never overflow the submission queue.
+ */
+void
+nvme_qpair_batch_begin(struct nvme_qpair *qpair)
+{
+	qpair->batch_depth++;
+}
+
+/**
+ * \brief End a batch started by nvme_qpair_batch_begin().
+ *
+ * If this ends the outermost batch, ring the tail doorbell once for every
+ *  command submitted while the batch was open.
+ */
+void
+nvme_qpair_batch_end(struct nvme_qpair *qpair)
+{
+	nvme_assert(qpair->batch_depth > 0, ("unbalanced nvme_qpair_batch_end\n"));
+
+	if (--qpair->batch_depth == 0 && qpair->sq_tdbl_pending) {
+		/*
+		 * A reset may have started since the commands were placed.  If
+		 *  so they stay on their trackers and are replayed once it is done.
+		 */
+		nvme_qpair_enter(qpair);
+		if (nvme_qpair_check_enabled(qpair) && qpair->sq_tdbl_pending) {
+			nvme_qpair_ring_sq_doorbell(qpair);
+		}
+		nvme_qpair_exit(qpair);
+	}
 }
 
 static void
@@ -657,31 +1004,281 @@ _nvme_fail_request_ctrlr_failed(struct nvme_qpair *qpair, struct nvme_request *r
 					   NVME_SC_ABORTED_BY_REQUEST, true);
 }
 
-void
-nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
+/*
+ * Write count PRP list entries for consecutive pages starting at
+ *  phys_addr, the first of them being list entry first.
+ */
+static void
+nvme_prp_list_fill(struct nvme_tracker *tr, uint32_t first, uint64_t phys_addr, uint32_t count)
 {
-	struct nvme_tracker	*tr;
-	struct nvme_request	*child_req;
-	uint64_t phys_addr;
-	void *seg_addr;
-	uint32_t nseg, cur_nseg, modulo, unaligned;
+	uint32_t	group, run, slot;
 
-	nvme_qpair_check_enabled(qpair);
+	while (count > 0) {
+		/* Entries up to the next chain entry occupy consecutive slots. */
+		group = first == 0 ? 0 : (first - 1) / (NVME_PRP_ENTRIES_PER_PAGE - 1);
+		run = nvme_min(count, (group + 1) * (NVME_PRP_ENTRIES_PER_PAGE - 1) + 1 - first);
+		slot = nvme_prp_list_slot(first);
 
-	if (req->num_children) {
-		/*
-		 * This is a split (parent) request. Submit all of the children but not the parent
-		 * request itself, since the parent is the original unsplit request.
-		 */
-		TAILQ_FOREACH(child_req, &req->children, child_tailq) {
-			nvme_qpair_submit_request(qpair, child_req);
+		if (group > 0 && first == group * (NVME_PRP_ENTRIES_PER_PAGE - 1) + 1) {
+			/*
+			 * The previous entry took the last slot of the
+			 *  previous page.  Move it to the start of this
+			 *  one and chain to this page from its old slot.
+			 */
+			tr->prp[slot - 1] = tr->prp[slot - 2];
+			tr->prp[slot - 2] = tr->prp_bus_addr + (slot - 1) * sizeof(uint64_t);
 		}
+
+		nvme_prp_fill(&tr->prp[slot], phys_addr, run);
+		first += run;
+		phys_addr += (uint64_t)run * PAGE_SIZE;
+		count -= run;
+	}
+}
+
+/*
+ * Append the pages of one virtually contiguous segment to the tracker's
+ *  PRP entries.  Entry 0 is PRP1; the rest go to the tracker's PRP list,
+ *  which holds at most max_entries.  Every entry but the first must start
+ *  on a page boundary.
+ *
+ * Translations are linear within an NVME_VTOPHYS_REGION_SIZE region, so
+ *  each region is translated once and its entries are filled in by
+ *  arithmetic.
+ */
+static int
+nvme_tracker_append_prps(struct nvme_tracker *tr, uint32_t *nprp, uint32_t max_entries,
+			 uintptr_t va, uint32_t len)
+{
+	uintptr_t	end = va + len;
+	uintptr_t	region_end, next;
+	uint64_t	phys_addr;
+	uint32_t	count;
+
+	if (*nprp > 0 && (va & (PAGE_SIZE - 1))) {
+		return EINVAL;
+	}
+
+	while (va < end) {
+		phys_addr = nvme_vtophys((void *)va);
+		if (phys_addr == NVME_VTOPHYS_ERROR) {
+			return EFAULT;
+		}
+		region_end = (va & ~((uintptr_t)NVME_VTOPHYS_REGION_SIZE - 1)) +
+			     NVME_VTOPHYS_REGION_SIZE;
+		region_end = nvme_min(region_end, end);
+
+		if (*nprp == 0) {
+			tr->dptr.prp.prp1 = phys_addr;
+			(*nprp)++;
+			next = (va + PAGE_SIZE) & ~((uintptr_t)PAGE_SIZE - 1);
+			phys_addr += next - va;
+			va = next;
+			if (va >= region_end) {
+				continue;
+			}
+		}
+
+		count = (region_end - va + PAGE_SIZE - 1) >> nvme_u32log2(PAGE_SIZE);
+		if (*nprp - 1 + count > max_entries) {
+			return EINVAL;
+		}
+		nvme_prp_list_fill(tr, *nprp - 1, phys_addr, count);
+		*nprp += count;
+		va = region_end;
+	}
+
+	return 0;
+}
+
+/*
+ * Build the PRP entries describing a request's payload, either one
+ *  contiguous buffer or a scatter list, into a tracker whose PRP list
+ *  holds max_entries.  The namespace layer only hands down scatter lists
+ *  that one PRP list can describe, so a failure here means a bad
+ *  translation or a malformed request.
+ */
+int
+nvme_tracker_build_prps(struct nvme_tracker *tr, struct nvme_request *req,
+			uint32_t max_entries)
+{
+	const struct iovec	*iov;
+	uint32_t		remaining = req->payload_size;
+	uint32_t		offset, len;
+	uint32_t		nprp = 0;
+	uintptr_t		va;
+	int			rc;
+
+	if (req->payload_type == NVME_PAYLOAD_TYPE_IOV) {
+		iov = req->u.iov;
+		offset = req->iov_offset;
+		while (remaining > 0) {
+			va = (uintptr_t)iov->iov_base + offset;
+			len = nvme_min(iov->iov_len - offset, remaining);
+			rc = nvme_tracker_append_prps(tr, &nprp, max_entries, va, len);
+			if (rc != 0) {
+				return rc;
+			}
+			remaining -= len;
+			if (remaining > 0 && ((va + len) & (PAGE_SIZE - 1))) {
+				return EINVAL;
+			}
+			iov++;
+			offset = 0;
+		}
+	} else {
+		rc = nvme_tracker_append_prps(tr, &nprp, max_entries, (uintptr_t)req->u.payload,
+					      remaining);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	if (nprp == 1) {
+		tr->dptr.prp.prp2 = 0;
+	} else if (nprp == 2) {
+		tr->dptr.prp.prp2 = tr->prp[0];
+	} else {
+		tr->dptr.prp.prp2 = (uint64_t)tr->prp_bus_addr;
+	}
+
+	return 0;
+}
+
+/*
+ * Build an SGL describing a scatter list payload: one data block
+ *  descriptor per physically contiguous run, translated a region at a
+ *  time as for PRPs, held in the command itself
+ *  if there is only one, or otherwise in the tracker's list as a last
+ *  segment.
+ */
+static int
+nvme_qpair_build_sgl(struct nvme_tracker *tr, struct nvme_request *req)
+{
+	struct nvme_sgl_descriptor	*sgl = (struct nvme_sgl_descriptor *)tr->prp;
+	const struct iovec		*iov = req->u.iov;
+	uint32_t			remaining = req->payload_size;
+	uint32_t			offset = req->iov_offset;
+	uint32_t			len, seg_len;
+	uint32_t			nsgl = 0;
+	uint64_t			phys_addr;
+	uintptr_t			va;
+
+	while (remaining > 0) {
+		va = (uintptr_t)iov->iov_base + offset;
+		len = nvme_min(iov->iov_len - offset, remaining);
+		remaining -= len;
+
+		while (len > 0) {
+			phys_addr = nvme_vtophys((void *)va);
+			if (phys_addr == NVME_VTOPHYS_ERROR) {
+				return EFAULT;
+			}
+			seg_len = nvme_min(len, NVME_VTOPHYS_REGION_SIZE -
+					   (va & (NVME_VTOPHYS_REGION_SIZE - 1)));
+
+			if (nsgl > 0 && sgl[nsgl - 1].address + sgl[nsgl - 1].length == phys_addr) {
+				sgl[nsgl - 1].length += seg_len;
+			} else {
+				if (nsgl == NVME_MAX_SGL_DESCRIPTORS) {
+					return EINVAL;
+				}
+				memset(&sgl[nsgl], 0, sizeof(sgl[nsgl]));
+				sgl[nsgl].address = phys_addr;
+				sgl[nsgl].length = seg_len;
+				sgl[nsgl].type = NVME_SGL_TYPE_DATA_BLOCK;
+				nsgl++;
+			}
+
+			va += seg_len;
+			len -= seg_len;
+		}
+
+		iov++;
+		offset = 0;
+	}
+
+	if (nsgl == 1) {
+		tr->dptr.sgl1 = sgl[0];
+	} else {
+		memset(&tr->dptr.sgl1, 0, sizeof(tr->dptr.sgl1));
+		tr->dptr.sgl1.address = tr->prp_bus_addr;
+		tr->dptr.sgl1.length = nsgl * sizeof(*sgl);
+		tr->dptr.sgl1.type = NVME_SGL_TYPE_LAST_SEGMENT;
+	}
+
+	return 0;
+}
+
+static inline int
+nvme_qpair_build_payload(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	struct nvme_request *req = tr->req;
+
+	if (req->payload_size == 0) {
+		return 0;
+	}
+
+	if (req->has_md) {
+		tr->mptr = 0;
+		if (req->md != NULL) {
+			tr->mptr = nvme_vtophys(req->md);
+			if (tr->mptr == NVME_VTOPHYS_ERROR) {
+				return EFAULT;
+			}
+		}
+	}
+
+	return req->use_sgl ? nvme_qpair_build_sgl(tr, req) :
+	       nvme_tracker_build_prps(tr, req, qpair->prp_list_entries);
+}
+
+/*
+ * Submit both commands of a fused pair, given the first.  Both trackers
+ *  are taken and both payloads built before either command is placed, so
+ *  the pair is only ever submitted whole.
+ */
+static void
+nvme_qpair_submit_fused(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	struct nvme_tracker	*tr, *fused_tr;
+	int			rc;
+
+	tr = &qpair->tr[qpair->free_tr[--qpair->num_free_tr]];
+	tr->req = req;
+	fused_tr = &qpair->tr[qpair->free_tr[--qpair->num_free_tr]];
+	fused_tr->req = req->fused_next;
+	tr->fused_cid = fused_tr->cid;
+
+	rc = nvme_qpair_build_payload(qpair, tr);
+	if (rc == 0) {
+		rc = nvme_qpair_build_payload(qpair, fused_tr);
+	}
+	if (rc != 0) {
+		_nvme_fail_request_bad_vtophys(qpair, tr);
+		_nvme_fail_request_bad_vtophys(qpair, fused_tr);
 		return;
 	}
 
-	tr = LIST_FIRST(&qpair->free_tr);
+	nvme_qpair_submit_tracker(qpair, tr);
+}
+
+static void
+_nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	struct nvme_tracker	*tr;
+	uint32_t		num_tr;
+	int			rc;
+
+	nvme_qpair_check_enabled(qpair);
+
+	nvme_assert(!req->is_split, ("split requests submit their children instead\n"));
+	nvme_assert(nvme_request_fuse(req) != NVME_CMD_FUSE_SECOND,
+		    ("fused pairs are submitted by their first command\n"));
+
+	num_tr = nvme_request_fuse(req) == NVME_CMD_FUSE_FIRST ? 2 : 1;
 
-	if (tr == NULL || !qpair->is_enabled) {
+	if (qpair->num_free_tr < num_tr || !qpair->is_enabled) {
 		/*
 		 * No tracker is available, or the qpair is disabled due to
 		 *  an in-progress controller-level reset or controller
@@ -698,60 +1295,41 @@ nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
 			 *  completed.
 			 */
 			STAILQ_INSERT_TAIL(&qpair->queued_req, req, stailq);
+			qpair->num_queued_req++;
 		}
 		return;
 	}
 
-	LIST_REMOVE(tr, list); /* remove tr from free_tr */
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
-	tr->req = req;
-	req->cmd.cid = tr->cid;
-
-	if (req->payload_size) {
-		/*
-		 * Build PRP list describing payload buffer.
-		 */
+	if (num_tr > 1) {
+		nvme_qpair_submit_fused(qpair, req);
+		return;
+	}
 
-		phys_addr = nvme_vtophys(req->u.payload);
-		if (phys_addr == NVME_VTOPHYS_ERROR) {
-			_nvme_fail_request_bad_vtophys(qpair, tr);
-			return;
-		}
-		nseg = req->payload_size >> nvme_u32log2(PAGE_SIZE);
-		modulo = req->payload_size & (PAGE_SIZE - 1);
-		unaligned = phys_addr & (PAGE_SIZE - 1);
-		if (modulo || unaligned) {
-			nseg += 1 + ((modulo + unaligned - 1) >> nvme_u32log2(PAGE_SIZE));
-		}
+	tr = &qpair->tr[qpair->free_tr[--qpair->num_free_tr]];
+	tr->req = req;
 
-		tr->req->cmd.psdt = NVME_PSDT_PRP;
-		tr->req->cmd.dptr.prp.prp1 = phys_addr;
-		if (nseg == 2) {
-			seg_addr = req->u.payload + PAGE_SIZE - unaligned;
-			tr->req->cmd.dptr.prp.prp2 = nvme_vtophys(seg_addr);
-		} else if (nseg > 2) {
-			cur_nseg = 1;
-			tr->req->cmd.dptr.prp.prp2 = (uint64_t)tr->prp_bus_addr;
-			while (cur_nseg < nseg) {
-				seg_addr = req->u.payload + cur_nseg * PAGE_SIZE - unaligned;
-				phys_addr = nvme_vtophys(seg_addr);
-				if (phys_addr == NVME_VTOPHYS_ERROR) {
-					_nvme_fail_request_bad_vtophys(qpair, tr);
-					return;
-				}
-				tr->prp[cur_nseg - 1] = phys_addr;
-				cur_nseg++;
-			}
-		}
+	rc = nvme_qpair_build_payload(qpair, tr);
+	if (rc != 0) {
+		_nvme_fail_request_bad_vtophys(qpair, tr);
+		return;
 	}
 
 	nvme_qpair_submit_tracker(qpair, tr);
 }
 
+void
+nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	nvme_qpair_enter(qpair);
+	_nvme_qpair_submit_request(qpair, req);
+	nvme_qpair_exit(qpair);
+}
+
 void
 nvme_qpair_reset(struct nvme_qpair *qpair)
 {
 	qpair->sq_tail = qpair->cq_head = 0;
+	qpair->sq_tdbl_pending = false;
 
 	/*
 	 * First time through the completion queue, HW will set phase
@@ -772,7 +1350,7 @@ static void
 _nvme_admin_qpair_enable(struct nvme_qpair *qpair)
 {
 	struct nvme_tracker		*tr;
-	struct nvme_tracker		*tr_temp;
+	uint16_t			i;
 
 	/*
 	 * Manually abort each outstanding admin command.  Do not retry
@@ -780,7 +1358,11 @@ _nvme_admin_qpair_enable(struct nvme_qpair *qpair)
 	 *  a controller reset and its likely the context in which the
 	 *  command was issued no longer applies.
 	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = nvme_qpair_get_active_tracker(qpair, i);
+		if (tr == NULL) {
+			continue;
+		}
 		nvme_printf(qpair->ctrlr,
 			    "aborting outstanding admin command\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
@@ -791,39 +1373,29 @@ _nvme_admin_qpair_enable(struct nvme_qpair *qpair)
 }
 
 static void
-_nvme_io_qpair_enable(struct nvme_qpair *qpair)
+nvme_io_qpair_resubmit_queued(struct nvme_qpair *qpair)
 {
 	STAILQ_HEAD(, nvme_request)	temp;
-	struct nvme_tracker		*tr;
-	struct nvme_tracker		*tr_temp;
 	struct nvme_request		*req;
 
-	/*
-	 * Manually abort each outstanding I/O.  This normally results in a
-	 *  retry, unless the retry count on the associated request has
-	 *  reached its limit.
-	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
-		nvme_printf(qpair->ctrlr, "aborting outstanding i/o\n");
-		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
-						   NVME_SC_ABORTED_BY_REQUEST, 0, true);
-	}
-
-	qpair->is_enabled = true;
-
 	STAILQ_INIT(&temp);
 	STAILQ_SWAP(&qpair->queued_req, &temp, nvme_request);
+	qpair->num_queued_req = 0;
 
 	while (!STAILQ_EMPTY(&temp)) {
 		req = STAILQ_FIRST(&temp);
 		STAILQ_REMOVE_HEAD(&temp, stailq);
-
-		nvme_printf(qpair->ctrlr, "resubmitting queued i/o\n");
-		nvme_qpair_print_command(qpair, &req->cmd);
 		nvme_qpair_submit_request(qpair, req);
 	}
 }
 
+static void
+_nvme_io_qpair_enable(struct nvme_qpair *qpair)
+{
+	qpair->is_enabled = true;
+	nvme_io_qpair_resubmit_queued(qpair);
+}
+
 void
 nvme_qpair_enable(struct nvme_qpair *qpair)
 {
@@ -862,25 +1434,208 @@ nvme_qpair_fail(struct nvme_qpair *qpair)
 {
 	struct nvme_tracker		*tr;
 	struct nvme_request		*req;
+	uint16_t			i;
 
 	while (!STAILQ_EMPTY(&qpair->queued_req)) {
 		req = STAILQ_FIRST(&qpair->queued_req);
 		STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+		qpair->num_queued_req--;
 		nvme_printf(qpair->ctrlr, "failing queued i/o\n");
 		nvme_qpair_manual_complete_request(qpair, req, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST, true);
 	}
 
-	/* Manually abort each outstanding I/O. */
-	while (!LIST_EMPTY(&qpair->outstanding_tr)) {
-		tr = LIST_FIRST(&qpair->outstanding_tr);
-		/*
-		 * Do not remove the tracker.  The abort_tracker path will
-		 *  do that for us.
-		 */
-		nvme_printf(qpair->ctrlr, "failing outstanding i/o\n");
-		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
-						   NVME_SC_ABORTED_BY_REQUEST, 1 /* do not retry */, true);
+	/*
+	 * Manually abort each outstanding I/O.  Completion callbacks may
+	 *  submit new I/O, so keep scanning until every tracker is free.
+	 */
+	while (qpair->num_free_tr < qpair->num_trackers) {
+		for (i = 0; i < qpair->num_trackers; i++) {
+			tr = nvme_qpair_get_active_tracker(qpair, i);
+			if (tr == NULL) {
+				continue;
+			}
+			/*
+			 * Do not free the tracker.  The complete_tracker path
+			 *  will do that for us.
+			 */
+			nvme_printf(qpair->ctrlr, "failing outstanding i/o\n");
+			nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
+							   NVME_SC_ABORTED_BY_REQUEST, 1 /* do not retry */, true);
+		}
+	}
+}
+
+/*
+ * The controller has started a reset.  Stop submitting to the old queues
+ *  and let the reset know this qpair is out of its way.  Commands already
+ *  outstanding stay on their trackers until the reset finishes.
+ */
+static void
+nvme_io_qpair_quiesce(struct nvme_qpair *qpair, uint32_t reset_seq)
+{
+	qpair->is_enabled = false;
+	if (qpair->stall_start_tsc == 0) {
+		qpair->stall_start_tsc = nvme_get_tsc();
+	}
+
+	wmb();
+	qpair->reset_seq = reset_seq;
+}
+
+static int
+nvme_io_qpair_tracker_cmp(const void *a, const void *b)
+{
+	const struct nvme_tracker *tr_a = *(struct nvme_tracker * const *)a;
+	const struct nvme_tracker *tr_b = *(struct nvme_tracker * const *)b;
+
+	/* submit_seq wraps, so compare the signed distance between the two. */
+	return (int32_t)(tr_a->submit_seq - tr_b->submit_seq);
+}
+
+/*
+ * Resubmit every command that was outstanding when the controller reset,
+ *  oldest first, followed by anything queued while the qpair was quiesced.
+ *  Falls back to cid order if there is no memory to sort with.  The second
+ *  command of a fused pair is resubmitted along with the first.
+ */
+static void
+nvme_io_qpair_replay(struct nvme_qpair *qpair)
+{
+	struct nvme_tracker	**active;
+	struct nvme_tracker	*tr;
+	uint16_t		i, num_active = 0;
+	uint32_t		num_replayed = 0;
+
+	active = calloc(qpair->num_trackers, sizeof(*active));
+
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = nvme_qpair_get_active_tracker(qpair, i);
+		if (tr == NULL) {
+			continue;
+		}
+		num_replayed++;
+		if (nvme_request_fuse(tr->req) == NVME_CMD_FUSE_SECOND) {
+			continue;
+		}
+		if (active != NULL) {
+			active[num_active] = tr;
+		}
+		num_active++;
 	}
+
+	nvme_qpair_reset(qpair);
+	qpair->is_enabled = true;
+
+	if (active != NULL) {
+		qsort(active, num_active, sizeof(*active), nvme_io_qpair_tracker_cmp);
+		for (i = 0; i < num_active; i++) {
+			nvme_qpair_submit_tracker(qpair, active[i]);
+		}
+		free(active);
+	} else {
+		for (i = 0; i < qpair->num_trackers; i++) {
+			tr = nvme_qpair_get_active_tracker(qpair, i);
+			if (tr != NULL &&
+			    nvme_request_fuse(tr->req) != NVME_CMD_FUSE_SECOND) {
+				nvme_qpair_submit_tracker(qpair, tr);
+			}
+		}
+	}
+
+	qpair->reset_stats.num_replayed += num_replayed;
+
+	nvme_io_qpair_resubmit_queued(qpair);
+}
+
+/*
+ * The controller has finished a reset and recreated this qpair's queues,
+ *  which are empty.  Complete whatever the controller posted before the
+ *  reset, then replay the rest onto the new queues.
+ */
+static void
+nvme_io_qpair_resume(struct nvme_qpair *qpair, uint32_t reset_seq)
+{
+	uint64_t stall_ticks = 0;
+
+	/* Set first: completion callbacks below come back through check_enabled. */
+	qpair->reset_seq = reset_seq;
+	qpair->is_enabled = false;
+
+	nvme_qpair_batch_begin(qpair);
+
+	_nvme_qpair_process_completions(qpair, 0, false);
+
+	if (qpair->ctrlr->is_failed) {
+		nvme_qpair_fail(qpair);
+	} else {
+		nvme_io_qpair_replay(qpair);
+	}
+
+	nvme_qpair_batch_end(qpair);
+
+	if (qpair->stall_start_tsc != 0) {
+		stall_ticks = nvme_get_tsc() - qpair->stall_start_tsc;
+		qpair->stall_start_tsc = 0;
+	}
+	qpair->reset_stats.num_resets++;
+	qpair->reset_stats.stall_ticks += stall_ticks;
+	qpair->reset_stats.max_stall_ticks = nvme_max(qpair->reset_stats.max_stall_ticks,
+					     stall_ticks);
 }
 
+static void
+nvme_io_qpair_follow_reset(struct nvme_qpair *qpair)
+{
+	uint32_t reset_seq = qpair->ctrlr->reset_seq;
+
+	rmb();
+
+	if (reset_seq & 1) {
+		nvme_io_qpair_quiesce(qpair, reset_seq);
+	} else {
+		nvme_io_qpair_resume(qpair, reset_seq);
+	}
+}
+
+void
+nvme_qpair_get_reset_stats(struct nvme_qpair *qpair, struct nvme_qpair_reset_stats *stats)
+{
+	uint64_t hz = nvme_get_tsc_hz();
+
+	stats->num_resets = qpair->reset_stats.num_resets;
+	stats->num_replayed = qpair->reset_stats.num_replayed;
+	stats->stall_us = qpair->reset_stats.stall_ticks * 1000000 / hz;
+	stats->max_stall_us = qpair->reset_stats.max_stall_ticks * 1000000 / hz;
+}
+
+void
+nvme_qpair_get_split_stats(struct nvme_qpair *qpair, struct nvme_qpair_split_stats *stats)
+{
+	stats->num_split_ios = qpair->split_stats.num_split_ios;
+	stats->num_split_cmds = qpair->split_stats.num_split_cmds;
+	stats->num_boundary_splits = qpair->split_stats.num_boundary_splits;
+}
+
+void
+nvme_qpair_set_queue_limit(struct nvme_qpair *qpair, uint32_t max_queued,
+			   nvme_qpair_slot_cb_fn_t cb_fn, void *cb_arg)
+{
+	qpair->is_queue_limited = (max_queued != NVME_QPAIR_QUEUE_UNLIMITED);
+	qpair->max_queued_req = max_queued;
+	qpair->slot_cb_fn = cb_fn;
+	qpair->slot_cb_arg = cb_arg;
+	qpair->is_slot_cb_pending = false;
+}
+
+uint32_t
+nvme_qpair_get_num_free_trackers(struct nvme_qpair *qpair)
+{
+	return qpair->is_enabled ? qpair->num_free_tr : 0;
+}
+
+uint32_t
+nvme_qpair_get_num_queued_requests(struct nvme_qpair *qpair)
+{
+	return qpair->num_queued_req;
+}
@@ -4,14 +4,11 @@
 
 #include <rte_config.h>
 #include <rte_malloc.h>
-#include <rte_mempool.h>
 #include <rte_lcore.h>
 
 #include "omnios/nvme.h"
 #include "omnios/pci.h"
 
-struct rte_mempool *request_mempool;
-
 #define MAX_DEVS 64
 
 struct dev {
@@ -166,16 +163,6 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	request_mempool = rte_mempool_create("nvme_request", 8192,
-					     nvme_request_size(), 128, 0,
-					     NULL, NULL, NULL, NULL,
-					     SOCKET_ID_ANY, 0);
-
-	if (request_mempool == NULL) {
-		fprintf(stderr, "could not initialize request mempool\n");
-		exit(1);
-	}
-
 	pci_system_init();
 
 	match.vendor_id =	PCI_MATCH_ANY;
@@ -12,8 +12,14 @@ $testdir/unit/nvme_c/nvme_ut
 $valgrind $testdir/unit/nvme_qpair_c/nvme_qpair_ut
 $valgrind $testdir/unit/nvme_ctrlr_c/nvme_ctrlr_ut
 $valgrind $testdir/unit/nvme_ctrlr_cmd_c/nvme_ctrlr_cmd_ut
+$valgrind $testdir/unit/nvme_dif_c/nvme_dif_ut
 timing_exit unit
 
+timing_enter prp_perf
+$testdir/prp_perf/prp_perf -n 100000
+process_core
+timing_exit prp_perf
+
 timing_enter aer
 $testdir/aer/aer
 process_core
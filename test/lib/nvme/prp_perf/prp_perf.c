@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rte_config.h>
+#include <rte_eal.h>
+#include <rte_cycles.h>
+#include <rte_malloc.h>
+
+#include "nvme_impl.h"
+#include "nvme_internal.h"
+
+/*
+ * Compare the cost of building the PRP entries for one I/O by translating
+ *  every page with vtophys(), as the driver used to, against the driver's
+ *  own builder, which translates once per NVME_VTOPHYS_REGION_SIZE region
+ *  and fills in the entries by arithmetic.
+ */
+
+#define NUM_BUFS	(256)
+
+static const char *ealargs[] = {
+	"prp_perf",
+	"-c 0x1",
+	"-n 4",
+};
+
+static uint32_t g_io_size = 128 * 1024;
+static uint32_t g_offset;
+static uint64_t g_iterations = 1000000;
+
+static struct nvme_tracker g_tr;
+static uint32_t g_max_entries;
+
+static uint32_t
+build_per_page(uint64_t *prp, uintptr_t va, uint32_t len)
+{
+	uintptr_t	end = va + len;
+	uint32_t	n = 0;
+
+	while (va < end) {
+		prp[n++] = vtophys((void *)va);
+		va = (va + PAGE_SIZE) & ~((uintptr_t)PAGE_SIZE - 1);
+	}
+
+	return n;
+}
+
+static void
+build_driver(void *buf, uint32_t len)
+{
+	struct nvme_request	req;
+
+	req.u.payload = buf;
+	req.payload_size = len;
+	req.payload_type = NVME_PAYLOAD_TYPE_CONTIG;
+	if (nvme_tracker_build_prps(&g_tr, &req, g_max_entries) != 0) {
+		fprintf(stderr, "nvme_tracker_build_prps failed\n");
+		exit(1);
+	}
+}
+
+/*
+ * Walk the tracker's PRP entries as the controller would, following the
+ *  chain entry at the end of each full list page, into a flat array.
+ *  Returns false if a chain entry does not point to the next slot.
+ */
+static bool
+flatten_driver_prps(uint64_t *prp, uint32_t n)
+{
+	uint32_t	i, slot = 0;
+
+	prp[0] = g_tr.dptr.prp.prp1;
+	if (n == 2) {
+		prp[1] = g_tr.dptr.prp.prp2;
+		return true;
+	} else if (n > 2 && g_tr.dptr.prp.prp2 != g_tr.prp_bus_addr) {
+		return false;
+	}
+
+	for (i = 1; i < n; i++) {
+		if (slot % NVME_PRP_ENTRIES_PER_PAGE == NVME_PRP_ENTRIES_PER_PAGE - 1 && i < n - 1) {
+			if (g_tr.prp[slot] != g_tr.prp_bus_addr + (slot + 1) * sizeof(uint64_t)) {
+				return false;
+			}
+			slot++;
+		}
+		prp[i] = g_tr.prp[slot++];
+	}
+
+	return true;
+}
+
+static uint64_t
+run_per_page(uint8_t **bufs, uint64_t *prp)
+{
+	uint64_t	start, ticks, i;
+	uint64_t	n = 0;
+
+	start = rte_rdtsc();
+	for (i = 0; i < g_iterations; i++) {
+		n += build_per_page(prp, (uintptr_t)bufs[i % NUM_BUFS] + g_offset, g_io_size);
+	}
+	ticks = rte_rdtsc() - start;
+
+	printf("%-12s %8.1f cycles per I/O (%u entries)\n", "per page",
+	       (double)ticks / g_iterations, (uint32_t)(n / g_iterations));
+	return ticks;
+}
+
+static uint64_t
+run_driver(uint8_t **bufs)
+{
+	uint64_t	start, ticks, i;
+
+	start = rte_rdtsc();
+	for (i = 0; i < g_iterations; i++) {
+		build_driver(bufs[i % NUM_BUFS] + g_offset, g_io_size);
+	}
+	ticks = rte_rdtsc() - start;
+
+	printf("%-12s %8.1f cycles per I/O\n", "driver",
+	       (double)ticks / g_iterations);
+	return ticks;
+}
+
+static void
+usage(char *program_name)
+{
+	printf("%s options\n", program_name);
+	printf("\t[-s io size in bytes (default 131072)]\n");
+	printf("\t[-o offset of each I/O into its page (default 0)]\n");
+	printf("\t[-n number of I/O to build (default 1000000)]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	uint8_t		*bufs[NUM_BUFS];
+	uint64_t	*prp, *check;
+	uint32_t	i, n;
+	int		op, rc;
+
+	while ((op = getopt(argc, argv, "s:o:n:")) != -1) {
+		switch (op) {
+		case 's':
+			g_io_size = atoi(optarg);
+			break;
+		case 'o':
+			g_offset = atoi(optarg);
+			break;
+		case 'n':
+			g_iterations = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (g_io_size == 0 || g_offset >= PAGE_SIZE || g_iterations == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rc = rte_eal_init(sizeof(ealargs) / sizeof(ealargs[0]),
+			  (char **)(void *)(uintptr_t)ealargs);
+	if (rc < 0) {
+		fprintf(stderr, "could not init eal\n");
+		return 1;
+	}
+
+	for (i = 0; i < NUM_BUFS; i++) {
+		bufs[i] = rte_malloc(NULL, g_io_size + g_offset, PAGE_SIZE);
+		if (bufs[i] == NULL) {
+			fprintf(stderr, "buffer allocation failed\n");
+			return 1;
+		}
+	}
+
+	/* A PRP list holds every entry but PRP1, plus a chain entry per full page. */
+	g_max_entries = g_io_size / PAGE_SIZE + 1;
+	n = g_max_entries + g_max_entries / (NVME_PRP_ENTRIES_PER_PAGE - 1) + 1;
+	g_tr.prp = rte_malloc(NULL, n * sizeof(uint64_t), PAGE_SIZE);
+	prp = rte_malloc(NULL, (g_max_entries + 1) * sizeof(*prp), 64);
+	check = rte_malloc(NULL, (g_max_entries + 1) * sizeof(*check), 64);
+	if (g_tr.prp == NULL || prp == NULL || check == NULL) {
+		fprintf(stderr, "PRP list allocation failed\n");
+		return 1;
+	}
+	g_tr.prp_bus_addr = vtophys(g_tr.prp);
+
+	/* Both builders must produce the same entries. */
+	for (i = 0; i < NUM_BUFS; i++) {
+		n = build_per_page(check, (uintptr_t)bufs[i] + g_offset, g_io_size);
+		build_driver(bufs[i] + g_offset, g_io_size);
+		if (!flatten_driver_prps(prp, n) ||
+		    memcmp(prp, check, n * sizeof(*prp)) != 0) {
+			fprintf(stderr, "PRP entries differ for buffer %u\n", i);
+			return 1;
+		}
+	}
+
+	printf("%u byte I/O at page offset %u, %ju iterations\n", g_io_size, g_offset,
+	       (uintmax_t)g_iterations);
+	run_per_page(bufs, prp);
+	run_driver(bufs);
+
+	return 0;
+}
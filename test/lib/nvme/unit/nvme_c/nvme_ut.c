@@ -47,13 +47,8 @@ uint64_t nvme_vtophys(void *buf)
 }
 
 int
-nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr)
-{
-	return 0;
-}
-
-int
-nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
+nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+		     const struct nvme_ctrlr_opts *opts, void *devhandle)
 {
 	return 0;
 }
@@ -163,6 +158,116 @@ test2(void)
 	CU_ASSERT(threads_fail == 4);
 }
 
+static void
+test_nvme_request_cache(void)
+{
+	struct nvme_request_cache	*cache = &nvme_thread_request_cache;
+	struct nvme_request		*req[NVME_REQUEST_CACHE_MIN_SIZE + 1];
+	struct nvme_request		*last;
+	uint32_t			i;
+
+	/* The first allocation creates the pool and refills half a cache. */
+	req[0] = nvme_allocate_request(NULL, 0, NULL, NULL);
+	CU_ASSERT_FATAL(req[0] != NULL);
+	CU_ASSERT(g_nvme_driver.num_request_pools == 1);
+	CU_ASSERT(g_nvme_driver.request_pool_size == NVME_REQUEST_POOL_MIN_SIZE);
+	CU_ASSERT(req[0]->pool == g_nvme_driver.request_pools[0]);
+	CU_ASSERT(cache->size == NVME_REQUEST_CACHE_MIN_SIZE);
+	CU_ASSERT(cache->count == NVME_REQUEST_CACHE_MIN_SIZE / 2 - 1);
+
+	/* The most recently freed request is handed out next. */
+	last = req[0];
+	nvme_free_request(req[0]);
+	req[0] = nvme_allocate_request(NULL, 0, NULL, NULL);
+	CU_ASSERT(req[0] == last);
+
+	for (i = 1; i <= NVME_REQUEST_CACHE_MIN_SIZE; i++) {
+		req[i] = nvme_allocate_request(NULL, 0, NULL, NULL);
+		CU_ASSERT_FATAL(req[i] != NULL);
+	}
+	CU_ASSERT(cache->count == NVME_REQUEST_CACHE_MIN_SIZE / 2 - 1);
+
+	/* Freeing into a full cache drains half of it back to the pool. */
+	for (i = 0; i <= NVME_REQUEST_CACHE_MIN_SIZE; i++) {
+		nvme_free_request(req[i]);
+		CU_ASSERT(cache->count <= cache->size);
+	}
+	CU_ASSERT(cache->count == NVME_REQUEST_CACHE_MIN_SIZE);
+
+	/* The cache grows to the qpair depth, within bounds, and never shrinks. */
+	nvme_request_cache_reserve(256);
+	CU_ASSERT(cache->size == 256);
+	nvme_request_cache_reserve(1);
+	CU_ASSERT(cache->size == 256);
+	nvme_request_cache_reserve(NVME_REQUEST_CACHE_MAX_SIZE * 2);
+	CU_ASSERT(cache->size == NVME_REQUEST_CACHE_MAX_SIZE);
+	CU_ASSERT(cache->count == NVME_REQUEST_CACHE_MIN_SIZE);
+
+	/* Unregistering the thread returns everything to the pool. */
+	prepare_for_test(1);
+	CU_ASSERT(nvme_register_io_thread() == 0);
+	nvme_unregister_io_thread();
+	CU_ASSERT(cache->count == 0);
+	CU_ASSERT(cache->size == 0);
+	CU_ASSERT(cache->reqs == NULL);
+}
+
+static void
+test_nvme_request_pool_reserve(void)
+{
+	struct nvme_driver	*driver = &g_nvme_driver;
+	uint32_t		size = driver->request_pool_size;
+
+	CU_ASSERT_FATAL(driver->num_request_pools == 1);
+	CU_ASSERT_FATAL(driver->num_reserved_requests == 0);
+
+	/* The pool grows by at least its own size for qpairs that need more. */
+	CU_ASSERT(nvme_request_pool_reserve(1024) == 0);
+	CU_ASSERT(driver->num_request_pools == 2);
+	CU_ASSERT(driver->request_pool_size == NVME_REQUEST_POOL_MIN_SIZE +
+		  1024 * NVME_REQUESTS_PER_TRACKER);
+	CU_ASSERT(driver->request_pool_size >= 2 * size);
+
+	size = driver->request_pool_size;
+	CU_ASSERT(nvme_request_pool_reserve(1) == 0);
+	CU_ASSERT(driver->num_request_pools == 3);
+	CU_ASSERT(driver->request_pool_size == 2 * size);
+
+	/* Room released by destroyed qpairs is reused rather than added to. */
+	nvme_request_pool_unreserve(1);
+	nvme_request_pool_unreserve(1024);
+	CU_ASSERT(driver->num_reserved_requests == 0);
+	CU_ASSERT(nvme_request_pool_reserve(2048) == 0);
+	CU_ASSERT(driver->num_request_pools == 3);
+	nvme_request_pool_unreserve(2048);
+}
+
+static void *
+nvme_request_thread(void *arg)
+{
+	struct nvme_request *req;
+
+	req = nvme_allocate_request(NULL, 0, NULL, NULL);
+	if (req != NULL) {
+		nvme_free_request(req);
+	}
+
+	return req;
+}
+
+static void
+test_nvme_request_cache_thread_exit(void)
+{
+	pthread_t	td;
+	void		*req = NULL;
+	int		num_out = *nvme_ut_request_pool_num_out();
+
+	/* A thread's cached requests go back to the pool when it exits. */
+	CU_ASSERT_FATAL(pthread_create(&td, NULL, nvme_request_thread, NULL) == 0);
+	CU_ASSERT(pthread_join(td, &req) == 0);
+	CU_ASSERT(req != NULL);
+	CU_ASSERT(*nvme_ut_request_pool_num_out() == num_out);
+}
 
 int main(int argc, char **argv)
 {
@@ -182,6 +287,10 @@ int main(int argc, char **argv)
 	if (
 		CU_add_test(suite, "test1", test1) == NULL
 		|| CU_add_test(suite, "test2", test2) == NULL
+		|| CU_add_test(suite, "request_cache", test_nvme_request_cache) == NULL
+		|| CU_add_test(suite, "request_pool_reserve", test_nvme_request_pool_reserve) == NULL
+		|| CU_add_test(suite, "request_cache_thread_exit",
+				  test_nvme_request_cache_thread_exit) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -44,18 +44,68 @@ char outbuf[OUTBUF_SIZE];
 
 __thread int    nvme_thread_ioq_index = -1;
 
+static struct nvme_command g_ut_ring;
+static uint32_t g_ut_num_created;
+static uint32_t g_ut_num_deleted;
+static bool g_ut_fail_create_sq;
+static uint16_t g_ut_fail_create_sq_id;
+
+/* I/O queues Set Features - Number of Queues grants, and the count it was last asked for. */
+static uint32_t g_ut_num_queues_granted = 4;
+static uint32_t g_ut_num_queues_requested;
+
+/* When set, admin commands complete from nvme_qpair_process_completions(). */
+static bool g_ut_defer_admin;
+static struct {
+	nvme_cb_fn_t	cb_fn;
+	void		*cb_arg;
+	bool		fail;
+} g_ut_deferred[64];
+static uint32_t g_ut_num_deferred;
+
 int nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
 			 uint16_t num_entries, uint16_t num_trackers,
 			 struct nvme_controller *ctrlr)
 {
+	qpair->id = id;
+	qpair->ctrlr = ctrlr;
+	qpair->num_entries = num_entries;
+	qpair->num_trackers = num_trackers;
+	qpair->num_free_tr = num_trackers;
+	qpair->cmd = &g_ut_ring;
+	qpair->reset_seq = ctrlr->reset_seq;
 	return 0;
 }
 
+void
+nvme_ctrlr_opts_set_defaults(struct nvme_ctrlr_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->io_queue_size = NVME_IO_ENTRIES;
+	opts->io_queue_requests = NVME_IO_TRACKERS;
+}
+
 void
 nvme_qpair_fail(struct nvme_qpair *qpair)
 {
 }
 
+void
+nvme_request_cache_reserve(uint32_t num_requests)
+{
+}
+
+int
+nvme_request_pool_reserve(uint32_t num_trackers)
+{
+	return 0;
+}
+
+void
+nvme_request_pool_unreserve(uint32_t num_trackers)
+{
+}
+
 void
 nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
 {
@@ -64,6 +114,28 @@ nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
 
 void
 nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions)
+{
+	struct nvme_completion	cpl;
+	uint32_t		i, num = g_ut_num_deferred;
+
+	g_ut_num_deferred = 0;
+	for (i = 0; i < num; i++) {
+		memset(&cpl, 0, sizeof(cpl));
+		if (g_ut_deferred[i].fail) {
+			cpl.status.sct = NVME_SCT_GENERIC;
+			cpl.status.sc = NVME_SC_INTERNAL_DEVICE_ERROR;
+		}
+		g_ut_deferred[i].cb_fn(g_ut_deferred[i].cb_arg, &cpl);
+	}
+}
+
+void
+nvme_qpair_batch_begin(struct nvme_qpair *qpair)
+{
+}
+
+void
+nvme_qpair_batch_end(struct nvme_qpair *qpair)
 {
 }
 
@@ -75,6 +147,9 @@ nvme_qpair_disable(struct nvme_qpair *qpair)
 void
 nvme_qpair_destroy(struct nvme_qpair *qpair)
 {
+	qpair->cmd = NULL;
+	qpair->num_trackers = 0;
+	qpair->num_free_tr = 0;
 }
 
 void
@@ -90,6 +165,31 @@ nvme_qpair_reset(struct nvme_qpair *qpair)
 void
 nvme_completion_poll_cb(void *arg, const struct nvme_completion *cpl)
 {
+	struct nvme_completion_poll_status	*status = arg;
+
+	memcpy(&status->cpl, cpl, sizeof(*cpl));
+	status->done = true;
+}
+
+static void
+ut_complete_admin_cmd(nvme_cb_fn_t cb_fn, void *cb_arg, bool fail)
+{
+	struct nvme_completion	cpl = {};
+
+	if (g_ut_defer_admin) {
+		CU_ASSERT_FATAL(g_ut_num_deferred < 64);
+		g_ut_deferred[g_ut_num_deferred].cb_fn = cb_fn;
+		g_ut_deferred[g_ut_num_deferred].cb_arg = cb_arg;
+		g_ut_deferred[g_ut_num_deferred].fail = fail;
+		g_ut_num_deferred++;
+		return;
+	}
+
+	if (fail) {
+		cpl.status.sct = NVME_SCT_GENERIC;
+		cpl.status.sc = NVME_SC_INTERNAL_DEVICE_ERROR;
+	}
+	cb_fn(cb_arg, &cpl);
 }
 
 void
@@ -97,18 +197,38 @@ nvme_ctrlr_cmd_set_async_event_config(struct nvme_controller *ctrlr,
 				      union nvme_critical_warning_state state, nvme_cb_fn_t cb_fn,
 				      void *cb_arg)
 {
+	ut_complete_admin_cmd(cb_fn, cb_arg, false);
 }
 
 void
 nvme_ctrlr_cmd_identify_controller(struct nvme_controller *ctrlr, void *payload,
 				   nvme_cb_fn_t cb_fn, void *cb_arg)
 {
+	struct nvme_controller_data *cdata = payload;
+
+	cdata->nn = 2;
+	cdata->mdts = 5;
+	cdata->aerl = 0;
+	ut_complete_admin_cmd(cb_fn, cb_arg, false);
+}
+
+void
+nvme_ctrlr_cmd_identify_namespace(struct nvme_controller *ctrlr, uint16_t nsid,
+				  void *payload, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	ut_complete_admin_cmd(cb_fn, cb_arg, false);
 }
 
 void
 nvme_ctrlr_cmd_set_num_queues(struct nvme_controller *ctrlr,
 			      uint32_t num_queues, nvme_cb_fn_t cb_fn, void *cb_arg)
 {
+	struct nvme_completion	cpl = {};
+
+	/* As many submission as completion queues, 0-based */
+	g_ut_num_queues_requested = num_queues;
+	cpl.cdw0 = ((g_ut_num_queues_granted - 1) << 16) | (g_ut_num_queues_granted - 1);
+	cb_fn(cb_arg, &cpl);
 }
 
 void
@@ -116,6 +236,7 @@ nvme_ctrlr_cmd_create_io_cq(struct nvme_controller *ctrlr,
 			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
 			    void *cb_arg)
 {
+	ut_complete_admin_cmd(cb_fn, cb_arg, false);
 }
 
 void
@@ -123,6 +244,29 @@ nvme_ctrlr_cmd_create_io_sq(struct nvme_controller *ctrlr,
 			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
 			    void *cb_arg)
 {
+	bool fail = g_ut_fail_create_sq || io_que->id == g_ut_fail_create_sq_id;
+
+	if (!fail) {
+		g_ut_num_created++;
+	}
+	ut_complete_admin_cmd(cb_fn, cb_arg, fail);
+}
+
+void
+nvme_ctrlr_cmd_delete_io_cq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
+			    void *cb_arg)
+{
+	g_ut_num_deleted++;
+	ut_complete_admin_cmd(cb_fn, cb_arg, false);
+}
+
+void
+nvme_ctrlr_cmd_delete_io_sq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
+			    void *cb_arg)
+{
+	ut_complete_admin_cmd(cb_fn, cb_arg, false);
 }
 
 void
@@ -143,10 +287,11 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 		      nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 	struct nvme_request *req = NULL;
-	nvme_alloc_request(&req);
+	req = malloc(sizeof(*req));
 
 	if (req != NULL) {
-		memset(req, 0, offsetof(struct nvme_request, children));
+		memset(req, 0, offsetof(struct nvme_request, split_ns));
+		memset(&req->cmd, 0, sizeof(req->cmd));
 
 		if (payload == NULL || payload_size == 0) {
 			req->u.payload = NULL;
@@ -174,6 +319,485 @@ test_nvme_ctrlr_fail(void)
 	CU_ASSERT(ctrlr.is_failed == true);
 }
 
+static void
+test_nvme_ctrlr_alloc_io_qpair(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_qpair	*qpair[3];
+	struct nvme_qpair	*thread_qpair;
+	uint32_t		i;
+
+	nvme_mutex_init_recursive(&ctrlr.ctrlr_lock);
+	nvme_ctrlr_opts_set_defaults(&ctrlr.opts);
+	ctrlr.regs = &regs;
+	regs.cap_lo.bits.mqes = 4095;
+	ctrlr.num_io_queues = 4;
+	g_ut_num_created = 0;
+	g_ut_num_deleted = 0;
+
+	/* No queues are created until they are claimed. */
+	CU_ASSERT(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+	CU_ASSERT_FATAL(ctrlr.ioq != NULL);
+	CU_ASSERT(g_ut_num_created == 0);
+	for (i = 0; i < ctrlr.num_io_queues; i++) {
+		CU_ASSERT(ctrlr.ioq[i].id == i + 1);
+		CU_ASSERT(ctrlr.ioq[i].cmd == NULL);
+	}
+
+	/* Explicit qpairs come from the top of the range. */
+	qpair[0] = nvme_ctrlr_alloc_io_qpair(&ctrlr, 0);
+	CU_ASSERT(qpair[0] == &ctrlr.ioq[3]);
+	CU_ASSERT(qpair[0]->num_entries == ctrlr.opts.io_queue_size);
+	CU_ASSERT(qpair[0]->num_trackers == ctrlr.opts.io_queue_requests);
+	CU_ASSERT(g_ut_num_created == 1);
+
+	/* The ring grows to fit a deep qpair. */
+	qpair[1] = nvme_ctrlr_alloc_io_qpair(&ctrlr, 1000);
+	CU_ASSERT(qpair[1] == &ctrlr.ioq[2]);
+	CU_ASSERT(qpair[1]->num_entries == 1001);
+	CU_ASSERT(qpair[1]->num_trackers == 1000);
+	CU_ASSERT(g_ut_num_created == 2);
+
+	/* Thread queues are indexed from the bottom and created on first use. */
+	nvme_thread_ioq_index = 0;
+	thread_qpair = nvme_ctrlr_get_thread_io_qpair(&ctrlr);
+	CU_ASSERT(thread_qpair == &ctrlr.ioq[0]);
+	CU_ASSERT(g_ut_num_created == 3);
+	CU_ASSERT(nvme_ctrlr_get_thread_io_qpair(&ctrlr) == thread_qpair);
+	CU_ASSERT(g_ut_num_created == 3);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(thread_qpair) == EINVAL);
+
+	/* A failed create leaves the slot free and deletes the CQ it created. */
+	g_ut_fail_create_sq = true;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, 16) == NULL);
+	CU_ASSERT(ctrlr.ioq[1].cmd == NULL);
+	CU_ASSERT(ctrlr.ioq[1].is_cq_created == false);
+	CU_ASSERT(g_ut_num_deleted == 1);
+	g_ut_fail_create_sq = false;
+
+	qpair[2] = nvme_ctrlr_alloc_io_qpair(&ctrlr, 16);
+	CU_ASSERT(qpair[2] == &ctrlr.ioq[1]);
+	CU_ASSERT(qpair[2]->num_trackers == 16);
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, 16) == NULL);
+
+	/* A thread whose index is taken by an explicit qpair gets no queue. */
+	nvme_thread_ioq_index = 1;
+	CU_ASSERT(nvme_ctrlr_get_thread_io_qpair(&ctrlr) == NULL);
+	nvme_thread_ioq_index = 4;
+	CU_ASSERT(nvme_ctrlr_get_thread_io_qpair(&ctrlr) == NULL);
+	nvme_thread_ioq_index = -1;
+
+	/* A reset recreates only the queues in use. */
+	g_ut_num_created = 0;
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_CREATE_IO_QPAIRS);
+	ctrlr.adminq.num_trackers = NVME_ADMIN_TRACKERS;
+	while (ctrlr.state != NVME_CTRLR_STATE_CONSTRUCT_NS) {
+		CU_ASSERT_FATAL(nvme_ctrlr_process_init_state(&ctrlr) != ENXIO);
+	}
+	CU_ASSERT(g_ut_num_created == 4);
+
+	/* Outstanding I/O keeps a qpair from being freed. */
+	qpair[2]->num_free_tr--;
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair[2]) == EBUSY);
+	qpair[2]->num_free_tr++;
+
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair[i]) == 0);
+		CU_ASSERT(qpair[i]->cmd == NULL);
+	}
+	CU_ASSERT(g_ut_num_deleted == 4);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair[0]) == EINVAL);
+
+	qpair[0] = nvme_ctrlr_alloc_io_qpair(&ctrlr, 0);
+	CU_ASSERT(qpair[0] == &ctrlr.ioq[3]);
+
+	free(ctrlr.ioq);
+	nvme_mutex_destroy(&ctrlr.ctrlr_lock);
+}
+
+static void
+test_nvme_ctrlr_construct_io_qpairs_opts(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+
+	ctrlr.regs = &regs;
+	ctrlr.num_io_queues = 1;
+	regs.cap_lo.bits.mqes = 1023;
+
+	/* Deep queues are limited by CAP.MQES. */
+	ctrlr.opts.io_queue_size = 4096;
+	ctrlr.opts.io_queue_requests = 4096;
+	CU_ASSERT(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 1024);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 1023);
+	free(ctrlr.ioq);
+	ctrlr.ioq = NULL;
+
+	/* Requests are limited by the queue size. */
+	ctrlr.opts.io_queue_size = 64;
+	ctrlr.opts.io_queue_requests = 128;
+	CU_ASSERT(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 64);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 63);
+	free(ctrlr.ioq);
+	ctrlr.ioq = NULL;
+
+	/* Shallow queues are allowed. */
+	ctrlr.opts.io_queue_size = 8;
+	ctrlr.opts.io_queue_requests = 4;
+	CU_ASSERT(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 8);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 4);
+	free(ctrlr.ioq);
+	ctrlr.ioq = NULL;
+
+	/* The driver limit applies even if the controller allows 64K entries. */
+	regs.cap_lo.bits.mqes = 0xFFFF;
+	ctrlr.opts.io_queue_size = 65536;
+	ctrlr.opts.io_queue_requests = 65536;
+	CU_ASSERT(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.opts.io_queue_size == NVME_MAX_IO_ENTRIES);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == NVME_MAX_IO_TRACKERS);
+	free(ctrlr.ioq);
+	ctrlr.ioq = NULL;
+}
+
+static void
+test_nvme_ctrlr_create_io_qpairs_pipelined(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	uint32_t		i;
+
+	nvme_mutex_init_recursive(&ctrlr.ctrlr_lock);
+	nvme_ctrlr_opts_set_defaults(&ctrlr.opts);
+	ctrlr.regs = &regs;
+	regs.cap_lo.bits.mqes = 1023;
+	ctrlr.num_io_queues = 5;
+	ctrlr.adminq.num_trackers = 2;
+	CU_ASSERT_FATAL(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+
+	/* Queues 1-4 were in use before the reset; queue 5 was not. */
+	for (i = 0; i < 4; i++) {
+		nvme_qpair_construct(&ctrlr.ioq[i], i + 1, 64, 32, &ctrlr);
+	}
+
+	g_ut_defer_admin = true;
+	g_ut_num_created = 0;
+	g_ut_num_deleted = 0;
+
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_CREATE_IO_QPAIRS);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_CREATE_IO_CQS);
+
+	/* Only as many creates as the admin queue has trackers go out at once. */
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.ioq[1].is_cq_created == true);
+	CU_ASSERT(ctrlr.ioq[2].is_cq_created == false);
+
+	/* All CQs are created before any SQ. */
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_CREATE_IO_SQS);
+	for (i = 0; i < 4; i++) {
+		CU_ASSERT(ctrlr.ioq[i].is_cq_created == true);
+		CU_ASSERT(ctrlr.ioq[i].is_sq_created == false);
+	}
+	CU_ASSERT(ctrlr.ioq[4].is_cq_created == false);
+
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == EAGAIN);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_CONSTRUCT_NS);
+	CU_ASSERT(g_ut_num_created == 4);
+	CU_ASSERT(g_ut_num_deleted == 0);
+
+	/* A failed SQ create deletes every queue that was created. */
+	g_ut_fail_create_sq_id = 3;
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_CREATE_IO_QPAIRS);
+	while (ctrlr.state != NVME_CTRLR_STATE_DELETE_IO_SQS) {
+		CU_ASSERT_FATAL(nvme_ctrlr_process_init_state(&ctrlr) != ENXIO);
+	}
+	CU_ASSERT(ctrlr.ioq[2].is_sq_created == false);
+	CU_ASSERT(ctrlr.ioq[3].is_sq_created == true);
+	while (nvme_ctrlr_process_init_state(&ctrlr) != ENXIO) {
+		CU_ASSERT_FATAL(ctrlr.state == NVME_CTRLR_STATE_DELETE_IO_SQS ||
+				ctrlr.state == NVME_CTRLR_STATE_DELETE_IO_CQS);
+	}
+	for (i = 0; i < 4; i++) {
+		CU_ASSERT(ctrlr.ioq[i].is_cq_created == false);
+		CU_ASSERT(ctrlr.ioq[i].is_sq_created == false);
+	}
+	CU_ASSERT(g_ut_num_deleted == 4);
+
+	g_ut_fail_create_sq_id = 0;
+	g_ut_defer_admin = false;
+	free(ctrlr.ioq);
+	nvme_mutex_destroy(&ctrlr.ctrlr_lock);
+}
+
+static void
+test_nvme_ctrlr_set_num_qpairs_reset(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+
+	nvme_mutex_init_recursive(&ctrlr.ctrlr_lock);
+	nvme_ctrlr_opts_set_defaults(&ctrlr.opts);
+	ctrlr.regs = &regs;
+	regs.cap_lo.bits.mqes = 1023;
+	ctrlr.num_io_queues = 4;
+	CU_ASSERT_FATAL(nvme_ctrlr_construct_io_qpairs(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.ioq_size == 4);
+	nvme_qpair_construct(&ctrlr.ioq[2], 3, 64, 32, &ctrlr);
+
+	/* After a reset, no more queues are asked for or used than ioq holds. */
+	g_ut_num_queues_granted = 8;
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_SET_NUM_QPAIRS);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(g_ut_num_queues_requested == 4);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_CREATE_IO_QPAIRS);
+	CU_ASSERT(ctrlr.num_io_queues == 4);
+
+	/* Fewer queues than are in use fails the reset. */
+	g_ut_num_queues_granted = 2;
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_SET_NUM_QPAIRS);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == ENXIO);
+	CU_ASSERT(ctrlr.num_io_queues == 4);
+
+	/* Fewer is fine if the queues that go away are unused, and they may come back. */
+	ctrlr.ioq[2].cmd = NULL;
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_SET_NUM_QPAIRS);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.num_io_queues == 2);
+
+	g_ut_num_queues_granted = 8;
+	nvme_ctrlr_set_state(&ctrlr, NVME_CTRLR_STATE_SET_NUM_QPAIRS);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(nvme_ctrlr_process_init_state(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.num_io_queues == 4);
+
+	g_ut_num_queues_granted = 4;
+	free(ctrlr.ioq);
+	nvme_mutex_destroy(&ctrlr.ctrlr_lock);
+}
+
+static void
+ut_set_csts_rdy(struct nvme_registers *regs, uint32_t rdy)
+{
+	union nvme_csts_register csts;
+
+	csts.raw = regs->csts;
+	csts.bits.rdy = rdy;
+	regs->csts = csts.raw;
+}
+
+static void
+test_nvme_ctrlr_process_init(void)
+{
+	struct nvme_controller	ctrlr[2] = {};
+	struct nvme_registers	regs[2] = {};
+	struct nvme_ctrlr_init_times	times;
+	uint32_t		i;
+
+	for (i = 0; i < 2; i++) {
+		nvme_mutex_init_recursive(&ctrlr[i].ctrlr_lock);
+		nvme_ctrlr_opts_set_defaults(&ctrlr[i].opts);
+		ctrlr[i].regs = &regs[i];
+		ctrlr[i].min_page_size = 4096;
+		ctrlr[i].max_xfer_size = NVME_DEFAULT_MAX_XFER_SIZE;
+		regs[i].cap_lo.bits.mqes = 1023;
+		regs[i].cap_lo.bits.to = 1;
+		nvme_ctrlr_begin_init(&ctrlr[i], NVME_CTRLR_STATE_INIT);
+	}
+
+	/* Controller 0 starts out enabled; controller 1 is already held in reset. */
+	regs[0].cc.bits.en = 1;
+	ut_set_csts_rdy(&regs[0], 1);
+
+	/* Neither controller blocks while it waits on the hardware. */
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[0]) == EAGAIN);
+	CU_ASSERT(ctrlr[0].state == NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+	CU_ASSERT(regs[0].cc.bits.en == 0);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[1]) == EAGAIN);
+	CU_ASSERT(ctrlr[1].state == NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1);
+	CU_ASSERT(regs[1].cc.bits.en == 1);
+
+	/* CSTS.RDY has not cleared yet. */
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[0]) == EAGAIN);
+	CU_ASSERT(ctrlr[0].state == NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+
+	/* The next state runs as soon as CSTS.RDY changes. */
+	ut_set_csts_rdy(&regs[0], 0);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[0]) == EAGAIN);
+	CU_ASSERT(ctrlr[0].state == NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1);
+	CU_ASSERT(regs[0].cc.bits.en == 1);
+
+	ut_set_csts_rdy(&regs[0], 1);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[0]) == 0);
+	CU_ASSERT(ctrlr[0].state == NVME_CTRLR_STATE_READY);
+	CU_ASSERT(ctrlr[0].num_io_queues == 4);
+	CU_ASSERT(ctrlr[0].num_ns == 2);
+	CU_ASSERT(ctrlr[0].max_xfer_size == 4096 * (1 << 5));
+	CU_ASSERT(ctrlr[0].num_aers == 1);
+	CU_ASSERT(ctrlr[0].init_ticks != 0);
+	CU_ASSERT(ctrlr[0].init_ticks >= ctrlr[0].init_state_ticks[NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0]);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[0]) == 0);
+
+	nvme_ctrlr_get_init_times(&ctrlr[0], &times);
+	CU_ASSERT(times.total_us >= times.disable_us + times.enable_us);
+
+	/* Controller 1 never becomes ready and times out. */
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[1]) == EAGAIN);
+	CU_ASSERT(ctrlr[1].ready_timeout_tsc != 0);
+	ctrlr[1].ready_timeout_tsc = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[1]) == ENXIO);
+	CU_ASSERT(ctrlr[1].state == NVME_CTRLR_STATE_ERROR);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr[1]) == ENXIO);
+
+	for (i = 0; i < 2; i++) {
+		nvme_ctrlr_destruct_namespaces(&ctrlr[i]);
+		free(ctrlr[i].ioq);
+		nvme_mutex_destroy(&ctrlr[i].ctrlr_lock);
+	}
+}
+
+static void
+test_nvme_ctrlr_reset_async(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_ctrlr_init_times	times;
+	struct nvme_qpair	*qpair;
+
+	nvme_mutex_init_recursive(&ctrlr.ctrlr_lock);
+	nvme_ctrlr_opts_set_defaults(&ctrlr.opts);
+	ctrlr.regs = &regs;
+	ctrlr.min_page_size = 4096;
+	ctrlr.max_xfer_size = NVME_DEFAULT_MAX_XFER_SIZE;
+	ctrlr.adminq.num_trackers = NVME_ADMIN_TRACKERS;
+	regs.cap_lo.bits.mqes = 1023;
+	regs.cap_lo.bits.to = 1;
+	nvme_ctrlr_begin_init(&ctrlr, NVME_CTRLR_STATE_INIT);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == EAGAIN);
+	ut_set_csts_rdy(&regs, 1);
+	CU_ASSERT_FATAL(nvme_ctrlr_process_init(&ctrlr) == 0);
+
+	nvme_thread_ioq_index = 0;
+	qpair = nvme_ctrlr_get_thread_io_qpair(&ctrlr);
+	CU_ASSERT_FATAL(qpair == &ctrlr.ioq[0]);
+	g_ut_num_created = 0;
+
+	CU_ASSERT(nvme_ctrlr_reset_async(&ctrlr) == 0);
+	CU_ASSERT(nvme_ctrlr_reset_async(&ctrlr) == EBUSY);
+	CU_ASSERT(ctrlr.is_resetting == true);
+	CU_ASSERT(ctrlr.reset_seq == 1);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS);
+
+	/* No new queues while the admin queue is busy with the reset. */
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, 0) == NULL);
+
+	/*
+	 * The reset waits for the thread using the qpair to finish with it,
+	 *  even once the qpair has quiesced.
+	 */
+	qpair->in_use = 1;
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS);
+	qpair->reset_seq = ctrlr.reset_seq;
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS);
+	qpair->in_use = 0;
+
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+	ut_set_csts_rdy(&regs, 0);
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1);
+	ut_set_csts_rdy(&regs, 1);
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_READY);
+	CU_ASSERT(ctrlr.is_resetting == false);
+	CU_ASSERT(ctrlr.is_failed == false);
+	CU_ASSERT(ctrlr.reset_seq == 2);
+	CU_ASSERT(g_ut_num_created == 1);
+
+	nvme_ctrlr_get_init_times(&ctrlr, &times);
+	CU_ASSERT(times.total_us >= times.quiesce_us + times.disable_us);
+
+	/*
+	 * An idle qpair does not hold up the reset; it quiesces the next time
+	 *  its thread uses it.  A reset that cannot recreate the queues fails
+	 *  the controller.
+	 */
+	CU_ASSERT(nvme_ctrlr_reset_async(&ctrlr) == 0);
+	g_ut_fail_create_sq = true;
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_DISABLE_WAIT_FOR_READY_0);
+	ut_set_csts_rdy(&regs, 0);
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	ut_set_csts_rdy(&regs, 1);
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == ENXIO);
+	CU_ASSERT(ctrlr.is_resetting == false);
+	CU_ASSERT(ctrlr.is_failed == true);
+	CU_ASSERT(ctrlr.reset_seq == 4);
+	CU_ASSERT(nvme_ctrlr_reset_async(&ctrlr) == ENXIO);
+	CU_ASSERT(nvme_ctrlr_reset(&ctrlr) == 0);
+	g_ut_fail_create_sq = false;
+
+	nvme_thread_ioq_index = -1;
+	nvme_ctrlr_destruct_namespaces(&ctrlr);
+	free(ctrlr.ioq);
+	nvme_mutex_destroy(&ctrlr.ctrlr_lock);
+}
+
+static void
+test_nvme_ctrlr_reset_quiesce_timeout(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_qpair	*qpair;
+
+	nvme_mutex_init_recursive(&ctrlr.ctrlr_lock);
+	nvme_ctrlr_opts_set_defaults(&ctrlr.opts);
+	ctrlr.regs = &regs;
+	ctrlr.min_page_size = 4096;
+	ctrlr.max_xfer_size = NVME_DEFAULT_MAX_XFER_SIZE;
+	ctrlr.adminq.num_trackers = NVME_ADMIN_TRACKERS;
+	regs.cap_lo.bits.mqes = 1023;
+	regs.cap_lo.bits.to = 1;
+	nvme_ctrlr_begin_init(&ctrlr, NVME_CTRLR_STATE_INIT);
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == EAGAIN);
+	ut_set_csts_rdy(&regs, 1);
+	CU_ASSERT_FATAL(nvme_ctrlr_process_init(&ctrlr) == 0);
+
+	nvme_thread_ioq_index = 0;
+	qpair = nvme_ctrlr_get_thread_io_qpair(&ctrlr);
+	CU_ASSERT_FATAL(qpair != NULL);
+
+	/* A qpair left in use past CAP.TO fails the reset instead of hanging it. */
+	qpair->in_use = 1;
+	CU_ASSERT(nvme_ctrlr_reset_async(&ctrlr) == 0);
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == EAGAIN);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_QUIESCE_IO_QPAIRS);
+	CU_ASSERT(ctrlr.ready_timeout_tsc != 0);
+	ctrlr.ready_timeout_tsc = 1;
+	CU_ASSERT(nvme_ctrlr_process_reset(&ctrlr) == ETIMEDOUT);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_ERROR);
+	CU_ASSERT(ctrlr.is_resetting == false);
+	CU_ASSERT(ctrlr.is_failed == true);
+	CU_ASSERT(ctrlr.reset_seq == 2);
+	qpair->in_use = 0;
+
+	nvme_thread_ioq_index = -1;
+	nvme_ctrlr_destruct_namespaces(&ctrlr);
+	free(ctrlr.ioq);
+	nvme_mutex_destroy(&ctrlr.ctrlr_lock);
+}
+
 int main(int argc, char **argv)
 {
 	CU_pSuite	suite = NULL;
@@ -191,6 +815,20 @@ int main(int argc, char **argv)
 
 	if (
 		CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_fail", test_nvme_ctrlr_fail) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_alloc_io_qpair",
+			       test_nvme_ctrlr_alloc_io_qpair) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_construct_io_qpairs",
+			       test_nvme_ctrlr_construct_io_qpairs_opts) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr pipelined I/O queue creation",
+			       test_nvme_ctrlr_create_io_qpairs_pipelined) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr I/O queue count after a reset",
+			       test_nvme_ctrlr_set_num_qpairs_reset) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_process_init",
+			       test_nvme_ctrlr_process_init) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_reset_async",
+			       test_nvme_ctrlr_reset_async) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr reset with a qpair left in use",
+			       test_nvme_ctrlr_reset_quiesce_timeout) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
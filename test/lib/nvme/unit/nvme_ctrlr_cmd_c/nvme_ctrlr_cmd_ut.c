@@ -41,6 +41,7 @@
 char outbuf[OUTBUF_SIZE];
 
 struct nvme_request g_req;
+struct nvme_qpair g_thread_qpair;
 
 uint32_t error_num_entries;
 uint32_t health_log_nsid = 1;
@@ -50,6 +51,7 @@ uint8_t get_feature = 1;
 uint32_t get_feature_cdw11 = 1;
 uint16_t abort_cid = 1;
 uint16_t abort_sqid = 1;
+uint16_t delete_qid = 3;
 
 
 typedef void (*verify_request_fn_t)(struct nvme_request *req);
@@ -111,6 +113,18 @@ static void verify_abort_cmd(struct nvme_request *req)
 	CU_ASSERT(req->cmd.cdw10 == (((uint32_t)abort_cid << 16) | abort_sqid));
 }
 
+static void verify_delete_io_cq_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_DELETE_IO_CQ);
+	CU_ASSERT(req->cmd.cdw10 == delete_qid);
+}
+
+static void verify_delete_io_sq_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_DELETE_IO_SQ);
+	CU_ASSERT(req->cmd.cdw10 == delete_qid);
+}
+
 static void verify_io_raw_cmd(struct nvme_request *req)
 {
 	struct nvme_command	command = {};
@@ -141,10 +155,18 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 	return req;
 }
 
+struct nvme_qpair *
+nvme_ctrlr_get_thread_io_qpair(struct nvme_controller *ctrlr)
+{
+	return &g_thread_qpair;
+}
+
 void
 nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
+			     struct nvme_qpair *qpair,
 			     struct nvme_request *req)
 {
+	CU_ASSERT(qpair == &g_thread_qpair);
 	verify_fn(req);
 	/* stop analyzer from thinking stack variable addresses are stored in a global */
 	memset(req, 0, sizeof(*req));
@@ -227,6 +249,21 @@ test_abort_cmd(void)
 	nvme_ctrlr_cmd_abort(&ctrlr, abort_cid, abort_sqid, NULL, NULL);
 }
 
+static void
+test_delete_io_queue_cmds(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_qpair	qpair = {};
+
+	qpair.id = delete_qid;
+
+	verify_fn = verify_delete_io_sq_cmd;
+	nvme_ctrlr_cmd_delete_io_sq(&ctrlr, &qpair, NULL, NULL);
+
+	verify_fn = verify_delete_io_cq_cmd;
+	nvme_ctrlr_cmd_delete_io_cq(&ctrlr, &qpair, NULL, NULL);
+}
+
 static void
 test_io_raw_cmd(void)
 {
@@ -260,6 +297,7 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "test ctrlr cmd set_feature", test_set_feature_cmd) == NULL
 		|| CU_add_test(suite, "test ctrlr cmd get_feature", test_get_feature_cmd) == NULL
 		|| CU_add_test(suite, "test ctrlr cmd abort_cmd", test_abort_cmd) == NULL
+		|| CU_add_test(suite, "test ctrlr cmd delete_io_queue", test_delete_io_queue_cmds) == NULL
 		|| CU_add_test(suite, "test ctrlr cmd io_raw_cmd", test_io_raw_cmd) == NULL
 	) {
 		CU_cleanup_registry();
@@ -0,0 +1,287 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "CUnit/Basic.h"
+
+#include "nvme/nvme_dif.c"
+
+char outbuf[OUTBUF_SIZE];
+
+static void
+fill_random(uint8_t *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	srand(seed);
+	for (i = 0; i < len; i++) {
+		buf[i] = rand();
+	}
+}
+
+static void
+prepare_ns(struct nvme_namespace *ns, uint32_t sector_size, uint16_t md_size,
+	   bool extended, uint8_t pi_type, bool pi_md_start)
+{
+	memset(ns, 0, sizeof(*ns));
+	ns->sector_size = sector_size;
+	ns->md_size = md_size;
+	ns->extended_lba_size = sector_size + (extended ? md_size : 0);
+	ns->pi_type = pi_type;
+	ns->pi_md_start = pi_md_start;
+}
+
+static void
+test_crc16_t10dif(void)
+{
+	uint8_t		buf[4096 + 15];
+	uint16_t	crc;
+	size_t		len, split;
+
+	CU_ASSERT(nvme_crc16_t10dif(0, "123456789", 9) == 0xD0DB);
+	CU_ASSERT(nvme_crc16_t10dif(0x1234, NULL, 0) == 0x1234);
+
+	fill_random(buf, sizeof(buf), 1);
+
+	/* Every length exercises the scalar tail, and the longer ones the kernels. */
+	for (len = 0; len <= 1040; len++) {
+		crc = nvme_crc16_t10dif_scalar(0, buf + 3, len);
+		CU_ASSERT(nvme_crc16_t10dif(0, buf + 3, len) == crc);
+
+		split = len / 3;
+		CU_ASSERT(nvme_crc16_t10dif(nvme_crc16_t10dif(0, buf + 3, split),
+					    buf + 3 + split, len - split) == crc);
+	}
+
+	CU_ASSERT(nvme_crc16_t10dif(0, buf, 4096) == nvme_crc16_t10dif_scalar(0, buf, 4096));
+	CU_ASSERT(nvme_crc16_t10dif(0xBEEF, buf + 1, 4096) ==
+		  nvme_crc16_t10dif_scalar(0xBEEF, buf + 1, 4096));
+}
+
+static void
+test_crc16_t10dif_kernels(void)
+{
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+	uint8_t		buf[2048];
+	size_t		len;
+
+	fill_random(buf, sizeof(buf), 2);
+
+	for (len = 16; len <= sizeof(buf); len += 16) {
+		CU_ASSERT(nvme_crc16_t10dif_pclmul(0xA5A5, buf, len) ==
+			  nvme_crc16_t10dif_scalar(0xA5A5, buf, len));
+#if defined(__VPCLMULQDQ__) && defined(__AVX2__)
+		if (len >= 128) {
+			CU_ASSERT(nvme_crc16_t10dif_vpclmul(0xA5A5, buf, len) ==
+				  nvme_crc16_t10dif_scalar(0xA5A5, buf, len));
+		}
+#endif
+	}
+#endif
+}
+
+static void
+test_dif_extended(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_protection_info	pi;
+	struct nvme_dif_error		err;
+	uint8_t				*buf;
+	uint32_t			block = 512 + 8;
+	uint32_t			flags = NVME_IO_FLAGS_PRCHK_GUARD |
+						NVME_IO_FLAGS_PRCHK_APPTAG |
+						NVME_IO_FLAGS_PRCHK_REFTAG;
+
+	prepare_ns(&ns, 512, 8, true, NVME_PI_TYPE1, false);
+	buf = malloc(4 * block);
+	fill_random(buf, 4 * block, 3);
+
+	CU_ASSERT(nvme_ns_dif_generate(&ns, buf, NULL, 0x100000010ULL, 4, 0x1234) == 0);
+
+	memcpy(&pi, buf + 512, sizeof(pi));
+	CU_ASSERT(be16toh(pi.guard) == nvme_crc16_t10dif(0, buf, 512));
+	CU_ASSERT(be16toh(pi.app_tag) == 0x1234);
+	CU_ASSERT(be32toh(pi.ref_tag) == 0x10);
+	memcpy(&pi, buf + 3 * block + 512, sizeof(pi));
+	CU_ASSERT(be32toh(pi.ref_tag) == 0x13);
+
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x100000010ULL, 4, flags, 0xFFFF, 0x1234,
+				     &err) == 0);
+
+	/* The application tag is only checked under the mask. */
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x10, 4, flags, 0xFF00, 0x12FF, &err) == 0);
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x10, 4, flags, 0xFFFF, 0x12FF, &err) == EIO);
+	CU_ASSERT(err.sc == NVME_SC_APPLICATION_TAG_CHECK_ERROR);
+	CU_ASSERT(err.lba == 0x10);
+	CU_ASSERT(err.expected == 0x12FF);
+	CU_ASSERT(err.actual == 0x1234);
+
+	/* Unchecked fields are ignored. */
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x11, 4, NVME_IO_FLAGS_PRCHK_GUARD,
+				     0xFFFF, 0, NULL) == 0);
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x11, 4, flags, 0xFFFF, 0x1234, &err) == EIO);
+	CU_ASSERT(err.sc == NVME_SC_REFERENCE_TAG_CHECK_ERROR);
+	CU_ASSERT(err.lba == 0x11);
+	CU_ASSERT(err.expected == 0x11);
+	CU_ASSERT(err.actual == 0x10);
+
+	/* Corrupt the data of the third sector. */
+	buf[2 * block + 100] ^= 1;
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x10, 4, flags, 0xFFFF, 0x1234, &err) == EIO);
+	CU_ASSERT(err.sc == NVME_SC_GUARD_CHECK_ERROR);
+	CU_ASSERT(err.lba == 0x12);
+
+	/* An application tag of 0xFFFF disables checking of the sector. */
+	pi.guard = 0;
+	pi.app_tag = 0xFFFF;
+	pi.ref_tag = 0;
+	memcpy(buf + 2 * block + 512, &pi, sizeof(pi));
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0x10, 4, flags, 0xFFFF, 0x1234, &err) == 0);
+
+	/* Extended LBAs have no separate metadata. */
+	CU_ASSERT(nvme_ns_dif_generate(&ns, buf, buf, 0, 1, 0) == EINVAL);
+
+	free(buf);
+}
+
+static void
+test_dif_separate_md(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_protection_info	pi;
+	struct nvme_dif_error		err;
+	uint8_t				*buf, md[2 * 16];
+	uint32_t			flags = NVME_IO_FLAGS_PRCHK_GUARD |
+						NVME_IO_FLAGS_PRCHK_REFTAG;
+	uint16_t			guard;
+
+	/* Protection information in the last eight of 16 bytes of metadata. */
+	prepare_ns(&ns, 4096, 16, false, NVME_PI_TYPE1, false);
+	buf = malloc(2 * 4096);
+	fill_random(buf, 2 * 4096, 4);
+	fill_random(md, sizeof(md), 5);
+
+	CU_ASSERT(nvme_ns_dif_generate(&ns, buf, md, 7, 2, 0) == 0);
+
+	/* The guard covers the metadata before the protection information. */
+	guard = nvme_crc16_t10dif(nvme_crc16_t10dif(0, buf + 4096, 4096), md + 16, 8);
+	memcpy(&pi, md + 16 + 8, sizeof(pi));
+	CU_ASSERT(be16toh(pi.guard) == guard);
+	CU_ASSERT(be32toh(pi.ref_tag) == 8);
+
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, md, 7, 2, flags, 0, 0, &err) == 0);
+	md[3] ^= 0x80;
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, md, 7, 2, flags, 0, 0, &err) == EIO);
+	CU_ASSERT(err.sc == NVME_SC_GUARD_CHECK_ERROR);
+	CU_ASSERT(err.lba == 7);
+
+	/* In the first eight bytes, the guard covers only the data. */
+	ns.pi_md_start = true;
+	CU_ASSERT(nvme_ns_dif_generate(&ns, buf, md, 7, 2, 0) == 0);
+	memcpy(&pi, md, sizeof(pi));
+	CU_ASSERT(be16toh(pi.guard) == nvme_crc16_t10dif(0, buf, 4096));
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, md, 7, 2, flags, 0, 0, &err) == 0);
+
+	/* Separate metadata must be given, and protection information formatted. */
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 7, 2, flags, 0, 0, &err) == EINVAL);
+	ns.pi_type = NVME_PI_TYPE_NONE;
+	CU_ASSERT(nvme_ns_dif_generate(&ns, buf, md, 7, 2, 0) == EINVAL);
+
+	free(buf);
+}
+
+static void
+test_dif_type3(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_protection_info	pi;
+	struct nvme_dif_error		err;
+	uint8_t				*buf;
+	uint32_t			flags = NVME_IO_FLAGS_PRCHK_GUARD |
+						NVME_IO_FLAGS_PRCHK_REFTAG;
+
+	prepare_ns(&ns, 512, 8, true, NVME_PI_TYPE3, true);
+	buf = malloc(2 * 520);
+	fill_random(buf, 2 * 520, 6);
+
+	/* Type 3 reference tags are not checked against the LBA. */
+	CU_ASSERT(nvme_ns_dif_generate(&ns, buf, NULL, 0, 2, 0x1111) == 0);
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 50, 2, flags, 0, 0, &err) == 0);
+
+	/* An application tag of 0xFFFF alone does not disable checking. */
+	memcpy(&pi, buf + 520 + 512, sizeof(pi));
+	pi.app_tag = 0xFFFF;
+	pi.guard ^= 1;
+	memcpy(buf + 520 + 512, &pi, sizeof(pi));
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0, 2, flags, 0, 0, &err) == EIO);
+	CU_ASSERT(err.sc == NVME_SC_GUARD_CHECK_ERROR);
+	CU_ASSERT(err.lba == 1);
+
+	pi.ref_tag = 0xFFFFFFFF;
+	memcpy(buf + 520 + 512, &pi, sizeof(pi));
+	CU_ASSERT(nvme_ns_dif_verify(&ns, buf, NULL, 0, 2, flags, 0, 0, &err) == 0);
+
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("nvme_dif", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "crc16_t10dif", test_crc16_t10dif) == NULL
+		|| CU_add_test(suite, "crc16_t10dif_kernels", test_crc16_t10dif_kernels) == NULL
+		|| CU_add_test(suite, "dif_extended", test_dif_extended) == NULL
+		|| CU_add_test(suite, "dif_separate_md", test_dif_separate_md) == NULL
+		|| CU_add_test(suite, "dif_type3", test_dif_type3) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
@@ -38,12 +38,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 static inline void *
 nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
 {
-	void *buf = calloc(1, size);
+	void *buf = NULL;
+
+	if (posix_memalign(&buf, align ? align : sizeof(void *), size) != 0) {
+		return NULL;
+	}
+	memset(buf, 0, size);
 	*phys_addr = (uint64_t)buf;
 	return buf;
 }
@@ -66,15 +73,62 @@ do							\
 
 uint64_t nvme_vtophys(void *buf);
 #define NVME_VTOPHYS_ERROR	(0xFFFFFFFFFFFFFFFFULL)
+#define NVME_VTOPHYS_REGION_SIZE	(2 * 1024 * 1024)
 
-#define nvme_alloc_request(bufp)	\
-do					\
-	{				\
-		*bufp = malloc(sizeof(struct nvme_request));	\
-	}				\
-	while (0)
+typedef struct {
+	int unused;
+} nvme_request_pool_t;
+
+static inline nvme_request_pool_t *
+nvme_request_pool_create(const char *name, unsigned count, size_t size)
+{
+	static nvme_request_pool_t pool;
+
+	return &pool;
+}
+
+/* Number of objects taken from request pools and not yet returned. */
+static inline int *
+nvme_ut_request_pool_num_out(void)
+{
+	static int num_out;
+
+	return &num_out;
+}
+
+static inline int
+nvme_ut_request_pool_get_bulk(void **objs, unsigned n, size_t size)
+{
+	unsigned i;
 
-#define nvme_dealloc_request(buf)	free(buf)
+	for (i = 0; i < n; i++) {
+		objs[i] = malloc(size);
+		if (objs[i] == NULL) {
+			while (i > 0) {
+				free(objs[--i]);
+			}
+			return -1;
+		}
+	}
+	__sync_fetch_and_add(nvme_ut_request_pool_num_out(), n);
+	return 0;
+}
+
+static inline void
+nvme_ut_request_pool_put_bulk(void **objs, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		free(objs[i]);
+	}
+	__sync_fetch_and_sub(nvme_ut_request_pool_num_out(), n);
+}
+
+#define nvme_request_pool_get_bulk(pool, reqs, n)	\
+	nvme_ut_request_pool_get_bulk((void **)(reqs), (n), sizeof(**(reqs)))
+#define nvme_request_pool_put_bulk(pool, reqs, n)	\
+	nvme_ut_request_pool_put_bulk((void **)(reqs), (n))
 #define nvme_pcicfg_read32(handle, var, offset)		do { *(var) = 0xFFFFFFFFu; } while (0)
 #define nvme_pcicfg_write32(handle, var, offset)	do { (void)(var); } while (0)
 
@@ -116,6 +170,17 @@ nvme_mutex_init_recursive(nvme_mutex_t *mtx)
 	return rc;
 }
 
+static inline uint64_t
+nvme_get_tsc(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define nvme_get_tsc_hz()		1000000000ULL
+
 /**
  * Copy a struct nvme_command from one memory location to another.
  */
@@ -38,20 +38,37 @@
 char outbuf[OUTBUF_SIZE];
 
 struct nvme_request *g_request = NULL;
+struct nvme_qpair *g_qpair = NULL;
 
-uint64_t nvme_vtophys(void *buf)
+/* Every request handed to the controller, in submission order. */
+#define UT_MAX_SUBMITTED 512
+struct nvme_request *g_submitted[UT_MAX_SUBMITTED];
+uint32_t g_num_submitted;
+
+static int g_req_cb_count;
+static bool g_req_cb_error;
+static struct nvme_completion g_req_cb_cpl;
+
+static void
+req_cb(void *cb_arg, const struct nvme_completion *cpl)
 {
-	return (uintptr_t)buf;
+	g_req_cb_count++;
+	g_req_cb_error = nvme_completion_is_error(cpl);
+	g_req_cb_cpl = *cpl;
 }
+struct nvme_qpair g_thread_qpair;
+struct nvme_qpair *g_thread_qpair_ptr = &g_thread_qpair;
 
-int
-nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr)
+static struct nvme_dsm_range g_dsm_pages[NVME_QPAIR_DSM_PAGES * NVME_DSM_MAX_RANGES];
+
+uint64_t nvme_vtophys(void *buf)
 {
-	return 0;
+	return (uintptr_t)buf;
 }
 
 int
-nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
+nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+		     const struct nvme_ctrlr_opts *opts, void *devhandle)
 {
 	return 0;
 }
@@ -79,11 +96,23 @@ nvme_ns_get_max_io_xfer_size(struct nvme_namespace *ns)
 	return ns->ctrlr->max_xfer_size;
 }
 
+struct nvme_qpair *
+nvme_ctrlr_get_thread_io_qpair(struct nvme_controller *ctrlr)
+{
+	return g_thread_qpair_ptr;
+}
+
 void
 nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
+			     struct nvme_qpair *qpair,
 			     struct nvme_request *req)
 {
 	g_request = req;
+	g_qpair = qpair;
+	if (g_num_submitted < UT_MAX_SUBMITTED) {
+		g_submitted[g_num_submitted] = req;
+	}
+	g_num_submitted++;
 }
 
 static void
@@ -92,22 +121,32 @@ prepare_for_test(struct nvme_namespace *ns, struct nvme_controller *ctrlr,
 		 uint32_t stripe_size)
 {
 	ctrlr->max_xfer_size = max_xfer_size;
+	ctrlr->sgl_supported = false;
 	memset(ns, 0, sizeof(*ns));
 	ns->ctrlr = ctrlr;
 	ns->sector_size = sector_size;
-	ns->stripe_size = stripe_size;
+	ns->extended_lba_size = sector_size;
 	ns->sectors_per_max_io = nvme_ns_get_max_io_xfer_size(ns) / ns->sector_size;
-	ns->sectors_per_stripe = ns->stripe_size / ns->sector_size;
+	ns->sectors_per_boundary = stripe_size / ns->sector_size;
 
 	g_request = NULL;
+	g_qpair = NULL;
+	g_num_submitted = 0;
+	g_thread_qpair_ptr = &g_thread_qpair;
+	memset(&g_thread_qpair.split_stats, 0, sizeof(g_thread_qpair.split_stats));
+	g_thread_qpair.dsm_pages = g_dsm_pages;
+	g_thread_qpair.dsm_free_pages = (1u << NVME_QPAIR_DSM_PAGES) - 1;
+	g_req_cb_count = 0;
+	g_req_cb_error = false;
 }
 
 static void
-nvme_cmd_interpret_rw(const struct nvme_command *cmd,
+nvme_cmd_interpret_rw(const struct nvme_request *req,
 		      uint64_t *lba, uint32_t *num_blocks)
 {
-	*lba = *(const uint64_t *)&cmd->cdw10;
-	*num_blocks = (cmd->cdw12 & 0xFFFFu) + 1;
+	CU_ASSERT(req->is_io_cmd);
+	*lba = req->io_lba;
+	*num_blocks = (req->io_cdw12 & 0xFFFFu) + 1;
 }
 
 static void
@@ -125,13 +164,13 @@ split_test(void)
 	lba = 0;
 	lba_count = 1;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL, 0);
 
 	CU_ASSERT(rc == 0);
 	CU_ASSERT_FATAL(g_request != NULL);
 
-	CU_ASSERT(g_request->num_children == 0);
-	nvme_cmd_interpret_rw(&g_request->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(!g_request->is_split);
+	nvme_cmd_interpret_rw(g_request, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(cmd_lba == lba);
 	CU_ASSERT(cmd_lba_count == lba_count);
 
@@ -139,15 +178,45 @@ split_test(void)
 	nvme_free_request(g_request);
 }
 
+static void
+ut_check_child(uint32_t i, struct nvme_request *parent, uint64_t lba, uint32_t lba_count)
+{
+	struct nvme_request	*child;
+	uint64_t		cmd_lba;
+	uint32_t		cmd_lba_count;
+
+	CU_ASSERT_FATAL(i < g_num_submitted);
+	child = g_submitted[i];
+	CU_ASSERT(child != parent);
+	CU_ASSERT(child->parent == parent);
+	CU_ASSERT(!child->is_split);
+	CU_ASSERT(child->payload_size == lba_count * 512);
+	nvme_cmd_interpret_rw(child, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba == lba);
+	CU_ASSERT(cmd_lba_count == lba_count);
+}
+
+static void
+ut_complete_submitted(uint32_t i, bool error)
+{
+	struct nvme_completion cpl = {};
+
+	if (error) {
+		cpl.status.sct = NVME_SCT_GENERIC;
+		cpl.status.sc = NVME_SC_DATA_TRANSFER_ERROR;
+	}
+	nvme_complete_request(g_submitted[i], &cpl);
+}
+
 static void
 split_test2(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
-	struct nvme_request	*child;
+	struct nvme_request	*parent;
 	void			*payload;
-	uint64_t		lba, cmd_lba;
-	uint32_t		lba_count, cmd_lba_count;
+	uint64_t		lba;
+	uint32_t		lba_count;
 	int			rc;
 
 	/*
@@ -161,35 +230,27 @@ split_test2(void)
 	lba = 0;
 	lba_count = (256 * 1024) / 512;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, req_cb, NULL, 0);
 
 	CU_ASSERT(rc == 0);
-	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
 
-	CU_ASSERT(g_request->num_children == 2);
+	parent = g_submitted[0]->parent;
+	CU_ASSERT_FATAL(parent != NULL);
+	CU_ASSERT(parent->is_split);
+	CU_ASSERT(parent->num_children == 2);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == 128 * 1024);
-	CU_ASSERT(cmd_lba == 0);
-	CU_ASSERT(cmd_lba_count == 256); /* 256 * 512 byte blocks = 128 KB */
-	nvme_free_request(child);
+	ut_check_child(0, parent, 0, 256); /* 256 * 512 byte blocks = 128 KB */
+	ut_check_child(1, parent, 256, 256);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == 128 * 1024);
-	CU_ASSERT(cmd_lba == 256);
-	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
-
-	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	ut_complete_submitted(0, false);
+	CU_ASSERT(g_req_cb_count == 0);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+	CU_ASSERT(g_num_submitted == 2);
 
 	free(payload);
-	nvme_free_request(g_request);
 }
 
 static void
@@ -197,10 +258,10 @@ split_test3(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
-	struct nvme_request	*child;
+	struct nvme_request	*parent;
 	void			*payload;
-	uint64_t		lba, cmd_lba;
-	uint32_t		lba_count, cmd_lba_count;
+	uint64_t		lba;
+	uint32_t		lba_count;
 	int			rc;
 
 	/*
@@ -216,35 +277,21 @@ split_test3(void)
 	lba = 10; /* Start at an LBA that isn't aligned to the stripe size */
 	lba_count = (256 * 1024) / 512;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, req_cb, NULL, 0);
 
 	CU_ASSERT(rc == 0);
-	CU_ASSERT_FATAL(g_request != NULL);
-
-	CU_ASSERT_FATAL(g_request->num_children == 2);
-
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == 128 * 1024);
-	CU_ASSERT(cmd_lba == 10);
-	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == 128 * 1024);
-	CU_ASSERT(cmd_lba == 266);
-	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
+	parent = g_submitted[0]->parent;
+	ut_check_child(0, parent, 10, 256);
+	ut_check_child(1, parent, 266, 256);
+	CU_ASSERT(g_submitted[1]->u.payload == (uint8_t *)payload + 128 * 1024);
 
-	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
 
 	free(payload);
-	nvme_free_request(g_request);
 }
 
 static void
@@ -252,10 +299,10 @@ split_test4(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
-	struct nvme_request	*child;
+	struct nvme_request	*parent;
 	void			*payload;
-	uint64_t		lba, cmd_lba;
-	uint32_t		lba_count, cmd_lba_count;
+	uint64_t		lba;
+	uint32_t		lba_count;
 	int			rc;
 
 	/*
@@ -273,44 +320,146 @@ split_test4(void)
 	lba = 10; /* Start at an LBA that isn't aligned to the stripe size */
 	lba_count = (256 * 1024) / 512;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, req_cb, NULL, 0);
 
 	CU_ASSERT(rc == 0);
-	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_num_submitted == 3);
 
-	CU_ASSERT_FATAL(g_request->num_children == 3);
-
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == (256 - 10) * 512);
-	CU_ASSERT(cmd_lba == 10);
-	CU_ASSERT(cmd_lba_count == 256 - 10);
-	nvme_free_request(child);
-
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == 128 * 1024);
-	CU_ASSERT(cmd_lba == 256);
-	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
-
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
-	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
-	CU_ASSERT(child->num_children == 0);
-	CU_ASSERT(child->payload_size == 10 * 512);
-	CU_ASSERT(cmd_lba == 512);
-	CU_ASSERT(cmd_lba_count == 10);
-	nvme_free_request(child);
-
-	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	parent = g_submitted[0]->parent;
+	CU_ASSERT(parent->num_children == 3);
+	ut_check_child(0, parent, 10, 256 - 10);
+	ut_check_child(1, parent, 256, 256);
+	ut_check_child(2, parent, 512, 10);
+
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	ut_complete_submitted(2, false);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	free(payload);
+}
+
+static void
+split_test_boundary(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_request	*parent;
+	void			*payload;
+	int			rc;
+
+	/*
+	 * A NOIOB of 96 blocks is not a power of two.  A 128 block read at
+	 *  LBA 90 crosses boundaries at 96 and 192:
+	 *  1) LBA = 90, count = 6 blocks
+	 *  2) LBA = 96, count = 96 blocks
+	 *  3) LBA = 192, count = 26 blocks
+	 */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.sectors_per_boundary = 96;
+	payload = malloc(128 * 512);
+
+	rc = nvme_ns_cmd_read(&ns, payload, 90, 128, req_cb, NULL, 0);
+
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 3);
+
+	parent = g_submitted[0]->parent;
+	ut_check_child(0, parent, 90, 6);
+	ut_check_child(1, parent, 96, 96);
+	ut_check_child(2, parent, 192, 26);
+
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	ut_complete_submitted(2, false);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	/* An I/O within one boundary is not split. */
+	rc = nvme_ns_cmd_read(&ns, payload, 96, 96, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 4);
+	CU_ASSERT(g_submitted[3]->parent == NULL);
+	nvme_free_request(g_submitted[3]);
+
+	CU_ASSERT(g_thread_qpair.split_stats.num_split_ios == 1);
+	CU_ASSERT(g_thread_qpair.split_stats.num_split_cmds == 3);
+	CU_ASSERT(g_thread_qpair.split_stats.num_boundary_splits == 2);
+
+	free(payload);
+}
+
+static void
+split_test_window(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_request	*parent;
+	void			*payload;
+	uint32_t		num_chunks = 300;
+	uint32_t		i;
+	int			rc;
+
+	/*
+	 * Controller has max xfer of 4 KB (8 blocks).  A 1200 KB I/O needs
+	 *  300 children, more than fit in the old 8-bit child count.  Only a
+	 *  window of them is issued up front; each completed child is rebuilt
+	 *  for the next 4 KB and resubmitted.
+	 */
+	prepare_for_test(&ns, &ctrlr, 512, 4 * 1024, 0);
+	payload = malloc(num_chunks * 4 * 1024);
+
+	rc = nvme_ns_cmd_write(&ns, payload, 0, num_chunks * 8, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == NVME_SPLIT_WINDOW);
+
+	parent = g_submitted[0]->parent;
+	for (i = 0; i < num_chunks; i++) {
+		CU_ASSERT_FATAL(i < g_num_submitted);
+		ut_check_child(i, parent, i * 8, 8);
+		CU_ASSERT(g_submitted[i]->io_opc == NVME_OPC_WRITE);
+		if (i >= NVME_SPLIT_WINDOW) {
+			/* Children are recycled rather than allocated. */
+			CU_ASSERT(g_submitted[i] == g_submitted[i - NVME_SPLIT_WINDOW]);
+		}
+		CU_ASSERT(parent->num_children <= NVME_SPLIT_WINDOW);
+		CU_ASSERT(g_req_cb_count == 0);
+		ut_complete_submitted(i, false);
+	}
+
+	CU_ASSERT(g_num_submitted == num_chunks);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+
+	free(payload);
+}
+
+static void
+split_test_error(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	void			*payload;
+	uint32_t		i;
+	int			rc;
+
+	/* A failed child stops the rest of the transfer from being issued. */
+	prepare_for_test(&ns, &ctrlr, 512, 4 * 1024, 0);
+	payload = malloc(20 * 4 * 1024);
+
+	rc = nvme_ns_cmd_read(&ns, payload, 0, 20 * 8, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == NVME_SPLIT_WINDOW);
+
+	ut_complete_submitted(0, true);
+	for (i = 1; i < NVME_SPLIT_WINDOW; i++) {
+		ut_complete_submitted(i, false);
+	}
+
+	CU_ASSERT(g_num_submitted == NVME_SPLIT_WINDOW);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(g_req_cb_error);
 
 	free(payload);
-	nvme_free_request(g_request);
 }
 
 static void
@@ -358,6 +507,821 @@ test_nvme_ns_cmd_deallocate(void)
 	CU_ASSERT(rc != 0);
 }
 
+static void
+test_nvme_ns_cmd_dataset_management(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_dsm_range	ranges[7] = {
+		{ .starting_lba = 100, .length = 10 },
+		{ .starting_lba = 0, .length = 8 },
+		{ .starting_lba = 8, .length = 8 },
+		{ .starting_lba = 4, .length = 2 },
+		{ .starting_lba = 110, .length = 5, .attributes = NVME_DSM_CATTR_SEQUENTIAL_READ },
+		{ .starting_lba = 50, .length = 0 },
+		{ .starting_lba = 105, .length = 10 },
+	};
+	struct nvme_dsm_range	orig[7];
+	struct nvme_dsm_range	*many, *sent;
+	uint32_t		i, num_ranges;
+	int			rc;
+
+	memcpy(orig, ranges, sizeof(orig));
+
+	/* Ranges are sorted, and touching or overlapping ones with equal attributes merged. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_dataset_management(&ns, NVME_DSM_ATTR_DEALLOCATE, ranges, 7,
+					    req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(g_submitted[0]->cmd.opc == NVME_OPC_DATASET_MANAGEMENT);
+	CU_ASSERT(g_submitted[0]->cmd.cdw10 == 2);
+	CU_ASSERT(g_submitted[0]->cmd.cdw11 == NVME_DSM_ATTR_DEALLOCATE);
+	CU_ASSERT(g_submitted[0]->payload_size == 3 * sizeof(struct nvme_dsm_range));
+	sent = g_submitted[0]->u.payload;
+	CU_ASSERT(sent == g_dsm_pages);
+	CU_ASSERT(sent[0].starting_lba == 0 && sent[0].length == 16);
+	CU_ASSERT(sent[1].starting_lba == 100 && sent[1].length == 15);
+	CU_ASSERT(sent[1].attributes == 0);
+	CU_ASSERT(sent[2].starting_lba == 110 && sent[2].length == 5);
+	CU_ASSERT(sent[2].attributes == NVME_DSM_CATTR_SEQUENTIAL_READ);
+	CU_ASSERT(g_thread_qpair.dsm_free_pages == (1u << NVME_QPAIR_DSM_PAGES) - 2);
+	/* The caller's list is left as it was. */
+	CU_ASSERT(memcmp(ranges, orig, sizeof(orig)) == 0);
+	ut_complete_submitted(0, false);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+	CU_ASSERT(g_thread_qpair.dsm_free_pages == (1u << NVME_QPAIR_DSM_PAGES) - 1);
+
+	/* Long lists are packed into full commands, a window at a time. */
+	num_ranges = 3000;
+	many = calloc(num_ranges, sizeof(*many));
+	for (i = 0; i < num_ranges; i++) {
+		many[i].starting_lba = (i + 1) * 2;
+		many[i].length = 1;
+	}
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_dataset_management(&ns, 0, many, num_ranges, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_num_submitted == NVME_SPLIT_WINDOW);
+	CU_ASSERT(g_thread_qpair.dsm_free_pages == 0);
+
+	/* With every range page in use, another request must wait. */
+	rc = nvme_ns_cmd_dataset_management(&ns, 0, ranges, 3, req_cb, NULL);
+	CU_ASSERT(rc == EAGAIN);
+	CU_ASSERT(g_num_submitted == NVME_SPLIT_WINDOW);
+
+	/* Each command's ranges are copied into its page as it is issued. */
+	for (i = 0; i < g_num_submitted; i++) {
+		sent = g_submitted[i]->u.payload;
+		CU_ASSERT(sent == &g_dsm_pages[(i % NVME_SPLIT_WINDOW) * NVME_DSM_MAX_RANGES]);
+		CU_ASSERT(sent[0].starting_lba == 2 + i * NVME_DSM_MAX_RANGES * 2);
+		CU_ASSERT(g_submitted[i]->cmd.cdw10 ==
+			  (i < num_ranges / NVME_DSM_MAX_RANGES ? NVME_DSM_MAX_RANGES - 1 :
+			   num_ranges % NVME_DSM_MAX_RANGES - 1));
+		ut_complete_submitted(i, false);
+	}
+	CU_ASSERT(g_num_submitted == (num_ranges + NVME_DSM_MAX_RANGES - 1) / NVME_DSM_MAX_RANGES);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(g_thread_qpair.dsm_free_pages == (1u << NVME_QPAIR_DSM_PAGES) - 1);
+
+	/* A page that merges down keeps taking ranges until the list runs out. */
+	for (i = 0; i < num_ranges; i++) {
+		many[i].starting_lba = i;
+	}
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_dataset_management(&ns, 0, many, num_ranges, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(g_submitted[0]->cmd.cdw10 == 0);
+	sent = g_submitted[0]->u.payload;
+	CU_ASSERT(sent[0].starting_lba == 0 && sent[0].length == num_ranges);
+	ut_complete_submitted(0, false);
+	CU_ASSERT(g_req_cb_count == 1);
+	free(many);
+
+	/* A qpair allocates its range pages on its first request. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	g_thread_qpair.dsm_pages = NULL;
+	g_thread_qpair.dsm_free_pages = 0;
+	rc = nvme_ns_cmd_dataset_management(&ns, 0, ranges, 7, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_thread_qpair.dsm_pages != NULL);
+	CU_ASSERT(((uintptr_t)g_thread_qpair.dsm_pages & 0xFFF) == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(g_submitted[0]->u.payload == g_thread_qpair.dsm_pages);
+	ut_complete_submitted(0, false);
+	CU_ASSERT(g_thread_qpair.dsm_free_pages == (1u << NVME_QPAIR_DSM_PAGES) - 1);
+	nvme_free(g_thread_qpair.dsm_pages);
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+
+	rc = nvme_ns_cmd_dataset_management(&ns, 0, &ranges[5], 1, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_thread_qpair.dsm_free_pages == (1u << NVME_QPAIR_DSM_PAGES) - 1);
+	rc = nvme_ns_cmd_dataset_management(&ns, 0, ranges, 0, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+}
+
+static void
+test_nvme_ns_cmd_qpair(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair = {};
+	void			*payload;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	payload = malloc(512);
+
+	/* Legacy calls go to the calling thread's queue. */
+	rc = nvme_ns_cmd_read(&ns, payload, 0, 1, NULL, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_qpair == &g_thread_qpair);
+	nvme_free_request(g_request);
+
+	/* Explicit qpair calls go to the given qpair. */
+	rc = nvme_ns_cmd_read_qpair(&ns, &qpair, payload, 0, 1, NULL, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_qpair == &qpair);
+	CU_ASSERT(g_request->io_opc == NVME_OPC_READ);
+	nvme_free_request(g_request);
+
+	rc = nvme_ns_cmd_write_qpair(&ns, &qpair, payload, 0, 1, NULL, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_qpair == &qpair);
+	CU_ASSERT(g_request->io_opc == NVME_OPC_WRITE);
+	nvme_free_request(g_request);
+
+	rc = nvme_ns_cmd_flush_qpair(&ns, &qpair, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_qpair == &qpair);
+	CU_ASSERT(g_request->cmd.opc == NVME_OPC_FLUSH);
+	nvme_free_request(g_request);
+
+	/* No thread queue on this controller. */
+	g_thread_qpair_ptr = NULL;
+	g_request = NULL;
+	rc = nvme_ns_cmd_write(&ns, payload, 0, 1, NULL, NULL, 0);
+	CU_ASSERT(rc == ENXIO);
+	CU_ASSERT(g_request == NULL);
+
+	free(payload);
+}
+
+static void
+test_nvme_ns_cmd_req(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair = {};
+	struct nvme_completion	cpl = {};
+	struct nvme_request	*child;
+	void			*req_buf;
+	void			*payload;
+	uint32_t		i;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	payload = malloc(256 * 1024);
+	req_buf = malloc(nvme_request_size());
+
+	/* Unsplit I/O is built directly in the caller's storage. */
+	rc = nvme_ns_cmd_read_req(&ns, &qpair, req_buf, payload, 0, 1, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_qpair == &qpair);
+	CU_ASSERT_FATAL(g_request == req_buf);
+	CU_ASSERT(g_request->is_caller_owned);
+	CU_ASSERT(g_request->io_opc == NVME_OPC_READ);
+	CU_ASSERT(g_request->payload_size == 512);
+
+	/* Completing it runs the callback but does not free the storage. */
+	nvme_complete_request(g_request, &cpl);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	/* Split I/O: the parent lives in the caller's storage, children in the pool. */
+	g_num_submitted = 0;
+	rc = nvme_ns_cmd_write_req(&ns, &qpair, req_buf, payload, 0, 512, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	CU_ASSERT(((struct nvme_request *)req_buf)->is_split);
+	CU_ASSERT(((struct nvme_request *)req_buf)->num_children == 2);
+
+	for (i = 0; i < 2; i++) {
+		child = g_submitted[i];
+		CU_ASSERT(child != req_buf);
+		CU_ASSERT(child->parent == req_buf);
+		CU_ASSERT(child->io_opc == NVME_OPC_WRITE);
+		ut_complete_submitted(i, false);
+	}
+	CU_ASSERT(g_req_cb_count == 2);
+
+	free(req_buf);
+	free(payload);
+}
+
+static void
+test_nvme_ns_cmd_queue_limit(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair = {};
+	void			*req_buf;
+	void			*payload;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	payload = malloc(256 * 1024);
+	req_buf = malloc(nvme_request_size());
+
+	/* One free tracker and no software queueing. */
+	qpair.is_enabled = true;
+	qpair.num_free_tr = 1;
+	qpair.is_queue_limited = true;
+	qpair.max_queued_req = 0;
+
+	rc = nvme_ns_cmd_read_qpair(&ns, &qpair, payload, 0, 1, NULL, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	nvme_free_request(g_request);
+
+	/* A 256 KB I/O splits into two commands and does not fit. */
+	g_request = NULL;
+	rc = nvme_ns_cmd_read_qpair(&ns, &qpair, payload, 0, 512, NULL, NULL, 0);
+	CU_ASSERT(rc == EAGAIN);
+	CU_ASSERT(g_request == NULL);
+
+	rc = nvme_ns_cmd_write_req(&ns, &qpair, req_buf, payload, 0, 512, NULL, NULL, 0);
+	CU_ASSERT(rc == EAGAIN);
+	CU_ASSERT(g_request == NULL);
+
+	qpair.num_free_tr = 0;
+	rc = nvme_ns_cmd_flush_qpair(&ns, &qpair, NULL, NULL);
+	CU_ASSERT(rc == EAGAIN);
+	CU_ASSERT(g_request == NULL);
+
+	free(req_buf);
+	free(payload);
+}
+
+static void
+test_nvme_ns_cmd_iov(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_request	*parent;
+	struct iovec		iov[3];
+	uint8_t			*buf;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	buf = aligned_alloc(4096, 4 * 4096);
+	CU_ASSERT_FATAL(buf != NULL);
+
+	/* Page-aligned elements make up one PRP list, so one command. */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 4096;
+	iov[1].iov_base = buf + 4096;
+	iov[1].iov_len = 8192;
+	iov[2].iov_base = buf + 3 * 4096;
+	iov[2].iov_len = 4096;
+	rc = nvme_ns_cmd_readv(&ns, 0, 32, iov, 3, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(!g_request->is_split);
+	CU_ASSERT(g_request->payload_type == NVME_PAYLOAD_TYPE_IOV);
+	CU_ASSERT(g_request->u.iov == iov);
+	CU_ASSERT(g_request->iov_offset == 0);
+	CU_ASSERT(g_request->payload_size == 32 * 512);
+	CU_ASSERT(g_request->io_opc == NVME_OPC_READ);
+	nvme_free_request(g_request);
+
+	/* An element ending within a page ends the command there. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	iov[1].iov_len = 1024;
+	iov[2].iov_base = buf + 2 * 4096;
+	iov[2].iov_len = 3072;
+	rc = nvme_ns_cmd_writev(&ns, 0, 16, iov, 3, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	parent = g_submitted[0]->parent;
+	ut_check_child(0, parent, 0, 10);
+	ut_check_child(1, parent, 10, 6);
+	CU_ASSERT(parent->payload_type == NVME_PAYLOAD_TYPE_IOV);
+	CU_ASSERT(g_submitted[0]->payload_type == NVME_PAYLOAD_TYPE_IOV);
+	CU_ASSERT(g_submitted[0]->u.iov == &iov[0]);
+	CU_ASSERT(g_submitted[1]->u.iov == &iov[2]);
+	CU_ASSERT(g_submitted[1]->iov_offset == 0);
+	CU_ASSERT(g_submitted[1]->io_opc == NVME_OPC_WRITE);
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+
+	/* Splits for the transfer size fall within an element. */
+	prepare_for_test(&ns, &ctrlr, 512, 4 * 1024, 0);
+	iov[0].iov_len = 8192;
+	rc = nvme_ns_cmd_readv(&ns, 0, 16, iov, 1, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	parent = g_submitted[0]->parent;
+	ut_check_child(0, parent, 0, 8);
+	ut_check_child(1, parent, 8, 8);
+	CU_ASSERT(g_submitted[1]->u.iov == &iov[0]);
+	CU_ASSERT(g_submitted[1]->iov_offset == 4096);
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	/* The scatter list must cover the transfer exactly. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_readv(&ns, 0, 15, iov, 1, req_cb, NULL, 0);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_readv(&ns, 0, 16, iov, 0, req_cb, NULL, 0);
+	CU_ASSERT(rc == EINVAL);
+
+	/* A boundary that cannot be a command boundary is rejected. */
+	iov[0].iov_len = 256;
+	iov[1].iov_len = 256;
+	rc = nvme_ns_cmd_readv(&ns, 0, 1, iov, 2, req_cb, NULL, 0);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 0);
+
+	free(buf);
+}
+
+static void
+test_nvme_ns_cmd_iov_sgl(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_request	*parent;
+	struct iovec		iov[3];
+	struct iovec		big_iov[20];
+	uint8_t			*buf;
+	uint32_t		i;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ctrlr.sgl_supported = true;
+	buf = aligned_alloc(4096, 40 * 4096);
+	CU_ASSERT_FATAL(buf != NULL);
+
+	/* A list a PRP list can describe still uses one. */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 8192;
+	rc = nvme_ns_cmd_readv(&ns, 0, 16, iov, 1, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(!g_request->is_split);
+	CU_ASSERT(!g_request->use_sgl);
+	nvme_free_request(g_request);
+
+	/* Elements ending within pages and sectors fit in one command. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ctrlr.sgl_supported = true;
+	iov[0].iov_base = buf + 100;
+	iov[0].iov_len = 1000;
+	iov[1].iov_base = buf + 2 * 4096;
+	iov[1].iov_len = 300;
+	iov[2].iov_base = buf + 3 * 4096 + 8;
+	iov[2].iov_len = 1772;
+	rc = nvme_ns_cmd_writev(&ns, 0, 6, iov, 3, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(!g_request->is_split);
+	CU_ASSERT(g_request->use_sgl);
+	CU_ASSERT(g_request->payload_size == 6 * 512);
+	nvme_free_request(g_request);
+
+	/*
+	 * Page-sized elements starting mid-page each need two descriptors,
+	 *  so one segment carries 8 of them.
+	 */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ctrlr.sgl_supported = true;
+	for (i = 0; i < 20; i++) {
+		big_iov[i].iov_base = buf + i * 2 * 4096 + 512;
+		big_iov[i].iov_len = 4096;
+	}
+	rc = nvme_ns_cmd_readv(&ns, 0, 20 * 8, big_iov, 20, req_cb, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 3);
+	parent = g_submitted[0]->parent;
+	ut_check_child(0, parent, 0, 64);
+	ut_check_child(1, parent, 64, 64);
+	ut_check_child(2, parent, 128, 32);
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(g_submitted[i]->use_sgl);
+		CU_ASSERT(g_submitted[i]->u.iov == &big_iov[i * 8]);
+		CU_ASSERT(g_submitted[i]->iov_offset == 0);
+		ut_complete_submitted(i, false);
+	}
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+
+	free(buf);
+}
+
+static void
+test_nvme_ns_cmd_write_zeroes(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_request	*parent;
+	int			rc;
+
+	/* No data is transferred, so the transfer size does not limit it. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_write_zeroes(&ns, 0x1000, 4096, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	CU_ASSERT(!g_request->is_split);
+	CU_ASSERT(g_request->payload_size == 0);
+	CU_ASSERT(g_request->io_opc == NVME_OPC_WRITE_ZEROES);
+	CU_ASSERT(g_request->io_lba == 0x1000);
+	CU_ASSERT(g_request->io_cdw12 == 4095);
+	nvme_free_request(g_request);
+
+	/* The 16-bit block count does. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_write_zeroes(&ns, 0, NVME_MAX_IO_BLOCKS + 8, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	parent = g_submitted[0]->parent;
+	CU_ASSERT(g_submitted[0]->payload_size == 0);
+	CU_ASSERT(g_submitted[0]->io_lba == 0);
+	CU_ASSERT(g_submitted[0]->io_cdw12 == NVME_MAX_IO_BLOCKS - 1);
+	CU_ASSERT(g_submitted[1]->parent == parent);
+	CU_ASSERT(g_submitted[1]->payload_size == 0);
+	CU_ASSERT(g_submitted[1]->io_lba == NVME_MAX_IO_BLOCKS);
+	CU_ASSERT(g_submitted[1]->io_cdw12 == 7);
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	/* Stripe boundaries are honoured as for writes. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 128 * 1024);
+	rc = nvme_ns_cmd_write_uncorrectable(&ns, 200, 100, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	CU_ASSERT(g_submitted[0]->io_opc == NVME_OPC_WRITE_UNCORRECTABLE);
+	CU_ASSERT(g_submitted[0]->io_lba == 200);
+	CU_ASSERT(g_submitted[0]->io_cdw12 == 55);
+	CU_ASSERT(g_submitted[1]->io_lba == 256);
+	CU_ASSERT(g_submitted[1]->io_cdw12 == 43);
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	rc = nvme_ns_cmd_write_zeroes(&ns, 0, 0, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+}
+
+static void
+test_nvme_ns_cmd_compare(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	void			*payload, *md;
+	int			rc;
+
+	/* Compares carry data and split like reads. */
+	prepare_for_test(&ns, &ctrlr, 512, 4 * 1024, 0);
+	payload = malloc(2 * 4096);
+
+	rc = nvme_ns_cmd_compare(&ns, payload, 0, 16, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	ut_check_child(0, g_submitted[0]->parent, 0, 8);
+	ut_check_child(1, g_submitted[0]->parent, 8, 8);
+	CU_ASSERT(g_submitted[0]->io_opc == NVME_OPC_COMPARE);
+	CU_ASSERT(g_submitted[1]->u.payload == (uint8_t *)payload + 4096);
+
+	/* A miscompare fails the whole compare. */
+	ut_complete_submitted(0, true);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(g_req_cb_error);
+
+	/* With separate metadata, compares need the metadata variant. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.md_size = 8;
+	ns.pi_type = NVME_PI_TYPE1;
+	md = malloc(8 * 8);
+	rc = nvme_ns_cmd_compare(&ns, payload, 0, 8, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_compare_with_md(&ns, payload, md, 10, 8, NULL, NULL,
+					 NVME_IO_FLAGS_PRCHK_GUARD, 0, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->io_opc == NVME_OPC_COMPARE);
+	CU_ASSERT(g_request->has_md);
+	CU_ASSERT(g_request->md == md);
+	CU_ASSERT(g_request->io_reftag == 10);
+	CU_ASSERT(g_request->io_cdw12 == (NVME_IO_FLAGS_PRCHK_GUARD | 7));
+	nvme_free_request(g_request);
+
+	free(md);
+	free(payload);
+}
+
+static void
+ut_complete_status(struct nvme_request *req, uint32_t sct, uint32_t sc)
+{
+	struct nvme_completion cpl = {};
+
+	cpl.status.sct = sct;
+	cpl.status.sc = sc;
+	nvme_complete_request(req, &cpl);
+}
+
+static void
+test_nvme_ns_cmd_compare_and_write(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_request	*compare, *write;
+	void			*cmp_buf, *wr_buf, *cmp_md, *wr_md;
+	uint32_t		io_flags;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	cmp_buf = malloc(4096);
+	wr_buf = malloc(4096);
+
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0x100, 8, req_cb, NULL);
+	CU_ASSERT(rc == ENOTSUP);
+	CU_ASSERT(g_num_submitted == 0);
+
+	ns.flags |= NVME_NS_COMPARE_AND_WRITE_SUPPORTED;
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0x100, 0, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0x100, 257, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 0);
+
+	/* Only the compare is handed down; the write travels with it. */
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0x100, 8, req_cb, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	compare = g_submitted[0];
+	write = compare->fused_next;
+	CU_ASSERT_FATAL(write != NULL);
+	CU_ASSERT(nvme_request_fuse(compare) == NVME_CMD_FUSE_FIRST);
+	CU_ASSERT(nvme_request_fuse(write) == NVME_CMD_FUSE_SECOND);
+	CU_ASSERT(compare->cmd.opc == NVME_OPC_COMPARE);
+	CU_ASSERT(write->cmd.opc == NVME_OPC_WRITE);
+	CU_ASSERT(compare->u.payload == cmp_buf);
+	CU_ASSERT(write->u.payload == wr_buf);
+	CU_ASSERT(compare->payload_size == 4096);
+	CU_ASSERT(write->payload_size == 4096);
+	CU_ASSERT(compare->cmd.cdw10 == 0x100 && write->cmd.cdw10 == 0x100);
+	CU_ASSERT(compare->cmd.cdw12 == 7 && write->cmd.cdw12 == 7);
+	CU_ASSERT(compare->parent == write->parent);
+
+	ut_complete_status(compare, NVME_SCT_GENERIC, NVME_SC_SUCCESS);
+	CU_ASSERT(g_req_cb_count == 0);
+	ut_complete_status(write, NVME_SCT_GENERIC, NVME_SC_SUCCESS);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+
+	/* A miscompare is reported against the compare, whichever half completes first. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.flags |= NVME_NS_COMPARE_AND_WRITE_SUPPORTED;
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0, 8, req_cb, NULL);
+	CU_ASSERT_FATAL(rc == 0);
+	compare = g_submitted[0];
+	write = compare->fused_next;
+	ut_complete_status(write, NVME_SCT_GENERIC, NVME_SC_ABORTED_FAILED_FUSED);
+	ut_complete_status(compare, NVME_SCT_MEDIA_ERROR, NVME_SC_COMPARE_FAILURE);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(g_req_cb_error);
+	CU_ASSERT(g_req_cb_cpl.status.sct == NVME_SCT_MEDIA_ERROR);
+	CU_ASSERT(g_req_cb_cpl.status.sc == NVME_SC_COMPARE_FAILURE);
+	CU_ASSERT(g_req_cb_cpl.cdw0 == NVME_CMD_FUSE_FIRST);
+
+	/* A failed write is reported against the write. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.flags |= NVME_NS_COMPARE_AND_WRITE_SUPPORTED;
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0, 8, req_cb, NULL);
+	CU_ASSERT_FATAL(rc == 0);
+	compare = g_submitted[0];
+	write = compare->fused_next;
+	ut_complete_status(compare, NVME_SCT_GENERIC, NVME_SC_SUCCESS);
+	ut_complete_status(write, NVME_SCT_MEDIA_ERROR, NVME_SC_WRITE_FAULTS);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(g_req_cb_cpl.status.sc == NVME_SC_WRITE_FAULTS);
+	CU_ASSERT(g_req_cb_cpl.cdw0 == NVME_CMD_FUSE_SECOND);
+
+	/* With separate metadata, both halves carry their own metadata and PRINFO. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.flags |= NVME_NS_COMPARE_AND_WRITE_SUPPORTED;
+	ns.md_size = 8;
+	ns.pi_type = NVME_PI_TYPE1;
+	cmp_md = malloc(8 * 8);
+	wr_md = malloc(8 * 8);
+	rc = nvme_ns_cmd_compare_and_write(&ns, cmp_buf, wr_buf, 0x100, 8, req_cb, NULL);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 0);
+	rc = nvme_ns_cmd_compare_and_write_with_md(&ns, cmp_buf, NULL, wr_buf, wr_md, 0x100, 8,
+						   req_cb, NULL, 0, 0, 0);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 0);
+
+	io_flags = NVME_IO_FLAGS_PRCHK_GUARD | NVME_IO_FLAGS_PRCHK_APPTAG |
+		   NVME_IO_FLAGS_FORCE_UNIT_ACCESS;
+	rc = nvme_ns_cmd_compare_and_write_with_md(&ns, cmp_buf, cmp_md, wr_buf, wr_md, 0x100, 8,
+						   req_cb, NULL, io_flags, 0xFFFF, 0x1234);
+	CU_ASSERT_FATAL(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 1);
+	compare = g_submitted[0];
+	write = compare->fused_next;
+	CU_ASSERT_FATAL(write != NULL);
+	CU_ASSERT(compare->has_md && compare->md == cmp_md);
+	CU_ASSERT(write->has_md && write->md == wr_md);
+	CU_ASSERT(compare->payload_size == 4096 && write->payload_size == 4096);
+	CU_ASSERT(compare->cmd.cdw12 == (io_flags | 7));
+	CU_ASSERT(write->cmd.cdw12 == (io_flags | 7));
+	CU_ASSERT(compare->cmd.cdw14 == 0x100 && write->cmd.cdw14 == 0x100);
+	CU_ASSERT(compare->cmd.cdw15 == 0xFFFF1234 && write->cmd.cdw15 == 0xFFFF1234);
+	ut_complete_status(compare, NVME_SCT_GENERIC, NVME_SC_SUCCESS);
+	ut_complete_status(write, NVME_SCT_GENERIC, NVME_SC_SUCCESS);
+	CU_ASSERT(g_req_cb_count == 1);
+	CU_ASSERT(!g_req_cb_error);
+
+	free(cmp_md);
+	free(wr_md);
+	free(cmp_buf);
+	free(wr_buf);
+}
+
+static void
+test_nvme_ns_cmd_io_flags(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	void			*payload;
+	uint32_t		io_flags;
+	uint32_t		i;
+	int			rc;
+
+	io_flags = NVME_IO_FLAGS_FORCE_UNIT_ACCESS | NVME_IO_FLAGS_LIMITED_RETRY |
+		   NVME_IO_FLAGS_ACCESS_LATENCY(NVME_DSM_LATENCY_LOW) |
+		   NVME_IO_FLAGS_ACCESS_FREQUENCY(NVME_DSM_FREQ_FREQUENT);
+	payload = malloc(256 * 1024);
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_write(&ns, payload, 0, 8, NULL, NULL, io_flags);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->io_cdw12 == (NVME_IO_FLAGS_FORCE_UNIT_ACCESS |
+					  NVME_IO_FLAGS_LIMITED_RETRY | 7));
+	CU_ASSERT(g_request->io_dsm == 0x35);
+	nvme_free_request(g_request);
+
+	/* Every child of a split I/O carries the flags. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_write(&ns, payload, 0, 512, req_cb, NULL,
+			       NVME_IO_FLAGS_FORCE_UNIT_ACCESS);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 2);
+	for (i = 0; i < 2; i++) {
+		CU_ASSERT(g_submitted[i]->io_cdw12 == (NVME_IO_FLAGS_FORCE_UNIT_ACCESS | 255));
+		CU_ASSERT(g_submitted[i]->io_dsm == 0);
+	}
+	ut_complete_submitted(0, false);
+	ut_complete_submitted(1, false);
+	CU_ASSERT(g_req_cb_count == 1);
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_read(&ns, payload, 0, 8, NULL, NULL, 1U << 16);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 0);
+
+	free(payload);
+}
+
+static void
+test_nvme_ns_cmd_pi(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	uint8_t			*payload, *md;
+	uint32_t		prinfo;
+	uint32_t		i;
+	int			rc;
+
+	prinfo = NVME_IO_FLAGS_PRCHK_GUARD | NVME_IO_FLAGS_PRCHK_REFTAG;
+	payload = malloc(256 * 1024);
+	md = malloc(20 * 16);
+
+	/* Extended LBAs carry the metadata in the payload. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.md_size = 8;
+	ns.extended_lba_size = 520;
+	ns.pi_type = NVME_PI_TYPE1;
+	rc = nvme_ns_cmd_read(&ns, payload, 10, 8, NULL, NULL, prinfo);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->payload_size == 8 * 520);
+	CU_ASSERT(g_request->io_cdw12 == (prinfo | 7));
+	CU_ASSERT(g_request->has_md);
+	CU_ASSERT(g_request->md == NULL);
+	CU_ASSERT(g_request->io_reftag == 10);
+	CU_ASSERT(g_request->io_apptag == 0);
+	nvme_free_request(g_request);
+
+	/* With PRACT, protection information that is all of the metadata is not transferred. */
+	g_request = NULL;
+	rc = nvme_ns_cmd_write_with_md(&ns, payload, NULL, 0x100000020ULL, 8, NULL, NULL,
+				       NVME_IO_FLAGS_PRACT | prinfo, 0xFF00, 0x1234);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->payload_size == 8 * 512);
+	CU_ASSERT(g_request->io_cdw12 == (NVME_IO_FLAGS_PRACT | prinfo | 7));
+	CU_ASSERT(g_request->io_reftag == 0x20);
+	CU_ASSERT(g_request->io_apptag == 0xFF001234);
+	nvme_free_request(g_request);
+
+	/* I/O without protection information flags leaves the extra fields alone. */
+	g_request = NULL;
+	rc = nvme_ns_cmd_read(&ns, payload, 0, 8, NULL, NULL, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->payload_size == 8 * 520);
+	CU_ASSERT(!g_request->has_md);
+	nvme_free_request(g_request);
+
+	/* A separate metadata buffer does not fit extended LBAs. */
+	rc = nvme_ns_cmd_read_with_md(&ns, payload, md, 0, 8, NULL, NULL, 0, 0, 0);
+	CU_ASSERT(rc == EINVAL);
+
+	/* Separate metadata advances with each child of a split I/O. */
+	prepare_for_test(&ns, &ctrlr, 512, 4096, 0);
+	ns.md_size = 16;
+	ns.pi_type = NVME_PI_TYPE1;
+	rc = nvme_ns_cmd_read_with_md(&ns, payload, md, 100, 20, req_cb, NULL, prinfo, 0, 0);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_num_submitted == 3);
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(g_submitted[i]->has_md);
+		CU_ASSERT(g_submitted[i]->md == md + i * 8 * 16);
+		CU_ASSERT(g_submitted[i]->io_reftag == 100 + i * 8);
+		CU_ASSERT(g_submitted[i]->io_cdw12 == (prinfo | (i < 2 ? 7 : 3)));
+		CU_ASSERT(g_submitted[i]->payload_size == (i < 2 ? 8 : 4) * 512);
+	}
+	for (i = 0; i < 3; i++) {
+		ut_complete_submitted(i, false);
+	}
+	CU_ASSERT(g_req_cb_count == 1);
+
+	/* The metadata pointer must be dword aligned. */
+	rc = nvme_ns_cmd_read_with_md(&ns, payload, md + 2, 0, 8, NULL, NULL, 0, 0, 0);
+	CU_ASSERT(rc == EINVAL);
+
+	/* Separate metadata needs a buffer, with or without protection information flags... */
+	rc = nvme_ns_cmd_read(&ns, payload, 0, 8, NULL, NULL, 0);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_read_with_md(&ns, payload, NULL, 0, 8, NULL, NULL, prinfo, 0, 0);
+	CU_ASSERT(rc == EINVAL);
+
+	/* ...and with PRACT if there is more metadata than the protection information. */
+	rc = nvme_ns_cmd_write_with_md(&ns, payload, NULL, 0, 8, NULL, NULL,
+				       NVME_IO_FLAGS_PRACT | prinfo, 0, 0);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 3);
+
+	ns.md_size = 8;
+	g_request = NULL;
+	rc = nvme_ns_cmd_write(&ns, payload, 0, 8, NULL, NULL, NVME_IO_FLAGS_PRACT);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->payload_size == 8 * 512);
+	CU_ASSERT(g_request->has_md);
+	CU_ASSERT(g_request->md == NULL);
+	nvme_free_request(g_request);
+
+	/* Commands that transfer no data transfer no metadata either. */
+	g_request = NULL;
+	rc = nvme_ns_cmd_write_zeroes(&ns, 0, 8, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(!g_request->has_md);
+	nvme_free_request(g_request);
+
+	/* Protection information flags need a namespace formatted with it. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	rc = nvme_ns_cmd_write(&ns, payload, 0, 8, NULL, NULL, NVME_IO_FLAGS_PRACT);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_write_with_md(&ns, payload, md, 0, 8, NULL, NULL, 0, 0, 0);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_num_submitted == 0);
+
+	free(md);
+	free(payload);
+}
+
 int main(int argc, char **argv)
 {
 	CU_pSuite	suite = NULL;
@@ -378,8 +1342,24 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "split_test2", split_test2) == NULL
 		|| CU_add_test(suite, "split_test3", split_test3) == NULL
 		|| CU_add_test(suite, "split_test4", split_test4) == NULL
+		|| CU_add_test(suite, "split_test_boundary", split_test_boundary) == NULL
+		|| CU_add_test(suite, "split_test_window", split_test_window) == NULL
+		|| CU_add_test(suite, "split_test_error", split_test_error) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_flush testing", test_nvme_ns_cmd_flush) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_deallocate testing", test_nvme_ns_cmd_deallocate) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_qpair testing", test_nvme_ns_cmd_qpair) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_req testing", test_nvme_ns_cmd_req) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_queue_limit testing", test_nvme_ns_cmd_queue_limit) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_iov testing", test_nvme_ns_cmd_iov) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_iov_sgl testing", test_nvme_ns_cmd_iov_sgl) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_write_zeroes testing", test_nvme_ns_cmd_write_zeroes) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_compare testing", test_nvme_ns_cmd_compare) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_io_flags testing", test_nvme_ns_cmd_io_flags) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_pi testing", test_nvme_ns_cmd_pi) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_dataset_management testing",
+			       test_nvme_ns_cmd_dataset_management) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_compare_and_write testing",
+			       test_nvme_ns_cmd_compare_and_write) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
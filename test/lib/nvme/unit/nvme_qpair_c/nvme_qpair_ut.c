@@ -45,9 +45,11 @@ int32_t nvme_retry_count = 1;
 char outbuf[OUTBUF_SIZE];
 
 bool fail_vtophys = false;
+uint32_t g_vtophys_calls;
 
 uint64_t nvme_vtophys(void *buf)
 {
+	g_vtophys_calls++;
 	if (fail_vtophys) {
 		return (uint64_t) - 1;
 	} else {
@@ -61,21 +63,21 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 {
 	struct nvme_request *req = NULL;
 
-	nvme_alloc_request(&req);
+	req = malloc(sizeof(*req));
 
 	if (req == NULL) {
 		return req;
 	}
 
 	/*
-	 * Only memset up to (but not including) the children
-	 *  TAILQ_ENTRY.  children, and following members, are
-	 *  only used as part of I/O splitting so we avoid
-	 *  memsetting them until it is actually needed.
-	 *  They will be initialized in nvme_request_add_child()
-	 *  if the request is split.
+	 * Only memset up to (but not including) the split cursor.
+	 *  It, and following members, are only used as part of I/O
+	 *  splitting so we avoid memsetting them until it is
+	 *  actually needed.  They will be initialized when the
+	 *  request is split.
 	 */
-	memset(req, 0, offsetof(struct nvme_request, children));
+	memset(req, 0, offsetof(struct nvme_request, split_ns));
+	memset(&req->cmd, 0, sizeof(req->cmd));
 	req->cb_fn = cb_fn;
 	req->cb_arg = cb_arg;
 	req->timeout = true;
@@ -96,7 +98,7 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 void
 nvme_free_request(struct nvme_request *req)
 {
-	nvme_dealloc_request(req);
+	free(req);
 }
 
 static void
@@ -169,20 +171,17 @@ ut_insert_cq_entry(struct nvme_qpair *qpair, uint32_t slot)
 	struct nvme_tracker *tr;
 	struct nvme_completion	*cpl;
 
-	nvme_alloc_request(&req);
+	req = malloc(sizeof(*req));
 	memset(req, 0, sizeof(*req));
-	req->cmd.cid = slot;
 
-	tr = LIST_FIRST(&qpair->free_tr);
-	LIST_REMOVE(tr, list); /* remove tr from free_tr */
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
-	tr->cid = slot;
+	CU_ASSERT_FATAL(qpair->num_free_tr > 0);
+	tr = &qpair->tr[qpair->free_tr[--qpair->num_free_tr]];
 	tr->req = req;
-	qpair->act_tr[tr->cid] = tr;
+	req->cmd.cid = tr->cid;
 
 	cpl = &qpair->cpl[slot];
 	cpl->status.p = qpair->phase;
-	cpl->cid = slot;
+	cpl->cid = tr->cid;
 }
 
 static void
@@ -287,6 +286,505 @@ test_ctrlr_failed(void)
 	cleanup_submit_request_test(&qpair);
 }
 
+static void
+test_nvme_qpair_io_cmd(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_command	*sqe;
+	struct nvme_completion	cpl = {};
+	void			*payload = NULL;
+	uint16_t		cid;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT_FATAL(posix_memalign(&payload, 4096, 8192) == 0);
+
+	req = nvme_allocate_request(payload, 8192, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	req->is_io_cmd = true;
+	req->io_opc = NVME_OPC_WRITE;
+	req->io_nsid = 3;
+	req->io_lba = 0x123456789ull;
+	req->io_cdw12 = NVME_IO_FLAGS_FORCE_UNIT_ACCESS | 15;
+	req->io_dsm = NVME_IO_FLAGS_SEQUENTIAL_REQUEST | NVME_DSM_FREQ_TYPICAL;
+	/* Poison the staged command; LBA-addressed I/O must not use it. */
+	memset(&req->cmd, 0xFF, sizeof(req->cmd));
+
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 1);
+
+	sqe = &qpair.cmd[0];
+	cid = sqe->cid;
+	CU_ASSERT(sqe->opc == NVME_OPC_WRITE);
+	CU_ASSERT(sqe->fuse == 0);
+	CU_ASSERT(sqe->psdt == NVME_PSDT_PRP);
+	CU_ASSERT(sqe->nsid == 3);
+	CU_ASSERT(sqe->mptr == 0);
+	CU_ASSERT(sqe->cdw10 == 0x23456789);
+	CU_ASSERT(sqe->cdw11 == 0x1);
+	CU_ASSERT(sqe->cdw12 == (NVME_IO_FLAGS_FORCE_UNIT_ACCESS | 15));
+	CU_ASSERT(sqe->cdw13 == 0x41);
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)payload);
+	CU_ASSERT(sqe->dptr.prp.prp2 == (uintptr_t)payload + 4096);
+	CU_ASSERT(qpair.tr[cid].req == req);
+
+	/* A retryable error rebuilds the same entry in the next slot. */
+	cpl.cid = cid;
+	cpl.status.sct = NVME_SCT_GENERIC;
+	cpl.status.sc = NVME_SC_NAMESPACE_NOT_READY;
+	nvme_qpair_complete_tracker(&qpair, &qpair.tr[cid], &cpl, false);
+	CU_ASSERT_FATAL(qpair.sq_tail == 2);
+	CU_ASSERT(memcmp(&qpair.cmd[1], &qpair.cmd[0], sizeof(struct nvme_command)) == 0);
+	CU_ASSERT(req->retries == 1);
+
+	free(payload);
+	cleanup_submit_request_test(&qpair);
+	nvme_free_request(req);
+}
+
+static void
+test_nvme_qpair_io_cmd_md(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_command	*sqe;
+	struct nvme_completion	cpl = {};
+	void			*payload = NULL;
+	uint64_t		md[8];
+	uint16_t		cid;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT_FATAL(posix_memalign(&payload, 4096, 4096) == 0);
+
+	req = nvme_allocate_request(payload, 4096, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	req->is_io_cmd = true;
+	req->io_opc = NVME_OPC_READ;
+	req->io_nsid = 1;
+	req->io_lba = 0x100000040ull;
+	req->io_cdw12 = NVME_IO_FLAGS_PRCHK_GUARD | NVME_IO_FLAGS_PRCHK_REFTAG | 7;
+	req->has_md = true;
+	req->md = md;
+	req->io_reftag = 0x40;
+	req->io_apptag = 0xFFFF0055;
+
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 1);
+
+	sqe = &qpair.cmd[0];
+	cid = sqe->cid;
+	CU_ASSERT(sqe->mptr == (uintptr_t)md);
+	CU_ASSERT(sqe->cdw12 == (NVME_IO_FLAGS_PRCHK_GUARD | NVME_IO_FLAGS_PRCHK_REFTAG | 7));
+	CU_ASSERT(sqe->cdw14 == 0x40);
+	CU_ASSERT(sqe->cdw15 == 0xFFFF0055);
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)payload);
+
+	/* A retry reuses the translated metadata pointer. */
+	cpl.cid = cid;
+	cpl.status.sct = NVME_SCT_GENERIC;
+	cpl.status.sc = NVME_SC_NAMESPACE_NOT_READY;
+	nvme_qpair_complete_tracker(&qpair, &qpair.tr[cid], &cpl, false);
+	CU_ASSERT_FATAL(qpair.sq_tail == 2);
+	CU_ASSERT(memcmp(&qpair.cmd[1], &qpair.cmd[0], sizeof(struct nvme_command)) == 0);
+
+	free(payload);
+	cleanup_submit_request_test(&qpair);
+	nvme_free_request(req);
+}
+
+static void
+test_nvme_qpair_iov_prp(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_tracker	*tr;
+	struct nvme_command	*sqe;
+	struct iovec		iov[3];
+	uint8_t			*buf = NULL;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT_FATAL(posix_memalign((void **)&buf, 4096, 5 * 4096) == 0);
+
+	/* The first element may start and the last may end within a page. */
+	iov[0].iov_base = buf + 512;
+	iov[0].iov_len = 4096 - 512;
+	iov[1].iov_base = buf + 2 * 4096;
+	iov[1].iov_len = 2 * 4096;
+	iov[2].iov_base = buf + 4 * 4096;
+	iov[2].iov_len = 1024;
+
+	req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	req->payload_type = NVME_PAYLOAD_TYPE_IOV;
+	req->u.iov = iov;
+	req->payload_size = 3584 + 8192 + 1024;
+
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 1);
+
+	sqe = &qpair.cmd[0];
+	tr = &qpair.tr[sqe->cid];
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)buf + 512);
+	CU_ASSERT(sqe->dptr.prp.prp2 == tr->prp_bus_addr);
+	CU_ASSERT(tr->prp[0] == (uintptr_t)buf + 2 * 4096);
+	CU_ASSERT(tr->prp[1] == (uintptr_t)buf + 3 * 4096);
+	CU_ASSERT(tr->prp[2] == (uintptr_t)buf + 4 * 4096);
+	nvme_free_request(req);
+
+	/* An element ending within a page cannot be followed in one list. */
+	iov[1].iov_len = 1024;
+	req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	req->payload_type = NVME_PAYLOAD_TYPE_IOV;
+	req->u.iov = iov;
+	req->payload_size = 3584 + 1024 + 1024;
+
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(qpair.sq_tail == 1);
+
+	free(buf);
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_iov_sgl(void)
+{
+	struct nvme_qpair		qpair = {};
+	struct nvme_request		*req;
+	struct nvme_controller		ctrlr = {};
+	struct nvme_registers		regs = {};
+	struct nvme_tracker		*tr;
+	struct nvme_command		*sqe;
+	struct nvme_sgl_descriptor	*sgl;
+	struct iovec			iov[3];
+	uint8_t				*buf = NULL;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT_FATAL(posix_memalign((void **)&buf, 4096, 4 * 4096) == 0);
+
+	/* Contiguous elements collapse into one data block in the command. */
+	iov[0].iov_base = buf + 100;
+	iov[0].iov_len = 4000;
+	iov[1].iov_base = buf + 4100;
+	iov[1].iov_len = 5000;
+
+	req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	req->payload_type = NVME_PAYLOAD_TYPE_IOV;
+	req->use_sgl = true;
+	req->u.iov = iov;
+	req->payload_size = 9000;
+
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 1);
+
+	sqe = &qpair.cmd[0];
+	CU_ASSERT(sqe->psdt == NVME_PSDT_SGL_MPTR_CONTIG);
+	CU_ASSERT(sqe->dptr.sgl1.type == NVME_SGL_TYPE_DATA_BLOCK);
+	CU_ASSERT(sqe->dptr.sgl1.address == (uintptr_t)buf + 100);
+	CU_ASSERT(sqe->dptr.sgl1.length == 9000);
+	nvme_free_request(req);
+
+	/* Otherwise the descriptors go in the tracker's list. */
+	iov[1].iov_base = buf + 3 * 4096 + 8;
+	iov[1].iov_len = 300;
+	iov[2].iov_base = buf + 2 * 4096;
+	iov[2].iov_len = 700;
+
+	req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	req->payload_type = NVME_PAYLOAD_TYPE_IOV;
+	req->use_sgl = true;
+	req->u.iov = iov;
+	req->iov_offset = 1000;
+	req->payload_size = 3000 + 300 + 512;
+
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 2);
+
+	sqe = &qpair.cmd[1];
+	tr = &qpair.tr[sqe->cid];
+	sgl = (struct nvme_sgl_descriptor *)tr->prp;
+	CU_ASSERT(sqe->psdt == NVME_PSDT_SGL_MPTR_CONTIG);
+	CU_ASSERT(sqe->dptr.sgl1.type == NVME_SGL_TYPE_LAST_SEGMENT);
+	CU_ASSERT(sqe->dptr.sgl1.address == tr->prp_bus_addr);
+	CU_ASSERT(sqe->dptr.sgl1.length == 3 * sizeof(*sgl));
+	CU_ASSERT(sgl[0].address == (uintptr_t)buf + 1100);
+	CU_ASSERT(sgl[0].length == 3000);
+	CU_ASSERT(sgl[0].type == NVME_SGL_TYPE_DATA_BLOCK);
+	CU_ASSERT(sgl[1].address == (uintptr_t)buf + 3 * 4096 + 8);
+	CU_ASSERT(sgl[1].length == 300);
+	CU_ASSERT(sgl[2].address == (uintptr_t)buf + 2 * 4096);
+	CU_ASSERT(sgl[2].length == 512);
+	nvme_free_request(req);
+
+	free(buf);
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_chained_prp(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_tracker	*tr;
+	struct nvme_command	*sqe;
+	uint8_t			*buf = NULL;
+	uint32_t		i;
+
+	/* 4 MiB takes a list of 1024 entries, chained across three pages. */
+	memset(&ctrlr, 0, sizeof(ctrlr));
+	ctrlr.regs = &regs;
+	ctrlr.max_xfer_size = 1024 * 4096;
+	nvme_qpair_construct(&qpair, 1, 128, 4, &ctrlr);
+	qpair.is_enabled = true;
+	CU_ASSERT(qpair.prp_list_entries == 1024);
+	CU_ASSERT(qpair.prp_list_size == 3 * 4096);
+	CU_ASSERT_FATAL(posix_memalign((void **)&buf, 4096, 1025 * 4096) == 0);
+
+	/* 1023 list entries fill the second page without another chain. */
+	req = nvme_allocate_request(buf, 1024 * 4096, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 1);
+
+	sqe = &qpair.cmd[0];
+	tr = &qpair.tr[sqe->cid];
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)buf);
+	CU_ASSERT(sqe->dptr.prp.prp2 == tr->prp_bus_addr);
+	for (i = 0; i < 511; i++) {
+		CU_ASSERT(tr->prp[i] == (uintptr_t)buf + (i + 1) * 4096);
+	}
+	CU_ASSERT(tr->prp[511] == tr->prp_bus_addr + 4096);
+	for (i = 512; i < 1024; i++) {
+		CU_ASSERT(tr->prp[i] == (uintptr_t)buf + i * 4096);
+	}
+	nvme_free_request(req);
+
+	/* Starting mid-page needs all 1024 entries and a second chain. */
+	req = nvme_allocate_request(buf + 512, 1024 * 4096, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 2);
+
+	sqe = &qpair.cmd[1];
+	tr = &qpair.tr[sqe->cid];
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)buf + 512);
+	CU_ASSERT(tr->prp[511] == tr->prp_bus_addr + 4096);
+	CU_ASSERT(tr->prp[1022] == (uintptr_t)buf + 1022 * 4096);
+	CU_ASSERT(tr->prp[1023] == tr->prp_bus_addr + 2 * 4096);
+	CU_ASSERT(tr->prp[1024] == (uintptr_t)buf + 1023 * 4096);
+	CU_ASSERT(tr->prp[1025] == (uintptr_t)buf + 1024 * 4096);
+	nvme_free_request(req);
+
+	/* One page more than the list holds fails the request. */
+	req = nvme_allocate_request(buf + 512, 1024 * 4096 + 4096, expected_failure_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(qpair.sq_tail == 2);
+
+	free(buf);
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_prp_regions(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_tracker	*tr;
+	struct nvme_command	*sqe;
+	uint8_t			*buf = NULL;
+	uint8_t			*payload;
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT_FATAL(posix_memalign((void **)&buf, NVME_VTOPHYS_REGION_SIZE,
+				       2 * NVME_VTOPHYS_REGION_SIZE) == 0);
+
+	/* A payload within one region is translated once. */
+	payload = buf + 100;
+	req = nvme_allocate_request(payload, 128 * 1024 - 100, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	g_vtophys_calls = 0;
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 1);
+	CU_ASSERT(g_vtophys_calls == 1);
+
+	sqe = &qpair.cmd[0];
+	tr = &qpair.tr[sqe->cid];
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)payload);
+	for (i = 0; i < 31; i++) {
+		CU_ASSERT(tr->prp[i] == (uintptr_t)buf + (i + 1) * 4096);
+	}
+	nvme_free_request(req);
+
+	/* One that crosses into the next region is translated twice. */
+	payload = buf + NVME_VTOPHYS_REGION_SIZE - 5 * 4096 - 8;
+	req = nvme_allocate_request(payload, 64 * 1024, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	g_vtophys_calls = 0;
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT_FATAL(qpair.sq_tail == 2);
+	CU_ASSERT(g_vtophys_calls == 2);
+
+	sqe = &qpair.cmd[1];
+	tr = &qpair.tr[sqe->cid];
+	CU_ASSERT(sqe->dptr.prp.prp1 == (uintptr_t)payload);
+	for (i = 0; i < 16; i++) {
+		CU_ASSERT(tr->prp[i] == (uintptr_t)buf + NVME_VTOPHYS_REGION_SIZE + ((int64_t)i - 5) * 4096);
+	}
+	nvme_free_request(req);
+
+	free(buf);
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+slot_available_cb(void *cb_arg, struct nvme_qpair *qpair)
+{
+	(*(int *)cb_arg)++;
+}
+
+static void
+test_nvme_qpair_queue_limit(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_completion	cpl = {};
+	int			num_cb = 0;
+	uint16_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Unlimited by default. */
+	CU_ASSERT(nvme_qpair_get_num_free_trackers(&qpair) == 32);
+	CU_ASSERT(nvme_qpair_admit(&qpair, 1000));
+
+	nvme_qpair_set_queue_limit(&qpair, 2, slot_available_cb, &num_cb);
+
+	for (i = 0; i < 32 + 2; i++) {
+		CU_ASSERT(nvme_qpair_admit(&qpair, 1));
+		req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+		CU_ASSERT_FATAL(req != NULL);
+		nvme_qpair_submit_request(&qpair, req);
+	}
+	CU_ASSERT(nvme_qpair_get_num_free_trackers(&qpair) == 0);
+	CU_ASSERT(nvme_qpair_get_num_queued_requests(&qpair) == 2);
+
+	/* The queue is full, so the next submission is refused. */
+	CU_ASSERT(!nvme_qpair_admit(&qpair, 1));
+	CU_ASSERT(qpair.is_slot_cb_pending);
+
+	/* A completion moves a queued request to the freed tracker and reports the slot. */
+	cpl.cid = 0;
+	nvme_qpair_complete_tracker(&qpair, &qpair.tr[0], &cpl, false);
+	CU_ASSERT(nvme_qpair_get_num_queued_requests(&qpair) == 1);
+	CU_ASSERT(num_cb == 1);
+	CU_ASSERT(!qpair.is_slot_cb_pending);
+
+	/* Nothing was refused since, so no further callback. */
+	cpl.cid = 1;
+	nvme_qpair_complete_tracker(&qpair, &qpair.tr[1], &cpl, false);
+	CU_ASSERT(nvme_qpair_get_num_queued_requests(&qpair) == 0);
+	CU_ASSERT(num_cb == 1);
+
+	/* Split I/O is admitted only if all of its commands fit. */
+	CU_ASSERT(nvme_qpair_admit(&qpair, 2));
+	CU_ASSERT(!nvme_qpair_admit(&qpair, 3));
+
+	nvme_qpair_set_queue_limit(&qpair, NVME_QPAIR_QUEUE_UNLIMITED, NULL, NULL);
+	CU_ASSERT(nvme_qpair_admit(&qpair, 1000));
+
+	for (i = 0; i < qpair.num_trackers; i++) {
+		free(qpair.tr[i].req);
+	}
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_submit_batch(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req[3];
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	int			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Doorbell is written once per command outside of a batch. */
+	req[0] = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req[0] != NULL);
+	nvme_qpair_submit_request(&qpair, req[0]);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 1);
+	CU_ASSERT(qpair.sq_tdbl_pending == false);
+	nvme_free_request(req[0]);
+
+	/* Inside a (nested) batch, the doorbell is deferred until the outermost end. */
+	nvme_qpair_batch_begin(&qpair);
+	nvme_qpair_batch_begin(&qpair);
+	for (i = 0; i < 3; i++) {
+		req[i] = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+		CU_ASSERT_FATAL(req[i] != NULL);
+		nvme_qpair_submit_request(&qpair, req[i]);
+	}
+	CU_ASSERT(qpair.sq_tail == 4);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 1);
+	CU_ASSERT(qpair.sq_tdbl_pending == true);
+
+	nvme_qpair_batch_end(&qpair);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 1);
+
+	nvme_qpair_batch_end(&qpair);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 4);
+	CU_ASSERT(qpair.sq_tdbl_pending == false);
+	CU_ASSERT(qpair.batch_depth == 0);
+
+	for (i = 0; i < 3; i++) {
+		nvme_free_request(req[i]);
+	}
+
+	/*
+	 * A batch that spans the start of a reset leaves the doorbell alone;
+	 *  its command is replayed once the reset is done.
+	 */
+	nvme_qpair_batch_begin(&qpair);
+	req[0] = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req[0] != NULL);
+	nvme_qpair_submit_request(&qpair, req[0]);
+	CU_ASSERT(qpair.sq_tail == 5);
+	ctrlr.reset_seq = 1;
+	nvme_qpair_batch_end(&qpair);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 4);
+	CU_ASSERT(qpair.is_enabled == false);
+	CU_ASSERT(qpair.reset_seq == 1);
+	CU_ASSERT(qpair.in_use == 0);
+	nvme_free_request(req[0]);
+
+	cleanup_submit_request_test(&qpair);
+}
+
 static void struct_packing(void)
 {
 	/* ctrlr is the first field in nvme_qpair after the fields
@@ -303,18 +801,16 @@ static void test_nvme_qpair_fail(void)
 	struct nvme_controller	ctrlr = {};
 	struct nvme_registers	regs = {};
 	struct nvme_tracker	*tr_temp;
-	uint64_t		phys_addr = 0;
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
 
-	tr_temp = nvme_malloc("nvme_tracker", sizeof(struct nvme_tracker),
-			      64, &phys_addr);
+	tr_temp = &qpair.tr[qpair.free_tr[--qpair.num_free_tr]];
 	tr_temp->req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
 	CU_ASSERT_FATAL(tr_temp->req != NULL);
 
-	LIST_INSERT_HEAD(&qpair.outstanding_tr, tr_temp, list);
 	nvme_qpair_fail(&qpair);
-	CU_ASSERT_TRUE(LIST_EMPTY(&qpair.outstanding_tr));
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	CU_ASSERT(tr_temp->req == NULL);
 
 	req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
 	CU_ASSERT_FATAL(req != NULL);
@@ -360,14 +856,281 @@ test_nvme_qpair_process_completions_limit(void)
 	/* This should only process 2 completions, and 2 should be left in the queue */
 	nvme_qpair_process_completions(&qpair, 2);
 	CU_ASSERT(qpair.cq_head == 2);
+	CU_ASSERT(*qpair.cq_hdbl == 2);
 
 	/* This should only process 1 completion, and 1 should be left in the queue */
 	nvme_qpair_process_completions(&qpair, 1);
 	CU_ASSERT(qpair.cq_head == 3);
+	CU_ASSERT(*qpair.cq_hdbl == 3);
 
 	/* This should process the remaining completion */
 	nvme_qpair_process_completions(&qpair, 5);
 	CU_ASSERT(qpair.cq_head == 4);
+	CU_ASSERT(*qpair.cq_hdbl == 4);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_process_completions_hdbl_batch(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Batch cap is bounded by the queue size. */
+	CU_ASSERT(qpair.cq_hdbl_batch == nvme_min(NVME_CQ_HDBL_BATCH, 128 - 1));
+
+	/*
+	 * Reap more completions than the batch cap in one pass.  The head
+	 *  doorbell must end up pointing past the last reaped entry.
+	 */
+	qpair.cq_hdbl_batch = 3;
+	for (i = 0; i < 8; i++) {
+		ut_insert_cq_entry(&qpair, i);
+	}
+
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.cq_head == 8);
+	CU_ASSERT(*qpair.cq_hdbl == 8);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static uint32_t g_reset_num_ok;
+static uint32_t g_reset_num_failed;
+
+static void
+reset_callback(void *arg, const struct nvme_completion *cpl)
+{
+	if (nvme_completion_is_error(cpl)) {
+		g_reset_num_failed++;
+	} else {
+		g_reset_num_ok++;
+	}
+}
+
+static struct nvme_request *
+ut_submit_reset_request(struct nvme_qpair *qpair)
+{
+	struct nvme_request *req;
+
+	req = nvme_allocate_request(NULL, 0, reset_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(qpair, req);
+	return req;
+}
+
+static void
+test_nvme_qpair_reset_replay(void)
+{
+	struct nvme_qpair		qpair = {};
+	struct nvme_controller		ctrlr = {};
+	struct nvme_qpair_reset_stats	stats;
+	struct nvme_request		*req[3];
+	struct nvme_completion		*cpl;
+	uint32_t			*doorbell;
+
+	/*
+	 * Give the SQ and CQ doorbells separate registers.  struct
+	 *  nvme_registers only has room for the admin queue's, so back it
+	 *  with a buffer that also holds queue 1's.
+	 */
+	uint64_t regs[(sizeof(struct nvme_registers) + 4 * sizeof(uint32_t) + 7) / 8] = {};
+
+	ctrlr.regs = (struct nvme_registers *)regs;
+	ctrlr.doorbell_stride_u32 = 1;
+	doorbell = (uint32_t *)((uint8_t *)regs + offsetof(struct nvme_registers, doorbell));
+	CU_ASSERT_FATAL(nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr) == 0);
+	CU_ASSERT(qpair.is_enabled == true);
+	g_reset_num_ok = 0;
+	g_reset_num_failed = 0;
+
+	/* Outstanding: cid 1, cid 2, then cid 0, in submission order. */
+	req[0] = ut_submit_reset_request(&qpair);
+	ut_submit_reset_request(&qpair);
+	ut_submit_reset_request(&qpair);
+	CU_ASSERT(req[0]->cmd.cid == 0);
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[0], NVME_SCT_GENERIC,
+					   NVME_SC_SUCCESS, 0, false);
+	req[0] = ut_submit_reset_request(&qpair);
+	CU_ASSERT(req[0]->cmd.cid == 0);
+	CU_ASSERT(qpair.sq_tail == 4);
+	CU_ASSERT(g_reset_num_ok == 1);
+
+	/* A reset starts.  The next submission quiesces the qpair and is queued. */
+	ctrlr.is_resetting = true;
+	ctrlr.reset_seq = 1;
+	ut_submit_reset_request(&qpair);
+	CU_ASSERT(qpair.reset_seq == 1);
+	CU_ASSERT(qpair.is_enabled == false);
+	CU_ASSERT(qpair.stall_start_tsc != 0);
+	CU_ASSERT(!STAILQ_EMPTY(&qpair.queued_req));
+	CU_ASSERT(qpair.sq_tail == 4);
+
+	/* cid 1 completed before the controller went down. */
+	cpl = &qpair.cpl[0];
+	cpl->status.p = qpair.phase;
+	cpl->cid = 1;
+
+	/* The reset finishes.  The next poll resumes the qpair. */
+	ctrlr.is_resetting = false;
+	ctrlr.reset_seq = 2;
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.reset_seq == 2);
+	CU_ASSERT(qpair.is_enabled == true);
+	CU_ASSERT(g_reset_num_ok == 2);
+	CU_ASSERT(g_reset_num_failed == 0);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.queued_req));
+
+	/* Replayed oldest first, then the queued request, on fresh rings. */
+	CU_ASSERT(qpair.cmd[0].cid == 2);
+	CU_ASSERT(qpair.cmd[1].cid == 0);
+	CU_ASSERT(qpair.cmd[2].cid == 1);
+	CU_ASSERT(qpair.sq_tail == 3);
+	CU_ASSERT(qpair.cq_head == 0);
+	CU_ASSERT(doorbell[2] == 3);	/* queue 1 SQ tail */
+	CU_ASSERT(doorbell[3] == 0);	/* queue 1 CQ head */
+
+	nvme_qpair_get_reset_stats(&qpair, &stats);
+	CU_ASSERT(stats.num_resets == 1);
+	CU_ASSERT(stats.num_replayed == 2);
+	CU_ASSERT(stats.stall_us == stats.max_stall_us);
+	CU_ASSERT(qpair.stall_start_tsc == 0);
+
+	/* A qpair idle through a failed reset fails its I/O when next used. */
+	ctrlr.is_failed = true;
+	ctrlr.reset_seq = 4;
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.is_enabled == false);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	CU_ASSERT(g_reset_num_failed == 3);
+	ut_submit_reset_request(&qpair);
+	CU_ASSERT(g_reset_num_failed == 4);
+
+	nvme_qpair_get_reset_stats(&qpair, &stats);
+	CU_ASSERT(stats.num_resets == 2);
+	CU_ASSERT(stats.num_replayed == 2);
+
+	nvme_qpair_destroy(&qpair);
+}
+
+static int g_fused_num_ok;
+static int g_fused_num_failed;
+
+static void
+fused_callback(void *arg, const struct nvme_completion *cpl)
+{
+	if (nvme_completion_is_error(cpl)) {
+		g_fused_num_failed++;
+	} else {
+		g_fused_num_ok++;
+	}
+}
+
+static void
+ut_submit_fused_pair(struct nvme_qpair *qpair)
+{
+	struct nvme_request *first, *second;
+
+	first = nvme_allocate_request(NULL, 0, fused_callback, NULL);
+	second = nvme_allocate_request(NULL, 0, fused_callback, NULL);
+	CU_ASSERT_FATAL(first != NULL && second != NULL);
+	first->cmd.opc = NVME_OPC_COMPARE;
+	first->cmd.fuse = NVME_CMD_FUSE_FIRST;
+	first->fused_next = second;
+	second->cmd.opc = NVME_OPC_WRITE;
+	second->cmd.fuse = NVME_CMD_FUSE_SECOND;
+	nvme_qpair_submit_request(qpair, first);
+}
+
+static void
+test_nvme_qpair_fused(void)
+{
+	struct nvme_qpair		qpair = {};
+	struct nvme_controller		ctrlr = {};
+	struct nvme_registers		regs = {};
+	struct nvme_qpair_reset_stats	stats;
+	struct nvme_request		*req;
+	uint16_t			cid[2];
+	uint32_t			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	g_fused_num_ok = 0;
+	g_fused_num_failed = 0;
+
+	/* Both halves are placed in adjacent slots under one doorbell write. */
+	ut_submit_fused_pair(&qpair);
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 2);
+	CU_ASSERT(qpair.cmd[0].opc == NVME_OPC_COMPARE);
+	CU_ASSERT(qpair.cmd[0].fuse == NVME_CMD_FUSE_FIRST);
+	CU_ASSERT(qpair.cmd[1].opc == NVME_OPC_WRITE);
+	CU_ASSERT(qpair.cmd[1].fuse == NVME_CMD_FUSE_SECOND);
+	CU_ASSERT(qpair.tr[qpair.cmd[0].cid].fused_cid == qpair.cmd[1].cid);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers - 2);
+
+	/* Neither half is retried on its own. */
+	cid[0] = qpair.cmd[0].cid;
+	cid[1] = qpair.cmd[1].cid;
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[cid[0]], NVME_SCT_GENERIC,
+					   NVME_SC_ABORTED_BY_REQUEST, 0, false);
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[cid[1]], NVME_SCT_GENERIC,
+					   NVME_SC_ABORTED_BY_REQUEST, 0, false);
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(g_fused_num_failed == 2);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	/* A pair that finds too few trackers waits at the head until two are free. */
+	while (qpair.num_free_tr > 0) {
+		req = nvme_allocate_request(NULL, 0, NULL, NULL);
+		CU_ASSERT_FATAL(req != NULL);
+		nvme_qpair_submit_request(&qpair, req);
+	}
+	ut_submit_fused_pair(&qpair);
+	CU_ASSERT(qpair.num_queued_req == 1);
+	CU_ASSERT(qpair.sq_tail == 2 + qpair.num_trackers);
+
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[qpair.cmd[2].cid], NVME_SCT_GENERIC,
+					   NVME_SC_SUCCESS, 0, false);
+	CU_ASSERT(qpair.num_queued_req == 1);
+	CU_ASSERT(qpair.num_free_tr == 1);
+
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[qpair.cmd[3].cid], NVME_SCT_GENERIC,
+					   NVME_SC_SUCCESS, 0, false);
+	CU_ASSERT(qpair.num_queued_req == 0);
+	CU_ASSERT(qpair.num_free_tr == 0);
+	i = 2 + qpair.num_trackers;
+	CU_ASSERT(qpair.sq_tail == i + 2);
+	CU_ASSERT(qpair.cmd[i].fuse == NVME_CMD_FUSE_FIRST);
+	CU_ASSERT(qpair.cmd[i + 1].fuse == NVME_CMD_FUSE_SECOND);
+
+	/* Replay after a reset keeps the halves adjacent. */
+	ctrlr.reset_seq = 1;
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.is_enabled == false);
+	ctrlr.reset_seq = 2;
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.is_enabled == true);
+	CU_ASSERT(qpair.sq_tail == qpair.num_trackers);
+	CU_ASSERT(qpair.cmd[qpair.num_trackers - 2].fuse == NVME_CMD_FUSE_FIRST);
+	CU_ASSERT(qpair.cmd[qpair.num_trackers - 1].fuse == NVME_CMD_FUSE_SECOND);
+	nvme_qpair_get_reset_stats(&qpair, &stats);
+	CU_ASSERT(stats.num_replayed == qpair.num_trackers);
+
+	/* Failing the qpair completes both halves of a queued pair too. */
+	ut_submit_fused_pair(&qpair);
+	CU_ASSERT(qpair.num_queued_req == 1);
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(qpair.num_queued_req == 0);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	CU_ASSERT(g_fused_num_failed == 6);
+	CU_ASSERT(g_fused_num_ok == 0);
 
 	cleanup_submit_request_test(&qpair);
 }
@@ -377,20 +1140,32 @@ static void test_nvme_qpair_destroy(void)
 	struct nvme_qpair	qpair = {};
 	struct nvme_controller	ctrlr = {};
 	struct nvme_registers	regs = {};
-	struct nvme_tracker	*tr_temp;
-	uint64_t		phys_addr = 0;
+	uint16_t		i;
 
 	memset(&ctrlr, 0, sizeof(ctrlr));
 	ctrlr.regs = &regs;
 	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr);
 
-	tr_temp = nvme_malloc("nvme_tracker", sizeof(struct nvme_tracker),
-			      64, &phys_addr);
-	nvme_alloc_request(&tr_temp->req);
+	CU_ASSERT(qpair.num_trackers == 32);
+	CU_ASSERT(qpair.num_free_tr == 32);
+	for (i = 0; i < qpair.num_trackers; i++) {
+		/* The free stack hands out trackers in cid order. */
+		CU_ASSERT(qpair.free_tr[qpair.num_free_tr - 1 - i] == i);
+		CU_ASSERT(qpair.tr[i].cid == i);
+		CU_ASSERT(qpair.tr[i].req == NULL);
+		CU_ASSERT(((uintptr_t)qpair.tr[i].prp & (qpair.prp_list_size - 1)) == 0);
+	}
 
-	LIST_INSERT_HEAD(&qpair.free_tr, tr_temp, list);
+	/* Dataset management range pages wait for the first such command. */
+	CU_ASSERT(qpair.dsm_pages == NULL);
+	CU_ASSERT(qpair.dsm_free_pages == 0);
 
 	nvme_qpair_destroy(&qpair);
+	CU_ASSERT(qpair.tr == NULL);
+	CU_ASSERT(qpair.free_tr == NULL);
+	CU_ASSERT(qpair.num_trackers == 0);
+	CU_ASSERT(qpair.dsm_pages == NULL);
+	CU_ASSERT(qpair.dsm_free_pages == 0);
 }
 
 static void test_nvme_completion_is_retry(void)
@@ -496,11 +1271,23 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "test3", test3) == NULL
 		|| CU_add_test(suite, "test4", test4) == NULL
 		|| CU_add_test(suite, "ctrlr_failed", test_ctrlr_failed) == NULL
+		|| CU_add_test(suite, "io_cmd", test_nvme_qpair_io_cmd) == NULL
+		|| CU_add_test(suite, "io_cmd_md", test_nvme_qpair_io_cmd_md) == NULL
+		|| CU_add_test(suite, "iov_prp", test_nvme_qpair_iov_prp) == NULL
+		|| CU_add_test(suite, "iov_sgl", test_nvme_qpair_iov_sgl) == NULL
+		|| CU_add_test(suite, "chained_prp", test_nvme_qpair_chained_prp) == NULL
+		|| CU_add_test(suite, "prp_regions", test_nvme_qpair_prp_regions) == NULL
+		|| CU_add_test(suite, "queue_limit", test_nvme_qpair_queue_limit) == NULL
+		|| CU_add_test(suite, "submit_batch", test_nvme_qpair_submit_batch) == NULL
 		|| CU_add_test(suite, "struct_packing", struct_packing) == NULL
 		|| CU_add_test(suite, "nvme_qpair_fail", test_nvme_qpair_fail) == NULL
 		|| CU_add_test(suite, "nvme_qpair_process_completions", test_nvme_qpair_process_completions) == NULL
 		|| CU_add_test(suite, "nvme_qpair_process_completions_limit",
 			       test_nvme_qpair_process_completions_limit) == NULL
+		|| CU_add_test(suite, "nvme_qpair_process_completions_hdbl_batch",
+			       test_nvme_qpair_process_completions_hdbl_batch) == NULL
+		|| CU_add_test(suite, "nvme_qpair_reset_replay", test_nvme_qpair_reset_replay) == NULL
+		|| CU_add_test(suite, "nvme_qpair_fused", test_nvme_qpair_fused) == NULL
 		|| CU_add_test(suite, "nvme_qpair_destroy", test_nvme_qpair_destroy) == NULL
 		|| CU_add_test(suite, "nvme_completion_is_retry", test_nvme_completion_is_retry) == NULL
 		|| CU_add_test(suite, "get_status_string", test_get_status_string) == NULL
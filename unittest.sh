@@ -9,3 +9,4 @@ test/lib/nvme/unit/nvme_ctrlr_c/nvme_ctrlr_ut
 test/lib/nvme/unit/nvme_ctrlr_cmd_c/nvme_ctrlr_cmd_ut
 test/lib/nvme/unit/nvme_ns_cmd_c/nvme_ns_cmd_ut
 test/lib/nvme/unit/nvme_qpair_c/nvme_qpair_ut
+test/lib/nvme/unit/nvme_dif_c/nvme_dif_ut